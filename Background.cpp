@@ -0,0 +1,236 @@
+#include "Background.h"
+#include "Parallel.h"
+#include "Scratch.h"
+#include "SimdKernels.h"
+
+#include <QtGlobal>
+
+#include <cstring>
+
+namespace
+{
+
+//columns the vertical pass does together. Wide enough for the vector loops,
+//narrow enough that the running min/max buffers for a strip stay small.
+static constexpr int STRIP_WIDTH = 256;
+
+typedef void (*RowOp)(const uchar* a, const uchar* b, uchar* dst, const int& count);
+
+//van Herk / Gil-Werman down every column. neutral is what the rows above and
+//below the image count as, 255 for min and 0 for max, so they never win.
+QImage ColumnPass(const QImage& gray, const int& radius, const RowOp& op, const uchar& neutral)
+{
+   const int width = gray.width();
+   const int height = gray.height();
+   const int window = 2 * radius + 1;
+   const int padded = height + 2 * radius;
+   const int strips = (width + STRIP_WIDTH - 1) / STRIP_WIDTH;
+
+   QImage out(gray.size(), QImage::Format_Grayscale8);
+   const uchar* srcBits = gray.constBits();
+   const int srcStride = gray.bytesPerLine();
+   uchar* dstBits = out.bits();
+   const int dstStride = out.bytesPerLine();
+
+   Parallel::ForRows(strips, height * STRIP_WIDTH, [=](const int& begin, const int& end) {
+      const Scratch::Buffer<uchar> neutralRow(STRIP_WIDTH, neutral);
+      Scratch::Buffer<uchar> forward((qint64)padded * STRIP_WIDTH);
+      Scratch::Buffer<uchar> backward((qint64)padded * STRIP_WIDTH);
+
+      for (int s = begin; s < end; s++)
+      {
+         const int x0 = s * STRIP_WIDTH;
+         const int n = qMin(STRIP_WIDTH, width - x0);
+
+         //row p of the column padded by radius at both ends, p = y + radius
+         auto row = [&](const int& p) -> const uchar* {
+            const int y = p - radius;
+            return y >= 0 && y < height ? srcBits + (qint64)y * srcStride + x0 : neutralRow.constData();
+         };
+
+         //running min/max from the start of each block...
+         for (int p = 0; p < padded; p++)
+         {
+            uchar* f = forward.data() + (qint64)p * n;
+
+            if (p % window == 0)
+            {
+               std::memcpy(f, row(p), n);
+            }
+            else
+            {
+               op(f - n, row(p), f, n);
+            }
+         }
+
+         //...and back from the end of it
+         for (int p = padded - 1; p >= 0; p--)
+         {
+            uchar* b = backward.data() + (qint64)p * n;
+
+            if (p == padded - 1 || (p + 1) % window == 0)
+            {
+               std::memcpy(b, row(p), n);
+            }
+            else
+            {
+               op(b + n, row(p), b, n);
+            }
+         }
+
+         //row y's window is padded rows y to y + 2 * radius, which is the tail
+         //of one block plus the head of the next (or exactly one block)
+         for (int y = 0; y < height; y++)
+         {
+            op(backward.constData() + (qint64)y * n, forward.constData() + (qint64)(y + 2 * radius) * n,
+               dstBits + (qint64)y * dstStride + x0, n);
+         }
+      }
+   });
+
+   return out;
+}
+
+QImage Filter(const QImage& img, const int& radius, const RowOp& op, const uchar& neutral)
+{
+   const QImage gray = SimdKernels::ToGray(img);
+
+   if (radius <= 0 || gray.isNull())
+   {
+      return gray;
+   }
+
+   const QImage columns = ColumnPass(gray, radius, op, neutral);
+   return SimdKernels::Transpose(ColumnPass(SimdKernels::Transpose(columns), radius, op, neutral));
+}
+
+}
+
+QImage Background::MinFilter(const QImage& img, const int& radius)
+{
+   return Filter(img, radius, SimdKernels::MinRow, 255);
+}
+
+QImage Background::MaxFilter(const QImage& img, const int& radius)
+{
+   return Filter(img, radius, SimdKernels::MaxRow, 0);
+}
+
+QImage Background::Opening(const QImage& img, const int& radius)
+{
+   return MaxFilter(MinFilter(img, radius), radius);
+}
+
+QImage Background::SubtractBackground(const QImage& img, const int& radius)
+{
+   const QImage gray = SimdKernels::ToGray(img);
+
+   if (radius <= 0 || gray.isNull())
+   {
+      return gray;
+   }
+
+   const QImage background = Opening(gray, radius);
+   QImage out(gray.size(), QImage::Format_Grayscale8);
+
+   const uchar* srcBits = gray.constBits();
+   const int srcStride = gray.bytesPerLine();
+   const uchar* bgBits = background.constBits();
+   const int bgStride = background.bytesPerLine();
+   uchar* dstBits = out.bits();
+   const int dstStride = out.bytesPerLine();
+   const int width = gray.width();
+
+   Parallel::ForRows(gray.height(), width, [=](const int& begin, const int& end) {
+      for (int y = begin; y < end; y++)
+      {
+         SimdKernels::SubtractRow(srcBits + (qint64)y * srcStride, bgBits + (qint64)y * bgStride, dstBits + (qint64)y * dstStride, width);
+      }
+   });
+
+   return out;
+}
+
+QVector<float> Background::FlatFieldGain(const QImage& reference)
+{
+   const QImage gray = SimdKernels::ToGray(reference);
+   const int width = gray.width();
+   const int height = gray.height();
+
+   if (gray.isNull())
+   {
+      return QVector<float>();
+   }
+
+   qint64 sum = 0;
+
+   for (int y = 0; y < height; y++)
+   {
+      const uchar* line = gray.constScanLine(y);
+
+      for (int x = 0; x < width; x++)
+      {
+         sum += line[x];
+      }
+   }
+
+   const float mean = (float)((double)sum / ((qint64)width * height));
+   QVector<float> gain(width * height);
+
+   for (int y = 0; y < height; y++)
+   {
+      const uchar* line = gray.constScanLine(y);
+      float* out = gain.data() + (qint64)y * width;
+
+      for (int x = 0; x < width; x++)
+      {
+         out[x] = mean / qMax(1, (int)line[x]);
+      }
+   }
+
+   return gain;
+}
+
+QImage Background::ApplyFlatField(const QImage& img, const QVector<float>& gain)
+{
+   const QImage gray = SimdKernels::ToGray(img);
+   const int width = gray.width();
+
+   if (gain.count() != width * gray.height())
+   {
+      return gray;
+   }
+
+   QImage out(gray.size(), QImage::Format_Grayscale8);
+   const uchar* srcBits = gray.constBits();
+   const int srcStride = gray.bytesPerLine();
+   uchar* dstBits = out.bits();
+   const int dstStride = out.bytesPerLine();
+   const float* gainBits = gain.constData();
+
+   Parallel::ForRows(gray.height(), width, [=](const int& begin, const int& end) {
+      for (int y = begin; y < end; y++)
+      {
+         SimdKernels::GainRow(srcBits + (qint64)y * srcStride, gainBits + (qint64)y * width, dstBits + (qint64)y * dstStride, width);
+      }
+   });
+
+   return out;
+}
+
+QImage Background::Correct(const QImage& img, const QVector<float>& gain, const int& radius)
+{
+   QImage gray = SimdKernels::ToGray(img);
+
+   if (!gain.isEmpty() && gain.count() == gray.width() * gray.height())
+   {
+      gray = ApplyFlatField(gray, gain);
+   }
+
+   if (radius > 0)
+   {
+      gray = SubtractBackground(gray, radius);
+   }
+
+   return gray;
+}
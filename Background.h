@@ -0,0 +1,50 @@
+#ifndef Background_h
+#define Background_h
+
+#include <QImage>
+#include <QVector>
+
+//Illumination correction that runs before thresholding, so a single global
+//threshold works on slides that are brighter in the middle than at the edges.
+//
+//The min/max filters are van Herk / Gil-Werman: the line is cut into blocks as
+//long as the window, a running min from the start of each block and one from
+//its end give the min of any window from two lookups, 3 comparisons per pixel
+//whatever the radius. Square windows are separable, so it's one pass down the
+//columns and one along the rows. The row pass runs as a column pass on the
+//transposed image so both are whole rows of SimdKernels::MinRow/MaxRow.
+namespace Background
+{
+
+//flat square window of side 2 * radius + 1, pixels outside the image don't
+//count. Format_Grayscale8 out, anything else is converted to gray first.
+QImage MinFilter(const QImage& img, const int& radius);
+
+QImage MaxFilter(const QImage& img, const int& radius);
+
+//MaxFilter(MinFilter(img)), the background with everything brighter than its
+//surroundings and narrower than the window taken out
+QImage Opening(const QImage& img, const int& radius);
+
+//white top-hat, img - Opening(img). Anything that varies slower than the window
+//goes to 0 and bright cells narrower than 2 * radius + 1 stay. This is the
+//flat window version of a rolling ball, so pick a radius a bit over half the
+//widest cell.
+QImage SubtractBackground(const QImage& img, const int& radius);
+
+//per pixel gain mean(reference) / reference, from a picture of an empty slide
+//taken with the same light. Dark reference pixels are held at 1 so the gain
+//stays finite.
+QVector<float> FlatFieldGain(const QImage& reference);
+
+//img * gain, rounded and clamped to 0..255. Format_Grayscale8. gain has to
+//come from a reference the same size as img.
+QImage ApplyFlatField(const QImage& img, const QVector<float>& gain);
+
+//ApplyFlatField when there is a gain for an image this size, then
+//SubtractBackground when radius > 0. Just the gray image otherwise.
+QImage Correct(const QImage& img, const QVector<float>& gain, const int& radius);
+
+}
+
+#endif /* Background_h */
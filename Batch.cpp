@@ -0,0 +1,147 @@
+#include "Batch.h"
+#include "Scheduler.h"
+#include "Scratch.h"
+
+#include <QElapsedTimer>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QThread>
+
+namespace
+{
+
+class BatchWorker : public QThread
+{
+public:
+   BatchWorker(DecodeQueue* queue, const Pipeline::Params& params, const Batch::ResultCallback& onResult, QMutex* callbackMutex, Scheduler::Context* context)
+      : queue(queue)
+      , params(params)
+      , onResult(onResult)
+      , callbackMutex(callbackMutex)
+      , context(context) {};
+
+   void run() override
+   {
+      //run as part of whatever scheduler job started the batch, so cancelling
+      //that stops the batch at the next picture
+      Scheduler::ContextScope scope(context);
+      DecodedFrame frame;
+
+      while (!Scheduler::Cancelled() && queue->Take(frame))
+      {
+         Pipeline::Result result;
+
+         if (frame.error.isEmpty())
+         {
+            const qint64 allocationsBefore = Scratch::ThisThread().heapAllocations;
+            QElapsedTimer timer;
+            timer.start();
+            result = Pipeline::Run(frame.image, params);
+            computeNs += timer.nsecsElapsed();
+
+            if (pictures++ > 0)
+            {
+               warmScratchAllocations += Scratch::ThisThread().heapAllocations - allocationsBefore;
+            }
+         }
+
+         //the pixels aren't needed past this point, give the budget back before
+         //the callback gets a chance to be slow
+         queue->Release(frame);
+         frame.image = QImage();
+
+         if (frame.error.isEmpty())
+         {
+            cells += result.cells.count();
+         }
+         else
+         {
+            failed++;
+         }
+
+         if (onResult)
+         {
+            QMutexLocker locker(callbackMutex);
+            onResult(frame, result);
+         }
+      }
+   }
+
+   qint64 computeNs = 0;
+   qint64 warmScratchAllocations = 0;
+   int pictures = 0;
+   int cells = 0;
+   int failed = 0;
+
+private:
+   DecodeQueue* queue = nullptr;
+   Pipeline::Params params;
+   Batch::ResultCallback onResult;
+   QMutex* callbackMutex = nullptr;
+   Scheduler::Context* context = nullptr;
+};
+
+}
+
+QString Batch::Stats::Summary() const
+{
+   return QString("%1 images, %2 cells in %3 s (decode %4 s, compute %5 s, waited on decode %6 s, %7 scratch allocations, %8 after warm up)")
+         .arg(images)
+         .arg(cells)
+         .arg(wallNs / 1e9, 0, 'f', 2)
+         .arg(decodeNs / 1e9, 0, 'f', 2)
+         .arg(computeNs / 1e9, 0, 'f', 2)
+         .arg(stallNs / 1e9, 0, 'f', 2)
+         .arg(scratchAllocations)
+         .arg(warmScratchAllocations);
+}
+
+Batch::Stats Batch::Run(const QStringList& paths, const Options& options, const ResultCallback& onResult)
+{
+   Scheduler::Context* context = Scheduler::CurrentContext();
+   const bool background = context != nullptr && context->priority == Scheduler::Priority::Background;
+
+   //background jobs keep their row loops serial, so the parallelism has to
+   //come from running more pictures at once, on threads that lose to the GUI
+   const int cores = qMax(1, QThread::idealThreadCount());
+   const int decoders = options.decoderThreads > 0 ? options.decoderThreads : qMax(1, cores / 4);
+   const int workers = options.workerThreads > 0 ? options.workerThreads : background ? qMax(1, cores - 1) : qMax(1, cores / 4);
+   const QThread::Priority priority = background ? QThread::LowPriority : QThread::InheritPriority;
+
+   QElapsedTimer wall;
+   wall.start();
+   const qint64 allocationsBefore = Scratch::Totals().heapAllocations;
+
+   DecodeQueue queue(paths, options.decode, decoders, options.memoryBudget);
+   queue.Start(priority);
+
+   QMutex callbackMutex;
+   QVector<BatchWorker*> pool;
+
+   for (int i = 0; i < workers; i++)
+   {
+      BatchWorker* worker = new BatchWorker(&queue, options.params, onResult, &callbackMutex, context);
+      pool.push_back(worker);
+      worker->start(priority);
+   }
+
+   Stats stats;
+   stats.images = paths.count();
+
+   for (auto worker : pool)
+   {
+      worker->wait();
+      stats.computeNs += worker->computeNs;
+      stats.cells += worker->cells;
+      stats.failed += worker->failed;
+      stats.warmScratchAllocations += worker->warmScratchAllocations;
+      delete worker;
+   }
+
+   stats.decodeNs = queue.DecodeNs();
+   stats.stallNs = queue.StallNs();
+   stats.scratchAllocations = Scratch::Totals().heapAllocations - allocationsBefore;
+   stats.wallNs = wall.nsecsElapsed();
+
+   return stats;
+}
@@ -0,0 +1,64 @@
+#ifndef Batch_h
+#define Batch_h
+
+#include <QStringList>
+
+#include <functional>
+
+#include "DecodeQueue.h"
+#include "Pipeline.h"
+
+//Runs Pipeline::Run over a list of files with decoding and processing
+//overlapped, see DecodeQueue
+namespace Batch
+{
+
+struct Options
+{
+   Pipeline::Params params;
+   DecodeOptions decode;
+
+   //<= 0 picks from QThread::idealThreadCount(). The pipeline stages are
+   //already row parallel, so a couple of processing workers are enough to keep
+   //the cores busy while the decoders read ahead.
+   int decoderThreads = 0;
+   int workerThreads = 0;
+
+   //decoded frames held at once, decoder scratch included
+   qint64 memoryBudget = 512ll * 1024 * 1024;
+};
+
+struct Stats
+{
+   int images = 0;
+   int failed = 0;
+   int cells = 0;
+   qint64 wallNs = 0;
+
+   //both summed over threads, so they can add up to more than the wall time
+   qint64 decodeNs = 0;
+   qint64 computeNs = 0;
+
+   //time processing workers spent waiting on the decoders. Near zero means
+   //decoding is hidden behind compute, which is the point.
+   qint64 stallNs = 0;
+
+   //blocks the Scratch pools had to get from the heap during the run, and
+   //the ones the workers needed after their first picture. The second should
+   //be 0 for a run of same sized pictures, everything after the first picture
+   //reuses the first one's buffers. The stages' results aren't scratch and
+   //aren't counted, see Scratch.
+   qint64 scratchAllocations = 0;
+   qint64 warmScratchAllocations = 0;
+
+   QString Summary() const;
+};
+
+//called from the worker threads, one at a time
+typedef std::function<void(const DecodedFrame& frame, const Pipeline::Result& result)> ResultCallback;
+
+Stats Run(const QStringList& paths, const Options& options, const ResultCallback& onResult);
+
+}
+
+#endif /* Batch_h */
@@ -0,0 +1,163 @@
+#include "BitDepth.h"
+#include "ImageOps.h"
+#include "Parallel.h"
+#include "SimdKernels.h"
+
+#include <algorithm>
+#include <utility>
+
+namespace
+{
+
+//P is the pixel type, top the largest value it can hold
+template <typename P>
+std::pair<int, int> RangeOf(const QImage& gray, const int& top)
+{
+   typedef std::pair<int, int> MinMax;
+   const uchar* bits = gray.constBits();
+   const int stride = gray.bytesPerLine();
+   const int width = gray.width();
+
+   return Parallel::ReduceRows<MinMax>(gray.height(), width, [=](const int& begin, const int& end) {
+      MinMax part(top, 0);
+
+      for (int y = begin; y < end; y++)
+      {
+         const P* line = (const P*)(bits + (qint64)y * stride);
+         const auto minMax = std::minmax_element(line, line + width);
+         part.first = qMin(part.first, (int)*minMax.first);
+         part.second = qMax(part.second, (int)*minMax.second);
+      }
+
+      return part;
+   }, [](MinMax& total, const MinMax& part) {
+      total.first = qMin(total.first, part.first);
+      total.second = qMax(total.second, part.second);
+   });
+}
+
+}
+
+bool BitDepth::IsDeep(const QImage& img)
+{
+   return img.format() == QImage::Format_Grayscale16;
+}
+
+void BitDepth::Range(const QImage& img, int& lowest, int& highest)
+{
+   lowest = 0;
+   highest = 0;
+
+   if (img.isNull())
+   {
+      return;
+   }
+
+   const std::pair<int, int> range = IsDeep(img) ? RangeOf<quint16>(img, MAX_GRAY16_VAL) : RangeOf<uchar>(SimdKernels::ToGray(img), MAX_THRESH_VAL);
+   lowest = range.first;
+   highest = range.second;
+}
+
+int BitDepth::SignificantBits(const QImage& img)
+{
+   if (!IsDeep(img))
+   {
+      return 8;
+   }
+
+   int lowest = 0;
+   int highest = 0;
+   Range(img, lowest, highest);
+
+   int bits = 8;
+
+   while (bits < 16 && highest >= (1 << bits))
+   {
+      bits++;
+   }
+
+   return bits;
+}
+
+double BitDepth::Scale(const int& bits)
+{
+   return (double)((1 << qBound(8, bits, 16)) - 1) / MAX_THRESH_VAL;
+}
+
+QVector<int> BitDepth::SliderLut(const QImage& img)
+{
+   QVector<int> lut(MAX_THRESH_VAL + 1);
+
+   if (!IsDeep(img))
+   {
+      for (int s = 0; s <= MAX_THRESH_VAL; s++)
+      {
+         lut[s] = s;
+      }
+
+      return lut;
+   }
+
+   int lowest = 0;
+   int highest = 0;
+   Range(img, lowest, highest);
+
+   for (int s = 0; s <= MAX_THRESH_VAL; s++)
+   {
+      lut[s] = lowest + (int)(((qint64)s * (highest - lowest) + MAX_THRESH_VAL / 2) / MAX_THRESH_VAL);
+   }
+
+   return lut;
+}
+
+int BitDepth::SliderPosition(const QVector<int>& lut, const int& threshold)
+{
+   const int above = std::upper_bound(lut.begin(), lut.end(), threshold) - lut.begin();
+   return qBound(0, above - 1, MAX_THRESH_VAL);
+}
+
+QImage BitDepth::SliderLevels(const QImage& img, const QVector<int>& lut)
+{
+   if (!IsDeep(img))
+   {
+      return img;
+   }
+
+   //level[v] is how many slider thresholds v is above, so level > s exactly
+   //when v > lut[s]. It tops out at 255 because nothing is above lut[255].
+   QVector<uchar> level(MAX_GRAY16_VAL + 1);
+   int s = 0;
+
+   for (int v = 0; v <= MAX_GRAY16_VAL; v++)
+   {
+      while (s <= MAX_THRESH_VAL && lut[s] < v)
+      {
+         s++;
+      }
+
+      level[v] = (uchar)qMin(s, MAX_THRESH_VAL);
+   }
+
+   QImage gray(img.size(), QImage::Format_Grayscale8);
+   const uchar* srcBits = img.constBits();
+   const int srcStride = img.bytesPerLine();
+   uchar* dstBits = gray.bits();
+   const int dstStride = gray.bytesPerLine();
+   const int width = img.width();
+   const uchar* table = level.constData();
+
+   Parallel::ForRows(img.height(), width, [=](const int& begin, const int& end) {
+      for (int y = begin; y < end; y++)
+      {
+         const quint16* in = (const quint16*)(srcBits + (qint64)y * srcStride);
+         uchar* out = dstBits + (qint64)y * dstStride;
+
+         for (int x = 0; x < width; x++)
+         {
+            out[x] = table[in[x]];
+         }
+      }
+   });
+
+   return gray;
+}
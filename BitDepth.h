@@ -0,0 +1,44 @@
+#ifndef BitDepth_h
+#define BitDepth_h
+
+#include <QImage>
+#include <QVector>
+
+//12 and 16 bit camera pictures. Those load as Format_Grayscale16 and the
+//threshold, Otsu and local threshold stages take them as they are, in their
+//own units, instead of going through qGray() and losing the bottom bits.
+//
+//A 12 bit camera's TIFFs hold 0..4095 in 16 bit words, so how many bits a
+//picture really uses is worked out from its brightest pixel.
+namespace BitDepth
+{
+
+bool IsDeep(const QImage& img);
+
+//smallest and largest gray value, 16 bit units for deep pictures
+void Range(const QImage& img, int& lowest, int& highest);
+
+//8 for anything that isn't deep, otherwise the bits the brightest pixel needs
+//but at least 8
+int SignificantBits(const QImage& img);
+
+//what 8 bit amounts (Sauvola's r, the C offsets) get multiplied by at that
+//many bits, 1 at 8 bits and 257 at 16
+double Scale(const int& bits);
+
+//threshold for each of the 256 slider positions. Identity for 8 bit pictures,
+//for deep ones the slider spans lowest to highest so a dim sample still gets
+//the whole slider.
+QVector<int> SliderLut(const QImage& img);
+
+//the slider position whose threshold is the highest one at or below threshold
+int SliderPosition(const QVector<int>& lut, const int& threshold);
+
+//Format_Grayscale8 copy where gray > s is exactly where img > lut[s], for
+//whatever only knows 8 bit levels, like the incremental labeller behind the
+//live clean. The picture as it is when it's not deep.
+QImage SliderLevels(const QImage& img, const QVector<int>& lut);
+
+}
+
+#endif /* BitDepth_h */
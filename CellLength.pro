@@ -1,6 +1,7 @@
 QT       += core gui
 QT 	+= testlib
 QT 	+= concurrent
+QT 	+= network
 greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
 
 CONFIG += c++11
@@ -10,13 +11,17 @@ CONFIG += c++11
 #DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
 
 SOURCES += \
+    JobServer.cpp \
+    TiledImageItem.cpp \
     main.cpp \
-    mainwindow.cpp \
-    ImageOps.cpp
+    mainwindow.cpp
 
 HEADERS += \
-    mainwindow.h \
-    ImageOps.h
+    JobServer.h \
+    TiledImageItem.h \
+    mainwindow.h
+
+include(CellLengthCore.pri)
 
 # Default rules for deployment.
 qnx: target.path = /tmp/$${TARGET}/bin
@@ -0,0 +1,54 @@
+# Image processing core shared by the GUI, the benchmarks and anything else
+# that wants to run the pipeline without going through MainWindow.
+
+INCLUDEPATH += $$PWD
+DEPENDPATH += $$PWD
+
+SOURCES += \
+    $$PWD/Background.cpp \
+    $$PWD/Batch.cpp \
+    $$PWD/BitDepth.cpp \
+    $$PWD/Contour.cpp \
+    $$PWD/DecodeQueue.cpp \
+    $$PWD/Denoise.cpp \
+    $$PWD/DistanceTransform.cpp \
+    $$PWD/Document.cpp \
+    $$PWD/ImageOps.cpp \
+    $$PWD/IncrementalLabel.cpp \
+    $$PWD/LocalThreshold.cpp \
+    $$PWD/MaxTree.cpp \
+    $$PWD/Otsu.cpp \
+    $$PWD/Pipeline.cpp \
+    $$PWD/Scheduler.cpp \
+    $$PWD/Scratch.cpp \
+    $$PWD/ShapeFilter.cpp \
+    $$PWD/Shard.cpp \
+    $$PWD/SimdKernels.cpp \
+    $$PWD/Stack.cpp \
+    $$PWD/Sweep.cpp \
+    $$PWD/Watershed.cpp
+
+HEADERS += \
+    $$PWD/Background.h \
+    $$PWD/Batch.h \
+    $$PWD/BitDepth.h \
+    $$PWD/Contour.h \
+    $$PWD/DecodeQueue.h \
+    $$PWD/Denoise.h \
+    $$PWD/DistanceTransform.h \
+    $$PWD/Document.h \
+    $$PWD/ImageOps.h \
+    $$PWD/IncrementalLabel.h \
+    $$PWD/LocalThreshold.h \
+    $$PWD/MaxTree.h \
+    $$PWD/Otsu.h \
+    $$PWD/Parallel.h \
+    $$PWD/Pipeline.h \
+    $$PWD/Scheduler.h \
+    $$PWD/Scratch.h \
+    $$PWD/ShapeFilter.h \
+    $$PWD/Shard.h \
+    $$PWD/SimdKernels.h \
+    $$PWD/Stack.h \
+    $$PWD/Sweep.h \
+    $$PWD/Watershed.h
@@ -0,0 +1,577 @@
+#include "Contour.h"
+#include "Scheduler.h"
+#include "Scratch.h"
+#include "SimdKernels.h"
+
+#include <QHash>
+#include <QtMath>
+
+#include <algorithm>
+
+namespace
+{
+
+//the 8 neighbours clockwise on screen starting at +x, the order Suzuki & Abe
+//search in. Freeman code of direction k is (8 - k) % 8.
+static constexpr int DX[8] = { 1, 1, 0, -1, -1, -1, 0, 1 };
+static constexpr int DY[8] = { 0, 1, 1, 1, 0, -1, -1, -1 };
+
+static constexpr int EAST = 0;
+static constexpr int WEST = 4;
+
+//the mask as 0/1 with a one pixel frame of background round it, so nothing
+//in here has to check for the edge. f holds (width + 2) * (height + 2).
+template<typename T>
+void Pad(const QImage& mask, T* f)
+{
+   const QImage gray = SimdKernels::ToGray(mask);
+   const int stride = gray.width() + 2;
+   std::fill(f, f + (qint64)stride * (gray.height() + 2), 0);
+
+   for (int y = 0; y < gray.height(); y++)
+   {
+      const uchar* line = gray.constScanLine(y);
+      T* out = f + (qint64)(y + 1) * stride + 1;
+
+      for (int x = 0; x < gray.width(); x++)
+      {
+         out[x] = line[x] != 0;
+      }
+   }
+}
+
+template<typename T>
+QVector<T> Padded(const QImage& mask)
+{
+   QVector<T> f((qint64)(mask.width() + 2) * (mask.height() + 2));
+   Pad(mask, f.data());
+
+   return f;
+}
+
+//Trace, leaving the labels behind in f. Every pixel a border went through
+//ends up at +-(its index + 2), object pixels no border touched stay at 1.
+QVector<Contour::Border> TraceLabels(const QImage& mask, const Contour::Connectivity& connectivity, QVector<qint32>& f)
+{
+   typedef Contour::Border Border;
+
+   const int width = mask.width();
+   const int height = mask.height();
+   const int stride = width + 2;
+   const int step = connectivity == Contour::Connectivity::Eight ? 1 : 2;
+   const int directions = 8 / step;
+
+   f = Padded<qint32>(mask);
+   QVector<Border> borders;
+
+   int offset[8];
+
+   for (int k = 0; k < 8; k++)
+   {
+      offset[k] = DY[k] * stride + DX[k];
+   }
+
+   //labels are 1 for the frame and index + 2 for the borders, negative once a
+   //border has gone past with background to the east of it (section 3.4)
+   int nbd = 1;
+
+   auto follow = [&](const int& i0, const int& startDirection, Border& border) {
+      //3.1, clockwise round the start for the first object pixel
+      int d1 = -1;
+
+      for (int n = 0; n < directions; n++)
+      {
+         const int k = (startDirection + n * step) % 8;
+
+         if (f[i0 + offset[k]] != 0)
+         {
+            d1 = k;
+            break;
+         }
+      }
+
+      if (d1 < 0)
+      {
+         f[i0] = -nbd;
+         return;
+      }
+
+      const int i1 = i0 + offset[d1];
+      int i3 = i0;
+      int d = d1;
+
+      while (true)
+      {
+         //3.3, anticlockwise round i3 from just past where we came from
+         bool eastIsBackground = false;
+         int k = d;
+
+         for (int n = 1; n <= directions; n++)
+         {
+            k = (d - n * step + 8) % 8;
+
+            if (f[i3 + offset[k]] != 0)
+            {
+               break;
+            }
+
+            if (k == EAST)
+            {
+               eastIsBackground = true;
+            }
+         }
+
+         const int i4 = i3 + offset[k];
+
+         //3.4
+         if (eastIsBackground)
+         {
+            f[i3] = -nbd;
+         }
+         else if (f[i3] == 1)
+         {
+            f[i3] = nbd;
+         }
+
+         border.chain.push_back((quint8)((8 - k) % 8));
+
+         //3.5, back at the start and about to go round the same way again
+         if (i4 == i0 && i3 == i1)
+         {
+            break;
+         }
+
+         d = (k + 4) % 8;
+         i3 = i4;
+      }
+   };
+
+   for (int y = 1; y <= height; y++)
+   {
+      int lnbd = 1;
+
+      for (int x = 1; x <= width; x++)
+      {
+         const int i = y * stride + x;
+         const qint32 v = f[i];
+
+         if (v == 0)
+         {
+            continue;
+         }
+
+         const bool outer = v == 1 && f[i - 1] == 0;
+         const bool hole = !outer && v >= 1 && f[i + 1] == 0;
+
+         if (outer || hole)
+         {
+            if (hole && v > 1)
+            {
+               lnbd = v;
+            }
+
+            nbd++;
+
+            //table 1 of the paper, a border of the same kind as the last one
+            //passed shares its parent, a different kind sits inside it
+            const bool lastIsHole = lnbd == 1 || borders[lnbd - 2].isHole;
+            const int lastParent = lnbd == 1 ? -1 : borders[lnbd - 2].parent;
+
+            Border border;
+            border.start = Pixel(x - 1, y - 1);
+            border.isHole = hole;
+            border.parent = hole == lastIsHole ? lastParent : lnbd - 2;
+
+            follow(i, outer ? WEST : EAST, border);
+            borders.push_back(border);
+         }
+
+         if (f[i] != 1)
+         {
+            lnbd = qAbs(f[i]);
+         }
+      }
+   }
+
+   return borders;
+}
+
+}
+
+QVector<Contour::Border> Contour::Trace(const QImage& mask, const Connectivity& connectivity)
+{
+   QVector<qint32> labels;
+   return TraceLabels(mask, connectivity, labels);
+}
+
+QVector<Pixel> Contour::Points(const Border& border)
+{
+   QVector<Pixel> points;
+   points.reserve(qMax(1, border.chain.count()));
+
+   Pixel p = border.start;
+   points.push_back(p);
+
+   //the last step goes back to start
+   for (int n = 0; n + 1 < border.chain.count(); n++)
+   {
+      p = Pixel(p.x + CHAIN_DX[border.chain[n]], p.y + CHAIN_DY[border.chain[n]]);
+      points.push_back(p);
+   }
+
+   return points;
+}
+
+double Contour::Perimeter(const Border& border)
+{
+   int diagonal = 0;
+
+   for (const auto& code : border.chain)
+   {
+      diagonal += code & 1;
+   }
+
+   return (border.chain.count() - diagonal) + diagonal * M_SQRT2;
+}
+
+QPolygonF Contour::ConvexHull(const Border& border)
+{
+   QVector<QPoint> corners;
+
+   for (const auto& p : Points(border))
+   {
+      corners << QPoint(p.x, p.y) << QPoint(p.x + 1, p.y) << QPoint(p.x, p.y + 1) << QPoint(p.x + 1, p.y + 1);
+   }
+
+   std::sort(corners.begin(), corners.end(), [](const QPoint& a, const QPoint& b) {
+      return a.x() < b.x() || (a.x() == b.x() && a.y() < b.y());
+   });
+
+   //> 0 when o -> a -> b turns clockwise on screen
+   auto turn = [](const QPoint& o, const QPoint& a, const QPoint& b) {
+      return (qint64)(a.x() - o.x()) * (b.y() - o.y()) - (qint64)(a.y() - o.y()) * (b.x() - o.x());
+   };
+
+   //Andrew's monotone chain, the half below on screen left to right and then
+   //the half above right to left
+   QVector<QPoint> hull(2 * corners.count());
+   int k = 0;
+
+   for (int i = 0; i < corners.count(); i++)
+   {
+      while (k >= 2 && turn(hull[k - 2], hull[k - 1], corners[i]) >= 0)
+      {
+         k--;
+      }
+
+      hull[k++] = corners[i];
+   }
+
+   for (int i = corners.count() - 2, lower = k + 1; i >= 0; i--)
+   {
+      while (k >= lower && turn(hull[k - 2], hull[k - 1], corners[i]) >= 0)
+      {
+         k--;
+      }
+
+      hull[k++] = corners[i];
+   }
+
+   QPolygonF polygon;
+
+   //the last point is the first one again
+   for (int i = 0; i + 1 < k; i++)
+   {
+      polygon << QPointF(hull[i].x(), hull[i].y());
+   }
+
+   return polygon;
+}
+
+double Contour::Area(const QPolygonF& polygon)
+{
+   double twice = 0;
+
+   for (int i = 0; i < polygon.count(); i++)
+   {
+      const QPointF& a = polygon[i];
+      const QPointF& b = polygon[(i + 1) % polygon.count()];
+      twice += a.x() * b.y() - b.x() * a.y();
+   }
+
+   return qAbs(twice) / 2;
+}
+
+QVector<Pixel> Contour::BorderPixels(const QImage& mask)
+{
+   const int width = mask.width();
+   const int stride = width + 2;
+
+   //with four connected objects every pixel next to the background, diagonals
+   //included, is on one of the borders, so it's every pixel a border labelled
+   QVector<qint32> labels;
+   TraceLabels(mask, Connectivity::Four, labels);
+
+   QVector<Pixel> pixels;
+
+   for (int y = 0; y < mask.height(); y++)
+   {
+      const qint32* line = labels.constData() + (qint64)(y + 1) * stride + 1;
+
+      for (int x = 0; x < width; x++)
+      {
+         if (line[x] != 0 && line[x] != 1)
+         {
+            pixels.push_back(Pixel(x, y));
+         }
+      }
+   }
+
+   return pixels;
+}
+
+QVector<QPolygonF> Contour::Outlines(const QImage& gray, const double& level)
+{
+   const QImage img = SimdKernels::ToGray(gray);
+   const int width = img.width();
+   const int height = img.height();
+
+   //grid point gx, gy is pixel gx - 1, gy - 1, the ring round the outside is
+   //the 0 padding
+   const int gridWidth = width + 2;
+   const int gridHeight = height + 2;
+
+   auto value = [&](const int& gx, const int& gy) -> double {
+      const int x = gx - 1;
+      const int y = gy - 1;
+      return x >= 0 && y >= 0 && x < width && y < height ? img.constScanLine(y)[x] : 0.0;
+   };
+
+   //even ids are the edge from a grid point to the one right of it, odd ids
+   //the edge to the one below
+   auto edge = [&](const int& gx, const int& gy, const bool& down) -> qint64 {
+      return 2 * ((qint64)gy * gridWidth + gx) + (down ? 1 : 0);
+   };
+
+   auto point = [&](const qint64& id) -> QPointF {
+      const qint64 corner = id / 2;
+      const int gx = (int)(corner % gridWidth);
+      const int gy = (int)(corner / gridWidth);
+      const bool down = id & 1;
+      const int qx = down ? gx : gx + 1;
+      const int qy = down ? gy + 1 : gy;
+
+      const double vp = value(gx, gy);
+      const double vq = value(qx, qy);
+      const double t = (level - vp) / (vq - vp);
+
+      return QPointF(gx - 0.5 + t * (qx - gx), gy - 0.5 + t * (qy - gy));
+   };
+
+   //each cell's segments go from where its corners (walked clockwise) cross
+   //into the level to where they cross back out. Neighbouring cells walk their
+   //shared edge opposite ways, so every crossing is the start of exactly one
+   //segment and the end of exactly one.
+   QHash<qint64, qint64> next;
+   QVector<qint64> starts;
+
+   for (int gy = 0; gy + 1 < gridHeight; gy++)
+   {
+      for (int gx = 0; gx + 1 < gridWidth; gx++)
+      {
+         const double v[4] = { value(gx, gy), value(gx + 1, gy), value(gx + 1, gy + 1), value(gx, gy + 1) };
+         const bool in[4] = { v[0] >= level, v[1] >= level, v[2] >= level, v[3] >= level };
+
+         if (in[0] == in[1] && in[1] == in[2] && in[2] == in[3])
+         {
+            continue;
+         }
+
+         const qint64 edges[4] = { edge(gx, gy, false), edge(gx + 1, gy, true), edge(gx, gy + 1, false), edge(gx, gy, true) };
+
+         qint64 crossing[4];
+         bool entering[4];
+         int count = 0;
+
+         for (int k = 0; k < 4; k++)
+         {
+            if (in[k] != in[(k + 1) % 4])
+            {
+               crossing[count] = edges[k];
+               entering[count] = in[(k + 1) % 4];
+               count++;
+            }
+         }
+
+         //two crossings, or a saddle with four. Joined saddles pair each
+         //crossing in with the crossing out before it instead of after it.
+         const bool joined = count == 4 && (v[0] + v[1] + v[2] + v[3]) / 4 >= level;
+
+         for (int c = 0; c < count; c++)
+         {
+            if (entering[c])
+            {
+               const int out = joined ? (c + count - 1) % count : (c + 1) % count;
+               next.insert(crossing[c], crossing[out]);
+               starts.push_back(crossing[c]);
+            }
+         }
+      }
+   }
+
+   QVector<QPolygonF> outlines;
+
+   for (const auto& start : starts)
+   {
+      if (!next.contains(start))
+      {
+         continue;
+      }
+
+      QPolygonF outline;
+      qint64 current = start;
+
+      do
+      {
+         outline << point(current);
+         current = next.take(current);
+      } while (current != start && next.contains(current));
+
+      outlines.push_back(outline);
+   }
+
+   return outlines;
+}
+
+QVector<Pixel> Contour::Thin(const QImage& mask)
+{
+   const int width = mask.width();
+   const int height = mask.height();
+   const int stride = width + 2;
+
+   //the padded mask, the queue flags and the border lists all come from the
+   //scratch pool, Thin runs once per cell and they'd be allocated every time.
+   //A pixel is on a border list at most once, so none of them can outgrow m.
+   const qint64 padded = (qint64)stride * (height + 2);
+   Scratch::Buffer<uchar> m(padded);
+   Pad(mask, m.data());
+
+   //ImageOps::neigh order, bit n of the isSimpleTable key is neighbour n
+   int offset[9];
+
+   for (int n = 0; n < 9; n++)
+   {
+      offset[n] = neigh[n].y * stride + neigh[n].x;
+   }
+
+   auto isSimple = [&](const int& i) {
+      int key = 0;
+
+      for (int n = 0; n < 9; n++)
+      {
+         key |= m[i + offset[n]] << n;
+      }
+
+      return isSimpleTable[key];
+   };
+
+   auto isCurveEnd = [&](const int& i) {
+      int neighbours = 0;
+
+      for (int n = 0; n < 9; n++)
+      {
+         neighbours += n != 4 ? m[i + offset[n]] : 0;
+      }
+
+      return neighbours <= 1;
+   };
+
+   Scratch::Buffer<int> borderBuffer(padded);
+   Scratch::Buffer<int> nextBuffer(padded);
+   Scratch::Buffer<int> removed(padded);
+   int* border = borderBuffer.data();
+   int* nextBorder = nextBuffer.data();
+   int borderCount = 0;
+
+   for (const auto& p : BorderPixels(mask))
+   {
+      border[borderCount++] = (p.y + 1) * stride + p.x + 1;
+   }
+
+   //last pass a pixel was queued in, so nothing is queued twice
+   Scratch::Buffer<int> queued(padded, 0);
+   int pass = 0;
+
+   while (true)
+   {
+      int removedCount = 0;
+
+      //raster order and taken off as we go, same as ImageOps::Thin
+      for (int b = 0; b < borderCount; b++)
+      {
+         const int i = border[b];
+
+         if (isSimple(i) && !isCurveEnd(i))
+         {
+            m[i] = 0;
+            removed[removedCount++] = i;
+         }
+      }
+
+      if (removedCount == 0 || Scheduler::Cancelled())
+      {
+         break;
+      }
+
+      //the next border is what's left of this one plus whatever object is
+      //now next to a pixel that just went
+      pass++;
+      int nextCount = 0;
+
+      for (int b = 0; b < borderCount; b++)
+      {
+         const int i = border[b];
+
+         if (m[i] && queued[i] != pass)
+         {
+            queued[i] = pass;
+            nextBorder[nextCount++] = i;
+         }
+      }
+
+      for (int r = 0; r < removedCount; r++)
+      {
+         for (int n = 0; n < 9; n++)
+         {
+            const int j = removed[r] + offset[n];
+
+            if (m[j] && queued[j] != pass)
+            {
+               queued[j] = pass;
+               nextBorder[nextCount++] = j;
+            }
+         }
+      }
+
+      std::sort(nextBorder, nextBorder + nextCount);
+      std::swap(border, nextBorder);
+      borderCount = nextCount;
+   }
+
+   QVector<Pixel> s;
+
+   for (int y = 0; y < height; y++)
+   {
+      const uchar* line = m.constData() + (qint64)(y + 1) * stride + 1;
+
+      for (int x = 0; x < width; x++)
+      {
+         if (line[x])
+         {
+            s.push_back(Pixel(x, y));
+         }
+      }
+   }
+
+   return s;
+}
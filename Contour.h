@@ -0,0 +1,92 @@
+#ifndef Contour_h
+#define Contour_h
+
+#include <QImage>
+#include <QPolygonF>
+#include <QVector>
+
+#include "ImageOps.h"
+
+//Border following after Suzuki & Abe, "Topological Structural Analysis of
+//Digitized Binary Images by Border Following". One raster pass over the mask
+//finds every outer border and every hole border and follows each one the
+//moment its first pixel is hit, so the borders come out ordered as chain codes
+//instead of as an unordered pixel scan like ImageOps::GetBorderPixels.
+//
+//Masks are Format_Grayscale8 with anything non zero as object, what
+//DistanceTransform::Foreground/RedForeground give. Nothing outside the image
+//counts as object.
+namespace Contour
+{
+
+enum class Connectivity
+{
+   Four,
+   Eight
+};
+
+//Freeman codes, 0 = +x then anticlockwise on screen: 1 is up and to the right,
+//2 straight up (-y), ... 7 down and to the right
+static const int CHAIN_DX[8] = { 1, 1, 0, -1, -1, -1, 0, 1 };
+static const int CHAIN_DY[8] = { 0, -1, -1, -1, 0, 1, 1, 1 };
+
+struct Border
+{
+   //first pixel hit by the raster scan
+   Pixel start;
+
+   //steps from start all the way round and back to start, empty for a
+   //single pixel on its own
+   QVector<quint8> chain;
+
+   //outer border of a component, or the border of a hole in one
+   bool isHole = false;
+
+   //index of the border this one sits directly inside, -1 for the image frame
+   int parent = -1;
+};
+
+//every border in the order the raster scan finds them, a component's outer
+//border always before its holes. connectivity is the object's, the background
+//gets the other one.
+QVector<Border> Trace(const QImage& mask, const Connectivity& connectivity);
+
+//the pixels a border visits, start first. Thin parts are gone over twice, so
+//pixels can repeat.
+QVector<Pixel> Points(const Border& border);
+
+//Freeman length, 1 per straight step and sqrt(2) per diagonal one
+double Perimeter(const Border& border);
+
+//convex hull of the pixel squares a border goes through, by their corners so
+//a single pixel comes out as a unit square. Anticlockwise on screen.
+QPolygonF ConvexHull(const Border& border);
+
+//area inside a closed polygon, whichever way round it goes
+double Area(const QPolygonF& polygon);
+
+//object pixels with background somewhere in their 8 neighbourhood, in raster
+//order. Same set as ImageOps::GetBorderPixels on the red overlay, taken from
+//the four connected borders instead of checking every pixel.
+QVector<Pixel> BorderPixels(const QImage& mask);
+
+//sub pixel outlines of where gray crosses level, marching squares on the
+//pixel centres (pixel x, y is at x + 0.5, y + 0.5) with the crossing linearly
+//interpolated along each cell edge. Every outline is closed (the last point
+//joins the first) with the above-level side on its left, so outer outlines run
+//anticlockwise on screen and the ones round holes clockwise. Outside the
+//image counts as 0, so level has to be above 0. Saddle cells go by the average
+//of their corners, >= level joins the two above-level corners, so a 0/255
+//mask at level 127.5 gives diagonal pixels one outline, like the 8 connected
+//labelling does.
+QVector<QPolygonF> Outlines(const QImage& gray, const double& level);
+
+//ImageOps::Thin for a mask, same skeleton pixel for pixel. The first pass
+//starts from BorderPixels and every pass after only looks at the border it
+//left behind and the pixels next to what it took off, instead of scanning the
+//whole frame again.
+QVector<Pixel> Thin(const QImage& mask);
+
+}
+
+#endif /* Contour_h */
@@ -0,0 +1,179 @@
+#include "DecodeQueue.h"
+#include "SimdKernels.h"
+
+#include <QElapsedTimer>
+#include <QImageReader>
+#include <QMutexLocker>
+
+DecodeQueue::DecodeQueue(const QStringList& paths, const DecodeOptions& options, const int& decoderThreads, const qint64& memoryBudget)
+   : paths(paths)
+   , options(options)
+   , decoderThreads(qMax(1, decoderThreads))
+   , memoryBudget(memoryBudget)
+{
+}
+
+DecodeQueue::~DecodeQueue()
+{
+   Stop();
+
+   for (auto worker : workers)
+   {
+      worker->wait();
+      delete worker;
+   }
+}
+
+void DecodeQueue::Start(const QThread::Priority& priority)
+{
+   for (int i = 0; i < decoderThreads; i++)
+   {
+      DecodeWorker* worker = new DecodeWorker(this);
+      workers.push_back(worker);
+      worker->start(priority);
+   }
+}
+
+bool DecodeQueue::Take(DecodedFrame& frame)
+{
+   QMutexLocker locker(&mutex);
+   QElapsedTimer timer;
+   timer.start();
+
+   while (ready.isEmpty() && handedOut < paths.count() && !stopping)
+   {
+      frameAvailable.wait(&mutex);
+   }
+
+   stallNs += timer.nsecsElapsed();
+
+   if (ready.isEmpty())
+   {
+      return false;
+   }
+
+   frame = ready.dequeue();
+   handedOut++;
+
+   return true;
+}
+
+void DecodeQueue::Release(const DecodedFrame& frame)
+{
+   Unreserve(frame.reservedBytes);
+}
+
+void DecodeQueue::Stop()
+{
+   QMutexLocker locker(&mutex);
+   stopping = true;
+   spaceAvailable.wakeAll();
+   frameAvailable.wakeAll();
+}
+
+qint64 DecodeQueue::DecodeNs()
+{
+   QMutexLocker locker(&mutex);
+   return decodeNs;
+}
+
+qint64 DecodeQueue::StallNs()
+{
+   QMutexLocker locker(&mutex);
+   return stallNs;
+}
+
+bool DecodeQueue::Reserve(const qint64& bytes)
+{
+   QMutexLocker locker(&mutex);
+
+   //a single frame bigger than the whole budget still goes through on its own,
+   //otherwise the queue would never move
+   while (!stopping && reserved > 0 && reserved + bytes > memoryBudget)
+   {
+      spaceAvailable.wait(&mutex);
+   }
+
+   if (stopping)
+   {
+      return false;
+   }
+
+   reserved += bytes;
+   return true;
+}
+
+void DecodeQueue::Unreserve(const qint64& bytes)
+{
+   QMutexLocker locker(&mutex);
+   reserved -= bytes;
+   spaceAvailable.wakeAll();
+}
+
+void DecodeQueue::DecodeLoop()
+{
+   while (true)
+   {
+      DecodedFrame frame;
+
+      {
+         QMutexLocker locker(&mutex);
+
+         if (stopping || nextToDecode >= paths.count())
+         {
+            return;
+         }
+
+         frame.index = nextToDecode++;
+         frame.path = paths[frame.index];
+      }
+
+      QElapsedTimer timer;
+      timer.start();
+
+      QImageReader reader(frame.path);
+
+      if (options.clipRect.isValid())
+      {
+         reader.setClipRect(options.clipRect);
+      }
+
+      if (options.scaledSize.isValid())
+      {
+         reader.setScaledSize(options.scaledSize);
+      }
+
+      //the header is enough to know how big the decode is going to be. The
+      //decoder's own buffer is 32 bit whatever we end up keeping.
+      QSize decodedSize = options.scaledSize.isValid() ? options.scaledSize
+                        : options.clipRect.isValid() ? options.clipRect.size()
+                        : reader.size();
+      frame.reservedBytes = decodedSize.isValid() ? (qint64)decodedSize.width() * decodedSize.height() * 4 : 0;
+
+      if (!Reserve(frame.reservedBytes))
+      {
+         return;
+      }
+
+      if (!reader.read(&frame.image))
+      {
+         frame.error = reader.errorString();
+         frame.image = QImage();
+      }
+      else if (options.grayscale && frame.image.format() != QImage::Format_Grayscale16)
+      {
+         frame.image = SimdKernels::ToGray(frame.image);
+      }
+
+      //trade the decode sized reservation for what the frame actually holds
+      const qint64 kept = frame.image.isNull() ? 0 : (qint64)frame.image.bytesPerLine() * frame.image.height();
+      Unreserve(frame.reservedBytes - kept);
+      frame.reservedBytes = kept;
+      frame.decodeNs = timer.nsecsElapsed();
+
+      QMutexLocker locker(&mutex);
+      decodeNs += frame.decodeNs;
+      ready.enqueue(frame);
+      frameAvailable.wakeOne();
+   }
+}
@@ -0,0 +1,110 @@
+#ifndef DecodeQueue_h
+#define DecodeQueue_h
+
+#include <QImage>
+#include <QMutex>
+#include <QQueue>
+#include <QRect>
+#include <QSize>
+#include <QStringList>
+#include <QThread>
+#include <QVector>
+#include <QWaitCondition>
+
+struct DecodeOptions
+{
+   //handed to QImageReader. The JPEG plugin does the scaling inside libjpeg
+   //(DCT scaling), which is a lot cheaper than decoding full size and shrinking.
+   //Invalid/null means full size, whole picture.
+   QSize scaledSize;
+   QRect clipRect;
+
+   //hand out Format_Grayscale8 frames. Gray JPEGs/TIFFs already come out of the
+   //reader that way, colour ones get converted on the decoder thread. 12 and
+   //16 bit gray TIFFs stay Format_Grayscale16 so the pipeline gets all the bits.
+   bool grayscale = true;
+};
+
+struct DecodedFrame
+{
+   int index = -1;
+   QString path;
+   QImage image;
+   QString error;
+   qint64 decodeNs = 0;
+   qint64 reservedBytes = 0;
+};
+
+//Bounded producer/consumer queue in front of the processing. N decoder threads
+//read ahead through the file list while the consumers work on what is already
+//decoded. Every frame reserves its size against a memory budget from the moment
+//its decode starts until the consumer Release()s it, and the decoders block
+//once the budget is used up, so a slow consumer can't make the read ahead eat
+//all the memory.
+class DecodeQueue
+{
+public:
+   DecodeQueue(const QStringList& paths, const DecodeOptions& options, const int& decoderThreads, const qint64& memoryBudget);
+   ~DecodeQueue();
+
+   void Start(const QThread::Priority& priority = QThread::InheritPriority);
+
+   //blocks until a frame is ready. Returns false once every frame has been
+   //handed out or the queue was stopped. Frames come in decode completion order,
+   //DecodedFrame::index says where they were in the list.
+   bool Take(DecodedFrame& frame);
+
+   //gives the frame's memory back to the budget
+   void Release(const DecodedFrame& frame);
+
+   void Stop();
+
+   int Count() const { return paths.count(); }
+
+   //summed over all decoder threads
+   qint64 DecodeNs();
+
+   //how long consumers sat in Take() waiting for a decoder
+   qint64 StallNs();
+
+private:
+   friend class DecodeWorker;
+
+   void DecodeLoop();
+   bool Reserve(const qint64& bytes);
+   void Unreserve(const qint64& bytes);
+
+   QStringList paths;
+   DecodeOptions options;
+   int decoderThreads = 1;
+   qint64 memoryBudget = 0;
+
+   QMutex mutex;
+   QWaitCondition spaceAvailable;
+   QWaitCondition frameAvailable;
+   QQueue<DecodedFrame> ready;
+   QVector<QThread*> workers;
+   int nextToDecode = 0;
+   int handedOut = 0;
+   qint64 reserved = 0;
+   qint64 decodeNs = 0;
+   qint64 stallNs = 0;
+   bool stopping = false;
+};
+
+class DecodeWorker : public QThread
+{
+public:
+   DecodeWorker(DecodeQueue* queue)
+      : queue(queue) {};
+
+   void run() override
+   {
+      queue->DecodeLoop();
+   }
+
+private:
+   DecodeQueue* queue = nullptr;
+};
+
+#endif /* DecodeQueue_h */
@@ -0,0 +1,307 @@
+#include "Denoise.h"
+#include "Parallel.h"
+#include "Scratch.h"
+#include "SimdKernels.h"
+
+#include <QVector>
+#include <QtMath>
+
+#include <cstring>
+
+namespace
+{
+
+//columns the recursive pass does together, the float buffer for a strip is
+//height * STRIP_WIDTH
+static constexpr int STRIP_WIDTH = 256;
+
+static constexpr int FINE_BINS = 256;
+static constexpr int COARSE_BINS = 16;
+
+QVector<float> GaussianWeights(const double& sigma)
+{
+   const int radius = qMax(1, (int)qCeil(3 * sigma));
+   QVector<float> weights(2 * radius + 1);
+   double sum = 0;
+
+   for (int k = -radius; k <= radius; k++)
+   {
+      const double w = qExp(-(double)k * k / (2 * sigma * sigma));
+      weights[k + radius] = (float)w;
+      sum += w;
+   }
+
+   for (auto& w : weights)
+   {
+      w = (float)(w / sum);
+   }
+
+   return weights;
+}
+
+//one FIR pass down the columns, every output row is a weighted sum of whole input rows
+QImage GaussianColumns(const QImage& gray, const QVector<float>& weights)
+{
+   const int width = gray.width();
+   const int height = gray.height();
+   const int radius = weights.count() / 2;
+
+   QImage out(gray.size(), QImage::Format_Grayscale8);
+   const uchar* srcBits = gray.constBits();
+   const int srcStride = gray.bytesPerLine();
+   uchar* dstBits = out.bits();
+   const int dstStride = out.bytesPerLine();
+
+   Parallel::ForRows(height, width * weights.count(), [=](const int& begin, const int& end) {
+      Scratch::Buffer<float> acc(width);
+
+      for (int y = begin; y < end; y++)
+      {
+         std::fill(acc.begin(), acc.end(), 0.0f);
+
+         for (int k = 0; k < weights.count(); k++)
+         {
+            const int source = qBound(0, y + k - radius, height - 1);
+            SimdKernels::AccumulateRow(srcBits + (qint64)source * srcStride, weights[k], acc.data(), width);
+         }
+
+         SimdKernels::FloatToGrayRow(acc.constData(), dstBits + (qint64)y * dstStride, width);
+      }
+   });
+
+   return out;
+}
+
+//c[0] = B, c[1..3] = b1..b3 / b0 from Young & van Vliet, eq. 8c and 10
+void RecursiveCoefficients(const double& sigma, float c[4])
+{
+   const double q = sigma >= 2.5 ? 0.98711 * sigma - 0.96330
+                                 : 3.97156 - 4.14554 * qSqrt(1 - 0.26891 * sigma);
+   const double b0 = 1.57825 + 2.44413 * q + 1.4281 * q * q + 0.422205 * q * q * q;
+   const double b1 = 2.44413 * q + 2.85619 * q * q + 1.26661 * q * q * q;
+   const double b2 = -(1.4281 * q * q + 1.26661 * q * q * q);
+   const double b3 = 0.422205 * q * q * q;
+
+   c[0] = (float)(1 - (b1 + b2 + b3) / b0);
+   c[1] = (float)(b1 / b0);
+   c[2] = (float)(b2 / b0);
+   c[3] = (float)(b3 / b0);
+}
+
+//causal then anti-causal pass down a strip of columns at a time. Both start
+//from the edge value, which is where a constant column would settle.
+QImage RecursiveColumns(const QImage& gray, const float c[4])
+{
+   const int width = gray.width();
+   const int height = gray.height();
+   const int strips = (width + STRIP_WIDTH - 1) / STRIP_WIDTH;
+   const float coefficients[4] = { c[0], c[1], c[2], c[3] };
+
+   QImage out(gray.size(), QImage::Format_Grayscale8);
+   const uchar* srcBits = gray.constBits();
+   const int srcStride = gray.bytesPerLine();
+   uchar* dstBits = out.bits();
+   const int dstStride = out.bytesPerLine();
+
+   Parallel::ForRows(strips, height * STRIP_WIDTH, [=](const int& begin, const int& end) {
+      Scratch::Buffer<float> buffer((qint64)height * STRIP_WIDTH);
+      Scratch::Buffer<float> in(STRIP_WIDTH);
+      Scratch::Buffer<float> edge(STRIP_WIDTH);
+
+      for (int s = begin; s < end; s++)
+      {
+         const int x0 = s * STRIP_WIDTH;
+         const int n = qMin(STRIP_WIDTH, width - x0);
+         float* rows = buffer.data();
+
+         auto row = [&](const int& y) { return rows + (qint64)y * n; };
+
+         SimdKernels::GrayToFloatRow(srcBits + x0, edge.data(), n);
+
+         for (int y = 0; y < height; y++)
+         {
+            SimdKernels::GrayToFloatRow(srcBits + (qint64)y * srcStride + x0, in.data(), n);
+            SimdKernels::RecursiveRow(in.constData(),
+                                      y >= 1 ? row(y - 1) : edge.constData(),
+                                      y >= 2 ? row(y - 2) : edge.constData(),
+                                      y >= 3 ? row(y - 3) : edge.constData(),
+                                      coefficients, row(y), n);
+         }
+
+         //in place, row y of the causal pass is read before it's overwritten
+         std::memcpy(edge.data(), row(height - 1), n * sizeof(float));
+
+         for (int y = height - 1; y >= 0; y--)
+         {
+            std::memcpy(in.data(), row(y), n * sizeof(float));
+            SimdKernels::RecursiveRow(in.constData(),
+                                      y + 1 < height ? row(y + 1) : edge.constData(),
+                                      y + 2 < height ? row(y + 2) : edge.constData(),
+                                      y + 3 < height ? row(y + 3) : edge.constData(),
+                                      coefficients, row(y), n);
+            SimdKernels::FloatToGrayRow(row(y), dstBits + (qint64)y * dstStride + x0, n);
+         }
+      }
+   });
+
+   return out;
+}
+
+}
+
+QImage Denoise::Gaussian(const QImage& img, const double& sigma)
+{
+   const QImage gray = SimdKernels::ToGray(img);
+
+   if (sigma <= 0 || gray.isNull())
+   {
+      return gray;
+   }
+
+   const QVector<float> weights = GaussianWeights(sigma);
+   const QImage columns = GaussianColumns(gray, weights);
+   return SimdKernels::Transpose(GaussianColumns(SimdKernels::Transpose(columns), weights));
+}
+
+QImage Denoise::RecursiveGaussian(const QImage& img, const double& sigma)
+{
+   const QImage gray = SimdKernels::ToGray(img);
+
+   if (sigma <= 0 || gray.isNull())
+   {
+      return gray;
+   }
+
+   float c[4];
+   RecursiveCoefficients(sigma, c);
+
+   const QImage columns = RecursiveColumns(gray, c);
+   return SimdKernels::Transpose(RecursiveColumns(SimdKernels::Transpose(columns), c));
+}
+
+QImage Denoise::Smooth(const QImage& img, const double& sigma)
+{
+   return sigma > RECURSIVE_SIGMA ? RecursiveGaussian(img, sigma) : Gaussian(img, sigma);
+}
+
+QImage Denoise::Median(const QImage& img, const int& radius)
+{
+   const QImage gray = SimdKernels::ToGray(img);
+   const int r = qMin(radius, MAX_MEDIAN_RADIUS);
+
+   if (r <= 0 || gray.isNull())
+   {
+      return gray;
+   }
+
+   const int width = gray.width();
+   const int height = gray.height();
+
+   QImage out(gray.size(), QImage::Format_Grayscale8);
+   const uchar* srcBits = gray.constBits();
+   const int srcStride = gray.bytesPerLine();
+   uchar* dstBits = out.bits();
+   const int dstStride = out.bytesPerLine();
+
+   //every block of rows gets its own column histograms, primed with the
+   //window of its first row
+   Parallel::ForRows(height, width * FINE_BINS, [=](const int& begin, const int& end) {
+      Scratch::Buffer<quint16> fineColumns((qint64)width * FINE_BINS, 0);
+      Scratch::Buffer<quint16> coarseColumns((qint64)width * COARSE_BINS, 0);
+      const Scratch::Buffer<quint16> zero(FINE_BINS, 0);
+      quint16 fine[FINE_BINS];
+      quint16 coarse[COARSE_BINS];
+
+      auto addRow = [&](const int& y, const int& sign) {
+         const uchar* line = srcBits + (qint64)y * srcStride;
+
+         for (int x = 0; x < width; x++)
+         {
+            fineColumns[x * FINE_BINS + line[x]] += sign;
+            coarseColumns[x * COARSE_BINS + (line[x] >> 4)] += sign;
+         }
+      };
+
+      for (int y = qMax(0, begin - r); y <= qMin(height - 1, begin + r); y++)
+      {
+         addRow(y, 1);
+      }
+
+      for (int y = begin; y < end; y++)
+      {
+         if (y > begin)
+         {
+            if (y - r - 1 >= 0)
+            {
+               addRow(y - r - 1, -1);
+            }
+
+            if (y + r < height)
+            {
+               addRow(y + r, 1);
+            }
+         }
+
+         const int rows = qMin(height - 1, y + r) - qMax(0, y - r) + 1;
+         uchar* line = dstBits + (qint64)y * dstStride;
+
+         std::memset(fine, 0, sizeof(fine));
+         std::memset(coarse, 0, sizeof(coarse));
+
+         for (int x = 0; x <= qMin(width - 1, r); x++)
+         {
+            SimdKernels::HistogramUpdate(fine, fineColumns.constData() + x * FINE_BINS, zero.constData(), FINE_BINS);
+            SimdKernels::HistogramUpdate(coarse, coarseColumns.constData() + x * COARSE_BINS, zero.constData(), COARSE_BINS);
+         }
+
+         for (int x = 0; x < width; x++)
+         {
+            const int columns = qMin(width - 1, x + r) - qMax(0, x - r) + 1;
+            const int rank = rows * columns / 2;
+
+            //coarse bins first, then at most 16 fine ones inside the right one
+            int below = 0;
+            int bin = 0;
+
+            while (below + coarse[bin] <= rank)
+            {
+               below += coarse[bin++];
+            }
+
+            int v = bin * 16;
+
+            while (below + fine[v] <= rank)
+            {
+               below += fine[v++];
+            }
+
+            line[x] = (uchar)v;
+
+            const int in = x + r + 1;
+            const int gone = x - r;
+
+            if (in < width || gone >= 0)
+            {
+               SimdKernels::HistogramUpdate(fine, in < width ? fineColumns.constData() + in * FINE_BINS : zero.constData(),
+                                            gone >= 0 ? fineColumns.constData() + gone * FINE_BINS : zero.constData(), FINE_BINS);
+               SimdKernels::HistogramUpdate(coarse, in < width ? coarseColumns.constData() + in * COARSE_BINS : zero.constData(),
+                                            gone >= 0 ? coarseColumns.constData() + gone * COARSE_BINS : zero.constData(), COARSE_BINS);
+            }
+         }
+      }
+   });
+
+   return out;
+}
+
+QImage Denoise::Apply(const QImage& img, const int& medianRadius, const double& sigma)
+{
+   QImage gray = SimdKernels::ToGray(img);
+
+   if (medianRadius > 0)
+   {
+      gray = Median(gray, medianRadius);
+   }
+
+   return Smooth(gray, sigma);
+}
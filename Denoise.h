@@ -0,0 +1,48 @@
+#ifndef Denoise_h
+#define Denoise_h
+
+#include <QImage>
+
+//Smoothing before thresholding. Salt and pepper noise left in turns into
+//thousands of one or two pixel components that labelling then has to flood
+//and Clean has to throw away, so it's cheaper to get rid of it here.
+//
+//Everything is Format_Grayscale8 out (other formats are converted to gray
+//first) and runs down the columns with the SimdKernels row kernels. The rows
+//are done as columns of the transposed image.
+namespace Denoise
+{
+
+//above this sigma Smooth switches to the recursive filter
+static constexpr double RECURSIVE_SIGMA = 3.0;
+
+//window counts have to fit the 16 bit histograms, (2 * 127 + 1)^2 < 65536
+static constexpr int MAX_MEDIAN_RADIUS = 127;
+
+//separable Gaussian, kernel cut off at 3 sigma, edges repeated outwards.
+//Costs 2 * 3 sigma multiply-adds per pixel and pass.
+QImage Gaussian(const QImage& img, const double& sigma);
+
+//Young & van Vliet's third order recursive Gaussian ("Recursive implementation
+//of the Gaussian filter", 1995), one causal and one anti-causal pass per
+//direction. Same cost at any sigma, not quite as exact as Gaussian for small
+//ones (it's meant for sigma >= 0.5).
+QImage RecursiveGaussian(const QImage& img, const double& sigma);
+
+//Gaussian up to RECURSIVE_SIGMA, RecursiveGaussian past it. sigma <= 0 leaves
+//the picture alone.
+QImage Smooth(const QImage& img, const double& sigma);
+
+//median of the (2 * radius + 1) square window clipped at the edges (the upper
+//one when the clipped window has an even count). Perreault & Hebert's
+//constant time filter: a histogram per column slides down the rows and the
+//window histogram slides along by adding one column and taking one away, so
+//the cost doesn't depend on the radius. radius is clamped to MAX_MEDIAN_RADIUS.
+QImage Median(const QImage& img, const int& radius);
+
+//Median (when medianRadius > 0) and then Smooth
+QImage Apply(const QImage& img, const int& medianRadius, const double& sigma);
+
+}
+
+#endif /* Denoise_h */
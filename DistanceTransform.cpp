@@ -0,0 +1,302 @@
+#include "DistanceTransform.h"
+#include "Parallel.h"
+#include "Scratch.h"
+#include "SimdKernels.h"
+
+#include <QColor>
+#include <QtMath>
+
+#include <limits>
+
+namespace
+{
+
+//lower envelope of the parabolas (q - i)^2 + f[i], written to d.
+//v holds the parabolas in the envelope, z the boundaries between them.
+void Transform1d(const qint32* f, qint32* d, const int& n, int* v, double* z)
+{
+   const double infinity = std::numeric_limits<double>::infinity();
+   int k = 0;
+   v[0] = 0;
+   z[0] = -infinity;
+   z[1] = infinity;
+
+   for (int q = 1; q < n; q++)
+   {
+      double s = 0;
+
+      while (true)
+      {
+         const int p = v[k];
+         s = (((double)f[q] + (double)q * q) - ((double)f[p] + (double)p * p)) / (2.0 * (q - p));
+
+         if (s > z[k])
+         {
+            break;
+         }
+
+         k--;
+      }
+
+      k++;
+      v[k] = q;
+      z[k] = s;
+      z[k + 1] = infinity;
+   }
+
+   k = 0;
+
+   for (int q = 0; q < n; q++)
+   {
+      while (z[k + 1] < q)
+      {
+         k++;
+      }
+
+      const qint64 dq = q - v[k];
+      d[q] = (qint32)qMin<qint64>(dq * dq + f[v[k]], DistanceTransform::INF);
+   }
+}
+
+QImage CopyAs32Bit(const QImage& img)
+{
+   if (img.format() == QImage::Format_RGB32 || img.format() == QImage::Format_ARGB32)
+   {
+      QImage copy = img;
+      copy.detach();
+      return copy;
+   }
+
+   return img.convertToFormat(QImage::Format_ARGB32);
+}
+
+//sets every pixel of the copy whose squared distance passes keep() to color
+template <typename Keep>
+QImage Paint(const QImage& img, const QVector<qint32>& dist, const QRgb& color, Keep keep)
+{
+   QImage returnImg = CopyAs32Bit(img);
+   uchar* bits = returnImg.bits();
+   const int bpl = returnImg.bytesPerLine();
+   const int width = returnImg.width();
+   const qint32* d = dist.constData();
+
+   Parallel::ForRows(returnImg.height(), width, [=](const int& begin, const int& end) {
+      for (int y = begin; y < end; y++)
+      {
+         QRgb* line = (QRgb*)(bits + (qint64)y * bpl);
+         const qint32* row = d + (qint64)y * width;
+
+         for (int x = 0; x < width; x++)
+         {
+            if (keep(row[x]))
+            {
+               line[x] = color;
+            }
+         }
+      }
+   });
+
+   return returnImg;
+}
+
+//the object pixels of a 0/255 picture further than sqrt(r2) from any background
+QImage ErodeForeground(const QImage& foreground, const double& r2)
+{
+   const int width = foreground.width();
+   const int height = foreground.height();
+   const QVector<qint32> toBackground = DistanceTransform::SquaredDistance(foreground, false);
+   QImage eroded(foreground.size(), QImage::Format_Grayscale8);
+
+   for (int y = 0; y < height; y++)
+   {
+      const uchar* in = foreground.constScanLine(y);
+      const qint32* row = toBackground.constData() + (qint64)y * width;
+      uchar* out = eroded.scanLine(y);
+
+      for (int x = 0; x < width; x++)
+      {
+         out[x] = in[x] != 0 && row[x] > r2 ? 255 : 0;
+      }
+   }
+
+   return eroded;
+}
+
+//every pixel within sqrt(r2) of an object pixel of a 0/255 picture
+QImage DilateForeground(const QImage& foreground, const double& r2)
+{
+   const int width = foreground.width();
+   const int height = foreground.height();
+   const QVector<qint32> toObject = DistanceTransform::SquaredDistance(foreground, true);
+   QImage dilated(foreground.size(), QImage::Format_Grayscale8);
+
+   for (int y = 0; y < height; y++)
+   {
+      const qint32* row = toObject.constData() + (qint64)y * width;
+      uchar* out = dilated.scanLine(y);
+
+      for (int x = 0; x < width; x++)
+      {
+         out[x] = row[x] <= r2 ? 255 : 0;
+      }
+   }
+
+   return dilated;
+}
+
+}
+
+QImage DistanceTransform::Foreground(const QImage& img)
+{
+   return SimdKernels::ThresholdMask(img, MAX_THRESH_VAL - 1);
+}
+
+QImage DistanceTransform::RedForeground(const QImage& img)
+{
+   const QImage src = img.convertToFormat(QImage::Format_ARGB32);
+   QImage mask(src.size(), QImage::Format_Grayscale8);
+   const QRgb red = QColor(Qt::red).rgb();
+
+   for (int y = 0; y < src.height(); y++)
+   {
+      const QRgb* line = (const QRgb*)src.constScanLine(y);
+      uchar* out = mask.scanLine(y);
+
+      for (int x = 0; x < src.width(); x++)
+      {
+         out[x] = line[x] == red ? 255 : 0;
+      }
+   }
+
+   return mask;
+}
+
+QVector<qint32> DistanceTransform::SquaredDistance(const QImage& mask, const bool& toNonZero)
+{
+   const QImage gray = SimdKernels::ToGray(mask);
+   const int width = gray.width();
+   const int height = gray.height();
+
+   QVector<qint32> dist((qint64)width * height);
+   qint32* d = dist.data();
+   const uchar* bits = gray.constBits();
+   const int bpl = gray.bytesPerLine();
+
+   //the rows only have 0/INF inputs, so the 1d transform is just the distance
+   //to the nearest feature on the left or right, squared. Two sweeps does it.
+   Parallel::ForRows(height, width, [=](const int& begin, const int& end) {
+      for (int y = begin; y < end; y++)
+      {
+         const uchar* line = bits + (qint64)y * bpl;
+         qint32* row = d + (qint64)y * width;
+         qint32 run = INF;
+
+         for (int x = 0; x < width; x++)
+         {
+            const bool feature = (line[x] != 0) == toNonZero;
+            run = feature ? 0 : (run == INF ? INF : run + 1);
+            row[x] = run;
+         }
+
+         run = INF;
+
+         for (int x = width - 1; x >= 0; x--)
+         {
+            run = row[x] == 0 ? 0 : (run == INF ? INF : run + 1);
+            row[x] = qMin(row[x], run);
+         }
+
+         for (int x = 0; x < width; x++)
+         {
+            row[x] = row[x] == INF ? INF : row[x] * row[x];
+         }
+      }
+   });
+
+   //columns get the full parabola envelope. Each column is copied out into a
+   //contiguous buffer so the envelope isn't striding through memory.
+   Parallel::ForRows(width, height, [=](const int& begin, const int& end) {
+      Scratch::Buffer<qint32> f(height);
+      Scratch::Buffer<qint32> out(height);
+      Scratch::Buffer<int> v(height);
+      Scratch::Buffer<double> z(height + 1);
+
+      for (int x = begin; x < end; x++)
+      {
+         for (int y = 0; y < height; y++)
+         {
+            f[y] = d[(qint64)y * width + x];
+         }
+
+         Transform1d(f.constData(), out.data(), height, v.data(), z.data());
+
+         for (int y = 0; y < height; y++)
+         {
+            d[(qint64)y * width + x] = out[y];
+         }
+      }
+   });
+
+   return dist;
+}
+
+QImage DistanceTransform::DilateDisk(const QImage& img, const double& radius)
+{
+   const double r2 = radius * radius;
+   const QVector<qint32> dist = SquaredDistance(Foreground(img), true);
+
+   return Paint(img, dist, QColor(Qt::white).rgb(), [r2](const qint32& d) { return d > 0 && d <= r2; });
+}
+
+QImage DistanceTransform::ErodeDisk(const QImage& img, const double& radius)
+{
+   const double r2 = radius * radius;
+   const QVector<qint32> dist = SquaredDistance(Foreground(img), false);
+
+   return Paint(img, dist, QColor(Qt::black).rgb(), [r2](const qint32& d) { return d > 0 && d <= r2; });
+}
+
+QImage DistanceTransform::DilateMask(const QImage& mask, const double& radius)
+{
+   const QImage foreground = Foreground(mask);
+   return radius > 0 ? DilateForeground(foreground, radius * radius) : foreground;
+}
+
+QImage DistanceTransform::ErodeMask(const QImage& mask, const double& radius)
+{
+   const QImage foreground = Foreground(mask);
+   return radius > 0 ? ErodeForeground(foreground, radius * radius) : foreground;
+}
+
+QImage DistanceTransform::Open(const QImage& mask, const double& radius)
+{
+   const QImage foreground = Foreground(mask);
+
+   if (radius <= 0)
+   {
+      return foreground;
+   }
+
+   //the eroded picture is already 0/255, no need for another Foreground pass
+   const double r2 = radius * radius;
+   return DilateForeground(ErodeForeground(foreground, r2), r2);
+}
+
+QVector<double> DistanceTransform::WidthProfile(const QImage& objectMask, const QVector<Pixel>& skeleton)
+{
+   const QVector<qint32> dist = SquaredDistance(objectMask, false);
+   const int width = objectMask.width();
+   QVector<double> widths;
+   widths.reserve(skeleton.count());
+
+   for (const auto& pix : skeleton)
+   {
+      const qint32 d = dist[(qint64)pix.y * width + pix.x];
+
+      //d is the distance from the centre of the skeleton pixel to the centre of
+      //the nearest background pixel, so a stripe n pixels wide has d = (n + 1) / 2
+      widths.push_back(d >= INF ? 0 : 2 * qSqrt(d) - 1);
+   }
+
+   return widths;
+}
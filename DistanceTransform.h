@@ -0,0 +1,58 @@
+#ifndef DistanceTransform_h
+#define DistanceTransform_h
+
+#include <QImage>
+#include <QVector>
+
+#include "ImageOps.h"
+
+//Exact Euclidean distance transform, Felzenszwalb & Huttenlocher,
+//"Distance Transforms of Sampled Functions". One pass along the rows and one
+//along the columns, both linear and both split over the thread pool. Everything
+//is in squared pixel distances so it stays in integers.
+namespace DistanceTransform
+{
+
+//what pixels with no feature pixel anywhere in the image end up at
+static constexpr qint32 INF = 1 << 30;
+
+//Format_Grayscale8, 255 where the picture is white (qGray == 255, same test
+//Dilate/Erode use) and 0 everywhere else
+QImage Foreground(const QImage& img);
+
+//same, but for the red overlay ThinThread and the flood fills work on
+QImage RedForeground(const QImage& img);
+
+//squared distance from every pixel to the nearest feature pixel, row major.
+//The features are the non zero pixels of mask when toNonZero is set, the zero
+//ones otherwise. Nothing outside the image counts as a feature.
+QVector<qint32> SquaredDistance(const QImage& mask, const bool& toNonZero);
+
+//disk shaped dilation/erosion of the white pixels, radius in pixels. A pixel is
+//inside the disk when dx^2 + dy^2 <= radius^2.
+//Dilation turns pixels white, erosion turns them black, everything else is left
+//alone like Dilate/Erode do. Unlike Dilate, nothing outside the image is treated
+//as white, so the frame border doesn't grow in. Erosion keeps the old behaviour
+//of not eating in from the border.
+QImage DilateDisk(const QImage& img, const double& radius);
+
+QImage ErodeDisk(const QImage& img, const double& radius);
+
+//DilateDisk and ErodeDisk for a 0/255 mask, Format_Grayscale8 in and out
+//instead of the 32 bit pictures the GUI stages pass round
+QImage DilateMask(const QImage& mask, const double& radius);
+
+QImage ErodeMask(const QImage& mask, const double& radius);
+
+//ErodeDisk then DilateDisk with the same radius on a 0/255 mask, straight
+//from the two distance maps without going through 32 bit pictures. Takes off
+//bridges and spurs narrower than the disk. Format_Grayscale8 in and out.
+QImage Open(const QImage& mask, const double& radius);
+
+//cell width at each skeleton pixel, in pixels, from the distance of the skeleton
+//to the nearest background pixel of the (unthinned) object
+QVector<double> WidthProfile(const QImage& objectMask, const QVector<Pixel>& skeleton);
+
+}
+
+#endif /* DistanceTransform_h */
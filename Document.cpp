@@ -0,0 +1,292 @@
+#include "Document.h"
+
+bool RleMask::Encode(const QImage& img, RleMask& mask)
+{
+   if (img.isNull() || img.depth() != 32)
+   {
+      return false;
+   }
+
+   mask = RleMask();
+   mask.width = img.width();
+   mask.height = img.height();
+   mask.format = img.format();
+   mask.colors[0] = ((const QRgb*)img.constScanLine(0))[0];
+   mask.colors[1] = mask.colors[0];
+
+   bool haveSecond = false;
+   int colour = 0;
+   quint32 run = 0;
+
+   for (int y = 0; y < img.height(); y++)
+   {
+      const QRgb* line = (const QRgb*)img.constScanLine(y);
+
+      for (int x = 0; x < img.width(); x++)
+      {
+         if (line[x] == mask.colors[colour])
+         {
+            run++;
+            continue;
+         }
+
+         if (!haveSecond)
+         {
+            mask.colors[1] = line[x];
+            haveSecond = true;
+         }
+         else if (line[x] != mask.colors[1 - colour])
+         {
+            //a third colour, not a mask
+            return false;
+         }
+
+         mask.runs.push_back(run);
+         colour = 1 - colour;
+         run = 1;
+      }
+   }
+
+   mask.runs.push_back(run);
+   mask.runs.squeeze();
+
+   return true;
+}
+
+QImage RleMask::Decode() const
+{
+   QImage img(width, height, format);
+   QRgb* bits = (QRgb*)img.bits();
+   const int stride = img.bytesPerLine() / sizeof(QRgb);
+   int x = 0;
+   int y = 0;
+
+   for (int i = 0; i < runs.count(); i++)
+   {
+      const QRgb value = colors[i % 2];
+      quint32 left = runs[i];
+
+      while (left > 0)
+      {
+         const int span = (int)qMin<quint32>(left, width - x);
+         std::fill(bits + (qint64)y * stride + x, bits + (qint64)y * stride + x + span, value);
+         left -= span;
+         x += span;
+
+         if (x == width)
+         {
+            x = 0;
+            y++;
+         }
+      }
+   }
+
+   return img;
+}
+
+Document::Plane Document::Plane::From(const QImage& img)
+{
+   Plane plane;
+   RleMask mask;
+
+   if (RleMask::Encode(img, mask))
+   {
+      plane.mask = QSharedPointer<const RleMask>(new RleMask(mask));
+   }
+   else
+   {
+      plane.image = img;
+   }
+
+   return plane;
+}
+
+QImage Document::Plane::Decode() const
+{
+   return mask.isNull() ? image : mask->Decode();
+}
+
+bool Document::Plane::SharedWith(const Plane& other) const
+{
+   return mask == other.mask && image.isSharedWith(other.image);
+}
+
+qint64 Document::Plane::Bytes() const
+{
+   return mask.isNull() ? (qint64)image.bytesPerLine() * image.height() : mask->Bytes();
+}
+
+void Document::Open(const QImage& img)
+{
+   source = img;
+   history.clear();
+   current = -1;
+
+   State state;
+   state.label = "Open";
+   state.working.image = img;
+   state.input = img;
+   Push(state, img, QImage());
+}
+
+void Document::Push(const State& state, const QImage& decodedWorking, const QImage& decodedOverlay)
+{
+   //a new branch throws away whatever could have been redone
+   history.resize(current + 1);
+   history.push_back(state);
+
+   if (history.count() > MAX_HISTORY)
+   {
+      history.remove(0);
+   }
+
+   current = history.count() - 1;
+   working = decodedWorking;
+   overlay = decodedOverlay;
+}
+
+void Document::Commit(const QString& label, const QImage& img, const bool& coalesce)
+{
+   if (current < 0)
+   {
+      return;
+   }
+
+   State state;
+   state.label = label;
+   state.coalesce = coalesce;
+   state.working = Plane::From(img);
+   state.overlay = history[current].overlay;
+   state.input = history[current].input;
+   state.preprocessing = history[current].preprocessing;
+
+   if (coalesce && history[current].coalesce && history[current].label == label)
+   {
+      current--;
+   }
+
+   Push(state, img, overlay);
+}
+
+void Document::CommitOverlay(const QString& label, const QImage& img, const bool& coalesce)
+{
+   if (current < 0)
+   {
+      return;
+   }
+
+   if (coalesce && history[current].coalesce && history[current].label == label)
+   {
+      current--;
+   }
+
+   State state;
+   state.label = label;
+   state.coalesce = coalesce;
+   state.working = history[current].working;
+   state.overlay = Plane::From(img);
+   state.input = history[current].input;
+   state.preprocessing = history[current].preprocessing;
+   Push(state, working, img);
+}
+
+void Document::CommitBoth(const QString& label, const QImage& workingImg, const QImage& overlayImg)
+{
+   if (current < 0)
+   {
+      return;
+   }
+
+   State state;
+   state.label = label;
+   state.working = Plane::From(workingImg);
+   state.overlay = Plane::From(overlayImg);
+   state.input = history[current].input;
+   state.preprocessing = history[current].preprocessing;
+   Push(state, workingImg, overlayImg);
+}
+
+void Document::CommitInput(const QString& label, const QImage& input, const Pipeline::Params& preprocessing)
+{
+   if (current < 0)
+   {
+      return;
+   }
+
+   State state;
+   state.label = label;
+   state.working = Plane::From(input);
+   state.overlay = history[current].overlay;
+   state.input = input;
+   state.preprocessing = preprocessing;
+   Push(state, input, overlay);
+}
+
+void Document::Show(const int& index)
+{
+   //planes shared with the state we're leaving don't need decoding again
+   const State& from = history[current];
+   const State& to = history[index];
+
+   if (!to.working.SharedWith(from.working))
+   {
+      working = to.working.Decode();
+   }
+
+   if (!to.overlay.SharedWith(from.overlay))
+   {
+      overlay = to.overlay.Decode();
+   }
+
+   current = index;
+}
+
+bool Document::Undo()
+{
+   if (!CanUndo())
+   {
+      return false;
+   }
+
+   Show(current - 1);
+   return true;
+}
+
+bool Document::Redo()
+{
+   if (!CanRedo())
+   {
+      return false;
+   }
+
+   Show(current + 1);
+   return true;
+}
+
+QString Document::UndoLabel() const
+{
+   return CanUndo() ? history[current].label : QString();
+}
+
+QString Document::RedoLabel() const
+{
+   return CanRedo() ? history[current + 1].label : QString();
+}
+
+qint64 Document::HistoryBytes() const
+{
+   qint64 bytes = 0;
+
+   for (int i = 0; i < history.count(); i++)
+   {
+      const State& state = history[i];
+      bytes += state.working.Bytes() + state.overlay.Bytes();
+
+      if (i == 0 || !state.input.isSharedWith(history[i - 1].input))
+      {
+         bytes += (qint64)state.input.bytesPerLine() * state.input.height();
+      }
+   }
+
+   return bytes;
+}
@@ -0,0 +1,132 @@
+#ifndef Document_h
+#define Document_h
+
+#include <QImage>
+#include <QSharedPointer>
+#include <QString>
+#include <QVector>
+
+#include "Pipeline.h"
+
+//Two colour picture, stored as the lengths of the runs of each colour in
+//raster order. The masks the stages make (white on black, red on transparent)
+//are mostly long runs, so a history step costs kilobytes instead of a full
+//32 bit frame.
+class RleMask
+{
+public:
+   //false if img has more than two colours or isn't 32 bit
+   static bool Encode(const QImage& img, RleMask& mask);
+
+   QImage Decode() const;
+
+   qint64 Bytes() const { return runs.count() * sizeof(quint32); }
+
+private:
+   int width = 0;
+   int height = 0;
+   QImage::Format format = QImage::Format_ARGB32;
+
+   //runs alternate colors[0], colors[1], colors[0]... starting with colors[0]
+   QRgb colors[2] = { 0, 0 };
+   QVector<quint32> runs;
+};
+
+//What the window is showing, as a chain of states instead of whatever the
+//pixmaps last held. Every state has the working picture (threshold result,
+//cleaned, dilated...) and the overlay (flooded component, skeleton), the
+//stages read their input from here and commit their output as a new state.
+//
+//States are never changed once made. A commit that only touches one of the
+//two pictures shares the other with the state before it, and binary pictures
+//are kept as RleMasks, so a long history stays small. The current state's
+//pictures are kept decoded, undo and redo decode at most one state.
+//
+//Every state also has the input the thresholds read, the source put through
+//the median, smooth and background settings it records. Undo takes those back
+//along with the picture, and a new setting is applied to the source again
+//rather than on top of the last result.
+class Document
+{
+public:
+   //starts a new history with img as the source and the first working picture
+   void Open(const QImage& img);
+
+   bool IsOpen() const { return !source.isNull(); }
+
+   //the picture as it was opened
+   const QImage& Source() const { return source; }
+
+   const QImage& Working() const { return working; }
+   const QImage& Overlay() const { return overlay; }
+
+   //Source() after the current state's preprocessing, and those settings
+   const QImage& Input() const { return current < 0 ? source : history[current].input; }
+   Pipeline::Params Preprocessing() const { return current < 0 ? Pipeline::Params() : history[current].preprocessing; }
+
+   //coalesce replaces the current state if it was also a coalescing commit
+   //with the same label, so dragging the slider is one undo step, not fifty
+   void Commit(const QString& label, const QImage& working, const bool& coalesce = false);
+   void CommitOverlay(const QString& label, const QImage& overlay, const bool& coalesce = false);
+   void CommitBoth(const QString& label, const QImage& working, const QImage& overlay);
+
+   //input is Source() run through Pipeline::Preprocess with preprocessing, and
+   //becomes both the input and the working picture
+   void CommitInput(const QString& label, const QImage& input, const Pipeline::Params& preprocessing);
+
+   bool CanUndo() const { return current > 0; }
+   bool CanRedo() const { return current + 1 < history.count(); }
+
+   bool Undo();
+   bool Redo();
+
+   //label of the step Undo/Redo would take back/do again
+   QString UndoLabel() const;
+   QString RedoLabel() const;
+
+   //what the whole history holds onto, shared planes counted once per state
+   //and inputs once for each run of states sharing one
+   qint64 HistoryBytes() const;
+
+   //oldest states get dropped past this
+   static constexpr int MAX_HISTORY = 64;
+
+private:
+   //one picture of a state, either a mask or the image itself. QImage is
+   //implicitly shared, copies of a Plane don't copy pixels.
+   struct Plane
+   {
+      QSharedPointer<const RleMask> mask;
+      QImage image;
+
+      static Plane From(const QImage& img);
+      QImage Decode() const;
+      bool SharedWith(const Plane& other) const;
+      qint64 Bytes() const;
+   };
+
+   struct State
+   {
+      QString label;
+      bool coalesce = false;
+      Plane working;
+      Plane overlay;
+
+      //a gray picture, shared between states until the preprocessing changes
+      QImage input;
+      Pipeline::Params preprocessing;
+   };
+
+   void Push(const State& state, const QImage& decodedWorking, const QImage& decodedOverlay);
+   void Show(const int& index);
+
+   QImage source;
+   QVector<State> history;
+   int current = -1;
+
+   //the current state's planes, decoded
+   QImage working;
+   QImage overlay;
+};
+
+#endif /* Document_h */
@@ -1,4 +1,7 @@
 #include "ImageOps.h"
+#include "BitDepth.h"
+#include "Scheduler.h"
+#include "Scratch.h"
 #include <QtConcurrent/QtConcurrent>
 #include <QFuture>
 
@@ -9,7 +12,7 @@ QImage ImageOps::Threshold(const QImage& img, const int& threshVal)
    
    if (threshVal != 0)
    {
-      for (int y = 0; y < img.height(); y++)
+      for (int y = 0; y < img.height() && !Scheduler::Cancelled(); y++)
       {
          QRgb* line = (QRgb*)returnImg.scanLine(y);
          for (int x = 0; x < img.width(); x++)
@@ -23,31 +26,79 @@ QImage ImageOps::Threshold(const QImage& img, const int& threshVal)
    return returnImg;
 }
 
-QImage ImageOps::AdaptiveThreshold(const QImage& img, const int& area)
+namespace
 {
-   QImage returnImg = img;
 
-   for (int y = 0; y < img.height(); y++)
+//deep pictures brought down to their slider levels for the window loops
+//below, which only know 256 levels. qGray would just keep the top byte.
+QImage EightBit(const QImage& img)
+{
+   return BitDepth::IsDeep(img) ? BitDepth::SliderLevels(img, BitDepth::SliderLut(img)) : img;
+}
+
+}
+
+QImage ImageOps::AdaptiveThreshold(const QImage& picture, const int& area, const int& c, ProgressIndicator* progress)
+{
+   const QImage img = EightBit(picture);
+
+   //not a copy of img, QRgb writes would run off the end of a 1 or 2 byte row
+   QImage returnImg(img.size(), img.depth() == 32 ? img.format() : QImage::Format_ARGB32);
+
+   for (int y = 0; y < img.height() && !Scheduler::Cancelled(); y++)
    {
       QRgb* line = (QRgb*)returnImg.scanLine(y);
       
       for (int x = 0; x < img.width(); x++)
       {
          // line[x] has an individual pixel
-         line[x] = qGray(img.pixel(x, y)) > GetAreaMean(img, Pixel(x,y), area) ? QColor(Qt::white).rgb() : 0;
+         line[x] = qGray(img.pixel(x, y)) > (GetAreaMean(img, Pixel(x,y), area) - c) ? QColor(Qt::white).rgb() : 0;
+      }
+
+      if (progress != nullptr)
+      {
+         progress->ProgressUpdate(((double)y/img.height())*100, "Adapt Threshold: ");
       }
    }
    
    return returnImg;
 }
 
+QImage ImageOps::LocalOtsuThreshold(const QImage& picture, const int& area, const int& c, ProgressIndicator* progress)
+{
+   const QImage img = EightBit(picture);
+   QImage returnImg(img.size(), img.depth() == 32 ? img.format() : QImage::Format_ARGB32);
+
+   //one histogram for every pixel instead of a fresh one each
+   Scratch::Buffer<int> hist(MAX_THRESH_VAL + 1);
+
+   for (int y = 0; y < img.height() && !Scheduler::Cancelled(); y++)
+   {
+      QRgb* line = (QRgb*)returnImg.scanLine(y);
+
+      for (int x = 0; x < img.width(); x++)
+      {
+         GetAreaHistogram(img, Pixel(x,y), area, hist.data());
+
+         line[x] = qGray(img.pixel(x, y)) > (CalculateOtsu(img, hist.constData(), 4*area*area)-c) ? QColor(Qt::white).rgb() : 0;
+      }
+
+      if (progress != nullptr)
+      {
+         progress->ProgressUpdate(((double)y/img.height())*100, "Otsu Threshold: ");
+      }
+   }
+
+   return returnImg;
+}
+
 QImage ImageOps::Dilate(const QImage& img)
 {
    QImage returnImg = img;
 
    //the dilation operation sets a background pixel to foreground
    //if there is an object pixel in its 3x3 neighborhood
-   for (int y = 0; y < img.height(); y++)
+   for (int y = 0; y < img.height() && !Scheduler::Cancelled(); y++)
    {
       QRgb* line = (QRgb*)returnImg.scanLine(y);
       
@@ -74,7 +125,7 @@ QImage ImageOps::Erode(const QImage& img)
 
    //the dilation operation sets a foreground pixel to background
    //if there is an background pixel in its 3x3 neighborhood
-   for (int y = 0; y < img.height(); y++)
+   for (int y = 0; y < img.height() && !Scheduler::Cancelled(); y++)
    {
       QRgb* line = (QRgb*)returnImg.scanLine(y);
       
@@ -97,6 +148,11 @@ QImage ImageOps::Erode(const QImage& img)
 
 //https://www.ipol.im/pub/art/2016/158/article_lr.pdf
 int ImageOps::CalculateOtsu(const QImage& img, const QVector<int>& histogram, const int& N)
+{
+   return CalculateOtsu(img, histogram.constData(), N);
+}
+
+int ImageOps::CalculateOtsu(const QImage& img, const int* histogram, const int& N)
 {
 //   int N = img.width() * img.height();
    
@@ -126,8 +182,8 @@ int ImageOps::CalculateOtsu(const QImage& img, const QVector<int>& histogram, co
          }
          
          sumB += (double)(t * histogram[t]);
-         int u1 = sumB / q1;
-         int u2 = (sum - sumB) / q2;
+         double u1 = sumB / q1;
+         double u2 = (sum - sumB) / q2;
          
          double varianceBetween = (double)q1 * (double)q2 * (u1 - u2) * (u1 - u2);
          
@@ -161,7 +217,15 @@ int ImageOps::GetAreaMean(const QImage& img, const Pixel& p, const int& area)
 
 QVector<int> ImageOps::GetAreaHistogram(const QImage& img, const Pixel& p, const int& area)
 {
-   QVector<int> histogram(QVector<int>(MAX_THRESH_VAL, 0));
+   QVector<int> histogram(MAX_THRESH_VAL + 1);
+   GetAreaHistogram(img, p, area, histogram.data());
+   
+   return histogram;
+}
+
+void ImageOps::GetAreaHistogram(const QImage& img, const Pixel& p, const int& area, int* histogram)
+{
+   std::fill(histogram, histogram + MAX_THRESH_VAL + 1, 0);
    
    for (int i = -area; i <= area; i++)
    {
@@ -170,8 +234,6 @@ QVector<int> ImageOps::GetAreaHistogram(const QImage& img, const Pixel& p, const
          histogram[RealImageValue(img, Pixel(p, Pixel(i,j)))]++;
       }
    }
-   
-   return histogram;
 }
 
 int ImageOps::RealImageValue(const QImage& img, const Pixel& p)
@@ -191,10 +253,12 @@ QVector<Pixel> ImageOps::Flood(const QImage& img, const Pixel& startPixel, const
    s.push_back(startPixel);
    q.push(startPixel);
 
-   bool* visited = new bool[img.height() * img.width()]{ false };
-   visited[startPixel.x * img.width() + startPixel.y] = true;
+   //row major, y * width + x. This used to be x * width + y, which only works
+   //out for square images
+   Scratch::Buffer<bool> visited((qint64)img.height() * img.width(), false);
+   visited[startPixel.y * img.width() + startPixel.x] = true;
 
-   while (q.size() > 0)
+   while (q.size() > 0 && !Scheduler::Cancelled())
    {
       Pixel pixelX = q.pop();
 
@@ -204,17 +268,16 @@ QVector<Pixel> ImageOps::Flood(const QImage& img, const Pixel& startPixel, const
 
          if (img.valid(pixelY.x, pixelY.y))
          {
-            if (!visited[pixelY.x * img.width() + pixelY.y] && img.pixel(pixelY.x, pixelY.y) == img.pixel(startPixel.x, startPixel.y))
+            if (!visited[pixelY.y * img.width() + pixelY.x] && img.pixel(pixelY.x, pixelY.y) == img.pixel(startPixel.x, startPixel.y))
             {
                s.push_back(pixelY);
-               visited[pixelY.x * img.width() + pixelY.y] = true;
+               visited[pixelY.y * img.width() + pixelY.x] = true;
                q.push(pixelY);
             }
          }
       }
    }
    
-   delete[] visited;
    return s;
 }
 
@@ -222,22 +285,27 @@ QVector<Pixel> ImageOps::LabelOp(const Pixel& pix)
 {
    QVector<Pixel> retComponent;
 
-   if (multiImg.pixel(pix.x, pix.y) == QColor(Qt::white).rgb() && !multiVisited[pix.x * multiImg.width() + pix.y])
+   if (multiImg.pixel(pix.x, pix.y) == QColor(Qt::white).rgb() && !multiVisited[pix.y * multiImg.width() + pix.x])
    {
       //flood from this point
       retComponent = Flood(multiImg, Pixel(pix.x,pix.y), *eightConn);
 
-      //mark all of the components in the current one as visited
-      for (const auto& pix : retComponent)
+      //it did bite. Two threads flooding the same component could each find
+      //the other's marks and both throw it away. Now only the flood that
+      //started on the component's first pixel in raster order keeps it and
+      //marks it, the rest just drop their copy.
+      for (const auto& other : retComponent)
       {
-         //yeah, the mutex slowed access down, just going to check if another
-         //thread has already touched this component. This is probs logic that will
-         //bite me later.
-         if (multiVisited[pix.x * multiImg.width() + pix.y])
+         if (other.y < pix.y || (other.y == pix.y && other.x < pix.x))
          {
             return QVector<Pixel>();
          }
-         multiVisited[pix.x * multiImg.width() + pix.y] = true;
+      }
+
+      //mark all of the components in the current one as visited
+      for (const auto& other : retComponent)
+      {
+         multiVisited[other.y * multiImg.width() + other.x] = true;
       }
    }
 
@@ -246,32 +314,39 @@ QVector<Pixel> ImageOps::LabelOp(const Pixel& pix)
 
 QVector<QVector<Pixel>> ImageOps::LabelComponents(const QImage& img, ProgressIndicator* progress)
 {
-   //don't use global variables, kids
-   multiVisited = new bool[img.height() * img.width()]{ false };
+   //don't use global variables, kids. The flags and coordinates come from this
+   //thread's scratch pool and stay here, the mapped LabelOps only touch them.
+   Scratch::Buffer<bool> visited((qint64)img.height() * img.width(), false);
+   multiVisited = visited.data();
    multiImg = img;
    
-   QVector<Pixel> xyCombos;
+   Scratch::Buffer<Pixel> xyCombos((qint64)img.height() * img.width());
    
    for (int y = 0; y < img.height(); y++)
    {
       for (int x = 0; x < img.width(); x++)
       {
-         xyCombos.push_back(Pixel(x,y));
+         xyCombos[(qint64)y * img.width() + x] = Pixel(x,y);
       }
    }
    
    //when your code is slow, don't bother being smart, it must just be time for
    //parallelization. Anywho, this will go through all x/y pairs and place them
    //into their components. It will block until finished.
-   auto components = QtConcurrent::mapped(xyCombos, ImageOps::LabelOp);
+   auto components = QtConcurrent::mapped(xyCombos.begin(), xyCombos.end(), ImageOps::LabelOp);
    
    while (!components.isFinished())
    {
+      if (Scheduler::Cancelled())
+      {
+         components.cancel();
+      }
+
 //      qDebug()<<(components.progressValue()/xyCombos.count())*100;
-      progress->ProgressUpdate((components.progressValue()/xyCombos.count())*100, "Labeling Components: ");
+      progress->ProgressUpdate((components.progressValue()/xyCombos.size())*100, "Labeling Components: ");
    }
    
-   delete[] multiVisited;
+   multiVisited = nullptr;
 
    return  components.results().toVector();
 }
@@ -380,20 +455,157 @@ bool ImageOps::IsSimple(const QImage& img, const Pixel& p)
    return isSimpleTable[simpleKey.to_ulong()];
 }
 
+namespace
+{
+
+//the red overlay as 0/1 bytes in a frame of background, the scratch copy
+//GetBorderPixels and Thin work on instead of a copy of the QImage
+void RedPlane(const QImage& img, uchar* plane)
+{
+   const int stride = img.width() + 2;
+   std::fill(plane, plane + (qint64)stride * (img.height() + 2), 0);
+
+   for (int y = 0; y < img.height(); y++)
+   {
+      for (int x = 0; x < img.width(); x++)
+      {
+         plane[(y + 1) * stride + x + 1] = img.pixel(x, y) == QColor(Qt::red).rgb();
+      }
+   }
+}
+
+//neighbour n of a plane pixel, ImageOps::neigh order
+void NeighbourOffsets(const int& stride, int* offset)
+{
+   for (int n = 0; n < 9; n++)
+   {
+      offset[n] = neigh[n].y * stride + neigh[n].x;
+   }
+}
+
+//IsBorder on the plane, the middle neighbour is the pixel itself
+bool PlaneBorder(const uchar* p, const int* offset)
+{
+   if (*p == 0)
+   {
+      return false;
+   }
+
+   for (int n = 0; n < 9; n++)
+   {
+      if (p[offset[n]] == 0)
+      {
+         return true;
+      }
+   }
+
+   return false;
+}
+
+//the plane's border pixels in raster order into found, how many there were
+int PlaneBorderPixels(const uchar* plane, const int& width, const int& height, const int* offset, Pixel* found)
+{
+   const int stride = width + 2;
+   int count = 0;
+
+   for (int y = 0; y < height && !Scheduler::Cancelled(); y++)
+   {
+      for (int x = 0; x < width; x++)
+      {
+         if (PlaneBorder(plane + (y + 1) * stride + x + 1, offset))
+         {
+            found[count++] = Pixel(x, y);
+         }
+      }
+   }
+
+   return count;
+}
+
+}
+
 QVector<Pixel> ImageOps::GetBorderPixels(const QImage& img)
 {
-	auto borderPixs = QVector<Pixel>();
-
-	for (int y = 0; y < img.height(); y++)
-	{
-		for (int x = 0; x < img.width(); x++)
-		{
-			if (IsBorder(img, Pixel(x, y)))
-			{
-				borderPixs.push_back(Pixel(x, y));
-			}
-		}
-	}
-
-	return borderPixs;
+   const int stride = img.width() + 2;
+   int offset[9];
+   NeighbourOffsets(stride, offset);
+
+   Scratch::Buffer<uchar> plane((qint64)stride * (img.height() + 2));
+   Scratch::Buffer<Pixel> found((qint64)img.width() * img.height());
+   RedPlane(img, plane.data());
+
+   const int count = PlaneBorderPixels(plane.constData(), img.width(), img.height(), offset, found.data());
+   QVector<Pixel> borderPixs(count);
+   std::copy(found.constData(), found.constData() + count, borderPixs.begin());
+
+   return borderPixs;
+}
+
+//peels simple, non end border pixels off the red object until a pass removes
+//nothing, what's left is the skeleton. The object and every pass's border
+//list live in scratch memory, the skeleton is the only thing allocated.
+QVector<Pixel> ImageOps::Thin(const QImage& img)
+{
+   const int width = img.width();
+   const int stride = width + 2;
+   int offset[9];
+   NeighbourOffsets(stride, offset);
+
+   Scratch::Buffer<uchar> thinned((qint64)stride * (img.height() + 2));
+   Scratch::Buffer<Pixel> borderPixels((qint64)width * img.height());
+   RedPlane(img, thinned.data());
+
+   while (true)
+   {
+      const int count = PlaneBorderPixels(thinned.constData(), width, img.height(), offset, borderPixels.data());
+      int numRemoved = 0;
+
+      for (int i = 0; i < count; i++)
+      {
+         uchar* p = thinned.data() + (borderPixels[i].y + 1) * stride + borderPixels[i].x + 1;
+         int key = 0;
+         int neighbours = 0;
+
+         for (int n = 0; n < 9; n++)
+         {
+            key |= p[offset[n]] << n;
+            neighbours += n != 4 ? p[offset[n]] : 0;
+         }
+
+         //simple and not the end of a curve
+         if (isSimpleTable[key] && neighbours > 1)
+         {
+            numRemoved++;
+            *p = 0;
+         }
+      }
+
+      if (numRemoved == 0 || Scheduler::Cancelled())
+      {
+         break;
+      }
+   }
+
+   int remaining = 0;
+
+   for (const auto& v : thinned)
+   {
+      remaining += v;
+   }
+
+   QVector<Pixel> s;
+   s.reserve(remaining);
+
+   for (int y = 0; y < img.height(); y++)
+   {
+      for (int x = 0; x < width; x++)
+      {
+         if (thinned[(y + 1) * stride + x + 1] != 0)
+         {
+            s.push_back(Pixel(x,y));
+         }
+      }
+   }
+
+   return s;
 }
@@ -13,6 +13,12 @@
 #define MAX_THRESH_VAL 255
 #define MIN_THRESH_VAL 0
 
+//top of a Format_Grayscale16 picture, see BitDepth
+#define MAX_GRAY16_VAL 65535
+
+//components with this many pixels or fewer get thrown out by Clean
+#define MIN_COMPONENT_SIZE 200
+
 class ProgressIndicator : public QObject
 {
    Q_OBJECT
@@ -55,7 +61,16 @@ namespace ImageOps
 
 QImage Threshold(const QImage& img, const int& threshVal);
 
-QImage AdaptiveThreshold(const QImage& img, const int& area);
+//white where the gray value is over the mean of the window around it less c.
+//The mask is a picture of its own, the input's format when that's 32 bit and
+//ARGB32 otherwise, so Format_Grayscale8 corrected pictures can go in too.
+//progress hears about every row when it's given.
+QImage AdaptiveThreshold(const QImage& img, const int& area, const int& c = 0, ProgressIndicator* progress = nullptr);
+
+//same, against the Otsu threshold of the window's histogram less c.
+//Format_Grayscale16 pictures go through both as their BitDepth::SliderLevels,
+//c in slider steps.
+QImage LocalOtsuThreshold(const QImage& img, const int& area, const int& c = 0, ProgressIndicator* progress = nullptr);
 
 QImage Dilate(const QImage& img);
 
@@ -69,10 +84,16 @@ QVector<Pixel> LabelOp(const Pixel& pix);
 
 int CalculateOtsu(const QImage& img, const QVector<int>& histogram, const int& N);
 
+//same, off MAX_THRESH_VAL + 1 counts somewhere else (a Scratch::Buffer)
+int CalculateOtsu(const QImage& img, const int* histogram, const int& N);
+
 int GetAreaMean(const QImage& img, const Pixel& p, const int& area);
 
 QVector<int> GetAreaHistogram(const QImage& img, const Pixel& p, const int& area);
 
+//same, into MAX_THRESH_VAL + 1 counts the caller keeps between pixels
+void GetAreaHistogram(const QImage& img, const Pixel& p, const int& area, int* histogram);
+
 QVector<Pixel> Flood(const QImage& img, const Pixel& startPixel, const QVector<Pixel>& conn);
 
 QImage ImageFromPixelSet(const QImage& img, const QVector<Pixel>& s, const QColor& color);
@@ -87,6 +108,8 @@ bool IsSimple(const QImage& img, const Pixel& p);
 
 QVector<Pixel> GetBorderPixels(const QImage& img);
 
+QVector<Pixel> Thin(const QImage& img);
+
 }
 
 static QVector<Pixel> neigh = QVector<Pixel>({ {-1,-1},{0,-1}, {1,-1}, {-1,0},{0,0},{1,0},{-1,1},{0,1},{1,1}});
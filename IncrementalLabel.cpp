@@ -0,0 +1,308 @@
+#include "IncrementalLabel.h"
+#include "SimdKernels.h"
+
+#include <QColor>
+#include <QMutexLocker>
+
+void IncrementalLabeler::Request(const int& threshVal)
+{
+   requested.storeRelease(threshVal);
+}
+
+QImage IncrementalLabeler::Update(const QImage& img, const int& minSize)
+{
+   QMutexLocker locker(&mutex);
+
+   if (img.cacheKey() != imageKey || img.width() != width || img.height() != height)
+   {
+      Build(img);
+   }
+
+   SetThresholdLocked(requested.loadAcquire());
+
+   return RenderLocked(minSize);
+}
+
+int IncrementalLabeler::SetThreshold(const int& threshVal)
+{
+   QMutexLocker locker(&mutex);
+   return SetThresholdLocked(threshVal);
+}
+
+int IncrementalLabeler::Threshold()
+{
+   QMutexLocker locker(&mutex);
+   return threshold;
+}
+
+int IncrementalLabeler::ComponentCount()
+{
+   QMutexLocker locker(&mutex);
+   return components;
+}
+
+int IncrementalLabeler::ComponentSize(const int& x, const int& y)
+{
+   QMutexLocker locker(&mutex);
+
+   if (x < 0 || y < 0 || x >= width || y >= height || parent[y * width + x] == -1)
+   {
+      return 0;
+   }
+
+   return size[Find(y * width + x)];
+}
+
+QImage IncrementalLabeler::Render(const int& minSize)
+{
+   QMutexLocker locker(&mutex);
+   return RenderLocked(minSize);
+}
+
+void IncrementalLabeler::Build(const QImage& img)
+{
+   const QImage g = SimdKernels::ToGray(img);
+
+   imageKey = img.cacheKey();
+   width = g.width();
+   height = g.height();
+   threshold = 255;
+   components = 0;
+
+   const int count = width * height;
+   gray = QVector<uchar>(count);
+
+   for (int y = 0; y < height; y++)
+   {
+      std::copy(g.constScanLine(y), g.constScanLine(y) + width, gray.begin() + y * width);
+   }
+
+   //counting sort of the pixel indexes by gray value
+   bucketStart = QVector<int>(257, 0);
+
+   for (const auto& v : gray)
+   {
+      bucketStart[v + 1]++;
+   }
+
+   for (int v = 1; v <= 256; v++)
+   {
+      bucketStart[v] += bucketStart[v - 1];
+   }
+
+   sorted = QVector<int>(count);
+   QVector<int> next = bucketStart;
+
+   for (int i = 0; i < count; i++)
+   {
+      sorted[next[gray[i]]++] = i;
+   }
+
+   parent = QVector<int>(count, -1);
+   size = QVector<int>(count, 0);
+   stamp = QVector<int>(count, 0);
+   currentStamp = 0;
+}
+
+int IncrementalLabeler::Find(int i)
+{
+   //path halving
+   while (parent[i] != i)
+   {
+      parent[i] = parent[parent[i]];
+      i = parent[i];
+   }
+
+   return i;
+}
+
+void IncrementalLabeler::Union(const int& a, const int& b)
+{
+   int ra = Find(a);
+   int rb = Find(b);
+
+   if (ra == rb)
+   {
+      return;
+   }
+
+   if (size[ra] < size[rb])
+   {
+      std::swap(ra, rb);
+   }
+
+   parent[rb] = ra;
+   size[ra] += size[rb];
+   components--;
+}
+
+void IncrementalLabeler::AddPixel(const int& i)
+{
+   parent[i] = i;
+   size[i] = 1;
+   components++;
+
+   const int x = i % width;
+   const int y = i / width;
+
+   for (int dy = -1; dy <= 1; dy++)
+   {
+      for (int dx = -1; dx <= 1; dx++)
+      {
+         const int nx = x + dx;
+         const int ny = y + dy;
+
+         if ((dx != 0 || dy != 0) && nx >= 0 && ny >= 0 && nx < width && ny < height && parent[ny * width + nx] != -1)
+         {
+            Union(i, ny * width + nx);
+         }
+      }
+   }
+}
+
+//removed pixels are already background. Every piece of a component that lost
+//pixels touches one of them, so flooding from their remaining neighbours gives
+//each piece a fresh root without looking at any other component.
+void IncrementalLabeler::RelabelFrom(const QVector<int>& removed)
+{
+   currentStamp++;
+   QVector<int> stack;
+
+   for (const auto& r : removed)
+   {
+      const int rx = r % width;
+      const int ry = r / width;
+
+      for (int dy = -1; dy <= 1; dy++)
+      {
+         for (int dx = -1; dx <= 1; dx++)
+         {
+            const int sx = rx + dx;
+            const int sy = ry + dy;
+
+            if (sx < 0 || sy < 0 || sx >= width || sy >= height)
+            {
+               continue;
+            }
+
+            const int seed = sy * width + sx;
+
+            if (parent[seed] == -1 || stamp[seed] == currentStamp)
+            {
+               continue;
+            }
+
+            int count = 0;
+            stamp[seed] = currentStamp;
+            stack.push_back(seed);
+
+            while (!stack.isEmpty())
+            {
+               const int p = stack.takeLast();
+               parent[p] = seed;
+               count++;
+
+               const int px = p % width;
+               const int py = p / width;
+
+               for (int ny = qMax(0, py - 1); ny <= qMin(height - 1, py + 1); ny++)
+               {
+                  for (int nx = qMax(0, px - 1); nx <= qMin(width - 1, px + 1); nx++)
+                  {
+                     const int n = ny * width + nx;
+
+                     if (parent[n] != -1 && stamp[n] != currentStamp)
+                     {
+                        stamp[n] = currentStamp;
+                        stack.push_back(n);
+                     }
+                  }
+               }
+            }
+
+            size[seed] = count;
+            components++;
+         }
+      }
+   }
+}
+
+int IncrementalLabeler::SetThresholdLocked(const int& threshVal)
+{
+   const int t = qBound(-1, threshVal, 255);
+
+   if (gray.isEmpty() || t == threshold)
+   {
+      threshold = t;
+      return 0;
+   }
+
+   int flipped = 0;
+
+   if (t < threshold)
+   {
+      //gray values (t, threshold] join the foreground
+      for (int i = bucketStart[t + 1]; i < bucketStart[threshold + 1]; i++)
+      {
+         AddPixel(sorted[i]);
+         flipped++;
+      }
+   }
+   else
+   {
+      //gray values (threshold, t] drop out
+      const int first = bucketStart[threshold + 1];
+      const int last = bucketStart[t + 1];
+      QVector<int> removed(sorted.begin() + first, sorted.begin() + last);
+
+      //every component that loses a pixel is thrown away and rebuilt
+      currentStamp++;
+
+      for (const auto& r : removed)
+      {
+         const int root = Find(r);
+
+         if (stamp[root] != currentStamp)
+         {
+            stamp[root] = currentStamp;
+            components--;
+         }
+      }
+
+      for (const auto& r : removed)
+      {
+         parent[r] = -1;
+         size[r] = 0;
+      }
+
+      RelabelFrom(removed);
+      flipped = removed.count();
+   }
+
+   threshold = t;
+   return flipped;
+}
+
+QImage IncrementalLabeler::RenderLocked(const int& minSize)
+{
+   QImage image(width, height, QImage::Format_ARGB32);
+   image.fill(Qt::transparent);
+   const QRgb white = QColor(Qt::white).rgb();
+
+   for (int y = 0; y < height; y++)
+   {
+      QRgb* line = (QRgb*)image.scanLine(y);
+
+      for (int x = 0; x < width; x++)
+      {
+         const int i = y * width + x;
+
+         if (parent[i] != -1 && size[Find(i)] > minSize)
+         {
+            line[x] = white;
+         }
+      }
+   }
+
+   return image;
+}
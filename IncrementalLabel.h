@@ -0,0 +1,81 @@
+#ifndef IncrementalLabel_h
+#define IncrementalLabel_h
+
+#include <QAtomicInt>
+#include <QImage>
+#include <QMutex>
+#include <QVector>
+
+//Keeps the 8-connected components of gray > threshold up to date while the
+//threshold moves, instead of redoing Threshold + LabelComponents every time.
+//
+//The pixels are bucket sorted by gray value once per image, so a threshold
+//change only touches the pixels whose gray value lies between the old and the
+//new threshold. Lowering the threshold adds pixels, which union-find handles
+//directly. Raising it removes pixels. Union-find can't split, so only the
+//components that lost pixels get relabelled, by flooding out from the removed
+//pixels' neighbours. Everything else keeps its labels.
+//
+//All the public functions lock, so one labeler can be shared between the GUI and
+//worker threads.
+class IncrementalLabeler
+{
+public:
+   IncrementalLabeler()
+      : requested(255) {};
+
+   //records the threshold the next Update() should move to. Only the latest
+   //request matters, so a worker that starts late still lands on the slider value
+   //the user ended up at.
+   void Request(const int& threshVal);
+
+   //rebuilds the index if img is not the image it was built for, moves to the
+   //last requested threshold and renders the components with more than minSize
+   //pixels white on transparent, the same picture CleanThread produces.
+   QImage Update(const QImage& img, const int& minSize);
+
+   //moves the labels to a new threshold, returns how many pixels flipped
+   int SetThreshold(const int& threshVal);
+
+   int Threshold();
+
+   int ComponentCount();
+
+   //size of the component pixel (x, y) is in, 0 for background
+   int ComponentSize(const int& x, const int& y);
+
+   QImage Render(const int& minSize);
+
+private:
+   void Build(const QImage& img);
+   int Find(int i);
+   void Union(const int& a, const int& b);
+   void AddPixel(const int& i);
+   void RelabelFrom(const QVector<int>& removed);
+   int SetThresholdLocked(const int& threshVal);
+   QImage RenderLocked(const int& minSize);
+
+   QMutex mutex;
+   QAtomicInt requested;
+   qint64 imageKey = 0;
+   int width = 0;
+   int height = 0;
+   int threshold = 255;
+   int components = 0;
+
+   QVector<uchar> gray;
+
+   //pixels in increasing gray order, bucketStart[g] is the first one with value g
+   QVector<int> sorted;
+   QVector<int> bucketStart;
+
+   //-1 for background, otherwise the union-find parent. size is only valid on roots.
+   QVector<int> parent;
+   QVector<int> size;
+
+   //visit stamps for the relabelling flood so the array never needs clearing
+   QVector<int> stamp;
+   int currentStamp = 0;
+};
+
+#endif /* IncrementalLabel_h */
@@ -0,0 +1,449 @@
+#include "JobServer.h"
+#include "Background.h"
+#include "Scratch.h"
+#include "ShapeFilter.h"
+#include "SimdKernels.h"
+
+#include <QElapsedTimer>
+#include <QImageReader>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QLocalSocket>
+#include <QSharedMemory>
+#include <QTcpSocket>
+#include <QThread>
+#include <QThreadStorage>
+
+namespace
+{
+
+//decode buffer per pool thread. QImageReader::read(QImage*) writes into the
+//image it's given when the size and format already fit, so back to back
+//pictures from the same camera reuse one allocation.
+QThreadStorage<QImage> decodeBuffer;
+
+QJsonObject CellToJson(const Pipeline::Cell& cell)
+{
+   QJsonObject json;
+   json["x"] = cell.bounds.x();
+   json["y"] = cell.bounds.y();
+   json["width"] = cell.bounds.width();
+   json["height"] = cell.bounds.height();
+   json["area"] = cell.area;
+   json["centroidX"] = cell.centroidX;
+   json["centroidY"] = cell.centroidY;
+   json["skeletonPixels"] = cell.skeletonPixels;
+   json["length"] = cell.length;
+   return json;
+}
+
+QJsonObject Error(const QJsonObject& job, const QString& message)
+{
+   QJsonObject reply;
+   reply["id"] = job["id"];
+   reply["status"] = QString("error");
+   reply["error"] = message;
+   return reply;
+}
+
+}
+
+JobServer::JobServer(const int& workers, QObject* parent)
+   : QObject(parent)
+   , localServer(new QLocalServer(this))
+   , tcpServer(new QTcpServer(this))
+{
+   pool.setMaxThreadCount(workers > 0 ? workers : qMax(1, QThread::idealThreadCount() / 4));
+
+   //keep both pools' threads alive between requests
+   pool.setExpiryTimeout(-1);
+   QThreadPool::globalInstance()->setExpiryTimeout(-1);
+
+   //does the cpuid probe once up front instead of on the first job
+   SimdKernels::ActiveCpuLevel();
+
+   connect(localServer, &QLocalServer::newConnection, this, &JobServer::HandleLocalConnection);
+   connect(tcpServer, &QTcpServer::newConnection, this, &JobServer::HandleTcpConnection);
+   connect(this, &JobServer::jobFinished, this, &JobServer::HandleJobFinished, Qt::QueuedConnection);
+}
+
+bool JobServer::ListenLocal(const QString& name)
+{
+   //a server that crashed leaves its socket file behind
+   QLocalServer::removeServer(name);
+
+   if (!localServer->listen(name))
+   {
+      errorString = localServer->errorString();
+      return false;
+   }
+
+   return true;
+}
+
+bool JobServer::ListenHttp(const quint16& port)
+{
+   if (!tcpServer->listen(QHostAddress::LocalHost, port))
+   {
+      errorString = tcpServer->errorString();
+      return false;
+   }
+
+   return true;
+}
+
+quint64 JobServer::AddClient(QIODevice* device, const bool& http)
+{
+   const quint64 client = nextClient++;
+   clients[client] = device;
+   device->setProperty("client", client);
+
+   if (http)
+   {
+      httpClients.insert(client);
+   }
+
+   connect(device, &QIODevice::readyRead, this, &JobServer::HandleReadyRead);
+
+   return client;
+}
+
+void JobServer::HandleLocalConnection()
+{
+   while (localServer->hasPendingConnections())
+   {
+      QLocalSocket* socket = localServer->nextPendingConnection();
+      const quint64 client = AddClient(socket, false);
+
+      connect(socket, &QLocalSocket::disconnected, this, [=]() {
+         clients.remove(client);
+         pending.remove(client);
+         socket->deleteLater();
+      });
+   }
+}
+
+void JobServer::HandleTcpConnection()
+{
+   while (tcpServer->hasPendingConnections())
+   {
+      QTcpSocket* socket = tcpServer->nextPendingConnection();
+      const quint64 client = AddClient(socket, true);
+
+      connect(socket, &QTcpSocket::disconnected, this, [=]() {
+         clients.remove(client);
+         pending.remove(client);
+         httpClients.remove(client);
+         socket->deleteLater();
+      });
+   }
+}
+
+void JobServer::HandleReadyRead()
+{
+   QIODevice* device = qobject_cast<QIODevice*>(sender());
+
+   if (device == nullptr)
+   {
+      return;
+   }
+
+   const quint64 client = device->property("client").toULongLong();
+   pending[client].append(device->readAll());
+
+   if (httpClients.contains(client))
+   {
+      HandleHttp(client);
+      return;
+   }
+
+   QByteArray& buffer = pending[client];
+   int newline = 0;
+
+   while ((newline = buffer.indexOf('\n')) >= 0)
+   {
+      const QByteArray line = buffer.left(newline).trimmed();
+      buffer.remove(0, newline + 1);
+
+      if (!line.isEmpty())
+      {
+         HandleLine(client, line);
+      }
+   }
+}
+
+void JobServer::HandleLine(const quint64& client, const QByteArray& line)
+{
+   QJsonParseError parseError;
+   const QJsonDocument doc = QJsonDocument::fromJson(line, &parseError);
+
+   if (!doc.isObject())
+   {
+      Reply(client, Error(QJsonObject(), "bad json: " + parseError.errorString()), 400);
+      return;
+   }
+
+   const QJsonObject job = doc.object();
+
+   if (job["cmd"].toString() == "stats")
+   {
+      Reply(client, Stats());
+      return;
+   }
+
+   Submit(client, job);
+}
+
+//just enough HTTP/1.1 for one request per connection, which is what curl and
+//the requests module do by default
+void JobServer::HandleHttp(const quint64& client)
+{
+   QByteArray& buffer = pending[client];
+   const int headerEnd = buffer.indexOf("\r\n\r\n");
+
+   if (headerEnd < 0)
+   {
+      return;
+   }
+
+   const QList<QByteArray> lines = buffer.left(headerEnd).split('\n');
+   const QList<QByteArray> requestLine = lines.first().trimmed().split(' ');
+   int contentLength = 0;
+
+   for (const auto& header : lines)
+   {
+      if (header.toLower().startsWith("content-length:"))
+      {
+         contentLength = header.mid(15).trimmed().toInt();
+      }
+   }
+
+   if (buffer.size() < headerEnd + 4 + contentLength)
+   {
+      return;
+   }
+
+   const QByteArray method = requestLine.value(0);
+   const QByteArray path = requestLine.value(1);
+   const QByteArray body = buffer.mid(headerEnd + 4, contentLength);
+   buffer.clear();
+
+   if (method == "GET" && path == "/stats")
+   {
+      Reply(client, Stats());
+   }
+   else if (method == "POST" && path == "/jobs")
+   {
+      HandleLine(client, body);
+   }
+   else
+   {
+      Reply(client, Error(QJsonObject(), "not found"), 404);
+   }
+}
+
+void JobServer::Submit(const quint64& client, const QJsonObject& job)
+{
+   submitted++;
+   pool.start(new JobRunnable(this, client, job), job["priority"].toInt());
+}
+
+QJsonObject JobServer::Stats() const
+{
+   QJsonObject stats;
+   stats["status"] = QString("stats");
+   stats["submitted"] = submitted;
+   stats["finished"] = finished;
+   stats["workers"] = pool.maxThreadCount();
+   stats["activeWorkers"] = pool.activeThreadCount();
+   stats["simd"] = SimdKernels::CpuLevelName(SimdKernels::ActiveCpuLevel());
+   return stats;
+}
+
+void JobServer::Reply(const quint64& client, const QJsonObject& reply, const int& httpStatus)
+{
+   Send(client, QJsonDocument(reply).toJson(QJsonDocument::Compact), httpStatus);
+}
+
+void JobServer::Send(const quint64& client, const QByteArray& json, const int& httpStatus)
+{
+   QIODevice* device = clients.value(client, nullptr);
+
+   if (device == nullptr)
+   {
+      return;
+   }
+
+   const QByteArray body = json + "\n";
+
+   if (httpClients.contains(client))
+   {
+      const QByteArray reason = httpStatus == 200 ? "OK" : httpStatus == 404 ? "Not Found" : "Bad Request";
+      device->write("HTTP/1.1 " + QByteArray::number(httpStatus) + " " + reason + "\r\n"
+                    + "Content-Type: application/json\r\n"
+                    + "Content-Length: " + QByteArray::number(body.size()) + "\r\n"
+                    + "Connection: close\r\n\r\n");
+      device->write(body);
+      device->close();
+      return;
+   }
+
+   device->write(body);
+}
+
+void JobServer::HandleJobFinished(const quint64& client, const QByteArray& reply)
+{
+   finished++;
+   Send(client, reply);
+}
+
+Pipeline::Params JobServer::ParamsFromJson(const QJsonObject& json, QString* error)
+{
+   Pipeline::Params params;
+   const QString mode = json["mode"].toString(Pipeline::ModeName(params.mode));
+
+   for (const auto& m : { Pipeline::ThresholdMode::Manual, Pipeline::ThresholdMode::GlobalOtsu, Pipeline::ThresholdMode::Mean,
+                          Pipeline::ThresholdMode::Niblack, Pipeline::ThresholdMode::Sauvola })
+   {
+      if (Pipeline::ModeName(m) == mode)
+      {
+         params.mode = m;
+      }
+   }
+
+   params.threshold = json["threshold"].toInt(params.threshold);
+   params.area = json["area"].toInt(params.area);
+   params.k = json["k"].toDouble(params.k);
+   params.c = json["c"].toInt(params.c);
+   params.minSize = json["minSize"].toInt(params.minSize);
+   params.shapeFilter = json["shapeFilter"].toString();
+   params.openingRadius = json["openingRadius"].toInt(params.openingRadius);
+   params.splitFilter = json["splitFilter"].toString();
+   params.splitDepth = json["splitDepth"].toDouble(params.splitDepth);
+   params.pixelsPerUnit = json["pixelsPerUnit"].toDouble(params.pixelsPerUnit);
+   params.medianRadius = json["medianRadius"].toInt(params.medianRadius);
+   params.smoothSigma = json["smoothSigma"].toDouble(params.smoothSigma);
+   params.backgroundRadius = json["backgroundRadius"].toInt(params.backgroundRadius);
+   params.bitDepth = json["bitDepth"].toInt(params.bitDepth);
+
+   if (json.contains("flatField"))
+   {
+      const QString path = json["flatField"].toString();
+      params.flatFieldGain = Background::FlatFieldGain(QImage(path));
+
+      //running without the correction would give results that look fine
+      if (params.flatFieldGain.isEmpty() && error != nullptr)
+      {
+         *error = "flatField: could not read " + path;
+      }
+   }
+
+   return params;
+}
+
+QJsonObject JobServer::RunJob(const QJsonObject& job)
+{
+   QString paramsError;
+   const Pipeline::Params params = ParamsFromJson(job["params"].toObject(), &paramsError);
+   Pipeline::Result result;
+
+   if (!paramsError.isEmpty())
+   {
+      return Error(job, paramsError);
+   }
+
+   const ShapeFilter filter(params.shapeFilter);
+
+   if (!filter.IsValid())
+   {
+      return Error(job, "shapeFilter: " + filter.Error());
+   }
+
+   const ShapeFilter split(params.splitFilter);
+
+   if (!split.IsValid())
+   {
+      return Error(job, "splitFilter: " + split.Error());
+   }
+
+   QElapsedTimer timer;
+   timer.start();
+   qint64 decodeNs = 0;
+
+   if (job.contains("path"))
+   {
+      QImageReader reader(job["path"].toString());
+      QImage& img = decodeBuffer.localData();
+
+      if (!reader.read(&img))
+      {
+         return Error(job, reader.errorString());
+      }
+
+      decodeNs = timer.nsecsElapsed();
+      result = Pipeline::Run(img, params);
+   }
+   else if (job.contains("shm"))
+   {
+      QSharedMemory shm(job["shm"].toString());
+
+      if (!shm.attach(QSharedMemory::ReadOnly))
+      {
+         return Error(job, shm.errorString());
+      }
+
+      const int width = job["width"].toInt();
+      const int height = job["height"].toInt();
+      const QString format = job["format"].toString("gray8");
+      const QImage::Format imageFormat = format == "gray8" ? QImage::Format_Grayscale8
+                                         : format == "gray16" ? QImage::Format_Grayscale16 : QImage::Format_ARGB32;
+      const int bytesPerLine = job["bytesPerLine"].toInt(width * (format == "gray8" ? 1 : format == "gray16" ? 2 : 4));
+
+      if (width <= 0 || height <= 0 || (qint64)bytesPerLine * height > shm.size())
+      {
+         shm.detach();
+         return Error(job, "picture doesn't fit the shared memory segment");
+      }
+
+      //wraps the segment without copying. Gray goes through ToGray (or stays
+      //16 bit) untouched, so the first copy made is the threshold mask.
+      shm.lock();
+      const QImage img((const uchar*)shm.constData(), width, height, bytesPerLine, imageFormat);
+      result = Pipeline::Run(img, params);
+      shm.unlock();
+      shm.detach();
+   }
+   else
+   {
+      return Error(job, "job needs a path or a shm key");
+   }
+
+   QJsonArray cells;
+
+   for (const auto& cell : result.cells)
+   {
+      cells.append(CellToJson(cell));
+   }
+
+   QJsonObject reply;
+   reply["id"] = job["id"];
+   reply["status"] = QString("done");
+   reply["mode"] = Pipeline::ModeName(params.mode);
+   reply["threshold"] = result.threshold;
+   reply["decodeMs"] = decodeNs / 1e6;
+   reply["computeMs"] = (timer.nsecsElapsed() - decodeNs) / 1e6;
+   reply["cells"] = cells;
+
+   return reply;
+}
+
+void JobRunnable::run()
+{
+   //the reply crosses back to the server's thread as bytes, the socket can only
+   //be written from there
+   emit server->jobFinished(client, QJsonDocument(JobServer::RunJob(job)).toJson(QJsonDocument::Compact));
+
+   //this thread lives as long as the server, it shouldn't sit on the scratch
+   //memory of the biggest picture it was ever sent
+   Scratch::Trim();
+}
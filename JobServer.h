@@ -0,0 +1,109 @@
+#ifndef JobServer_h
+#define JobServer_h
+
+#include <QByteArray>
+#include <QHash>
+#include <QImage>
+#include <QIODevice>
+#include <QJsonObject>
+#include <QLocalServer>
+#include <QObject>
+#include <QRunnable>
+#include <QSet>
+#include <QTcpServer>
+#include <QThreadPool>
+
+#include "Pipeline.h"
+
+//Long running measurement server so other tools don't pay for a process start
+//per picture. Jobs come in as JSON, one per line on a local socket (QLocalServer,
+//a Unix domain socket on Linux/macOS) or as the body of POST /jobs on localhost
+//HTTP:
+//
+//   {"id": "a1", "path": "/data/cell.tif", "priority": 5,
+//    "params": {"mode": "sauvola", "area": 15, "k": 0.2, "minSize": 200}}
+//
+//or with "shm": "<QSharedMemory key>", "width", "height", "bytesPerLine" and
+//"format" ("gray8", "gray16" or "argb32") in place of "path" for a picture
+//already in memory, which is read straight out of the shared segment. 16 bit
+//pictures are thresholded as they are, "threshold" is in their units and
+//"bitDepth" (say 12) scales the local modes' C, otherwise it's guessed.
+//"medianRadius" and "smoothSigma" in params turn on the denoising,
+//"backgroundRadius" and "flatField" (path to an empty slide picture, the job
+//fails if it can't be read) the illumination correction and "shapeFilter" (see ShapeFilter) drops components
+//by shape, "openingRadius" breaks thin bridges, "splitFilter" and "splitDepth"
+//cut touching cells apart (see Watershed). Results go back as one JSON line per job in the order they
+//finish, tagged with the job's id.
+//{"cmd": "stats"} on the socket or GET /stats gives the counters.
+//
+//Jobs run on their own pool, highest priority first. Its threads never expire
+//and each keeps its decode buffer between jobs, so a steady stream of same
+//sized pictures doesn't allocate or spin threads back up.
+class JobServer : public QObject
+{
+   Q_OBJECT
+public:
+   JobServer(const int& workers, QObject* parent = nullptr);
+
+   bool ListenLocal(const QString& name);
+   bool ListenHttp(const quint16& port);
+
+   QString ErrorString() const { return errorString; }
+
+   //runs one job on the calling thread
+   static QJsonObject RunJob(const QJsonObject& job);
+
+   //error is set when a setting names something that can't be used, a
+   //flatField picture that won't load
+   static Pipeline::Params ParamsFromJson(const QJsonObject& json, QString* error = nullptr);
+
+signals:
+   void jobFinished(const quint64& client, const QByteArray& reply);
+
+private slots:
+   void HandleLocalConnection();
+   void HandleTcpConnection();
+   void HandleReadyRead();
+   void HandleJobFinished(const quint64& client, const QByteArray& reply);
+
+private:
+   quint64 AddClient(QIODevice* device, const bool& http);
+   void HandleLine(const quint64& client, const QByteArray& line);
+   void HandleHttp(const quint64& client);
+   void Submit(const quint64& client, const QJsonObject& job);
+   QJsonObject Stats() const;
+   void Reply(const quint64& client, const QJsonObject& reply, const int& httpStatus = 200);
+   void Send(const quint64& client, const QByteArray& json, const int& httpStatus = 200);
+
+   QLocalServer* localServer = nullptr;
+   QTcpServer* tcpServer = nullptr;
+   QThreadPool pool;
+   QString errorString;
+
+   QHash<quint64, QIODevice*> clients;
+   QHash<quint64, QByteArray> pending;
+   QSet<quint64> httpClients;
+   quint64 nextClient = 1;
+
+   //only touched on the server's thread
+   qint64 submitted = 0;
+   qint64 finished = 0;
+};
+
+class JobRunnable : public QRunnable
+{
+public:
+   JobRunnable(JobServer* server, const quint64& client, const QJsonObject& job)
+      : server(server)
+      , client(client)
+      , job(job) {};
+
+   void run() override;
+
+private:
+   JobServer* server = nullptr;
+   quint64 client = 0;
+   QJsonObject job;
+};
+
+#endif /* JobServer_h */
@@ -0,0 +1,178 @@
+#include "LocalThreshold.h"
+#include "BitDepth.h"
+#include "Parallel.h"
+#include "SimdKernels.h"
+
+#include <QColor>
+#include <QtMath>
+
+namespace
+{
+
+//255 * (2 * area + 1)^2 has to fit in 32 bits for the plain sums
+static constexpr int MAX_AREA = 2051;
+
+//row prefix sums of f(gray) into rows 1..h, then the rows are added down the
+//columns. The column pass has to go top to bottom, so that one gets split over
+//blocks of columns instead of rows. P is the pixel type.
+template <typename P, typename T, typename Fn>
+void BuildTable(const QImage& gray, LocalThreshold::SummedArea<T>& area, Fn f)
+{
+   const int width = gray.width();
+   const int height = gray.height();
+   const int stride = width + 1;
+
+   area.stride = stride;
+   area.table = QVector<T>((qint64)stride * (height + 1), 0);
+
+   T* table = area.table.data();
+   const uchar* bits = gray.constBits();
+   const int bpl = gray.bytesPerLine();
+
+   Parallel::ForRows(height, width, [=](const int& begin, const int& end) {
+      for (int y = begin; y < end; y++)
+      {
+         const P* line = (const P*)(bits + (qint64)y * bpl);
+         T* row = table + (qint64)(y + 1) * stride;
+         T running = 0;
+
+         for (int x = 0; x < width; x++)
+         {
+            running += f(line[x]);
+            row[x + 1] = running;
+         }
+      }
+   });
+
+   //same row splitter, just handing out column ranges
+   Parallel::ForRows(stride, height, [=](const int& begin, const int& end) {
+      for (int y = 2; y <= height; y++)
+      {
+         const T* above = table + (qint64)(y - 1) * stride;
+         T* row = table + (qint64)y * stride;
+
+         for (int x = begin; x < end; x++)
+         {
+            row[x] += above[x];
+         }
+      }
+   });
+}
+
+template <typename P, typename S, typename T>
+QImage ApplyThreshold(const QImage& gray, const LocalThreshold::SummedArea<S>& sums, const LocalThreshold::SummedArea<T>& squares,
+                      const LocalThreshold::Mode& mode, const int& area, const double& k, const double& r, const double& c)
+{
+   const int width = gray.width();
+   const int height = gray.height();
+
+   QImage returnImg(gray.size(), QImage::Format_ARGB32);
+   uchar* dstBits = returnImg.bits();
+   const int dstStride = returnImg.bytesPerLine();
+   const uchar* srcBits = gray.constBits();
+   const int srcStride = gray.bytesPerLine();
+
+   Parallel::ForRows(height, width, [&, dstBits, dstStride, srcBits, srcStride](const int& begin, const int& end) {
+      for (int y = begin; y < end; y++)
+      {
+         const P* line = (const P*)(srcBits + (qint64)y * srcStride);
+         QRgb* out = (QRgb*)(dstBits + (qint64)y * dstStride);
+         const int y0 = qMax(0, y - area);
+         const int y1 = qMin(height, y + area + 1);
+
+         for (int x = 0; x < width; x++)
+         {
+            const int x0 = qMax(0, x - area);
+            const int x1 = qMin(width, x + area + 1);
+            const double n = (double)(x1 - x0) * (y1 - y0);
+
+            const double mean = sums.BoxSum(x0, y0, x1, y1) / n;
+            const double variance = squares.BoxSum(x0, y0, x1, y1) / n - mean * mean;
+            const double stddev = variance > 0 ? qSqrt(variance) : 0;
+
+            double threshold = 0;
+
+            if (mode == LocalThreshold::Mode::Niblack)
+            {
+               threshold = mean + k * stddev - c;
+            }
+            else
+            {
+               threshold = mean * (1 + k * (stddev / r - 1)) - c;
+            }
+
+            out[x] = line[x] > threshold ? QColor(Qt::white).rgb() : 0;
+         }
+      }
+   });
+
+   return returnImg;
+}
+
+}
+
+int LocalThreshold::MaxArea32()
+{
+   //65025 * (2 * area + 1)^2 < 2^32
+   return 128;
+}
+
+LocalThreshold::IntegralImages LocalThreshold::BuildIntegralImages(const QImage& img, const int& area)
+{
+   const QImage gray = BitDepth::IsDeep(img) ? img : SimdKernels::ToGray(img);
+
+   IntegralImages integral;
+   integral.width = gray.width();
+   integral.height = gray.height();
+
+   if (BitDepth::IsDeep(gray))
+   {
+      BuildTable<quint16>(gray, integral.sum64, [](const quint16& v) { return (quint64)v; });
+      BuildTable<quint16>(gray, integral.squares64, [](const quint16& v) { return (quint64)v * v; });
+      return integral;
+   }
+
+   BuildTable<uchar>(gray, integral.sum, [](const uchar& v) { return (quint32)v; });
+
+   if (area <= MaxArea32())
+   {
+      BuildTable<uchar>(gray, integral.squares32, [](const uchar& v) { return (quint32)v * v; });
+   }
+   else
+   {
+      BuildTable<uchar>(gray, integral.squares64, [](const uchar& v) { return (quint64)v * v; });
+   }
+
+   return integral;
+}
+
+QImage LocalThreshold::Threshold(const QImage& img, const Mode& mode, const int& area, const double& k, const double& r, const int& c, const int& bits)
+{
+   const QImage gray = BitDepth::IsDeep(img) ? img : SimdKernels::ToGray(img);
+   const int clampedArea = qBound(1, area, MAX_AREA);
+
+   return Threshold(gray, BuildIntegralImages(gray, clampedArea), mode, clampedArea, k, r, c, bits);
+}
+
+QImage LocalThreshold::Threshold(const QImage& img, const IntegralImages& integral, const Mode& mode, const int& area, const double& k, const double& r, const int& c, const int& bits)
+{
+   const QImage gray = BitDepth::IsDeep(img) ? img : SimdKernels::ToGray(img);
+   const int clampedArea = qBound(1, area, MAX_AREA);
+
+   //Sauvola divides by r, 128 is the usual dynamic range of the deviation for 8 bit
+   const double range = r > 0 ? r : 128;
+
+   if (BitDepth::IsDeep(gray))
+   {
+      const double scale = BitDepth::Scale(bits > 0 ? bits : BitDepth::SignificantBits(gray));
+      return ApplyThreshold<quint16>(gray, integral.sum64, integral.squares64, mode, clampedArea, k, range * scale, c * scale);
+   }
+
+   //whichever squares table the integral images were built with
+   if (!integral.squares32.table.isEmpty())
+   {
+      return ApplyThreshold<uchar>(gray, integral.sum, integral.squares32, mode, clampedArea, k, range, c);
+   }
+
+   return ApplyThreshold<uchar>(gray, integral.sum, integral.squares64, mode, clampedArea, k, range, c);
+}
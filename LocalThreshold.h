@@ -0,0 +1,78 @@
+#ifndef LocalThreshold_h
+#define LocalThreshold_h
+
+#include <QImage>
+#include <QVector>
+
+//Niblack and Sauvola thresholding. The window mean and standard deviation come
+//from integral images of the gray values and their squares, so every pixel costs
+//the same four lookups no matter how big the window is.
+namespace LocalThreshold
+{
+
+enum class Mode
+{
+   Niblack,
+   Sauvola
+};
+
+//Summed area tables with a zero row and column in front, so the sum over the
+//pixels [x0, x1) x [y0, y1) is
+//   at(x1, y1) - at(x0, y1) - at(x1, y0) + at(x0, y0)
+//The tables are allowed to wrap around. Unsigned arithmetic makes the box sum
+//come out exact anyway as long as the box sum itself fits, which is why the
+//plain sums get away with 32 bits. The squares only get 64 bits when the
+//window is big enough to need them.
+template <typename T>
+struct SummedArea
+{
+   int stride = 0;
+   QVector<T> table;
+
+   T at(const int& x, const int& y) const { return table[(qint64)y * stride + x]; }
+
+   T BoxSum(const int& x0, const int& y0, const int& x1, const int& y1) const
+   {
+      return (T)(at(x1, y1) - at(x0, y1) - at(x1, y0) + at(x0, y0));
+   }
+};
+
+struct IntegralImages
+{
+   int width = 0;
+   int height = 0;
+   SummedArea<quint32> sum;
+
+   //exactly one of these is filled in, see BuildIntegralImages
+   SummedArea<quint32> squares32;
+   SummedArea<quint64> squares64;
+
+   //in place of sum for Format_Grayscale16, which always gets squares64 too
+   SummedArea<quint64> sum64;
+};
+
+//largest window half size (area in the GUI) the 32 bit square table can handle
+int MaxArea32();
+
+//gray is converted to Format_Grayscale8 if it isn't already, unless it's
+//Format_Grayscale16. area is the half size of the window the tables will be
+//queried with, it picks the width of the squares table.
+IntegralImages BuildIntegralImages(const QImage& img, const int& area);
+
+//window is (2 * area + 1) square, clipped at the edges of the image.
+//   Niblack: T = mean + k * stddev - c
+//   Sauvola: T = mean * (1 + k * (stddev / r - 1)) - c
+//Pixels with gray > T come out white, everything else 0, like the other thresholds.
+//Format_Grayscale16 is thresholded as it is, with r and c given in 8 bit units
+//and scaled up by BitDepth::Scale(bits). bits of 0 works it out from the picture.
+QImage Threshold(const QImage& img, const Mode& mode, const int& area, const double& k, const double& r, const int& c, const int& bits = 0);
+
+//same thing off integral images built once up front, for running lots of
+//windows and offsets over the same picture. integral has to come from img, and
+//from BuildIntegralImages with an area at least this big if the 32 bit squares
+//table is to be trusted.
+QImage Threshold(const QImage& img, const IntegralImages& integral, const Mode& mode, const int& area, const double& k, const double& r, const int& c, const int& bits = 0);
+
+}
+
+#endif /* LocalThreshold_h */
@@ -0,0 +1,382 @@
+#include "MaxTree.h"
+#include "Scratch.h"
+#include "SimdKernels.h"
+
+#include <QColor>
+#include <QtMath>
+
+namespace
+{
+
+int FindRoot(int* zpar, int p)
+{
+   int root = p;
+
+   while (zpar[root] != root)
+   {
+      root = zpar[root];
+   }
+
+   //compress the whole path onto the root
+   while (zpar[p] != root)
+   {
+      const int next = zpar[p];
+      zpar[p] = root;
+      p = next;
+   }
+
+   return root;
+}
+
+}
+
+MaxTree MaxTree::Build(const QImage& img)
+{
+   const QImage g = SimdKernels::ToGray(img);
+   MaxTree tree;
+   tree.width = g.width();
+   tree.height = g.height();
+
+   const int width = tree.width;
+   const int height = tree.height;
+   const int count = width * height;
+
+   if (count == 0)
+   {
+      return tree;
+   }
+
+   tree.gray = QVector<uchar>(count);
+   uchar* f = tree.gray.data();
+
+   for (int y = 0; y < height; y++)
+   {
+      std::copy(g.constScanLine(y), g.constScanLine(y) + width, f + y * width);
+   }
+
+   //counting sort, brightest first
+   int bucket[257] = { 0 };
+
+   for (int i = 0; i < count; i++)
+   {
+      bucket[256 - f[i]]++;
+   }
+
+   for (int i = 1; i <= 256; i++)
+   {
+      bucket[i] += bucket[i - 1];
+   }
+
+   //only needed while building, so they come from the scratch pool
+   Scratch::Buffer<int> sorted(count);
+
+   for (int i = 0; i < count; i++)
+   {
+      sorted[bucket[255 - f[i]]++] = i;
+   }
+
+   //flood the pixels in from the top. Each new pixel becomes the parent of the
+   //(roots of the) already processed components it touches.
+   Scratch::Buffer<int> parent(count);
+   Scratch::Buffer<int> zpar(count, -1);
+
+   for (int i = 0; i < count; i++)
+   {
+      const int p = sorted[i];
+      parent[p] = p;
+      zpar[p] = p;
+
+      const int x = p % width;
+      const int y = p / width;
+
+      for (int ny = qMax(0, y - 1); ny <= qMin(height - 1, y + 1); ny++)
+      {
+         for (int nx = qMax(0, x - 1); nx <= qMin(width - 1, x + 1); nx++)
+         {
+            const int n = ny * width + nx;
+
+            if (n == p || zpar[n] == -1)
+            {
+               continue;
+            }
+
+            const int r = FindRoot(zpar.data(), n);
+
+            if (r != p)
+            {
+               parent[r] = p;
+               zpar[r] = p;
+            }
+         }
+      }
+   }
+
+   //canonicalise, so every pixel points at the first pixel of its own level
+   //(or straight at the node below it)
+   for (int i = count - 1; i >= 0; i--)
+   {
+      const int p = sorted[i];
+      const int q = parent[p];
+
+      if (f[parent[q]] == f[q])
+      {
+         parent[p] = parent[q];
+      }
+   }
+
+   //root to leaves, so a pixel's parent already has its node. The attributes
+   //are added up in the same pass, each pixel into its own node.
+   tree.pixelNode = QVector<int>(count);
+   int* pixelNode = tree.pixelNode.data();
+   QVector<Node>& nodes = tree.nodes;
+
+   for (int i = count - 1; i >= 0; i--)
+   {
+      const int p = sorted[i];
+      const int q = parent[p];
+
+      if (q == p || f[q] != f[p])
+      {
+         Node node;
+         node.parent = q == p ? 0 : pixelNode[q];
+         node.level = f[p];
+         node.minX = width;
+         node.minY = height;
+         node.maxX = -1;
+         node.maxY = -1;
+
+         pixelNode[p] = nodes.count();
+         nodes.push_back(node);
+      }
+      else
+      {
+         pixelNode[p] = pixelNode[q];
+      }
+
+      const int x = p % width;
+      const int y = p / width;
+
+      //an edge shared with a brighter 4 neighbour is inside every component
+      //from this node down, so it comes off here and nowhere above. Equal
+      //neighbours are in this same node, those pairs only count from the
+      //right/lower pixel.
+      int shared = 0;
+      shared += x > 0 && f[p - 1] >= f[p] ? 1 : 0;
+      shared += y > 0 && f[p - width] >= f[p] ? 1 : 0;
+      shared += x + 1 < width && f[p + 1] > f[p] ? 1 : 0;
+      shared += y + 1 < height && f[p + width] > f[p] ? 1 : 0;
+
+      Node& node = nodes[pixelNode[p]];
+      node.area++;
+      node.sumX += x;
+      node.sumY += y;
+      node.sumXX += (qint64)x * x;
+      node.sumXY += (qint64)x * y;
+      node.sumYY += (qint64)y * y;
+      node.perimeter += 4 - 2 * shared;
+      node.minX = qMin(node.minX, x);
+      node.minY = qMin(node.minY, y);
+      node.maxX = qMax(node.maxX, x);
+      node.maxY = qMax(node.maxY, y);
+   }
+
+   //children always come after their parent, so going backwards pushes every
+   //subtree up before its parent gets pushed
+   for (int n = nodes.count() - 1; n > 0; n--)
+   {
+      const Node& child = nodes[n];
+      Node& up = nodes[child.parent];
+      up.area += child.area;
+      up.sumX += child.sumX;
+      up.sumY += child.sumY;
+      up.sumXX += child.sumXX;
+      up.sumXY += child.sumXY;
+      up.sumYY += child.sumYY;
+      up.perimeter += child.perimeter;
+      up.minX = qMin(up.minX, child.minX);
+      up.minY = qMin(up.minY, child.minY);
+      up.maxX = qMax(up.maxX, child.maxX);
+      up.maxY = qMax(up.maxY, child.maxY);
+   }
+
+   return tree;
+}
+
+template<typename F>
+QVector<bool> MaxTree::Kept(const int& threshVal, const F& keepComponent) const
+{
+   QVector<bool> keep(nodes.count(), false);
+
+   for (int n = 0; n < nodes.count(); n++)
+   {
+      const Node& node = nodes[n];
+
+      if (node.level <= threshVal)
+      {
+         continue;
+      }
+
+      //a node whose parent is at or under the threshold is a whole component of
+      //{gray > threshVal}, anything deeper just inherits that component's answer
+      if (n == 0 || nodes[node.parent].level <= threshVal)
+      {
+         keep[n] = keepComponent(n);
+      }
+      else
+      {
+         keep[n] = keep[node.parent];
+      }
+   }
+
+   return keep;
+}
+
+QVector<int> MaxTree::ComponentsAbove(const int& threshVal, const int& minArea) const
+{
+   QVector<int> components;
+
+   for (int n = 0; n < nodes.count(); n++)
+   {
+      const Node& node = nodes[n];
+
+      if (node.level > threshVal && (n == 0 || nodes[node.parent].level <= threshVal) && node.area > minArea)
+      {
+         components.push_back(n);
+      }
+   }
+
+   return components;
+}
+
+QImage MaxTree::Select(const int& threshVal, const int& minArea) const
+{
+   return Paint(threshVal, Kept(threshVal, [&](const int& n) { return nodes[n].area > minArea; }));
+}
+
+QImage MaxTree::Select(const int& threshVal, const QVector<int>& components) const
+{
+   QVector<bool> picked(nodes.count(), false);
+
+   for (const auto& n : components)
+   {
+      picked[n] = true;
+   }
+
+   return Paint(threshVal, Kept(threshVal, [&](const int& n) { return picked[n]; }));
+}
+
+QImage MaxTree::Paint(const int& threshVal, const QVector<bool>& keep) const
+{
+   const QRgb white = QColor(Qt::white).rgb();
+
+   QImage image(width, height, QImage::Format_ARGB32);
+   image.fill(Qt::transparent);
+
+   for (int y = 0; y < height; y++)
+   {
+      QRgb* line = (QRgb*)image.scanLine(y);
+
+      for (int x = 0; x < width; x++)
+      {
+         const int p = y * width + x;
+
+         if (gray[p] > threshVal && keep[pixelNode[p]])
+         {
+            line[x] = white;
+         }
+      }
+   }
+
+   return image;
+}
+
+QImage MaxTree::ComponentMask(const int& n, const int& margin) const
+{
+   const Node& node = nodes[n];
+   const int left = qMin(margin, node.minX);
+   const int top = qMin(margin, node.minY);
+   const int right = qMin(margin, width - 1 - node.maxX);
+   const int bottom = qMin(margin, height - 1 - node.maxY);
+
+   QImage mask(left + node.maxX - node.minX + 1 + right, top + node.maxY - node.minY + 1 + bottom, QImage::Format_Grayscale8);
+   mask.fill(0);
+
+   for (int y = node.minY; y <= node.maxY; y++)
+   {
+      uchar* line = mask.scanLine(y - node.minY + top) + left;
+
+      for (int x = node.minX; x <= node.maxX; x++)
+      {
+         //up from the pixel's own node until the levels drop under n's, which
+         //is one step for the binary masks everything else hands in
+         int m = pixelNode[y * width + x];
+
+         while (m != n && m != 0 && nodes[m].level > node.level)
+         {
+            m = nodes[m].parent;
+         }
+
+         if (m == n)
+         {
+            line[x - node.minX] = 255;
+         }
+      }
+   }
+
+   return mask;
+}
+
+QImage MaxTree::AreaOpening(const int& minArea) const
+{
+   //parents first, so out[parent] is always ready
+   QVector<int> out(nodes.count());
+
+   for (int n = 0; n < nodes.count(); n++)
+   {
+      out[n] = (n == 0 || nodes[n].area > minArea) ? nodes[n].level : out[nodes[n].parent];
+   }
+
+   QImage image(width, height, QImage::Format_Grayscale8);
+
+   for (int y = 0; y < height; y++)
+   {
+      uchar* line = image.scanLine(y);
+
+      for (int x = 0; x < width; x++)
+      {
+         line[x] = (uchar)out[pixelNode[y * width + x]];
+      }
+   }
+
+   return image;
+}
+
+void MaxTree::Node::Axes(double& major, double& minor) const
+{
+   const double cx = CentroidX();
+   const double cy = CentroidY();
+   const double xx = (double)sumXX / area - cx * cx + 1.0 / 12;
+   const double yy = (double)sumYY / area - cy * cy + 1.0 / 12;
+   const double xy = (double)sumXY / area - cx * cy;
+
+   const double mean = (xx + yy) / 2;
+   const double spread = qSqrt((xx - yy) * (xx - yy) / 4 + xy * xy);
+   major = mean + spread;
+   minor = qMax(mean - spread, 1.0 / 12);
+}
+
+double MaxTree::Node::Elongation() const
+{
+   double major;
+   double minor;
+   Axes(major, minor);
+   return qSqrt(major / minor);
+}
+
+double MaxTree::Node::Eccentricity() const
+{
+   double major;
+   double minor;
+   Axes(major, minor);
+   return qSqrt(1 - minor / major);
+}
@@ -0,0 +1,104 @@
+#ifndef MaxTree_h
+#define MaxTree_h
+
+#include <QImage>
+#include <QVector>
+
+//Component tree of the upper level sets of a gray image. Every node is one
+//8-connected component of {gray >= level}, its parent is the component it
+//merges into one level further down. Built once in near linear time with the
+//union-find algorithm of Najman & Couprie (as laid out in Berger et al.,
+//"Effective Component Tree Computation with Application to Pattern Recognition
+//in Astronomical Imaging"), after that the components at any threshold are a
+//walk over the nodes instead of a Threshold + LabelComponents pass.
+class MaxTree
+{
+public:
+   struct Node
+   {
+      int parent = 0;
+      int level = 0;
+      int area = 0;
+      int minX = 0;
+      int minY = 0;
+      int maxX = 0;
+      int maxY = 0;
+      qint64 sumX = 0;
+      qint64 sumY = 0;
+      qint64 sumXX = 0;
+      qint64 sumXY = 0;
+      qint64 sumYY = 0;
+
+      //pixel edges between the component and everything else, the image
+      //border included
+      int perimeter = 0;
+
+      double CentroidX() const { return (double)sumX / area; }
+      double CentroidY() const { return (double)sumY / area; }
+
+      //how much of the bounding box the component covers
+      double Extent() const { return (double)area / ((maxX - minX + 1) * (maxY - minY + 1)); }
+
+      //major over minor axis of the ellipse with the same second moments, 1
+      //for a disk or a square
+      double Elongation() const;
+
+      //of that same ellipse, 0 for a disk and going to 1 as it stretches
+      double Eccentricity() const;
+
+   private:
+      //larger and smaller eigenvalue of the covariance, each pixel counted as
+      //a unit square so a single pixel isn't degenerate
+      void Axes(double& major, double& minor) const;
+   };
+
+   MaxTree() {};
+
+   //gray is converted to Format_Grayscale8 if it isn't already
+   static MaxTree Build(const QImage& img);
+
+   int Width() const { return width; }
+   int Height() const { return height; }
+
+   //node 0 is the root, every parent comes before its children
+   const QVector<Node>& Nodes() const { return nodes; }
+
+   //the node pixel (x, y) sits in at its own gray level
+   int NodeAt(const int& x, const int& y) const { return pixelNode[y * width + x]; }
+
+   //node n's pixels (its subtree's included) as 255 on 0, Format_Grayscale8
+   //the size of its bounding box plus up to margin pixels of 0 all round, as
+   //many as the picture has on each side. The crop's top left is
+   //(max(0, minX - margin), max(0, minY - margin)).
+   QImage ComponentMask(const int& n, const int& margin = 0) const;
+
+   //the components of {gray > threshVal} with more than minArea pixels. Same
+   //components the Threshold + LabelComponents route finds.
+   QVector<int> ComponentsAbove(const int& threshVal, const int& minArea) const;
+
+   //those components painted white on transparent, the same picture CleanThread makes
+   QImage Select(const int& threshVal, const int& minArea) const;
+
+   //same, for a hand picked set of ComponentsAbove(threshVal, ...)
+   QImage Select(const int& threshVal, const QVector<int>& components) const;
+
+   //area opening. Every pixel drops to the level of the nearest component
+   //containing it that has more than minArea pixels. Format_Grayscale8.
+   QImage AreaOpening(const int& minArea) const;
+
+private:
+   //keep[n] for every node, for the components of {gray > threshVal} that keep
+   //says yes to
+   template<typename F>
+   QVector<bool> Kept(const int& threshVal, const F& keep) const;
+
+   QImage Paint(const int& threshVal, const QVector<bool>& keep) const;
+
+   int width = 0;
+   int height = 0;
+   QVector<uchar> gray;
+   QVector<int> pixelNode;
+   QVector<Node> nodes;
+};
+
+#endif /* MaxTree_h */
@@ -0,0 +1,537 @@
+#include "Otsu.h"
+#include "ImageOps.h"
+#include "Parallel.h"
+#include "SimdKernels.h"
+
+#include <array>
+#include <cstring>
+
+namespace
+{
+
+static constexpr int LEVELS = MAX_THRESH_VAL + 1;
+
+typedef std::array<qint64, LEVELS> Counts;
+
+}
+
+QVector<qint64> Otsu::ImageHistogram(const QImage& img)
+{
+   const QImage gray = SimdKernels::ToGray(img);
+   const uchar* bits = gray.constBits();
+   const int stride = gray.bytesPerLine();
+   const int width = gray.width();
+
+   auto countRows = [=](const int& begin, const int& end) {
+      //four interleaved sub histograms so runs of the same gray value don't
+      //keep stalling on the previous increment of the same counter
+      quint32 sub[4][LEVELS];
+      std::memset(sub, 0, sizeof(sub));
+      Counts counts;
+      counts.fill(0);
+      qint64 pending = 0;
+
+      for (int y = begin; y < end; y++)
+      {
+         const uchar* line = bits + (qint64)y * stride;
+         int x = 0;
+
+         for (; x + 4 <= width; x += 4)
+         {
+            sub[0][line[x]]++;
+            sub[1][line[x + 1]]++;
+            sub[2][line[x + 2]]++;
+            sub[3][line[x + 3]]++;
+         }
+
+         for (; x < width; x++)
+         {
+            sub[0][line[x]]++;
+         }
+
+         //flush before a 32 bit counter could possibly wrap
+         pending += width;
+
+         if (pending >= (1ll << 30) || y == end - 1)
+         {
+            pending = 0;
+
+            for (int i = 0; i < LEVELS; i++)
+            {
+               counts[i] += (qint64)sub[0][i] + sub[1][i] + sub[2][i] + sub[3][i];
+            }
+            std::memset(sub, 0, sizeof(sub));
+         }
+      }
+
+      return counts;
+   };
+
+   auto merge = [](Counts& total, const Counts& part) {
+      for (int i = 0; i < LEVELS; i++)
+      {
+         total[i] += part[i];
+      }
+   };
+
+   const Counts counts = Parallel::ReduceRows<Counts>(gray.height(), width, countRows, merge);
+
+   QVector<qint64> histogram(LEVELS);
+   for (int i = 0; i < LEVELS; i++)
+   {
+      histogram[i] = counts[i];
+   }
+
+   return histogram;
+}
+
+int Otsu::GlobalThreshold(const QVector<qint64>& histogram)
+{
+   double sum = 0;
+   double total = 0;
+
+   for (int i = 0; i < histogram.count(); i++)
+   {
+      sum += (double)i * histogram[i];
+      total += histogram[i];
+   }
+
+   int threshold = 0;
+   double varMax = 0;
+   double sumB = 0;
+   double q1 = 0;
+
+   for (int t = 0; t < histogram.count(); t++)
+   {
+      q1 += histogram[t];
+
+      if (q1 == 0)
+      {
+         continue;
+      }
+
+      const double q2 = total - q1;
+
+      if (q2 == 0)
+      {
+         break;
+      }
+
+      sumB += (double)t * histogram[t];
+      const double u1 = sumB / q1;
+      const double u2 = (sum - sumB) / q2;
+
+      const double varianceBetween = q1 * q2 * (u1 - u2) * (u1 - u2);
+
+      if (varianceBetween > varMax)
+      {
+         threshold = t;
+         varMax = varianceBetween;
+      }
+   }
+
+   return threshold;
+}
+
+//Liao, Chen & Chung, "A Fast Algorithm for Multilevel Thresholding".
+//Maximising the between class variance is the same as maximising the sum of
+//S(u,v)^2 / P(u,v) over the classes, where P and S are the pixel count and the
+//gray value sum of the class [u, v]. Those come straight from prefix sums so the
+//whole table is L^2/2 entries. Instead of trying every combination of
+//thresholds (L^4 for four of them) the best split is built up one class at a
+//time: best[c][v] is the best score for putting levels [0, v] into c + 1 classes.
+QVector<int> Otsu::MultiThresholds(const QVector<qint64>& histogram, const int& count)
+{
+   const int levels = histogram.count();
+   const int classes = qBound(1, count, 4) + 1;
+
+   if (levels < classes)
+   {
+      return QVector<int>();
+   }
+
+   QVector<double> p(levels + 1, 0);
+   QVector<double> s(levels + 1, 0);
+
+   for (int i = 0; i < levels; i++)
+   {
+      p[i + 1] = p[i] + histogram[i];
+      s[i + 1] = s[i] + (double)i * histogram[i];
+   }
+
+   //h[u * levels + v] = S(u,v)^2 / P(u,v) for the class of levels u..v
+   QVector<double> h(levels * levels, 0);
+
+   for (int u = 0; u < levels; u++)
+   {
+      for (int v = u; v < levels; v++)
+      {
+         const double pc = p[v + 1] - p[u];
+         const double sc = s[v + 1] - s[u];
+         h[u * levels + v] = pc > 0 ? sc * sc / pc : 0;
+      }
+   }
+
+   QVector<double> best(classes * levels, -1);
+   QVector<int> from(classes * levels, 0);
+
+   for (int v = 0; v < levels; v++)
+   {
+      best[v] = h[v];
+   }
+
+   for (int c = 1; c < classes; c++)
+   {
+      //class c needs at least one level and so does every class before it
+      for (int v = c; v < levels; v++)
+      {
+         double bestScore = -1;
+         int bestSplit = c - 1;
+
+         for (int u = c; u <= v; u++)
+         {
+            const double score = best[(c - 1) * levels + u - 1] + h[u * levels + v];
+
+            if (score > bestScore)
+            {
+               bestScore = score;
+               bestSplit = u - 1;
+            }
+         }
+
+         best[c * levels + v] = bestScore;
+         from[c * levels + v] = bestSplit;
+      }
+   }
+
+   //walk back from the last class to recover where each one starts
+   QVector<int> thresholds(classes - 1);
+   int v = levels - 1;
+
+   for (int c = classes - 1; c > 0; c--)
+   {
+      v = from[c * levels + v];
+      thresholds[c - 1] = v;
+   }
+
+   return thresholds;
+}
+
+namespace
+{
+
+static constexpr int COARSE_BITS = 12;
+static constexpr int COARSE_SHIFT = 16 - COARSE_BITS;
+static constexpr int COARSE_BINS = 1 << COARSE_BITS;
+
+//bins the second pass counts level by level before it's cheaper to just count
+//all 65536 levels
+static constexpr int MAX_REFINED_BINS = 64;
+
+struct CoarseCounts
+{
+   QVector<qint64> count;
+
+   //sum of (value - first value of its bin) over each bin
+   QVector<qint64> offset;
+};
+
+//the same q1 * q2 * (u1 - u2)^2 GlobalThreshold maximises, 0 when either
+//class is empty
+double BetweenVariance(const double& q1, const double& sum1, const double& total, const double& sum)
+{
+   const double q2 = total - q1;
+
+   if (q1 == 0 || q2 == 0)
+   {
+      return 0;
+   }
+
+   const double u1 = sum1 / q1;
+   const double u2 = (sum - sum1) / q2;
+   return q1 * q2 * (u1 - u2) * (u1 - u2);
+}
+
+//an upper bound on BetweenVariance for every split inside one bin: q1 pixels
+//summing to sum1 under the bin, and count more in it with values from first
+//to first + 15. The variance is (sum1 * total - sum * q1)^2 / (q1 * q2), the
+//top is largest at one end of the pixels the split can move and the bottom
+//smallest at one end of the q1 it can reach.
+double VarianceBound(const double& q1, const double& sum1, const double& count, const int& first, const double& total, const double& sum)
+{
+   const double lowest = qMax(q1, 1.0);
+   const double highest = qMin(q1 + count, total - 1);
+
+   if (lowest > highest)
+   {
+      return 0;
+   }
+
+   const double d = sum1 * total - sum * q1;
+   const double low = d + count * (first * total - sum);
+   const double high = d + count * ((first + (1 << COARSE_SHIFT) - 1) * total - sum);
+   const double top = qMax(qAbs(d), qMax(qAbs(low), qAbs(high)));
+   const double bottom = qMin(lowest * (total - lowest), highest * (total - highest));
+
+   return top * top / bottom;
+}
+
+}
+
+QVector<qint64> Otsu::ImageHistogram16(const QImage& img, const int& bits)
+{
+   const QImage gray = SimdKernels::ToGray16(img);
+   const int bins = 1 << qBound(1, bits, 16);
+   const int shift = 16 - qBound(1, bits, 16);
+   const uchar* data = gray.constBits();
+   const int stride = gray.bytesPerLine();
+   const int width = gray.width();
+
+   auto countRows = [=](const int& begin, const int& end) {
+      //two interleaved sub histograms, four would push the 12 bit ones out of L1
+      QVector<quint32> sub(2 * bins, 0);
+      quint32* sub0 = sub.data();
+      quint32* sub1 = sub0 + bins;
+      QVector<qint64> counts(bins, 0);
+      qint64 pending = 0;
+
+      for (int y = begin; y < end; y++)
+      {
+         const quint16* line = (const quint16*)(data + (qint64)y * stride);
+         int x = 0;
+
+         for (; x + 2 <= width; x += 2)
+         {
+            sub0[line[x] >> shift]++;
+            sub1[line[x + 1] >> shift]++;
+         }
+
+         for (; x < width; x++)
+         {
+            sub0[line[x] >> shift]++;
+         }
+
+         pending += width;
+
+         if (pending >= (1ll << 30) || y == end - 1)
+         {
+            pending = 0;
+
+            for (int i = 0; i < bins; i++)
+            {
+               counts[i] += (qint64)sub0[i] + sub1[i];
+            }
+            std::fill(sub.begin(), sub.end(), 0);
+         }
+      }
+
+      return counts;
+   };
+
+   auto merge = [](QVector<qint64>& total, const QVector<qint64>& part) {
+      for (int i = 0; i < total.count(); i++)
+      {
+         total[i] += part[i];
+      }
+   };
+
+   return Parallel::ReduceRows<QVector<qint64>>(gray.height(), width, countRows, merge);
+}
+
+int Otsu::GlobalThreshold16(const QImage& img)
+{
+   const QImage gray = SimdKernels::ToGray16(img);
+   const uchar* data = gray.constBits();
+   const int stride = gray.bytesPerLine();
+   const int width = gray.width();
+
+   //count in the top 32 bits and offset in the bottom ones of the same word, so
+   //a pixel is one increment. Offsets are at most 15 a pixel, so the bottom
+   //half can't carry into the count before 2^28 pixels.
+   auto countCoarse = [=](const int& begin, const int& end) {
+      QVector<quint64> packed(COARSE_BINS, 0);
+      quint64* cell = packed.data();
+      CoarseCounts part;
+      part.count = QVector<qint64>(COARSE_BINS, 0);
+      part.offset = QVector<qint64>(COARSE_BINS, 0);
+      qint64 pending = 0;
+
+      for (int y = begin; y < end; y++)
+      {
+         const quint16* line = (const quint16*)(data + (qint64)y * stride);
+
+         for (int x = 0; x < width; x++)
+         {
+            cell[line[x] >> COARSE_SHIFT] += (1ull << 32) | (line[x] & ((1 << COARSE_SHIFT) - 1));
+         }
+
+         pending += width;
+
+         if (pending >= (1ll << 28) || y == end - 1)
+         {
+            pending = 0;
+
+            for (int i = 0; i < COARSE_BINS; i++)
+            {
+               part.count[i] += cell[i] >> 32;
+               part.offset[i] += cell[i] & 0xffffffffu;
+            }
+            std::fill(packed.begin(), packed.end(), 0);
+         }
+      }
+
+      return part;
+   };
+
+   auto mergeCoarse = [](CoarseCounts& total, const CoarseCounts& part) {
+      for (int i = 0; i < COARSE_BINS; i++)
+      {
+         total.count[i] += part.count[i];
+         total.offset[i] += part.offset[i];
+      }
+   };
+
+   const CoarseCounts coarse = Parallel::ReduceRows<CoarseCounts>(gray.height(), width, countCoarse, mergeCoarse);
+
+   //below[b] and belowSum[b] are the pixels in the bins under b and their sum
+   QVector<double> below(COARSE_BINS + 1, 0);
+   QVector<double> belowSum(COARSE_BINS + 1, 0);
+
+   for (int b = 0; b < COARSE_BINS; b++)
+   {
+      below[b + 1] = below[b] + coarse.count[b];
+      belowSum[b + 1] = belowSum[b] + (double)(b << COARSE_SHIFT) * coarse.count[b] + coarse.offset[b];
+   }
+
+   const double total = below[COARSE_BINS];
+   const double sum = belowSum[COARSE_BINS];
+
+   //the best split at a bin edge
+   double bestVariance = 0;
+
+   for (int b = 0; b < COARSE_BINS; b++)
+   {
+      bestVariance = qMax(bestVariance, BetweenVariance(below[b + 1], belowSum[b + 1], total, sum));
+   }
+
+   //every bin with a split inside it that could beat that gets counted one
+   //level at a time. A tiny bit of slack so rounding in the bound can only
+   //let more bins through, never the one with the best edge out.
+   QVector<int> slot(COARSE_BINS, -1);
+   QVector<int> refined;
+
+   for (int b = 0; b < COARSE_BINS; b++)
+   {
+      const double bound = VarianceBound(below[b], belowSum[b], coarse.count[b], b << COARSE_SHIFT, total, sum);
+
+      if (bound > 0 && bound * (1 + 1e-9) >= bestVariance)
+      {
+         slot[b] = refined.count();
+         refined.push_back(b);
+      }
+   }
+
+   //nothing to split at all
+   if (refined.isEmpty())
+   {
+      return 0;
+   }
+
+   //a picture with no clear split leaves too many to be worth it, the plain
+   //histogram gives the same answer
+   if (refined.count() > MAX_REFINED_BINS)
+   {
+      return GlobalThreshold(ImageHistogram16(gray, 16));
+   }
+
+   const int first = refined.first() << COARSE_SHIFT;
+   const unsigned span = ((refined.last() + 1) << COARSE_SHIFT) - first;
+   const int* slotOf = slot.constData();
+   const int fineLevels = refined.count() << COARSE_SHIFT;
+
+   auto countLevel = [=](qint64* part, const int& value) {
+      const int s = slotOf[value >> COARSE_SHIFT];
+
+      if (s >= 0)
+      {
+         part[(s << COARSE_SHIFT) | (value & ((1 << COARSE_SHIFT) - 1))]++;
+      }
+   };
+
+   auto countFine = [=](const int& begin, const int& end) {
+      QVector<qint64> part(fineLevels, 0);
+      qint64* counts = part.data();
+
+      for (int y = begin; y < end; y++)
+      {
+         const quint16* line = (const quint16*)(data + (qint64)y * stride);
+
+         int x = 0;
+
+         //hardly anything is in the refined bins, so eight at a time are
+         //checked against their range with one branch before any get counted
+         for (; x + 8 <= width; x += 8)
+         {
+            bool any = false;
+
+            for (int k = 0; k < 8; k++)
+            {
+               any |= (unsigned)(line[x + k] - first) < span;
+            }
+
+            if (any)
+            {
+               for (int k = 0; k < 8; k++)
+               {
+                  countLevel(counts, line[x + k]);
+               }
+            }
+         }
+
+         for (; x < width; x++)
+         {
+            countLevel(counts, line[x]);
+         }
+      }
+
+      return part;
+   };
+
+   auto mergeFine = [](QVector<qint64>& total, const QVector<qint64>& part) {
+      for (int i = 0; i < total.count(); i++)
+      {
+         total[i] += part[i];
+      }
+   };
+
+   const QVector<qint64> fine = Parallel::ReduceRows<QVector<qint64>>(gray.height(), width, countFine, mergeFine);
+
+   //lowest threshold first and strictly better only, like GlobalThreshold, so
+   //ties and a picture that can't be split come out the same
+   int threshold = 0;
+   bestVariance = 0;
+
+   for (int i = 0; i < refined.count(); i++)
+   {
+      const int b = refined[i];
+      double q1 = below[b];
+      double sum1 = belowSum[b];
+
+      for (int level = 0; level < (1 << COARSE_SHIFT); level++)
+      {
+         const int t = (b << COARSE_SHIFT) + level;
+         q1 += fine[(i << COARSE_SHIFT) + level];
+         sum1 += (double)t * fine[(i << COARSE_SHIFT) + level];
+
+         const double variance = BetweenVariance(q1, sum1, total, sum);
+
+         if (variance > bestVariance)
+         {
+            threshold = t;
+            bestVariance = variance;
+         }
+      }
+   }
+
+   return threshold;
+}
@@ -0,0 +1,43 @@
+#ifndef Otsu_h
+#define Otsu_h
+
+#include <QImage>
+#include <QVector>
+
+//Whole image Otsu, as opposed to the per pixel local version OtsuThresholdThread
+//runs. Thresholds follow the same convention as ImageOps::Threshold, a pixel is
+//above threshold t (and in the upper class) when gray > t.
+namespace Otsu
+{
+
+//256 bin gray histogram. Every block of rows counts into its own private
+//histogram and they get summed at the end.
+QVector<qint64> ImageHistogram(const QImage& img);
+
+//classic single threshold Otsu, class means kept as doubles
+int GlobalThreshold(const QVector<qint64>& histogram);
+
+//splits the histogram into count + 1 classes (count between 1 and 4) with the
+//highest between class variance. Built from O(L^2) lookup tables and a dynamic
+//program over the classes, so 4 thresholds cost about the same as 1. Returned
+//in increasing order.
+QVector<int> MultiThresholds(const QVector<qint64>& histogram, const int& count);
+
+//gray histogram of a Format_Grayscale16 picture (anything else is scaled up
+//with SimdKernels::ToGray16) in 1 << bits bins, each bin the values that share
+//their top bits. Every block of rows keeps its own 32 bit counts, 16K at the
+//default 12 bits, so they stay in cache.
+QVector<qint64> ImageHistogram16(const QImage& img, const int& bits = 12);
+
+//GlobalThreshold on all 65536 levels without a 65536 bin histogram. The first
+//pass counts 4096 bins along with how far into its bin every value is, which is
+//enough to score the split at every bin edge exactly and to bound the best
+//split inside each bin. The second one counts level by level only the bins
+//whose bound beats the best edge, so the answer is the same as GlobalThreshold
+//over ImageHistogram16(img, 16), which it falls back to when too many bins
+//are left. Same convention, in 16 bit units.
+int GlobalThreshold16(const QImage& img);
+
+}
+
+#endif /* Otsu_h */
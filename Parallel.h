@@ -0,0 +1,169 @@
+#ifndef Parallel_h
+#define Parallel_h
+
+#include <QVector>
+#include <QThreadPool>
+#include <QtConcurrent/QtConcurrent>
+
+#include "Scheduler.h"
+
+#include <algorithm>
+
+namespace Parallel
+{
+
+//frames smaller than this aren't worth waking the thread pool for
+static constexpr long long MIN_PARALLEL_PIXELS = 1 << 18;
+
+struct RowRange
+{
+   int begin;
+   int end;
+};
+
+//whether work covering this many pixels stays on the calling thread. Small
+//images and a single thread pool thread do.
+//Setting QThreadPool::globalInstance()->setMaxThreadCount(1) forces everything
+//serial, which is what the benchmarks do for the single thread numbers.
+//Background scheduler jobs also stay on their own thread so they never queue
+//up in front of an interactive job's blocks.
+inline bool Serial(const long long& pixels)
+{
+   const Scheduler::Context* context = Scheduler::CurrentContext();
+   const bool background = context != nullptr && context->priority == Scheduler::Priority::Background;
+
+   return QThreadPool::globalInstance()->maxThreadCount() <= 1 || background || pixels < MIN_PARALLEL_PIXELS;
+}
+
+//splits [0, height) into the blocks of rows the helpers below hand out, one
+//block covering everything when the image is too small to bother
+inline QVector<RowRange> RowBlocks(const int& height, const int& width)
+{
+   const int threads = QThreadPool::globalInstance()->maxThreadCount();
+
+   if (Serial((long long)height * width) || height < 2)
+   {
+      return QVector<RowRange>({ { 0, height } });
+   }
+
+   //a few blocks per thread so an uneven block doesn't hold everyone up
+   const int blockCount = std::min(height, threads * 4);
+   QVector<RowRange> blocks;
+   blocks.reserve(blockCount);
+
+   for (int i = 0; i < blockCount; i++)
+   {
+      blocks.push_back({ (int)((long long)height * i / blockCount), (int)((long long)height * (i + 1) / blockCount) });
+   }
+
+   return blocks;
+}
+
+//runs fn(begin, end) on each block of rows through the global thread pool.
+//The blocks run under the calling job's scheduler context, and once it's
+//cancelled the blocks that haven't started are skipped.
+template <typename Fn>
+void ForRows(const int& height, const int& width, Fn fn)
+{
+   QVector<RowRange> blocks = RowBlocks(height, width);
+
+   if (blocks.count() == 1)
+   {
+      fn(0, height);
+      return;
+   }
+
+   Scheduler::Context* context = Scheduler::CurrentContext();
+
+   QtConcurrent::blockingMap(blocks, [&fn, context](const RowRange& r) {
+      Scheduler::ContextScope scope(context);
+
+      if (!Scheduler::Cancelled())
+      {
+         fn(r.begin, r.end);
+      }
+   });
+}
+
+//runs fn(i) for every i in [0, count), for pieces of work that don't share
+//anything, like the cells of a frame. pixels is about how much work they add
+//up to, which decides whether it goes parallel the same way the row helpers
+//do. Each fn runs under the calling job's context, and the ones that haven't
+//started once it's cancelled are skipped.
+template <typename Fn>
+void ForEach(const int& count, const long long& pixels, Fn fn)
+{
+   if (Serial(pixels) || count < 2)
+   {
+      for (int i = 0; i < count && !Scheduler::Cancelled(); i++)
+      {
+         fn(i);
+      }
+
+      return;
+   }
+
+   QVector<int> index(count);
+
+   for (int i = 0; i < count; i++)
+   {
+      index[i] = i;
+   }
+
+   Scheduler::Context* context = Scheduler::CurrentContext();
+
+   QtConcurrent::blockingMap(index, [&fn, context](const int& i) {
+      Scheduler::ContextScope scope(context);
+
+      if (!Scheduler::Cancelled())
+      {
+         fn(i);
+      }
+   });
+}
+
+//every block builds its own private T with map(begin, end) and the results get
+//folded together with reduce(T& total, const T& part) once all blocks are done,
+//so the workers never share anything they write to
+template <typename T, typename Map, typename Reduce>
+T ReduceRows(const int& height, const int& width, Map map, Reduce reduce)
+{
+   const QVector<RowRange> blocks = RowBlocks(height, width);
+
+   if (blocks.count() == 1)
+   {
+      return map(0, height);
+   }
+
+   QVector<T> parts(blocks.count());
+   QVector<int> index(blocks.count());
+
+   for (int i = 0; i < index.count(); i++)
+   {
+      index[i] = i;
+   }
+
+   //raw pointer so the workers don't each try to detach the vector
+   T* partData = parts.data();
+
+   Scheduler::Context* context = Scheduler::CurrentContext();
+
+   //every part has to exist for reduce, so cancellation is left to map itself
+   QtConcurrent::blockingMap(index, [&](const int& i) {
+      Scheduler::ContextScope scope(context);
+      partData[i] = map(blocks[i].begin, blocks[i].end);
+   });
+
+   T total = parts.first();
+
+   for (int i = 1; i < parts.count(); i++)
+   {
+      reduce(total, parts[i]);
+   }
+
+   return total;
+}
+
+}
+
+#endif /* Parallel_h */
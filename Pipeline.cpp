@@ -0,0 +1,243 @@
+#include "Pipeline.h"
+#include "Background.h"
+#include "BitDepth.h"
+#include "Contour.h"
+#include "Denoise.h"
+#include "DistanceTransform.h"
+#include "LocalThreshold.h"
+#include "MaxTree.h"
+#include "Otsu.h"
+#include "Parallel.h"
+#include "ShapeFilter.h"
+#include "SimdKernels.h"
+#include "Watershed.h"
+
+#include <QStringList>
+
+#include <algorithm>
+
+QString Pipeline::ModeName(const ThresholdMode& mode)
+{
+   switch (mode)
+   {
+   case ThresholdMode::Manual:
+      return "manual";
+   case ThresholdMode::GlobalOtsu:
+      return "otsu";
+   case ThresholdMode::Mean:
+      return "mean";
+   case ThresholdMode::Niblack:
+      return "niblack";
+   case ThresholdMode::Sauvola:
+      return "sauvola";
+   }
+
+   return "";
+}
+
+QImage Pipeline::Preprocess(const QImage& img, const Params& params)
+{
+   if (BitDepth::IsDeep(img) && params.medianRadius <= 0 && params.smoothSigma <= 0 && params.backgroundRadius <= 0 && params.flatFieldGain.isEmpty())
+   {
+      return img;
+   }
+
+   //noise first, the min filter under the background subtraction would latch
+   //onto every dark speck otherwise
+   const QImage denoised = Denoise::Apply(img, params.medianRadius, params.smoothSigma);
+   return Background::Correct(denoised, params.flatFieldGain, params.backgroundRadius);
+}
+
+QImage Pipeline::Binarize(const QImage& gray, const Params& params, const LocalThreshold::IntegralImages* integral, int* usedThreshold)
+{
+   int threshold = -1;
+   QImage mask;
+
+   //Niblack with k = 0 is mean - C, with the window clipped properly at the edges
+   const LocalThreshold::Mode local = params.mode == ThresholdMode::Sauvola ? LocalThreshold::Mode::Sauvola : LocalThreshold::Mode::Niblack;
+   const double k = params.mode == ThresholdMode::Mean ? 0 : params.k;
+
+   switch (params.mode)
+   {
+   case ThresholdMode::Manual:
+      threshold = params.threshold;
+      mask = SimdKernels::ThresholdMask(gray, threshold);
+      break;
+   case ThresholdMode::GlobalOtsu:
+      threshold = BitDepth::IsDeep(gray) ? Otsu::GlobalThreshold16(gray) : Otsu::GlobalThreshold(Otsu::ImageHistogram(gray));
+      mask = SimdKernels::ThresholdMask(gray, threshold);
+      break;
+   case ThresholdMode::Mean:
+   case ThresholdMode::Niblack:
+   case ThresholdMode::Sauvola:
+      mask = SimdKernels::ThresholdMask(integral != nullptr ? LocalThreshold::Threshold(gray, *integral, local, params.area, k, 128, params.c, params.bitDepth)
+                                                            : LocalThreshold::Threshold(gray, local, params.area, k, 128, params.c, params.bitDepth),
+                                        MAX_THRESH_VAL - 1);
+      break;
+   }
+
+   if (usedThreshold != nullptr)
+   {
+      *usedThreshold = threshold;
+   }
+
+   return mask;
+}
+
+QImage Pipeline::Separate(const QImage& mask, const Params& params)
+{
+   const QImage opened = params.openingRadius > 0 ? DistanceTransform::Open(mask, params.openingRadius) : mask;
+   return Watershed::SplitComponents(opened, params.splitFilter, params.splitDepth);
+}
+
+QImage Pipeline::Segment(const QImage& img, const Params& params, int* usedThreshold)
+{
+   return Separate(Binarize(Preprocess(img, params), params, nullptr, usedThreshold), params);
+}
+
+Pipeline::Cell Pipeline::MeasureComponent(const MaxTree& tree, const int& n, const Params& params)
+{
+   const MaxTree::Node& node = tree.Nodes()[n];
+   Cell cell;
+   cell.bounds = QRect(QPoint(node.minX, node.minY), QPoint(node.maxX, node.maxY));
+   cell.area = node.area;
+   cell.centroidX = node.CentroidX();
+   cell.centroidY = node.CentroidY();
+
+   //thin just this component inside its own bounding box, other cells that
+   //poke into the box are left out
+   cell.skeletonPixels = Contour::Thin(tree.ComponentMask(n)).count();
+   cell.length = cell.skeletonPixels / params.pixelsPerUnit;
+
+   return cell;
+}
+
+Pipeline::Result Pipeline::Measure(const QImage& mask, const Params& params)
+{
+   Result result;
+
+   //binary mask, so each white component is a single node right under the root
+   const MaxTree tree = MaxTree::Build(mask);
+   const ShapeFilter filter(params.shapeFilter);
+   const QVector<int> components = filter.Filter(tree, tree.ComponentsAbove(MAX_THRESH_VAL - 1, params.minSize));
+
+   //every cell is thinned on its own crop, so they can all go at once
+   qint64 pixels = 0;
+
+   for (const auto& n : components)
+   {
+      const MaxTree::Node& node = tree.Nodes()[n];
+      pixels += (qint64)(node.maxX - node.minX + 1) * (node.maxY - node.minY + 1);
+   }
+
+   result.cells.resize(components.count());
+   Cell* cells = result.cells.data();
+
+   Parallel::ForEach(components.count(), pixels, [&](const int& i) {
+      cells[i] = MeasureComponent(tree, components[i], params);
+   });
+
+   std::sort(result.cells.begin(), result.cells.end(), [](const Cell& a, const Cell& b) { return a.area > b.area; });
+
+   return result;
+}
+
+QVector<Pixel> Pipeline::ThinComponents(const QImage& mask, QVector<double>* widths)
+{
+   const MaxTree tree = MaxTree::Build(mask);
+   const QVector<int> components = tree.ComponentsAbove(MAX_THRESH_VAL - 1, 0);
+
+   qint64 pixels = 0;
+
+   for (const auto& n : components)
+   {
+      const MaxTree::Node& node = tree.Nodes()[n];
+      pixels += (qint64)(node.maxX - node.minX + 1) * (node.maxY - node.minY + 1);
+   }
+
+   QVector<QVector<Pixel>> skeletons(components.count());
+   QVector<QVector<double>> skeletonWidths(components.count());
+   QVector<Pixel>* skeletonData = skeletons.data();
+   QVector<double>* widthData = skeletonWidths.data();
+
+   Parallel::ForEach(components.count(), pixels, [&](const int& i) {
+      const MaxTree::Node& node = tree.Nodes()[components[i]];
+
+      //the background frame keeps the crop's distances the same as the whole
+      //mask's: the nearest pixel that isn't this cell is always background.
+      //Where the cell touches the picture's edge there's no frame, same as
+      //there's no background past the edge of the whole mask.
+      const QImage crop = tree.ComponentMask(components[i], 1);
+      const int left = qMax(0, node.minX - 1);
+      const int top = qMax(0, node.minY - 1);
+
+      QVector<Pixel>& skeleton = skeletonData[i];
+      skeleton = Contour::Thin(crop);
+
+      if (widths != nullptr)
+      {
+         widthData[i] = DistanceTransform::WidthProfile(crop, skeleton);
+      }
+
+      for (auto& p : skeleton)
+      {
+         p.x += left;
+         p.y += top;
+      }
+   });
+
+   QVector<Pixel> all;
+
+   for (int i = 0; i < skeletons.count(); i++)
+   {
+      all += skeletons[i];
+
+      if (widths != nullptr)
+      {
+         *widths += skeletonWidths[i];
+      }
+   }
+
+   return all;
+}
+
+Pipeline::Result Pipeline::Run(const QImage& img, const Params& params)
+{
+   int threshold = -1;
+   const QImage mask = Segment(img, params, &threshold);
+
+   Result result = Measure(mask, params);
+   result.threshold = threshold;
+
+   return result;
+}
+
+QString Pipeline::CsvHeader()
+{
+   return "source,cell,x,y,width,height,area,centroid_x,centroid_y,skeleton_pixels,length,threshold";
+}
+
+QString Pipeline::CsvRows(const QString& source, const Result& result)
+{
+   QStringList rows;
+
+   for (int i = 0; i < result.cells.count(); i++)
+   {
+      const Cell& cell = result.cells[i];
+
+      rows.append(QStringList({ source,
+                                QString::number(i),
+                                QString::number(cell.bounds.x()),
+                                QString::number(cell.bounds.y()),
+                                QString::number(cell.bounds.width()),
+                                QString::number(cell.bounds.height()),
+                                QString::number(cell.area),
+                                QString::number(cell.centroidX, 'f', 2),
+                                QString::number(cell.centroidY, 'f', 2),
+                                QString::number(cell.skeletonPixels),
+                                QString::number(cell.length, 'f', 3),
+                                QString::number(result.threshold) }).join(","));
+   }
+
+   return rows.join("\n");
+}
@@ -0,0 +1,136 @@
+#ifndef Pipeline_h
+#define Pipeline_h
+
+#include <QImage>
+#include <QRect>
+#include <QString>
+#include <QVector>
+
+#include "ImageOps.h"
+#include "LocalThreshold.h"
+#include "MaxTree.h"
+
+//The threshold -> clean -> label -> thin -> length sequence the GUI buttons
+//walk through, in one call, for batch runs and anything else without a window.
+namespace Pipeline
+{
+
+enum class ThresholdMode
+{
+   Manual,
+   GlobalOtsu,
+   Mean,
+   Niblack,
+   Sauvola
+};
+
+struct Params
+{
+   ThresholdMode mode = ThresholdMode::GlobalOtsu;
+
+   //Manual only, in the picture's own units, 0..65535 for a 16 bit one
+   int threshold = 128;
+
+   //window half size, k and C for Mean/Niblack/Sauvola
+   int area = 15;
+   double k = 0.2;
+   int c = 0;
+
+   //components this size or smaller are thrown out, same as Clean
+   int minSize = MIN_COMPONENT_SIZE;
+
+   //and of the rest only the ones this ShapeFilter expression accepts, empty
+   //keeps them all
+   QString shapeFilter;
+
+   //opening (erode then dilate) with a disk of this radius in pixels before
+   //anything else touches the mask, breaks the thin bridges a loose threshold
+   //leaves between cells. 0 skips it.
+   int openingRadius = 0;
+
+   //components this ShapeFilter expression accepts get cut apart by
+   //Watershed::Split before anything is counted, empty leaves them whole.
+   //splitDepth is how far (pixels) a cell's middle has to stand above the
+   //waist to another one to count as a cell of its own.
+   QString splitFilter;
+   double splitDepth = 2;
+
+   //skeleton pixels per unit of length, the status bar uses 3.06 px per mm
+   double pixelsPerUnit = 3.06;
+
+   //denoising before any threshold, see Denoise. 0 turns each one off.
+   int medianRadius = 0;
+   double smoothSigma = 0;
+
+   //illumination correction after the denoising, see Background. A radius of
+   //0 leaves the background alone, an empty gain skips the flat field.
+   int backgroundRadius = 0;
+   QVector<float> flatFieldGain;
+
+   //bits a Format_Grayscale16 picture's values use, for scaling the local
+   //modes' C and r. 0 works it out from each picture (BitDepth::SignificantBits).
+   int bitDepth = 0;
+};
+
+struct Cell
+{
+   QRect bounds;
+   int area = 0;
+   double centroidX = 0;
+   double centroidY = 0;
+   int skeletonPixels = 0;
+   double length = 0;
+};
+
+struct Result
+{
+   //the global threshold that got used, -1 for the local modes
+   int threshold = -1;
+
+   //biggest first
+   QVector<Cell> cells;
+};
+
+QString ModeName(const ThresholdMode& mode);
+
+//the denoised and illumination corrected gray image Segment thresholds. The
+//filters are 8 bit, so a Format_Grayscale16 picture only stays 16 bit when
+//none of them is on.
+QImage Preprocess(const QImage& img, const Params& params);
+
+//thresholds an already Preprocess()ed picture by params.mode. integral can be
+//integral images of gray built up front (see LocalThreshold), the local modes
+//build their own otherwise. Format_Grayscale8, 255 for foreground.
+QImage Binarize(const QImage& gray, const Params& params, const LocalThreshold::IntegralImages* integral = nullptr, int* usedThreshold = nullptr);
+
+//the opening and the watershed split on a mask from Binarize
+QImage Separate(const QImage& mask, const Params& params);
+
+//Preprocess, Binarize and Separate. Format_Grayscale8, 255 for foreground
+QImage Segment(const QImage& img, const Params& params, int* usedThreshold = nullptr);
+
+//bounds, centroid and skeleton length of one component of a mask's max tree
+Cell MeasureComponent(const MaxTree& tree, const int& n, const Params& params);
+
+//cleans, labels and thins a mask from Segment, the cells in parallel
+Result Measure(const QImage& mask, const Params& params);
+
+//the skeleton of every component of a 0/255 mask, each one thinned on its own
+//bounding box plus a pixel of background (MaxTree::ComponentMask) instead of
+//on the whole frame, then
+//moved back to picture coordinates, component by component. The same pixels
+//Contour::Thin finds on the whole mask, thinning only looks at the 3x3 round a
+//pixel and two components never come that close. widths gets
+//DistanceTransform::WidthProfile of each skeleton pixel when it's given, also
+//worked out on the crop.
+QVector<Pixel> ThinComponents(const QImage& mask, QVector<double>* widths = nullptr);
+
+Result Run(const QImage& img, const Params& params);
+
+//one line per cell, for the batch outputs
+QString CsvHeader();
+QString CsvRows(const QString& source, const Result& result);
+
+}
+
+#endif /* Pipeline_h */
@@ -0,0 +1,265 @@
+#include "Scheduler.h"
+
+#include <QMutexLocker>
+
+namespace
+{
+
+thread_local Scheduler::Context* currentContext = nullptr;
+
+//which scheduler's worker this thread is, so jobs submitted from inside a job
+//land on the submitting worker's own queue
+thread_local const Scheduler* workerOwner = nullptr;
+thread_local int workerIndex = -1;
+
+}
+
+Scheduler::ContextScope::ContextScope(Context* context)
+   : previous(currentContext)
+{
+   currentContext = context;
+}
+
+Scheduler::ContextScope::~ContextScope()
+{
+   currentContext = previous;
+}
+
+Scheduler::Scheduler(const int& workerCount)
+{
+   const int count = qMax(1, workerCount);
+   maxBackground = qMax(1, count - 1);
+
+   for (int i = 0; i < count; i++)
+   {
+      queues.push_back(new Queue());
+   }
+
+   for (int i = 0; i < count; i++)
+   {
+      Worker* worker = new Worker(this, i);
+      workers.push_back(worker);
+      worker->start();
+   }
+}
+
+Scheduler::~Scheduler()
+{
+   {
+      QMutexLocker locker(&sleepMutex);
+      stopping.storeRelease(1);
+      workAvailable.wakeAll();
+   }
+
+   //whatever is running winds down at its next cancellation point, whatever
+   //is still queued never starts
+   {
+      QMutexLocker locker(&keysMutex);
+
+      for (auto job : running)
+      {
+         job->Cancel();
+      }
+   }
+
+   for (auto worker : workers)
+   {
+      worker->wait();
+      delete worker;
+   }
+
+   for (auto queue : queues)
+   {
+      for (auto& jobs : queue->jobs)
+      {
+         qDeleteAll(jobs);
+      }
+
+      delete queue;
+   }
+}
+
+Scheduler& Scheduler::Global()
+{
+   static Scheduler scheduler(QThread::idealThreadCount());
+   return scheduler;
+}
+
+Scheduler::Context* Scheduler::CurrentContext()
+{
+   return currentContext;
+}
+
+bool Scheduler::Cancelled()
+{
+   return currentContext != nullptr && currentContext->cancelled.loadAcquire() != 0;
+}
+
+void Scheduler::Submit(ScheduledJob* job, const Priority& priority, const QString& key)
+{
+   job->context.priority = priority;
+   job->key = key;
+
+   if (!key.isEmpty())
+   {
+      QMutexLocker locker(&keysMutex);
+      ScheduledJob* superseded = keyed.value(key, nullptr);
+
+      if (superseded != nullptr)
+      {
+         superseded->Cancel();
+      }
+
+      keyed[key] = job;
+   }
+
+   const int target = workerOwner == this ? workerIndex : (int)((unsigned)nextQueue.fetchAndAddRelaxed(1) % queues.count());
+
+   {
+      QMutexLocker locker(&queues[target]->mutex);
+      queues[target]->jobs[(int)priority].push_back(job);
+   }
+
+   pending.ref();
+
+   QMutexLocker locker(&sleepMutex);
+   workAvailable.wakeAll();
+}
+
+void Scheduler::Cancel(const QString& key)
+{
+   QMutexLocker locker(&keysMutex);
+   ScheduledJob* job = keyed.value(key, nullptr);
+
+   if (job != nullptr)
+   {
+      job->Cancel();
+   }
+}
+
+ScheduledJob* Scheduler::PopFront(Queue& queue, const int& priority)
+{
+   QMutexLocker locker(&queue.mutex);
+   return queue.jobs[priority].isEmpty() ? nullptr : queue.jobs[priority].takeFirst();
+}
+
+ScheduledJob* Scheduler::PopBack(Queue& queue, const int& priority)
+{
+   QMutexLocker locker(&queue.mutex);
+   return queue.jobs[priority].isEmpty() ? nullptr : queue.jobs[priority].takeLast();
+}
+
+ScheduledJob* Scheduler::Take(const int& index)
+{
+   const int background = (int)Priority::Background;
+
+   for (int priority = 0; priority < PRIORITY_COUNT; priority++)
+   {
+      //claim a background slot before looking, so two workers can't both take
+      //the last one
+      if (priority == background)
+      {
+         int running = runningBackground.loadAcquire();
+
+         do
+         {
+            if (running >= maxBackground)
+            {
+               return nullptr;
+            }
+         } while (!runningBackground.testAndSetOrdered(running, running + 1, running));
+      }
+
+      ScheduledJob* job = PopFront(*queues[index], priority);
+
+      //steal from the other end of everyone else's queue, the oldest work
+      for (int i = 1; job == nullptr && i < queues.count(); i++)
+      {
+         job = PopBack(*queues[(index + i) % queues.count()], priority);
+      }
+
+      if (job != nullptr)
+      {
+         pending.deref();
+
+         QMutexLocker locker(&keysMutex);
+         running.insert(job);
+
+         return job;
+      }
+
+      if (priority == background)
+      {
+         runningBackground.deref();
+      }
+   }
+
+   return nullptr;
+}
+
+void Scheduler::Finish(ScheduledJob* job)
+{
+   if (job->context.priority == Priority::Background)
+   {
+      runningBackground.deref();
+
+      //a worker may be sitting on queued background work it wasn't allowed
+      QMutexLocker locker(&sleepMutex);
+      workAvailable.wakeAll();
+   }
+
+   {
+      QMutexLocker locker(&keysMutex);
+      running.remove(job);
+
+      if (!job->key.isEmpty() && keyed.value(job->key, nullptr) == job)
+      {
+         keyed.remove(job->key);
+      }
+   }
+
+   emit job->finished();
+}
+
+void Scheduler::WorkerLoop(const int& index)
+{
+   workerOwner = this;
+   workerIndex = index;
+
+   while (stopping.loadAcquire() == 0)
+   {
+      ScheduledJob* job = Take(index);
+
+      if (job == nullptr)
+      {
+         QMutexLocker locker(&sleepMutex);
+
+         if (stopping.loadAcquire() != 0)
+         {
+            return;
+         }
+
+         //work that's queued but can't be taken yet (background over its share)
+         //frees up when a background job finishes, check back shortly
+         if (pending.loadAcquire() == 0)
+         {
+            workAvailable.wait(&sleepMutex);
+         }
+         else
+         {
+            workAvailable.wait(&sleepMutex, 20);
+         }
+
+         continue;
+      }
+
+      //superseded before it got going
+      if (!job->Cancelled() && stopping.loadAcquire() == 0)
+      {
+         ContextScope scope(&job->context);
+         job->run();
+      }
+
+      Finish(job);
+   }
+}
@@ -0,0 +1,152 @@
+#ifndef Scheduler_h
+#define Scheduler_h
+
+#include <QAtomicInt>
+#include <QHash>
+#include <QList>
+#include <QMutex>
+#include <QObject>
+#include <QSet>
+#include <QString>
+#include <QThread>
+#include <QVector>
+#include <QWaitCondition>
+
+//Runs the GUI's jobs on one worker per core instead of a fresh QThread each.
+//
+//Jobs come in three classes: Interactive (previews the user is watching, like
+//the threshold slider and flood clicks), Full (a result the user asked for,
+//like Clean or Thin) and Background (batches, stacks, precompute). Every worker
+//has its own queue per class and takes the highest class it can find, first
+//from the front of its own queue and then stolen from the back of the others.
+//Background jobs never get the last worker, and their row loops stay on their
+//own thread instead of fanning out over the global pool (see Parallel.h), so a
+//batch can run all day without a click waiting behind it.
+//
+//A job submitted with a key supersedes the one before it with the same key:
+//if that one hasn't started it's dropped, if it's running it gets cancelled.
+//Cancellation is cooperative, the ImageOps loops and the Parallel helpers check
+//Scheduler::Cancelled() and wind down early, and jobs don't emit results once
+//they've been cancelled.
+class ScheduledJob;
+
+class Scheduler
+{
+public:
+   enum class Priority
+   {
+      Interactive = 0,
+      Full = 1,
+      Background = 2
+   };
+
+   static constexpr int PRIORITY_COUNT = 3;
+
+   //what a running job's code, and anything it hands work to, can see of it
+   struct Context
+   {
+      QAtomicInt cancelled;
+      Priority priority = Priority::Full;
+   };
+
+   //installs a context on the current thread for as long as it lives, for
+   //helper threads a job hands work to
+   class ContextScope
+   {
+   public:
+      ContextScope(Context* context);
+      ~ContextScope();
+
+   private:
+      Context* previous = nullptr;
+   };
+
+   Scheduler(const int& workers);
+   ~Scheduler();
+
+   //the one the GUI uses, sized to the core count
+   static Scheduler& Global();
+
+   //takes ownership until the job's finished() fires, connect that to
+   //deleteLater like with a QThread
+   void Submit(ScheduledJob* job, const Priority& priority, const QString& key = QString());
+
+   //cancels whatever is queued or running under key
+   void Cancel(const QString& key);
+
+   //the job running on this thread, nullptr outside of one
+   static Context* CurrentContext();
+
+   //true once the job running on this thread has been cancelled
+   static bool Cancelled();
+
+private:
+   struct Queue
+   {
+      QMutex mutex;
+      QList<ScheduledJob*> jobs[PRIORITY_COUNT];
+   };
+
+   class Worker : public QThread
+   {
+   public:
+      Worker(Scheduler* scheduler, const int& index)
+         : scheduler(scheduler)
+         , index(index) {};
+
+      void run() override
+      {
+         scheduler->WorkerLoop(index);
+      }
+
+   private:
+      Scheduler* scheduler = nullptr;
+      int index = 0;
+   };
+
+   void WorkerLoop(const int& index);
+   ScheduledJob* Take(const int& index);
+   ScheduledJob* PopFront(Queue& queue, const int& priority);
+   ScheduledJob* PopBack(Queue& queue, const int& priority);
+   void Finish(ScheduledJob* job);
+
+   QVector<Queue*> queues;
+   QVector<Worker*> workers;
+
+   QMutex sleepMutex;
+   QWaitCondition workAvailable;
+   QAtomicInt pending;
+   QAtomicInt runningBackground;
+   QAtomicInt nextQueue;
+   int maxBackground = 1;
+   QAtomicInt stopping;
+
+   //guards both, jobs leave them before finished() can delete them
+   QMutex keysMutex;
+   QHash<QString, ScheduledJob*> keyed;
+   QSet<ScheduledJob*> running;
+};
+
+class ScheduledJob : public QObject
+{
+   Q_OBJECT
+public:
+   ScheduledJob() {};
+
+   virtual void run() = 0;
+
+   bool Cancelled() const { return context.cancelled.loadAcquire() != 0; }
+
+   void Cancel() { context.cancelled.storeRelease(1); }
+
+signals:
+   void finished();
+
+private:
+   friend class Scheduler;
+
+   Scheduler::Context context;
+   QString key;
+};
+
+#endif /* Scheduler_h */
@@ -0,0 +1,142 @@
+#include "Scratch.h"
+
+#include <QAtomicInteger>
+#include <QVector>
+
+namespace
+{
+
+//64 bytes is the smallest block, one cache line
+static constexpr int SMALLEST_CLASS = 6;
+static constexpr int CLASSES = 48;
+static constexpr int ALIGNMENT = 64;
+
+QAtomicInteger<qint64> totalHeapAllocations(0);
+QAtomicInteger<qint64> totalReuses(0);
+QAtomicInteger<qint64> totalBytesHeld(0);
+QAtomicInteger<qint64> threadLimit(128ll * 1024 * 1024);
+
+class Arena
+{
+public:
+   ~Arena()
+   {
+      Trim();
+   }
+
+   void* Take(const int& sizeClass)
+   {
+      QVector<void*>& pool = idle[sizeClass];
+
+      if (!pool.isEmpty())
+      {
+         counters.reuses++;
+         totalReuses.fetchAndAddRelaxed(1);
+         void* block = pool.back();
+         pool.pop_back();
+         idleBytes -= 1ll << sizeClass;
+         return block;
+      }
+
+      const qint64 bytes = 1ll << sizeClass;
+      counters.heapAllocations++;
+      counters.bytesHeld += bytes;
+      totalHeapAllocations.fetchAndAddRelaxed(1);
+      totalBytesHeld.fetchAndAddRelaxed(bytes);
+
+      return qMallocAligned(bytes, ALIGNMENT);
+   }
+
+   void Give(void* block, const int& sizeClass)
+   {
+      const qint64 bytes = 1ll << sizeClass;
+
+      if (idleBytes + bytes > threadLimit.loadAcquire())
+      {
+         counters.bytesHeld -= bytes;
+         totalBytesHeld.fetchAndAddRelaxed(-bytes);
+         qFreeAligned(block);
+         return;
+      }
+
+      idleBytes += bytes;
+      idle[sizeClass].push_back(block);
+   }
+
+   void Trim()
+   {
+      for (int c = 0; c < CLASSES; c++)
+      {
+         const qint64 bytes = (1ll << c) * idle[c].count();
+         counters.bytesHeld -= bytes;
+         totalBytesHeld.fetchAndAddRelaxed(-bytes);
+
+         for (auto block : idle[c])
+         {
+            qFreeAligned(block);
+         }
+
+         //capacity and all, the point is handing the memory back
+         idle[c] = QVector<void*>();
+      }
+
+      idleBytes = 0;
+   }
+
+   Scratch::Counters counters;
+
+private:
+   QVector<void*> idle[CLASSES];
+   qint64 idleBytes = 0;
+};
+
+thread_local Arena arena;
+
+}
+
+Scratch::Counters Scratch::ThisThread()
+{
+   return arena.counters;
+}
+
+Scratch::Counters Scratch::Totals()
+{
+   Counters totals;
+   totals.heapAllocations = totalHeapAllocations.loadAcquire();
+   totals.reuses = totalReuses.loadAcquire();
+   totals.bytesHeld = totalBytesHeld.loadAcquire();
+
+   return totals;
+}
+
+void Scratch::Trim()
+{
+   arena.Trim();
+}
+
+qint64 Scratch::ThreadLimit()
+{
+   return threadLimit.loadAcquire();
+}
+
+void Scratch::SetThreadLimit(const qint64& bytes)
+{
+   threadLimit.storeRelease(qMax(0ll, bytes));
+}
+
+void* Scratch::Take(const qint64& bytes, int& sizeClass)
+{
+   sizeClass = SMALLEST_CLASS;
+
+   while ((1ll << sizeClass) < bytes)
+   {
+      sizeClass++;
+   }
+
+   return arena.Take(sizeClass);
+}
+
+void Scratch::Give(void* block, const int& sizeClass)
+{
+   arena.Give(block, sizeClass);
+}
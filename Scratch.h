@@ -0,0 +1,102 @@
+#ifndef Scratch_h
+#define Scratch_h
+
+#include <QtGlobal>
+
+#include <algorithm>
+#include <type_traits>
+
+//Per thread pools of scratch memory, for the buffers a stage only needs while
+//it runs: visited flags, label planes, padded copies, histograms, queues.
+//
+//Blocks come in power of two size classes, 64 byte aligned, and go back to
+//the pool of the thread that took them instead of to the heap. A batch
+//worker or thread pool thread that keeps seeing same sized pictures stops
+//allocating scratch after the first one, which the counters are there to
+//check. What a stage hands back, its QImage or pixel list, is an ordinary
+//allocation the counters don't see, one per result.
+//Pools live as long as their thread, which for thread pool threads can be the
+//whole process, so each one only keeps ThreadLimit() bytes of idle blocks.
+//Anything given back past that, like the buffers of one huge picture, goes
+//straight back to the heap, and Trim() empties the pool.
+namespace Scratch
+{
+
+struct Counters
+{
+   //blocks that had to come from the heap, and blocks handed out again
+   qint64 heapAllocations = 0;
+   qint64 reuses = 0;
+
+   //pooled or handed out, everything the pools got from the heap and still have
+   qint64 bytesHeld = 0;
+};
+
+//the calling thread's pool
+Counters ThisThread();
+
+//every thread's pool added up, threads that have finished included
+Counters Totals();
+
+//gives the calling thread's idle blocks back to the heap
+void Trim();
+
+//the most idle memory any one thread's pool holds on to, 128 MB to start with
+qint64 ThreadLimit();
+void SetThreadLimit(const qint64& bytes);
+
+//the raw interface under Buffer. sizeClass says which pool the block goes
+//back to and has to be handed to Give along with it, on the same thread.
+void* Take(const qint64& bytes, int& sizeClass);
+void Give(void* block, const int& sizeClass);
+
+//count Ts out of the calling thread's pool, for as long as the Buffer is in
+//scope. Not initialised unless a fill value is given. Other threads may
+//read and write it, but it has to be destroyed on the thread that made it.
+template <typename T>
+class Buffer
+{
+   static_assert(std::is_trivially_destructible<T>::value, "scratch memory never runs destructors");
+
+public:
+   explicit Buffer(const qint64& count)
+      : count(count)
+   {
+      block = (T*)Take(count * (qint64)sizeof(T), sizeClass);
+   };
+
+   Buffer(const qint64& count, const T& value)
+      : Buffer(count)
+   {
+      std::fill(block, block + count, value);
+   };
+
+   ~Buffer()
+   {
+      Give(block, sizeClass);
+   };
+
+   Buffer(const Buffer&) = delete;
+   Buffer& operator=(const Buffer&) = delete;
+
+   T* data() { return block; }
+   const T* data() const { return block; }
+   const T* constData() const { return block; }
+
+   qint64 size() const { return count; }
+
+   T* begin() { return block; }
+   T* end() { return block + count; }
+
+   T& operator[](const qint64& i) { return block[i]; }
+   const T& operator[](const qint64& i) const { return block[i]; }
+
+private:
+   T* block = nullptr;
+   qint64 count = 0;
+   int sizeClass = 0;
+};
+
+}
+
+#endif /* Scratch_h */
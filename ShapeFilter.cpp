@@ -0,0 +1,328 @@
+#include "ShapeFilter.h"
+#include "Contour.h"
+
+namespace
+{
+
+//in the order Evaluate looks them up
+static const char* const VARIABLES[] = { "area", "perimeter", "extent", "elongation", "eccentricity", "solidity" };
+static constexpr int VARIABLE_COUNT = 6;
+static constexpr int SOLIDITY = 5;
+
+int VariableIndex(const QString& name)
+{
+   for (int v = 0; v < VARIABLE_COUNT; v++)
+   {
+      if (name == VARIABLES[v])
+      {
+         return v;
+      }
+   }
+
+   return -1;
+}
+
+}
+
+ShapeFilter::ShapeFilter(const QString& expression)
+{
+   //names, numbers and the two character operators as single tokens
+   QVector<Token> tokens;
+   int i = 0;
+
+   while (i < expression.length())
+   {
+      const QChar c = expression[i];
+
+      if (c.isSpace())
+      {
+         i++;
+         continue;
+      }
+
+      Token token;
+      token.column = i + 1;
+
+      if (c.isLetter() || c == '_')
+      {
+         while (i < expression.length() && (expression[i].isLetterOrNumber() || expression[i] == '_'))
+         {
+            token.text += expression[i++];
+         }
+      }
+      else if (c.isDigit() || c == '.')
+      {
+         while (i < expression.length() && (expression[i].isDigit() || expression[i] == '.' || expression[i] == 'e' || expression[i] == 'E'
+                                            || ((expression[i] == '-' || expression[i] == '+') && (expression[i - 1] == 'e' || expression[i - 1] == 'E'))))
+         {
+            token.text += expression[i++];
+         }
+      }
+      else
+      {
+         const QString two = expression.mid(i, 2);
+
+         if (two == "&&" || two == "||" || two == "<=" || two == ">=" || two == "==" || two == "!=")
+         {
+            token.text = two;
+            i += 2;
+         }
+         else
+         {
+            token.text = c;
+            i++;
+         }
+      }
+
+      tokens.push_back(token);
+   }
+
+   if (tokens.isEmpty())
+   {
+      return;
+   }
+
+   int pos = 0;
+   root = ParseOr(tokens, pos);
+
+   if (error.isEmpty() && pos < tokens.count())
+   {
+      Fail(tokens, pos, "&& or ||");
+   }
+
+   if (!error.isEmpty())
+   {
+      terms.clear();
+      root = -1;
+      usesSolidity = false;
+   }
+}
+
+int ShapeFilter::ParseOr(const QVector<Token>& tokens, int& pos)
+{
+   int left = ParseAnd(tokens, pos);
+
+   while (error.isEmpty() && pos < tokens.count() && tokens[pos].text == "||")
+   {
+      pos++;
+
+      Term term;
+      term.op = Op::Or;
+      term.left = left;
+      term.right = ParseAnd(tokens, pos);
+      left = Add(term);
+   }
+
+   return left;
+}
+
+int ShapeFilter::ParseAnd(const QVector<Token>& tokens, int& pos)
+{
+   int left = ParseUnary(tokens, pos);
+
+   while (error.isEmpty() && pos < tokens.count() && tokens[pos].text == "&&")
+   {
+      pos++;
+
+      Term term;
+      term.op = Op::And;
+      term.left = left;
+      term.right = ParseUnary(tokens, pos);
+      left = Add(term);
+   }
+
+   return left;
+}
+
+int ShapeFilter::ParseUnary(const QVector<Token>& tokens, int& pos)
+{
+   if (!error.isEmpty())
+   {
+      return -1;
+   }
+
+   if (pos < tokens.count() && tokens[pos].text == "!")
+   {
+      pos++;
+
+      Term term;
+      term.op = Op::Not;
+      term.left = ParseUnary(tokens, pos);
+      return Add(term);
+   }
+
+   if (pos < tokens.count() && tokens[pos].text == "(")
+   {
+      pos++;
+      const int inside = ParseOr(tokens, pos);
+
+      if (error.isEmpty() && (pos >= tokens.count() || tokens[pos].text != ")"))
+      {
+         Fail(tokens, pos, ")");
+      }
+
+      pos++;
+      return inside;
+   }
+
+   //name op number
+   Term term;
+   term.variable = pos < tokens.count() ? VariableIndex(tokens[pos].text) : -1;
+
+   if (term.variable < 0)
+   {
+      Fail(tokens, pos, "area, perimeter, extent, elongation, eccentricity or solidity");
+      return -1;
+   }
+
+   pos++;
+   const QString op = pos < tokens.count() ? tokens[pos].text : QString();
+
+   if (op == "<")
+   {
+      term.op = Op::Less;
+   }
+   else if (op == "<=")
+   {
+      term.op = Op::LessEqual;
+   }
+   else if (op == ">")
+   {
+      term.op = Op::Greater;
+   }
+   else if (op == ">=")
+   {
+      term.op = Op::GreaterEqual;
+   }
+   else if (op == "==")
+   {
+      term.op = Op::Equal;
+   }
+   else if (op == "!=")
+   {
+      term.op = Op::NotEqual;
+   }
+   else
+   {
+      Fail(tokens, pos, "a comparison");
+      return -1;
+   }
+
+   pos++;
+   bool ok = false;
+   term.value = pos < tokens.count() ? tokens[pos].text.toDouble(&ok) : 0;
+
+   if (!ok)
+   {
+      Fail(tokens, pos, "a number");
+      return -1;
+   }
+
+   pos++;
+   usesSolidity = usesSolidity || term.variable == SOLIDITY;
+
+   return Add(term);
+}
+
+int ShapeFilter::Add(const Term& term)
+{
+   terms.push_back(term);
+   return terms.count() - 1;
+}
+
+void ShapeFilter::Fail(const QVector<Token>& tokens, const int& pos, const QString& expected)
+{
+   if (!error.isEmpty())
+   {
+      return;
+   }
+
+   error = pos < tokens.count() ? QString("column %1: expected %2, found '%3'").arg(tokens[pos].column).arg(expected).arg(tokens[pos].text)
+                                : QString("expected %1 at the end").arg(expected);
+}
+
+ShapeFilter::Shape ShapeFilter::Measure(const MaxTree& tree, const int& n) const
+{
+   const MaxTree::Node& node = tree.Nodes()[n];
+
+   Shape shape;
+   shape.area = node.area;
+   shape.perimeter = node.perimeter;
+   shape.extent = node.Extent();
+   shape.elongation = node.Elongation();
+   shape.eccentricity = node.Eccentricity();
+
+   if (usesSolidity)
+   {
+      //the mask only holds this component, so its first border is the outer one
+      const QVector<Contour::Border> borders = Contour::Trace(tree.ComponentMask(n), Contour::Connectivity::Eight);
+
+      if (!borders.isEmpty())
+      {
+         shape.solidity = node.area / Contour::Area(Contour::ConvexHull(borders.first()));
+      }
+   }
+
+   return shape;
+}
+
+bool ShapeFilter::Accepts(const Shape& shape) const
+{
+   return root < 0 || Evaluate(root, shape);
+}
+
+QVector<int> ShapeFilter::Filter(const MaxTree& tree, const QVector<int>& components) const
+{
+   if (root < 0)
+   {
+      return components;
+   }
+
+   QVector<int> kept;
+
+   for (const auto& n : components)
+   {
+      if (Accepts(Measure(tree, n)))
+      {
+         kept.push_back(n);
+      }
+   }
+
+   return kept;
+}
+
+bool ShapeFilter::Evaluate(const int& t, const Shape& shape) const
+{
+   const Term& term = terms[t];
+
+   switch (term.op)
+   {
+   case Op::Or:
+      return Evaluate(term.left, shape) || Evaluate(term.right, shape);
+   case Op::And:
+      return Evaluate(term.left, shape) && Evaluate(term.right, shape);
+   case Op::Not:
+      return !Evaluate(term.left, shape);
+   default:
+      break;
+   }
+
+   const double values[VARIABLE_COUNT] = { shape.area, shape.perimeter, shape.extent, shape.elongation, shape.eccentricity, shape.solidity };
+   const double v = values[term.variable];
+
+   switch (term.op)
+   {
+   case Op::Less:
+      return v < term.value;
+   case Op::LessEqual:
+      return v <= term.value;
+   case Op::Greater:
+      return v > term.value;
+   case Op::GreaterEqual:
+      return v >= term.value;
+   case Op::Equal:
+      return v == term.value;
+   default:
+      return v != term.value;
+   }
+}
@@ -0,0 +1,105 @@
+#ifndef ShapeFilter_h
+#define ShapeFilter_h
+
+#include <QString>
+#include <QVector>
+
+#include "MaxTree.h"
+
+//Which components Clean and the pipeline keep, as an expression over their
+//shape instead of only a pixel count, e.g.
+//
+//   area > 200 && elongation > 3 && solidity > 0.8
+//
+//Names are the fields of Shape, compared with < <= > >= == != against numbers
+//and joined with &&, ||, ! and brackets. Everything but solidity comes
+//straight off the max tree node, so filtering happens before anything gets
+//thinned or measured.
+class ShapeFilter
+{
+public:
+   struct Shape
+   {
+      //pixels
+      double area = 0;
+
+      //pixel edges, MaxTree::Node::perimeter
+      double perimeter = 0;
+
+      //of the bounding box
+      double extent = 1;
+
+      //MaxTree::Node::Elongation/Eccentricity
+      double elongation = 1;
+      double eccentricity = 0;
+
+      //area over the area of the convex hull of the outer border, 1 for
+      //anything convex
+      double solidity = 1;
+   };
+
+   //keeps everything
+   ShapeFilter() {};
+
+   explicit ShapeFilter(const QString& expression);
+
+   //an empty expression is valid and keeps everything, an invalid one keeps
+   //everything too but says why in Error
+   bool IsValid() const { return error.isEmpty(); }
+   QString Error() const { return error; }
+
+   //solidity needs the component traced, only done when the expression asks
+   bool UsesSolidity() const { return usesSolidity; }
+
+   Shape Measure(const MaxTree& tree, const int& n) const;
+
+   bool Accepts(const Shape& shape) const;
+
+   //the ones out of components (MaxTree nodes) that get through, same order
+   QVector<int> Filter(const MaxTree& tree, const QVector<int>& components) const;
+
+private:
+   enum class Op
+   {
+      Or,
+      And,
+      Not,
+      Less,
+      LessEqual,
+      Greater,
+      GreaterEqual,
+      Equal,
+      NotEqual
+   };
+
+   //Or/And use left and right, Not only left, comparisons variable and value
+   struct Term
+   {
+      Op op = Op::Or;
+      int left = -1;
+      int right = -1;
+      int variable = -1;
+      double value = 0;
+   };
+
+   struct Token
+   {
+      QString text;
+      int column = 0;
+   };
+
+   int ParseOr(const QVector<Token>& tokens, int& pos);
+   int ParseAnd(const QVector<Token>& tokens, int& pos);
+   int ParseUnary(const QVector<Token>& tokens, int& pos);
+   int Add(const Term& term);
+   void Fail(const QVector<Token>& tokens, const int& pos, const QString& expected);
+
+   bool Evaluate(const int& t, const Shape& shape) const;
+
+   QVector<Term> terms;
+   int root = -1;
+   bool usesSolidity = false;
+   QString error;
+};
+
+#endif /* ShapeFilter_h */
@@ -0,0 +1,709 @@
+#include "Shard.h"
+#include "Scheduler.h"
+
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonDocument>
+#include <QSaveFile>
+#include <QSysInfo>
+
+#ifdef Q_OS_UNIX
+#include <cerrno>
+#include <signal.h>
+#endif
+
+namespace
+{
+
+static constexpr int MANIFEST_VERSION = 1;
+
+bool Fail(QString* error, const QString& message)
+{
+   if (error != nullptr)
+   {
+      *error = message;
+   }
+
+   return false;
+}
+
+QString ManifestPath(const QString& dir)
+{
+   return QDir(dir).filePath("manifest.txt");
+}
+
+QString ShardPath(const QString& dir, const int& shard, const QString& suffix)
+{
+   return QDir(dir).filePath(QString("shards/%1.%2").arg(shard, 5, 10, QChar('0')).arg(suffix));
+}
+
+//what a lease holds, "host pid"
+QByteArray Owner()
+{
+   return QSysInfo::machineHostName().toUtf8() + " " + QByteArray::number(QCoreApplication::applicationPid());
+}
+
+QByteArray ReadLease(const QString& path)
+{
+   QFile lease(path);
+
+   if (!lease.open(QIODevice::ReadOnly))
+   {
+      return QByteArray();
+   }
+
+   return lease.readAll().trimmed();
+}
+
+//O_EXCL, which NFS has done atomically since v3
+bool TryCreate(const QString& path)
+{
+   QFile lease(path);
+
+   if (!lease.open(QIODevice::WriteOnly | QIODevice::NewOnly))
+   {
+      return false;
+   }
+
+   //a lease left empty would never be renewed, so don't leave one behind
+   if (lease.write(Owner() + "\n") <= 0 || !lease.flush())
+   {
+      lease.close();
+      QFile::remove(path);
+      return false;
+   }
+
+   return true;
+}
+
+//whether the lease at path is past its timeout or belongs to a process on
+//this machine that has gone, with what it held
+bool Stale(const QString& path, const qint64& leaseTimeoutMs, QByteArray& owner)
+{
+   if (!QFile::exists(path))
+   {
+      return false;
+   }
+
+   owner = ReadLease(path);
+
+   //empty ones too, their worker died between creating and writing them
+   if (QFileInfo(path).lastModified().msecsTo(QDateTime::currentDateTime()) > leaseTimeoutMs)
+   {
+      return true;
+   }
+
+   if (owner.isEmpty())
+   {
+      //caught between being created and written
+      return false;
+   }
+
+#ifdef Q_OS_UNIX
+   const QList<QByteArray> parts = owner.split(' ');
+
+   if (parts.count() == 2 && parts[0] == QSysInfo::machineHostName().toUtf8() && kill((pid_t)parts[1].toLongLong(), 0) != 0 && errno == ESRCH)
+   {
+      return true;
+   }
+#endif
+
+   return false;
+}
+
+//rewriting the lease is what keeps it from going stale. False if it isn't
+//this process's any more.
+bool Renew(const QString& path)
+{
+   QFile lease(path);
+
+   if (!lease.open(QIODevice::ReadWrite | QIODevice::ExistingOnly) || lease.readAll().trimmed() != Owner())
+   {
+      return false;
+   }
+
+   lease.seek(0);
+
+   if (lease.write(Owner() + "\n") <= 0 || !lease.flush())
+   {
+      return false;
+   }
+
+   lease.close();
+
+   //a worker that broke the lease between the read and the write got the
+   //rewrite on the file it renamed out of the way, and whatever is at path
+   //now is its own lease or nothing
+   return ReadLease(path) == Owner();
+}
+
+void Release(const QString& path)
+{
+   if (ReadLease(path) == Owner())
+   {
+      QFile::remove(path);
+   }
+}
+
+//runs whatever shard hasn't got checkpoints for, with this process holding
+//its lease
+void RunShard(const QString& dir, const Shard::Manifest& manifest, const int& shard, const Shard::WorkOptions& options, Shard::WorkStats& stats)
+{
+   const QString leasePath = Shard::LeasePath(dir, shard);
+   const QString partPath = Shard::PartPath(dir, shard);
+   const QSet<int> done = Shard::Checkpointed(partPath);
+
+   QStringList paths;
+   QVector<int> indices;
+
+   for (int i = manifest.First(shard); i < manifest.First(shard) + manifest.Count(shard); i++)
+   {
+      if (!done.contains(i))
+      {
+         paths.push_back(manifest.images[i]);
+         indices.push_back(i);
+      }
+   }
+
+   QFile part(partPath);
+
+   if (!part.open(QIODevice::WriteOnly | QIODevice::Append))
+   {
+      stats.error = "Could not write " + partPath;
+      Release(leasePath);
+      return;
+   }
+
+   //the shard runs as a job of its own under whatever started the work, so a
+   //lost lease can stop it without cancelling the caller
+   Scheduler::Context* outer = Scheduler::CurrentContext();
+   Scheduler::Context context;
+   context.priority = outer != nullptr ? outer->priority : Scheduler::Priority::Full;
+
+   bool lost = false;
+   int finished = 0;
+   QElapsedTimer sinceRenewal;
+   sinceRenewal.start();
+
+   {
+      Scheduler::ContextScope scope(&context);
+
+      Batch::Run(paths, options.batch, [&](const DecodedFrame& frame, const Pipeline::Result& result) {
+         if (context.cancelled.loadAcquire() != 0)
+         {
+            return;
+         }
+
+         if (outer != nullptr && outer->cancelled.loadAcquire() != 0)
+         {
+            context.cancelled.storeRelease(1);
+            return;
+         }
+
+         //the rows and the checkpoint after them go out in one write
+         const QByteArray index = QByteArray::number(indices[frame.index]);
+         QByteArray record;
+
+         if (frame.error.isEmpty())
+         {
+            const QString rows = Pipeline::CsvRows(frame.path, result);
+
+            if (!rows.isEmpty())
+            {
+               record += rows.toUtf8() + "\n";
+            }
+
+            record += "#done " + index + "\n";
+         }
+         else
+         {
+            record += "#failed " + index + " " + frame.error.simplified().toUtf8() + "\n";
+         }
+
+         //a worker that broke the lease since the last renewal has the shard
+         //now, and two of them appending to one part file duplicates rows
+         if (ReadLease(leasePath) != Owner())
+         {
+            lost = true;
+            context.cancelled.storeRelease(1);
+            return;
+         }
+
+         if (part.write(record) != record.size() || !part.flush())
+         {
+            stats.error = "Could not write " + partPath;
+            context.cancelled.storeRelease(1);
+            return;
+         }
+
+         finished++;
+         stats.images++;
+
+         if (frame.error.isEmpty())
+         {
+            stats.cells += result.cells.count();
+         }
+         else
+         {
+            stats.failed++;
+         }
+
+         if (sinceRenewal.elapsed() > options.leaseTimeoutMs / 4)
+         {
+            if (!Renew(leasePath))
+            {
+               lost = true;
+               context.cancelled.storeRelease(1);
+            }
+
+            sinceRenewal.restart();
+         }
+      });
+   }
+
+   part.close();
+   stats.skipped += done.count();
+
+   //cancelled or out of disk, the checkpoints are there for whoever comes next
+   if (!lost && finished < paths.count())
+   {
+      Release(leasePath);
+      return;
+   }
+
+   if (lost || !Renew(leasePath))
+   {
+      stats.lost++;
+      return;
+   }
+
+   //a .csv already there means a worker that had this lease before finished it
+   QFile::rename(partPath, Shard::ResultPath(dir, shard));
+   Release(leasePath);
+
+   stats.shards++;
+
+   if (!done.isEmpty())
+   {
+      stats.resumed++;
+   }
+}
+
+}
+
+int Shard::Manifest::ShardCount() const
+{
+   return (images.count() + shardSize - 1) / shardSize;
+}
+
+int Shard::Manifest::First(const int& shard) const
+{
+   return shard * shardSize;
+}
+
+int Shard::Manifest::Count(const int& shard) const
+{
+   return qMin(shardSize, images.count() - First(shard));
+}
+
+bool Shard::CreateManifest(const QString& dir, const Manifest& manifest, QString* error)
+{
+   if (manifest.shardSize < 1)
+   {
+      return Fail(error, "The shard size has to be at least 1");
+   }
+
+   if (!QDir().mkpath(QDir(dir).filePath("shards")))
+   {
+      return Fail(error, "Could not make " + QDir(dir).filePath("shards"));
+   }
+
+   const QString path = ManifestPath(dir);
+
+   if (QFile::exists(path))
+   {
+      return Fail(error, dir + " already has a manifest");
+   }
+
+   //written under another name and renamed, so workers never see half of one
+   QSaveFile file(path);
+
+   if (!file.open(QIODevice::WriteOnly))
+   {
+      return Fail(error, "Could not write " + path);
+   }
+
+   QByteArray text;
+   text += "#cellength-manifest " + QByteArray::number(MANIFEST_VERSION) + "\n";
+   text += "#shard-size " + QByteArray::number(manifest.shardSize) + "\n";
+   text += "#params " + QJsonDocument(manifest.params).toJson(QJsonDocument::Compact) + "\n";
+
+   for (const auto& image : manifest.images)
+   {
+      text += image.toUtf8() + "\n";
+   }
+
+   if (file.write(text) != text.size() || !file.commit())
+   {
+      return Fail(error, "Could not write " + path);
+   }
+
+   return true;
+}
+
+bool Shard::ReadManifest(const QString& dir, Manifest& manifest, QString* error)
+{
+   const QString path = ManifestPath(dir);
+   QFile file(path);
+
+   if (!file.open(QIODevice::ReadOnly))
+   {
+      return Fail(error, "Could not read " + path);
+   }
+
+   manifest = Manifest();
+   int version = 0;
+
+   while (!file.atEnd())
+   {
+      const QByteArray line = file.readLine().trimmed();
+
+      if (line.isEmpty())
+      {
+         continue;
+      }
+
+      if (!line.startsWith('#'))
+      {
+         manifest.images.push_back(QString::fromUtf8(line));
+         continue;
+      }
+
+      const int space = line.indexOf(' ');
+      const QByteArray key = line.mid(1, space - 1);
+      const QByteArray value = space < 0 ? QByteArray() : line.mid(space + 1);
+
+      if (key == "cellength-manifest")
+      {
+         version = value.toInt();
+      }
+      else if (key == "shard-size")
+      {
+         manifest.shardSize = value.toInt();
+      }
+      else if (key == "params")
+      {
+         manifest.params = QJsonDocument::fromJson(value).object();
+      }
+   }
+
+   if (version != MANIFEST_VERSION || manifest.shardSize < 1)
+   {
+      return Fail(error, path + " isn't a version " + QString::number(MANIFEST_VERSION) + " manifest");
+   }
+
+   return true;
+}
+
+QString Shard::LeasePath(const QString& dir, const int& shard)
+{
+   return ShardPath(dir, shard, "lease");
+}
+
+QString Shard::PartPath(const QString& dir, const int& shard)
+{
+   return ShardPath(dir, shard, "part");
+}
+
+QString Shard::ResultPath(const QString& dir, const int& shard)
+{
+   return ShardPath(dir, shard, "csv");
+}
+
+bool Shard::Claim(const QString& dir, const int& shard, const qint64& leaseTimeoutMs)
+{
+   const QString path = LeasePath(dir, shard);
+
+   if (TryCreate(path))
+   {
+      return true;
+   }
+
+   QByteArray owner;
+
+   if (!Stale(path, leaseTimeoutMs, owner))
+   {
+      return false;
+   }
+
+   //only one of the workers that found it stale gets to rename it, the others
+   //find it gone
+   const QString broken = path + "." + QString::number(QCoreApplication::applicationPid()) + ".broken";
+
+   if (!QFile::rename(path, broken))
+   {
+      return false;
+   }
+
+   //unless one of them broke it, took the shard and wrote a new lease in the
+   //time since it was looked at, or its owner renewed it, that one goes back
+   QByteArray renamed;
+
+   if (!Stale(broken, leaseTimeoutMs, renamed) || renamed != owner)
+   {
+      if (QFile::rename(broken, path))
+      {
+         return false;
+      }
+
+      //someone made a new lease at path in the meantime. Its owner can't
+      //renew the one in broken any more, so it stops at its next write, and
+      //whoever holds path carries on.
+   }
+
+   QFile::remove(broken);
+
+   return TryCreate(path);
+}
+
+QSet<int> Shard::Checkpointed(const QString& partPath)
+{
+   QSet<int> done;
+   QFile part(partPath);
+
+   if (!part.open(QIODevice::ReadWrite))
+   {
+      return done;
+   }
+
+   qint64 read = 0;
+   qint64 kept = 0;
+
+   while (!part.atEnd())
+   {
+      const QByteArray line = part.readLine();
+      read += line.size();
+
+      //the last line of a worker that died mid write
+      if (!line.endsWith('\n'))
+      {
+         break;
+      }
+
+      if (line.startsWith("#done ") || line.startsWith("#failed "))
+      {
+         done.insert(line.trimmed().split(' ')[1].toInt());
+         kept = read;
+      }
+   }
+
+   if (kept < part.size())
+   {
+      part.resize(kept);
+   }
+
+   return done;
+}
+
+QString Shard::WorkStats::Summary() const
+{
+   QString summary = QString("%1 shards (%2 resumed), %3 images (%4 already done, %5 failed), %6 cells in %7 s")
+                     .arg(shards)
+                     .arg(resumed)
+                     .arg(images)
+                     .arg(skipped)
+                     .arg(failed)
+                     .arg(cells)
+                     .arg(wallNs / 1e9, 0, 'f', 2);
+
+   if (lost > 0)
+   {
+      summary += QString(", %1 leases lost").arg(lost);
+   }
+
+   if (!error.isEmpty())
+   {
+      summary += ". " + error;
+   }
+
+   return summary;
+}
+
+Shard::WorkStats Shard::Work(const QString& dir, const WorkOptions& options)
+{
+   WorkStats stats;
+   QElapsedTimer wall;
+   wall.start();
+
+   Manifest manifest;
+
+   if (!ReadManifest(dir, manifest, &stats.error))
+   {
+      return stats;
+   }
+
+   const int count = manifest.ShardCount();
+
+   //workers start at different shards so they aren't all after the same one
+   const int start = count > 0 ? (int)(qHash(Owner()) % (uint)count) : 0;
+   bool claimed = true;
+
+   //shards other workers left behind can go stale while this one works, so it
+   //keeps going round until a whole pass finds nothing to claim
+   while (claimed && stats.error.isEmpty() && !Scheduler::Cancelled())
+   {
+      claimed = false;
+
+      for (int i = 0; i < count && stats.error.isEmpty() && !Scheduler::Cancelled(); i++)
+      {
+         if (options.maxShards > 0 && stats.shards >= options.maxShards)
+         {
+            stats.wallNs = wall.nsecsElapsed();
+            return stats;
+         }
+
+         const int shard = (start + i) % count;
+
+         if (QFile::exists(ResultPath(dir, shard)) || !Claim(dir, shard, options.leaseTimeoutMs))
+         {
+            continue;
+         }
+
+         //finished by someone else between the check and the claim
+         if (QFile::exists(ResultPath(dir, shard)))
+         {
+            Release(LeasePath(dir, shard));
+            continue;
+         }
+
+         claimed = true;
+         RunShard(dir, manifest, shard, options, stats);
+      }
+   }
+
+   stats.wallNs = wall.nsecsElapsed();
+
+   return stats;
+}
+
+QString Shard::Progress::Summary() const
+{
+   QString summary = QString("%1/%2 shards done, %3 running, %4 to go").arg(done).arg(shards).arg(leased).arg(pending);
+
+   if (!broken.isEmpty())
+   {
+      summary += QString(", %1 broken leases left behind: %2").arg(broken.count()).arg(broken.join(", "));
+   }
+
+   return summary;
+}
+
+Shard::Progress Shard::Status(const QString& dir, const qint64& leaseTimeoutMs)
+{
+   Progress progress;
+   Manifest manifest;
+
+   if (!ReadManifest(dir, manifest))
+   {
+      return progress;
+   }
+
+   progress.shards = manifest.ShardCount();
+   progress.broken = QDir(QDir(dir).filePath("shards")).entryList(QStringList("*.broken"), QDir::Files);
+
+   for (int shard = 0; shard < progress.shards; shard++)
+   {
+      QByteArray owner;
+
+      if (QFile::exists(ResultPath(dir, shard)))
+      {
+         progress.done++;
+      }
+      else if (QFile::exists(LeasePath(dir, shard)) && !Stale(LeasePath(dir, shard), leaseTimeoutMs, owner))
+      {
+         progress.leased++;
+      }
+      else
+      {
+         progress.pending++;
+      }
+   }
+
+   return progress;
+}
+
+bool Shard::Merge(const QString& dir, const QString& outputPath, const bool& partial, QString* error)
+{
+   Manifest manifest;
+
+   if (!ReadManifest(dir, manifest, error))
+   {
+      return false;
+   }
+
+   QSaveFile output(outputPath);
+
+   if (!output.open(QIODevice::WriteOnly))
+   {
+      return Fail(error, "Could not write " + outputPath);
+   }
+
+   output.write(Pipeline::CsvHeader().toUtf8() + "\n");
+   QSet<int> merged;
+
+   for (int shard = 0; shard < manifest.ShardCount(); shard++)
+   {
+      QFile result(ResultPath(dir, shard));
+
+      if (!result.open(QIODevice::ReadOnly))
+      {
+         if (partial)
+         {
+            continue;
+         }
+
+         output.cancelWriting();
+         return Fail(error, QString("Shard %1 of %2 isn't finished").arg(shard).arg(manifest.ShardCount()));
+      }
+
+      //an image's rows come before its checkpoint, and go out only if no
+      //earlier checkpoint had the image already. Two workers on one shard
+      //can both have written it before the second noticed the lease was gone.
+      QByteArray rows;
+
+      while (!result.atEnd())
+      {
+         const QByteArray line = result.readLine();
+
+         if (!line.startsWith('#'))
+         {
+            rows += line;
+            continue;
+         }
+
+         if (line.startsWith("#done ") || line.startsWith("#failed "))
+         {
+            const int image = line.trimmed().split(' ')[1].toInt();
+
+            if (!merged.contains(image))
+            {
+               merged.insert(image);
+               output.write(rows);
+            }
+
+            rows.clear();
+         }
+      }
+   }
+
+   if (!output.commit())
+   {
+      return Fail(error, "Could not write " + outputPath);
+   }
+
+   return true;
+}
@@ -0,0 +1,126 @@
+#ifndef Shard_h
+#define Shard_h
+
+#include <QJsonObject>
+#include <QSet>
+#include <QStringList>
+
+#include "Batch.h"
+
+//Batch runs spread over several processes or machines that share a
+//directory (NFS will do), any of which can be killed and started again.
+//
+//CreateManifest writes the image list and the run's settings into a work
+//directory once, and the list is cut into shards of shardSize images. A
+//worker claims a shard by creating its lease file exclusively, runs it
+//through Batch::Run and appends every image's CSV rows to the shard's .part
+//file followed by a "#done <image>" line. That line is the checkpoint:
+//whoever picks a half done shard up throws away anything after the last one
+//and only runs the images that don't have one. A finished .part gets renamed
+//to .csv, which is what marks the shard done, and Merge puts the .csv files
+//together.
+//
+//The lease gets rewritten as images finish and read back, and a worker that
+//finds someone else's there stops. One that hasn't been rewritten for
+//leaseTimeoutMs, empty ones included, or whose process on this machine isn't
+//running any more, is broken by renaming it out of the way, which only one
+//worker can manage. The
+//timeout has to be well over the time one image takes plus the clock
+//difference between the nodes, or two workers end up on the same shard.
+namespace Shard
+{
+
+struct Manifest
+{
+   QStringList images;
+   int shardSize = 500;
+
+   //settings every worker runs with, a JobServer job object. Only stored here.
+   QJsonObject params;
+
+   int ShardCount() const;
+
+   //index of shard's first image and how many it has
+   int First(const int& shard) const;
+   int Count(const int& shard) const;
+};
+
+//fails if dir already has a manifest, one work directory is one run
+bool CreateManifest(const QString& dir, const Manifest& manifest, QString* error = nullptr);
+bool ReadManifest(const QString& dir, Manifest& manifest, QString* error = nullptr);
+
+struct WorkOptions
+{
+   Batch::Options batch;
+
+   qint64 leaseTimeoutMs = 10 * 60 * 1000;
+
+   //stop after this many shards, 0 keeps going until there's nothing to claim
+   int maxShards = 0;
+};
+
+struct WorkStats
+{
+   //finished here, and of those the ones another worker had started
+   int shards = 0;
+   int resumed = 0;
+
+   //run here, and already checkpointed by an earlier worker
+   int images = 0;
+   int skipped = 0;
+
+   int failed = 0;
+   int cells = 0;
+
+   //shards whose lease another worker broke while this one was on them
+   int lost = 0;
+
+   qint64 wallNs = 0;
+
+   //set when the manifest can't be read or a .part file can't be written
+   QString error;
+
+   QString Summary() const;
+};
+
+//claims and runs shards until every one is done or leased to a live worker
+WorkStats Work(const QString& dir, const WorkOptions& options);
+
+struct Progress
+{
+   int shards = 0;
+   int done = 0;
+
+   //leases that look live, stale ones count as pending
+   int leased = 0;
+   int pending = 0;
+
+   //.broken files in the shards directory, leases a worker renamed out of the
+   //way and died before deleting. Safe to remove once nobody is claiming.
+   QStringList broken;
+
+   QString Summary() const;
+};
+
+Progress Status(const QString& dir, const qint64& leaseTimeoutMs = 10 * 60 * 1000);
+
+//every shard's rows under one CSV header, in manifest order, each image's
+//once. Fails naming the first unfinished shard unless partial is set, then
+//those are just missing.
+bool Merge(const QString& dir, const QString& outputPath, const bool& partial = false, QString* error = nullptr);
+
+//the files of one shard in dir
+QString LeasePath(const QString& dir, const int& shard);
+QString PartPath(const QString& dir, const int& shard);
+QString ResultPath(const QString& dir, const int& shard);
+
+//takes shard's lease for this process, breaking a stale one
+bool Claim(const QString& dir, const int& shard, const qint64& leaseTimeoutMs);
+
+//the images a .part file has checkpoints for. Cuts off whatever was written
+//after the last one, the rows of an image that never got its checkpoint.
+QSet<int> Checkpointed(const QString& partPath);
+
+}
+
+#endif /* Shard_h */
@@ -0,0 +1,1269 @@
+#include "SimdKernels.h"
+#include "ImageOps.h"
+#include "Parallel.h"
+
+#include <QtGlobal>
+
+#include <atomic>
+#include <cmath>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define CELLLENGTH_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+//gcc/clang need to be told which functions are allowed to use the wider
+//instruction sets, msvc hands out every intrinsic regardless of /arch
+#if defined(CELLLENGTH_X86) && (defined(__GNUC__) || defined(__clang__))
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_SSE41
+#define TARGET_AVX2
+#endif
+
+using SimdKernels::CpuLevel;
+
+namespace
+{
+
+//---------------------------------------------------------------------------
+// cpu detection
+//---------------------------------------------------------------------------
+
+#ifdef CELLLENGTH_X86
+void Cpuid(const int& leaf, const int& subLeaf, unsigned int regs[4])
+{
+#if defined(_MSC_VER)
+   int r[4];
+   __cpuidex(r, leaf, subLeaf);
+   for (int i = 0; i < 4; i++)
+   {
+      regs[i] = (unsigned int)r[i];
+   }
+#else
+   __cpuid_count(leaf, subLeaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+unsigned long long ReadXcr0()
+{
+#if defined(_MSC_VER)
+   return _xgetbv(0);
+#else
+   unsigned int lo = 0;
+   unsigned int hi = 0;
+   __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+   return ((unsigned long long)hi << 32) | lo;
+#endif
+}
+#endif
+
+CpuLevel Detect()
+{
+#ifdef CELLLENGTH_X86
+   unsigned int regs[4] = { 0, 0, 0, 0 };
+   Cpuid(0, 0, regs);
+   const unsigned int maxLeaf = regs[0];
+
+   Cpuid(1, 0, regs);
+   const bool ssse3 = regs[2] & (1u << 9);
+   const bool sse41 = regs[2] & (1u << 19);
+   const bool osxsave = regs[2] & (1u << 27);
+   const bool avx = regs[2] & (1u << 28);
+
+   if (!ssse3 || !sse41)
+   {
+      return CpuLevel::Scalar;
+   }
+
+   //the cpu having avx2 isn't enough, the OS has to save the ymm registers too
+   if (maxLeaf >= 7 && osxsave && avx && (ReadXcr0() & 0x6) == 0x6)
+   {
+      Cpuid(7, 0, regs);
+
+      if (regs[1] & (1u << 5))
+      {
+         return CpuLevel::AVX2;
+      }
+   }
+
+   return CpuLevel::SSE41;
+#else
+   return CpuLevel::Scalar;
+#endif
+}
+
+CpuLevel Clamp(const CpuLevel& level)
+{
+   return (int)level > (int)SimdKernels::DetectCpuLevel() ? SimdKernels::DetectCpuLevel() : level;
+}
+
+CpuLevel InitialLevel()
+{
+   const QByteArray requested = qgetenv("CELLLENGTH_SIMD").toLower();
+
+   if (requested == "scalar")
+   {
+      return CpuLevel::Scalar;
+   }
+   else if (requested == "sse41")
+   {
+      return Clamp(CpuLevel::SSE41);
+   }
+
+   return SimdKernels::DetectCpuLevel();
+}
+
+std::atomic<int>& Level()
+{
+   static std::atomic<int> level((int)InitialLevel());
+   return level;
+}
+
+CpuLevel Active()
+{
+   return (CpuLevel)Level().load(std::memory_order_relaxed);
+}
+
+//---------------------------------------------------------------------------
+// scalar kernels, also used for the tails of the vector loops
+//---------------------------------------------------------------------------
+
+void ArgbToGrayScalar(const QRgb* src, uchar* dst, const int& count)
+{
+   for (int x = 0; x < count; x++)
+   {
+      dst[x] = (uchar)qGray(src[x]);
+   }
+}
+
+void BuildThresholdLut(uchar lut[256], const int& threshVal)
+{
+   for (int i = 0; i < 256; i++)
+   {
+      lut[i] = i > threshVal ? 255 : 0;
+   }
+}
+
+void GrayToMaskScalar(const uchar* src, uchar* dst, const int& count, const int& threshVal)
+{
+   uchar lut[256];
+   BuildThresholdLut(lut, threshVal);
+
+   for (int x = 0; x < count; x++)
+   {
+      dst[x] = lut[src[x]];
+   }
+}
+
+void Gray16ToMaskScalar(const quint16* src, uchar* dst, const int& count, const int& threshVal)
+{
+   for (int x = 0; x < count; x++)
+   {
+      dst[x] = src[x] > threshVal ? 255 : 0;
+   }
+}
+
+//count of pixels starting at src, dst already points at the right byte
+void GrayToBitMaskScalar(const uchar* src, uchar* dst, const int& count, const int& threshVal)
+{
+   for (int x = 0; x < count; x += 8)
+   {
+      const int n = qMin(8, count - x);
+      uchar packed = 0;
+
+      for (int i = 0; i < n; i++)
+      {
+         packed |= (uchar)((src[x + i] > threshVal) << i);
+      }
+
+      dst[x >> 3] = packed;
+   }
+}
+
+void ArgbThresholdScalar(const QRgb* src, QRgb* dst, const int& count, const int& threshVal)
+{
+   for (int x = 0; x < count; x++)
+   {
+      dst[x] = qGray(src[x]) > threshVal ? 0xffffffffu : 0u;
+   }
+}
+
+//the transpose goes tile by tile so the reads and the writes both stay in cache
+static constexpr int TRANSPOSE_TILE = 32;
+
+void MinScalar(const uchar* a, const uchar* b, uchar* dst, const int& count)
+{
+   for (int x = 0; x < count; x++)
+   {
+      dst[x] = qMin(a[x], b[x]);
+   }
+}
+
+void MaxScalar(const uchar* a, const uchar* b, uchar* dst, const int& count)
+{
+   for (int x = 0; x < count; x++)
+   {
+      dst[x] = qMax(a[x], b[x]);
+   }
+}
+
+void SubtractScalar(const uchar* a, const uchar* b, uchar* dst, const int& count)
+{
+   for (int x = 0; x < count; x++)
+   {
+      dst[x] = a[x] > b[x] ? a[x] - b[x] : 0;
+   }
+}
+
+//nearbyint rounds half to even like cvtps does, so the vector versions match
+void GainScalar(const uchar* src, const float* gain, uchar* dst, const int& count)
+{
+   for (int x = 0; x < count; x++)
+   {
+      const float v = std::nearbyint((float)src[x] * gain[x]);
+      dst[x] = v <= 0 ? 0 : (v >= 255 ? 255 : (uchar)v);
+   }
+}
+
+//the float kernels keep the multiplies and adds in the same order as the
+//vector versions and never fuse them, so every level gives the same bits
+void AccumulateScalar(const uchar* src, const float& weight, float* acc, const int& count)
+{
+   for (int x = 0; x < count; x++)
+   {
+      acc[x] = acc[x] + (float)src[x] * weight;
+   }
+}
+
+void GrayToFloatScalar(const uchar* src, float* dst, const int& count)
+{
+   for (int x = 0; x < count; x++)
+   {
+      dst[x] = src[x];
+   }
+}
+
+void FloatToGrayScalar(const float* src, uchar* dst, const int& count)
+{
+   for (int x = 0; x < count; x++)
+   {
+      const float v = std::nearbyint(src[x]);
+      dst[x] = v <= 0 ? 0 : (v >= 255 ? 255 : (uchar)v);
+   }
+}
+
+void RecursiveScalar(const float* in, const float* p1, const float* p2, const float* p3, const float c[4], float* out, const int& count)
+{
+   for (int x = 0; x < count; x++)
+   {
+      out[x] = c[0] * in[x] + c[1] * p1[x] + c[2] * p2[x] + c[3] * p3[x];
+   }
+}
+
+void HistogramScalar(quint16* hist, const quint16* add, const quint16* remove, const int& count)
+{
+   for (int i = 0; i < count; i++)
+   {
+      hist[i] = (quint16)(hist[i] + add[i] - remove[i]);
+   }
+}
+
+#ifdef CELLLENGTH_X86
+
+//---------------------------------------------------------------------------
+// SSE4.1, 16 pixels per iteration
+//---------------------------------------------------------------------------
+
+//memory order of a QRgb is b,g,r,a so the byte weights are 5,16,11,0. maddubs
+//gives b*5 + g*16 and r*11 per pixel, madd folds those into one dword.
+TARGET_SSE41 inline __m128i GrayDwordsSse(const QRgb* src)
+{
+   const __m128i weights = _mm_set1_epi32(0x000B1005);
+   const __m128i ones = _mm_set1_epi16(1);
+   const __m128i px = _mm_loadu_si128((const __m128i*)src);
+
+   return _mm_srli_epi32(_mm_madd_epi16(_mm_maddubs_epi16(px, weights), ones), 5);
+}
+
+TARGET_SSE41 void ArgbToGraySse(const QRgb* src, uchar* dst, const int& count)
+{
+   int x = 0;
+
+   for (; x + 16 <= count; x += 16)
+   {
+      const __m128i lo = _mm_packus_epi32(GrayDwordsSse(src + x), GrayDwordsSse(src + x + 4));
+      const __m128i hi = _mm_packus_epi32(GrayDwordsSse(src + x + 8), GrayDwordsSse(src + x + 12));
+      _mm_storeu_si128((__m128i*)(dst + x), _mm_packus_epi16(lo, hi));
+   }
+
+   ArgbToGrayScalar(src + x, dst + x, count - x);
+}
+
+//gray > t is the same as max(gray, t + 1) == gray for unsigned bytes
+TARGET_SSE41 inline __m128i MaskSse(const uchar* src, const __m128i& threshPlusOne)
+{
+   const __m128i g = _mm_loadu_si128((const __m128i*)src);
+   return _mm_cmpeq_epi8(_mm_max_epu8(g, threshPlusOne), g);
+}
+
+TARGET_SSE41 void GrayToMaskSse(const uchar* src, uchar* dst, const int& count, const int& threshVal)
+{
+   const __m128i t = _mm_set1_epi8((char)(threshVal + 1));
+   int x = 0;
+
+   for (; x + 16 <= count; x += 16)
+   {
+      _mm_storeu_si128((__m128i*)(dst + x), MaskSse(src + x, t));
+   }
+
+   GrayToMaskScalar(src + x, dst + x, count - x, threshVal);
+}
+
+//same max trick on unsigned words, the 0xffff/0 words then saturate down to
+//0xff/0 bytes when two registers get packed together
+TARGET_SSE41 void Gray16ToMaskSse(const quint16* src, uchar* dst, const int& count, const int& threshVal)
+{
+   const __m128i t = _mm_set1_epi16((short)(threshVal + 1));
+   int x = 0;
+
+   for (; x + 16 <= count; x += 16)
+   {
+      const __m128i a = _mm_loadu_si128((const __m128i*)(src + x));
+      const __m128i b = _mm_loadu_si128((const __m128i*)(src + x + 8));
+      const __m128i maskA = _mm_cmpeq_epi16(_mm_max_epu16(a, t), a);
+      const __m128i maskB = _mm_cmpeq_epi16(_mm_max_epu16(b, t), b);
+      _mm_storeu_si128((__m128i*)(dst + x), _mm_packs_epi16(maskA, maskB));
+   }
+
+   Gray16ToMaskScalar(src + x, dst + x, count - x, threshVal);
+}
+
+TARGET_SSE41 void GrayToBitMaskSse(const uchar* src, uchar* dst, const int& count, const int& threshVal)
+{
+   const __m128i t = _mm_set1_epi8((char)(threshVal + 1));
+   int x = 0;
+
+   for (; x + 16 <= count; x += 16)
+   {
+      const quint16 bits = (quint16)_mm_movemask_epi8(MaskSse(src + x, t));
+      std::memcpy(dst + (x >> 3), &bits, sizeof(bits));
+   }
+
+   GrayToBitMaskScalar(src + x, dst + (x >> 3), count - x, threshVal);
+}
+
+TARGET_SSE41 void ArgbThresholdSse(const QRgb* src, QRgb* dst, const int& count, const int& threshVal)
+{
+   const __m128i t = _mm_set1_epi32(threshVal);
+   int x = 0;
+
+   for (; x + 4 <= count; x += 4)
+   {
+      _mm_storeu_si128((__m128i*)(dst + x), _mm_cmpgt_epi32(GrayDwordsSse(src + x), t));
+   }
+
+   ArgbThresholdScalar(src + x, dst + x, count - x, threshVal);
+}
+
+TARGET_SSE41 void MinSse(const uchar* a, const uchar* b, uchar* dst, const int& count)
+{
+   int x = 0;
+
+   for (; x + 16 <= count; x += 16)
+   {
+      _mm_storeu_si128((__m128i*)(dst + x), _mm_min_epu8(_mm_loadu_si128((const __m128i*)(a + x)), _mm_loadu_si128((const __m128i*)(b + x))));
+   }
+
+   MinScalar(a + x, b + x, dst + x, count - x);
+}
+
+TARGET_SSE41 void MaxSse(const uchar* a, const uchar* b, uchar* dst, const int& count)
+{
+   int x = 0;
+
+   for (; x + 16 <= count; x += 16)
+   {
+      _mm_storeu_si128((__m128i*)(dst + x), _mm_max_epu8(_mm_loadu_si128((const __m128i*)(a + x)), _mm_loadu_si128((const __m128i*)(b + x))));
+   }
+
+   MaxScalar(a + x, b + x, dst + x, count - x);
+}
+
+TARGET_SSE41 void SubtractSse(const uchar* a, const uchar* b, uchar* dst, const int& count)
+{
+   int x = 0;
+
+   for (; x + 16 <= count; x += 16)
+   {
+      _mm_storeu_si128((__m128i*)(dst + x), _mm_subs_epu8(_mm_loadu_si128((const __m128i*)(a + x)), _mm_loadu_si128((const __m128i*)(b + x))));
+   }
+
+   SubtractScalar(a + x, b + x, dst + x, count - x);
+}
+
+//4 pixels widened to floats, scaled and rounded back to dwords
+TARGET_SSE41 inline __m128i GainDwordsSse(const uchar* src, const float* gain)
+{
+   int bytes = 0;
+   std::memcpy(&bytes, src, sizeof(bytes));
+
+   const __m128 v = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes)));
+   return _mm_cvtps_epi32(_mm_mul_ps(v, _mm_loadu_ps(gain)));
+}
+
+TARGET_SSE41 void GainSse(const uchar* src, const float* gain, uchar* dst, const int& count)
+{
+   int x = 0;
+
+   for (; x + 16 <= count; x += 16)
+   {
+      //the saturating packs do the clamp to 0..255
+      const __m128i lo = _mm_packus_epi32(GainDwordsSse(src + x, gain + x), GainDwordsSse(src + x + 4, gain + x + 4));
+      const __m128i hi = _mm_packus_epi32(GainDwordsSse(src + x + 8, gain + x + 8), GainDwordsSse(src + x + 12, gain + x + 12));
+      _mm_storeu_si128((__m128i*)(dst + x), _mm_packus_epi16(lo, hi));
+   }
+
+   GainScalar(src + x, gain + x, dst + x, count - x);
+}
+
+TARGET_SSE41 void AccumulateSse(const uchar* src, const float& weight, float* acc, const int& count)
+{
+   const __m128 w = _mm_set1_ps(weight);
+   int x = 0;
+
+   for (; x + 4 <= count; x += 4)
+   {
+      int bytes = 0;
+      std::memcpy(&bytes, src + x, sizeof(bytes));
+
+      const __m128 v = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes)));
+      _mm_storeu_ps(acc + x, _mm_add_ps(_mm_loadu_ps(acc + x), _mm_mul_ps(v, w)));
+   }
+
+   AccumulateScalar(src + x, weight, acc + x, count - x);
+}
+
+TARGET_SSE41 void GrayToFloatSse(const uchar* src, float* dst, const int& count)
+{
+   int x = 0;
+
+   for (; x + 4 <= count; x += 4)
+   {
+      int bytes = 0;
+      std::memcpy(&bytes, src + x, sizeof(bytes));
+      _mm_storeu_ps(dst + x, _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(bytes))));
+   }
+
+   GrayToFloatScalar(src + x, dst + x, count - x);
+}
+
+TARGET_SSE41 void FloatToGraySse(const float* src, uchar* dst, const int& count)
+{
+   int x = 0;
+
+   for (; x + 16 <= count; x += 16)
+   {
+      const __m128i lo = _mm_packus_epi32(_mm_cvtps_epi32(_mm_loadu_ps(src + x)), _mm_cvtps_epi32(_mm_loadu_ps(src + x + 4)));
+      const __m128i hi = _mm_packus_epi32(_mm_cvtps_epi32(_mm_loadu_ps(src + x + 8)), _mm_cvtps_epi32(_mm_loadu_ps(src + x + 12)));
+      _mm_storeu_si128((__m128i*)(dst + x), _mm_packus_epi16(lo, hi));
+   }
+
+   FloatToGrayScalar(src + x, dst + x, count - x);
+}
+
+TARGET_SSE41 void RecursiveSse(const float* in, const float* p1, const float* p2, const float* p3, const float c[4], float* out, const int& count)
+{
+   const __m128 c0 = _mm_set1_ps(c[0]);
+   const __m128 c1 = _mm_set1_ps(c[1]);
+   const __m128 c2 = _mm_set1_ps(c[2]);
+   const __m128 c3 = _mm_set1_ps(c[3]);
+   int x = 0;
+
+   for (; x + 4 <= count; x += 4)
+   {
+      __m128 v = _mm_add_ps(_mm_mul_ps(c0, _mm_loadu_ps(in + x)), _mm_mul_ps(c1, _mm_loadu_ps(p1 + x)));
+      v = _mm_add_ps(v, _mm_mul_ps(c2, _mm_loadu_ps(p2 + x)));
+      v = _mm_add_ps(v, _mm_mul_ps(c3, _mm_loadu_ps(p3 + x)));
+      _mm_storeu_ps(out + x, v);
+   }
+
+   RecursiveScalar(in + x, p1 + x, p2 + x, p3 + x, c, out + x, count - x);
+}
+
+TARGET_SSE41 void HistogramSse(quint16* hist, const quint16* add, const quint16* remove, const int& count)
+{
+   int i = 0;
+
+   for (; i + 8 <= count; i += 8)
+   {
+      const __m128i h = _mm_add_epi16(_mm_loadu_si128((const __m128i*)(hist + i)), _mm_loadu_si128((const __m128i*)(add + i)));
+      _mm_storeu_si128((__m128i*)(hist + i), _mm_sub_epi16(h, _mm_loadu_si128((const __m128i*)(remove + i))));
+   }
+
+   HistogramScalar(hist + i, add + i, remove + i, count - i);
+}
+
+//---------------------------------------------------------------------------
+// AVX2, 32 pixels per iteration
+//---------------------------------------------------------------------------
+
+TARGET_AVX2 inline __m256i GrayDwordsAvx(const QRgb* src)
+{
+   const __m256i weights = _mm256_set1_epi32(0x000B1005);
+   const __m256i ones = _mm256_set1_epi16(1);
+   const __m256i px = _mm256_loadu_si256((const __m256i*)src);
+
+   return _mm256_srli_epi32(_mm256_madd_epi16(_mm256_maddubs_epi16(px, weights), ones), 5);
+}
+
+TARGET_AVX2 void ArgbToGrayAvx(const QRgb* src, uchar* dst, const int& count)
+{
+   //the packs work per 128 bit lane, this puts the dwords back in pixel order
+   const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+   int x = 0;
+
+   for (; x + 32 <= count; x += 32)
+   {
+      const __m256i ab = _mm256_packus_epi32(GrayDwordsAvx(src + x), GrayDwordsAvx(src + x + 8));
+      const __m256i cd = _mm256_packus_epi32(GrayDwordsAvx(src + x + 16), GrayDwordsAvx(src + x + 24));
+      const __m256i bytes = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(ab, cd), order);
+      _mm256_storeu_si256((__m256i*)(dst + x), bytes);
+   }
+
+   ArgbToGraySse(src + x, dst + x, count - x);
+}
+
+TARGET_AVX2 inline __m256i MaskAvx(const uchar* src, const __m256i& threshPlusOne)
+{
+   const __m256i g = _mm256_loadu_si256((const __m256i*)src);
+   return _mm256_cmpeq_epi8(_mm256_max_epu8(g, threshPlusOne), g);
+}
+
+TARGET_AVX2 void GrayToMaskAvx(const uchar* src, uchar* dst, const int& count, const int& threshVal)
+{
+   const __m256i t = _mm256_set1_epi8((char)(threshVal + 1));
+   int x = 0;
+
+   for (; x + 32 <= count; x += 32)
+   {
+      _mm256_storeu_si256((__m256i*)(dst + x), MaskAvx(src + x, t));
+   }
+
+   GrayToMaskSse(src + x, dst + x, count - x, threshVal);
+}
+
+TARGET_AVX2 void Gray16ToMaskAvx(const quint16* src, uchar* dst, const int& count, const int& threshVal)
+{
+   const __m256i t = _mm256_set1_epi16((short)(threshVal + 1));
+   int x = 0;
+
+   for (; x + 32 <= count; x += 32)
+   {
+      const __m256i a = _mm256_loadu_si256((const __m256i*)(src + x));
+      const __m256i b = _mm256_loadu_si256((const __m256i*)(src + x + 16));
+      const __m256i maskA = _mm256_cmpeq_epi16(_mm256_max_epu16(a, t), a);
+      const __m256i maskB = _mm256_cmpeq_epi16(_mm256_max_epu16(b, t), b);
+
+      //the pack works per 128 bit lane, the permute puts the quarters back in order
+      _mm256_storeu_si256((__m256i*)(dst + x), _mm256_permute4x64_epi64(_mm256_packs_epi16(maskA, maskB), 0xd8));
+   }
+
+   Gray16ToMaskSse(src + x, dst + x, count - x, threshVal);
+}
+
+TARGET_AVX2 void GrayToBitMaskAvx(const uchar* src, uchar* dst, const int& count, const int& threshVal)
+{
+   const __m256i t = _mm256_set1_epi8((char)(threshVal + 1));
+   int x = 0;
+
+   for (; x + 32 <= count; x += 32)
+   {
+      const quint32 bits = (quint32)_mm256_movemask_epi8(MaskAvx(src + x, t));
+      std::memcpy(dst + (x >> 3), &bits, sizeof(bits));
+   }
+
+   GrayToBitMaskSse(src + x, dst + (x >> 3), count - x, threshVal);
+}
+
+TARGET_AVX2 void ArgbThresholdAvx(const QRgb* src, QRgb* dst, const int& count, const int& threshVal)
+{
+   const __m256i t = _mm256_set1_epi32(threshVal);
+   int x = 0;
+
+   for (; x + 8 <= count; x += 8)
+   {
+      _mm256_storeu_si256((__m256i*)(dst + x), _mm256_cmpgt_epi32(GrayDwordsAvx(src + x), t));
+   }
+
+   ArgbThresholdScalar(src + x, dst + x, count - x, threshVal);
+}
+
+TARGET_AVX2 void MinAvx(const uchar* a, const uchar* b, uchar* dst, const int& count)
+{
+   int x = 0;
+
+   for (; x + 32 <= count; x += 32)
+   {
+      _mm256_storeu_si256((__m256i*)(dst + x), _mm256_min_epu8(_mm256_loadu_si256((const __m256i*)(a + x)), _mm256_loadu_si256((const __m256i*)(b + x))));
+   }
+
+   MinSse(a + x, b + x, dst + x, count - x);
+}
+
+TARGET_AVX2 void MaxAvx(const uchar* a, const uchar* b, uchar* dst, const int& count)
+{
+   int x = 0;
+
+   for (; x + 32 <= count; x += 32)
+   {
+      _mm256_storeu_si256((__m256i*)(dst + x), _mm256_max_epu8(_mm256_loadu_si256((const __m256i*)(a + x)), _mm256_loadu_si256((const __m256i*)(b + x))));
+   }
+
+   MaxSse(a + x, b + x, dst + x, count - x);
+}
+
+TARGET_AVX2 void SubtractAvx(const uchar* a, const uchar* b, uchar* dst, const int& count)
+{
+   int x = 0;
+
+   for (; x + 32 <= count; x += 32)
+   {
+      _mm256_storeu_si256((__m256i*)(dst + x), _mm256_subs_epu8(_mm256_loadu_si256((const __m256i*)(a + x)), _mm256_loadu_si256((const __m256i*)(b + x))));
+   }
+
+   SubtractSse(a + x, b + x, dst + x, count - x);
+}
+
+TARGET_AVX2 inline __m256i GainDwordsAvx(const uchar* src, const float* gain)
+{
+   const __m256 v = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)src)));
+   return _mm256_cvtps_epi32(_mm256_mul_ps(v, _mm256_loadu_ps(gain)));
+}
+
+TARGET_AVX2 void GainAvx(const uchar* src, const float* gain, uchar* dst, const int& count)
+{
+   const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+   int x = 0;
+
+   for (; x + 32 <= count; x += 32)
+   {
+      const __m256i ab = _mm256_packus_epi32(GainDwordsAvx(src + x, gain + x), GainDwordsAvx(src + x + 8, gain + x + 8));
+      const __m256i cd = _mm256_packus_epi32(GainDwordsAvx(src + x + 16, gain + x + 16), GainDwordsAvx(src + x + 24, gain + x + 24));
+      const __m256i bytes = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(ab, cd), order);
+      _mm256_storeu_si256((__m256i*)(dst + x), bytes);
+   }
+
+   GainSse(src + x, gain + x, dst + x, count - x);
+}
+
+TARGET_AVX2 void AccumulateAvx(const uchar* src, const float& weight, float* acc, const int& count)
+{
+   const __m256 w = _mm256_set1_ps(weight);
+   int x = 0;
+
+   for (; x + 8 <= count; x += 8)
+   {
+      const __m256 v = _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(src + x))));
+      _mm256_storeu_ps(acc + x, _mm256_add_ps(_mm256_loadu_ps(acc + x), _mm256_mul_ps(v, w)));
+   }
+
+   AccumulateSse(src + x, weight, acc + x, count - x);
+}
+
+TARGET_AVX2 void GrayToFloatAvx(const uchar* src, float* dst, const int& count)
+{
+   int x = 0;
+
+   for (; x + 8 <= count; x += 8)
+   {
+      _mm256_storeu_ps(dst + x, _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(src + x)))));
+   }
+
+   GrayToFloatSse(src + x, dst + x, count - x);
+}
+
+TARGET_AVX2 void FloatToGrayAvx(const float* src, uchar* dst, const int& count)
+{
+   const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+   int x = 0;
+
+   for (; x + 32 <= count; x += 32)
+   {
+      const __m256i ab = _mm256_packus_epi32(_mm256_cvtps_epi32(_mm256_loadu_ps(src + x)), _mm256_cvtps_epi32(_mm256_loadu_ps(src + x + 8)));
+      const __m256i cd = _mm256_packus_epi32(_mm256_cvtps_epi32(_mm256_loadu_ps(src + x + 16)), _mm256_cvtps_epi32(_mm256_loadu_ps(src + x + 24)));
+      _mm256_storeu_si256((__m256i*)(dst + x), _mm256_permutevar8x32_epi32(_mm256_packus_epi16(ab, cd), order));
+   }
+
+   FloatToGraySse(src + x, dst + x, count - x);
+}
+
+TARGET_AVX2 void RecursiveAvx(const float* in, const float* p1, const float* p2, const float* p3, const float c[4], float* out, const int& count)
+{
+   const __m256 c0 = _mm256_set1_ps(c[0]);
+   const __m256 c1 = _mm256_set1_ps(c[1]);
+   const __m256 c2 = _mm256_set1_ps(c[2]);
+   const __m256 c3 = _mm256_set1_ps(c[3]);
+   int x = 0;
+
+   for (; x + 8 <= count; x += 8)
+   {
+      __m256 v = _mm256_add_ps(_mm256_mul_ps(c0, _mm256_loadu_ps(in + x)), _mm256_mul_ps(c1, _mm256_loadu_ps(p1 + x)));
+      v = _mm256_add_ps(v, _mm256_mul_ps(c2, _mm256_loadu_ps(p2 + x)));
+      v = _mm256_add_ps(v, _mm256_mul_ps(c3, _mm256_loadu_ps(p3 + x)));
+      _mm256_storeu_ps(out + x, v);
+   }
+
+   RecursiveSse(in + x, p1 + x, p2 + x, p3 + x, c, out + x, count - x);
+}
+
+TARGET_AVX2 void HistogramAvx(quint16* hist, const quint16* add, const quint16* remove, const int& count)
+{
+   int i = 0;
+
+   for (; i + 16 <= count; i += 16)
+   {
+      const __m256i h = _mm256_add_epi16(_mm256_loadu_si256((const __m256i*)(hist + i)), _mm256_loadu_si256((const __m256i*)(add + i)));
+      _mm256_storeu_si256((__m256i*)(hist + i), _mm256_sub_epi16(h, _mm256_loadu_si256((const __m256i*)(remove + i))));
+   }
+
+   HistogramSse(hist + i, add + i, remove + i, count - i);
+}
+
+#endif
+
+//the byte compare tricks above only work for thresholds that fit in a byte,
+//anything outside that is all white or all black
+bool FillsWholeRow(const int& threshVal)
+{
+   return threshVal < 0 || threshVal >= MAX_THRESH_VAL;
+}
+
+QImage As32Bit(const QImage& img)
+{
+   if (img.format() == QImage::Format_RGB32 || img.format() == QImage::Format_ARGB32)
+   {
+      return img;
+   }
+
+   return img.convertToFormat(QImage::Format_ARGB32);
+}
+
+}
+
+//---------------------------------------------------------------------------
+// dispatch
+//---------------------------------------------------------------------------
+
+CpuLevel SimdKernels::DetectCpuLevel()
+{
+   static const CpuLevel detected = Detect();
+   return detected;
+}
+
+CpuLevel SimdKernels::ActiveCpuLevel()
+{
+   return Active();
+}
+
+CpuLevel SimdKernels::SetCpuLevel(const CpuLevel& level)
+{
+   const CpuLevel clamped = Clamp(level);
+   Level().store((int)clamped, std::memory_order_relaxed);
+   return clamped;
+}
+
+const char* SimdKernels::CpuLevelName(const CpuLevel& level)
+{
+   switch (level)
+   {
+   case CpuLevel::AVX2:
+      return "AVX2";
+   case CpuLevel::SSE41:
+      return "SSE4.1";
+   default:
+      return "Scalar";
+   }
+}
+
+void SimdKernels::ArgbToGrayRow(const QRgb* src, uchar* dst, const int& count)
+{
+#ifdef CELLLENGTH_X86
+   switch (Active())
+   {
+   case CpuLevel::AVX2:
+      ArgbToGrayAvx(src, dst, count);
+      return;
+   case CpuLevel::SSE41:
+      ArgbToGraySse(src, dst, count);
+      return;
+   default:
+      break;
+   }
+#endif
+   ArgbToGrayScalar(src, dst, count);
+}
+
+void SimdKernels::GrayToMaskRow(const uchar* src, uchar* dst, const int& count, const int& threshVal)
+{
+   if (FillsWholeRow(threshVal))
+   {
+      std::memset(dst, threshVal < 0 ? 255 : 0, count);
+      return;
+   }
+
+#ifdef CELLLENGTH_X86
+   switch (Active())
+   {
+   case CpuLevel::AVX2:
+      GrayToMaskAvx(src, dst, count, threshVal);
+      return;
+   case CpuLevel::SSE41:
+      GrayToMaskSse(src, dst, count, threshVal);
+      return;
+   default:
+      break;
+   }
+#endif
+   GrayToMaskScalar(src, dst, count, threshVal);
+}
+
+void SimdKernels::Gray16ToMaskRow(const quint16* src, uchar* dst, const int& count, const int& threshVal)
+{
+   if (threshVal < 0 || threshVal >= MAX_GRAY16_VAL)
+   {
+      std::memset(dst, threshVal < 0 ? 255 : 0, count);
+      return;
+   }
+
+#ifdef CELLLENGTH_X86
+   switch (Active())
+   {
+   case CpuLevel::AVX2:
+      Gray16ToMaskAvx(src, dst, count, threshVal);
+      return;
+   case CpuLevel::SSE41:
+      Gray16ToMaskSse(src, dst, count, threshVal);
+      return;
+   default:
+      break;
+   }
+#endif
+   Gray16ToMaskScalar(src, dst, count, threshVal);
+}
+
+void SimdKernels::GrayToBitMaskRow(const uchar* src, uchar* dst, const int& count, const int& threshVal)
+{
+   if (FillsWholeRow(threshVal))
+   {
+      //only the bits that belong to the row get set, the padding stays zero
+      std::memset(dst, 0, (count + 7) / 8);
+
+      if (threshVal < 0)
+      {
+         std::memset(dst, 0xff, count / 8);
+
+         if (count % 8 != 0)
+         {
+            dst[count / 8] = (uchar)((1 << (count % 8)) - 1);
+         }
+      }
+      return;
+   }
+
+#ifdef CELLLENGTH_X86
+   switch (Active())
+   {
+   case CpuLevel::AVX2:
+      GrayToBitMaskAvx(src, dst, count, threshVal);
+      return;
+   case CpuLevel::SSE41:
+      GrayToBitMaskSse(src, dst, count, threshVal);
+      return;
+   default:
+      break;
+   }
+#endif
+   GrayToBitMaskScalar(src, dst, count, threshVal);
+}
+
+void SimdKernels::ArgbThresholdRow(const QRgb* src, QRgb* dst, const int& count, const int& threshVal)
+{
+#ifdef CELLLENGTH_X86
+   switch (Active())
+   {
+   case CpuLevel::AVX2:
+      ArgbThresholdAvx(src, dst, count, threshVal);
+      return;
+   case CpuLevel::SSE41:
+      ArgbThresholdSse(src, dst, count, threshVal);
+      return;
+   default:
+      break;
+   }
+#endif
+   ArgbThresholdScalar(src, dst, count, threshVal);
+}
+
+void SimdKernels::MinRow(const uchar* a, const uchar* b, uchar* dst, const int& count)
+{
+#ifdef CELLLENGTH_X86
+   switch (Active())
+   {
+   case CpuLevel::AVX2:
+      MinAvx(a, b, dst, count);
+      return;
+   case CpuLevel::SSE41:
+      MinSse(a, b, dst, count);
+      return;
+   default:
+      break;
+   }
+#endif
+   MinScalar(a, b, dst, count);
+}
+
+void SimdKernels::MaxRow(const uchar* a, const uchar* b, uchar* dst, const int& count)
+{
+#ifdef CELLLENGTH_X86
+   switch (Active())
+   {
+   case CpuLevel::AVX2:
+      MaxAvx(a, b, dst, count);
+      return;
+   case CpuLevel::SSE41:
+      MaxSse(a, b, dst, count);
+      return;
+   default:
+      break;
+   }
+#endif
+   MaxScalar(a, b, dst, count);
+}
+
+void SimdKernels::SubtractRow(const uchar* a, const uchar* b, uchar* dst, const int& count)
+{
+#ifdef CELLLENGTH_X86
+   switch (Active())
+   {
+   case CpuLevel::AVX2:
+      SubtractAvx(a, b, dst, count);
+      return;
+   case CpuLevel::SSE41:
+      SubtractSse(a, b, dst, count);
+      return;
+   default:
+      break;
+   }
+#endif
+   SubtractScalar(a, b, dst, count);
+}
+
+void SimdKernels::GainRow(const uchar* src, const float* gain, uchar* dst, const int& count)
+{
+#ifdef CELLLENGTH_X86
+   switch (Active())
+   {
+   case CpuLevel::AVX2:
+      GainAvx(src, gain, dst, count);
+      return;
+   case CpuLevel::SSE41:
+      GainSse(src, gain, dst, count);
+      return;
+   default:
+      break;
+   }
+#endif
+   GainScalar(src, gain, dst, count);
+}
+
+void SimdKernels::AccumulateRow(const uchar* src, const float& weight, float* acc, const int& count)
+{
+#ifdef CELLLENGTH_X86
+   switch (Active())
+   {
+   case CpuLevel::AVX2:
+      AccumulateAvx(src, weight, acc, count);
+      return;
+   case CpuLevel::SSE41:
+      AccumulateSse(src, weight, acc, count);
+      return;
+   default:
+      break;
+   }
+#endif
+   AccumulateScalar(src, weight, acc, count);
+}
+
+void SimdKernels::GrayToFloatRow(const uchar* src, float* dst, const int& count)
+{
+#ifdef CELLLENGTH_X86
+   switch (Active())
+   {
+   case CpuLevel::AVX2:
+      GrayToFloatAvx(src, dst, count);
+      return;
+   case CpuLevel::SSE41:
+      GrayToFloatSse(src, dst, count);
+      return;
+   default:
+      break;
+   }
+#endif
+   GrayToFloatScalar(src, dst, count);
+}
+
+void SimdKernels::FloatToGrayRow(const float* src, uchar* dst, const int& count)
+{
+#ifdef CELLLENGTH_X86
+   switch (Active())
+   {
+   case CpuLevel::AVX2:
+      FloatToGrayAvx(src, dst, count);
+      return;
+   case CpuLevel::SSE41:
+      FloatToGraySse(src, dst, count);
+      return;
+   default:
+      break;
+   }
+#endif
+   FloatToGrayScalar(src, dst, count);
+}
+
+void SimdKernels::RecursiveRow(const float* in, const float* p1, const float* p2, const float* p3, const float c[4], float* out, const int& count)
+{
+#ifdef CELLLENGTH_X86
+   switch (Active())
+   {
+   case CpuLevel::AVX2:
+      RecursiveAvx(in, p1, p2, p3, c, out, count);
+      return;
+   case CpuLevel::SSE41:
+      RecursiveSse(in, p1, p2, p3, c, out, count);
+      return;
+   default:
+      break;
+   }
+#endif
+   RecursiveScalar(in, p1, p2, p3, c, out, count);
+}
+
+void SimdKernels::HistogramUpdate(quint16* hist, const quint16* add, const quint16* remove, const int& count)
+{
+#ifdef CELLLENGTH_X86
+   switch (Active())
+   {
+   case CpuLevel::AVX2:
+      HistogramAvx(hist, add, remove, count);
+      return;
+   case CpuLevel::SSE41:
+      HistogramSse(hist, add, remove, count);
+      return;
+   default:
+      break;
+   }
+#endif
+   HistogramScalar(hist, add, remove, count);
+}
+
+//---------------------------------------------------------------------------
+// whole images
+//---------------------------------------------------------------------------
+
+QImage SimdKernels::ToGray(const QImage& img)
+{
+   if (img.format() == QImage::Format_Grayscale8)
+   {
+      return img;
+   }
+
+   const QImage src = As32Bit(img);
+   QImage gray(src.size(), QImage::Format_Grayscale8);
+
+   //grab the raw pointers up front, scanLine() on a shared image would detach
+   //from inside the worker threads
+   const uchar* srcBits = src.constBits();
+   const int srcStride = src.bytesPerLine();
+   uchar* dstBits = gray.bits();
+   const int dstStride = gray.bytesPerLine();
+   const int width = src.width();
+
+   Parallel::ForRows(src.height(), width, [=](const int& begin, const int& end) {
+      for (int y = begin; y < end; y++)
+      {
+         ArgbToGrayRow((const QRgb*)(srcBits + (qint64)y * srcStride), dstBits + (qint64)y * dstStride, width);
+      }
+   });
+
+   return gray;
+}
+
+QImage SimdKernels::ToGray16(const QImage& img)
+{
+   if (img.format() == QImage::Format_Grayscale16)
+   {
+      return img;
+   }
+
+   const QImage gray = ToGray(img);
+   QImage deep(gray.size(), QImage::Format_Grayscale16);
+
+   const uchar* srcBits = gray.constBits();
+   const int srcStride = gray.bytesPerLine();
+   uchar* dstBits = deep.bits();
+   const int dstStride = deep.bytesPerLine();
+   const int width = gray.width();
+
+   Parallel::ForRows(gray.height(), width, [=](const int& begin, const int& end) {
+      for (int y = begin; y < end; y++)
+      {
+         const uchar* in = srcBits + (qint64)y * srcStride;
+         quint16* out = (quint16*)(dstBits + (qint64)y * dstStride);
+
+         for (int x = 0; x < width; x++)
+         {
+            out[x] = in[x] * 257;
+         }
+      }
+   });
+
+   return deep;
+}
+
+QImage SimdKernels::ThresholdMask(const QImage& img, const int& threshVal)
+{
+   if (img.format() == QImage::Format_Grayscale16)
+   {
+      QImage mask(img.size(), QImage::Format_Grayscale8);
+
+      const uchar* srcBits = img.constBits();
+      const int srcStride = img.bytesPerLine();
+      uchar* dstBits = mask.bits();
+      const int dstStride = mask.bytesPerLine();
+      const int width = img.width();
+
+      Parallel::ForRows(img.height(), width, [=](const int& begin, const int& end) {
+         for (int y = begin; y < end; y++)
+         {
+            Gray16ToMaskRow((const quint16*)(srcBits + (qint64)y * srcStride), dstBits + (qint64)y * dstStride, width, threshVal);
+         }
+      });
+
+      return mask;
+   }
+
+   const QImage gray = ToGray(img);
+   QImage mask(gray.size(), QImage::Format_Grayscale8);
+
+   const uchar* srcBits = gray.constBits();
+   const int srcStride = gray.bytesPerLine();
+   uchar* dstBits = mask.bits();
+   const int dstStride = mask.bytesPerLine();
+   const int width = gray.width();
+
+   Parallel::ForRows(gray.height(), width, [=](const int& begin, const int& end) {
+      for (int y = begin; y < end; y++)
+      {
+         GrayToMaskRow(srcBits + (qint64)y * srcStride, dstBits + (qint64)y * dstStride, width, threshVal);
+      }
+   });
+
+   return mask;
+}
+
+QImage SimdKernels::ThresholdBitMask(const QImage& img, const int& threshVal)
+{
+   const QImage gray = ToGray(img);
+   QImage mask(gray.size(), QImage::Format_MonoLSB);
+   mask.setColorTable({ QColor(Qt::black).rgb(), QColor(Qt::white).rgb() });
+
+   const uchar* srcBits = gray.constBits();
+   const int srcStride = gray.bytesPerLine();
+   uchar* dstBits = mask.bits();
+   const int dstStride = mask.bytesPerLine();
+   const int width = gray.width();
+
+   Parallel::ForRows(gray.height(), width, [=](const int& begin, const int& end) {
+      for (int y = begin; y < end; y++)
+      {
+         GrayToBitMaskRow(srcBits + (qint64)y * srcStride, dstBits + (qint64)y * dstStride, width, threshVal);
+      }
+   });
+
+   return mask;
+}
+
+QImage SimdKernels::Threshold(const QImage& img, const int& threshVal)
+{
+   //same as the reference, a zero threshold leaves the picture alone
+   if (threshVal == 0)
+   {
+      return img;
+   }
+
+   if (img.format() == QImage::Format_Grayscale16)
+   {
+      return ThresholdMask(img, threshVal).convertToFormat(QImage::Format_ARGB32);
+   }
+
+   const QImage src = As32Bit(img);
+   QImage returnImg(src.size(), src.format());
+
+   const uchar* srcBits = src.constBits();
+   const int srcStride = src.bytesPerLine();
+   uchar* dstBits = returnImg.bits();
+   const int dstStride = returnImg.bytesPerLine();
+   const int width = src.width();
+
+   Parallel::ForRows(src.height(), width, [=](const int& begin, const int& end) {
+      for (int y = begin; y < end; y++)
+      {
+         ArgbThresholdRow((const QRgb*)(srcBits + (qint64)y * srcStride), (QRgb*)(dstBits + (qint64)y * dstStride), width, threshVal);
+      }
+   });
+
+   return returnImg;
+}
+
+QImage SimdKernels::Transpose(const QImage& img)
+{
+   const QImage gray = ToGray(img);
+   QImage out(gray.height(), gray.width(), QImage::Format_Grayscale8);
+   const uchar* srcBits = gray.constBits();
+   const int srcStride = gray.bytesPerLine();
+   uchar* dstBits = out.bits();
+   const int dstStride = out.bytesPerLine();
+   const int outWidth = out.width();
+
+   Parallel::ForRows(out.height(), outWidth, [=](const int& begin, const int& end) {
+      for (int y0 = begin; y0 < end; y0 += TRANSPOSE_TILE)
+      {
+         const int y1 = qMin(end, y0 + TRANSPOSE_TILE);
+
+         for (int x0 = 0; x0 < outWidth; x0 += TRANSPOSE_TILE)
+         {
+            const int x1 = qMin(outWidth, x0 + TRANSPOSE_TILE);
+
+            for (int y = y0; y < y1; y++)
+            {
+               uchar* line = dstBits + (qint64)y * dstStride;
+
+               for (int x = x0; x < x1; x++)
+               {
+                  line[x] = srcBits[(qint64)x * srcStride + y];
+               }
+            }
+         }
+      }
+   });
+
+   return out;
+}
@@ -0,0 +1,104 @@
+#ifndef SimdKernels_h
+#define SimdKernels_h
+
+#include <QImage>
+
+//Vectorised replacements for the per pixel qGray()/pixel() loops in ImageOps.
+//Every kernel has a scalar, SSE4.1 and AVX2 version and the best one the CPU
+//supports gets picked the first time any of them is called. The results are
+//bit for bit identical to qGray() (r*11 + g*16 + b*5) / 32 so these can stand
+//in for ImageOps::Threshold anywhere.
+namespace SimdKernels
+{
+
+enum class CpuLevel
+{
+   Scalar = 0,
+   SSE41 = 1,
+   AVX2 = 2
+};
+
+//what the hardware (and OS) can actually run
+CpuLevel DetectCpuLevel();
+
+//what the kernels are currently dispatching to. Defaults to DetectCpuLevel(),
+//can be lowered with the CELLLENGTH_SIMD environment variable (scalar, sse41, avx2)
+CpuLevel ActiveCpuLevel();
+
+//forces a dispatch level, clamped to what the CPU supports. Returns the level
+//that ended up active. Only meant for benchmarks and tests.
+CpuLevel SetCpuLevel(const CpuLevel& level);
+
+const char* CpuLevelName(const CpuLevel& level);
+
+//single row kernels
+void ArgbToGrayRow(const QRgb* src, uchar* dst, const int& count);
+
+void GrayToMaskRow(const uchar* src, uchar* dst, const int& count, const int& threshVal);
+
+//GrayToMaskRow for 16 bit gray, threshVal anywhere in 0..65535
+void Gray16ToMaskRow(const quint16* src, uchar* dst, const int& count, const int& threshVal);
+
+//packs 8 pixels per byte, least significant bit first (QImage::Format_MonoLSB layout)
+void GrayToBitMaskRow(const uchar* src, uchar* dst, const int& count, const int& threshVal);
+
+//fused gray + threshold straight into white/0 ARGB, which is what ImageOps::Threshold produces
+void ArgbThresholdRow(const QRgb* src, QRgb* dst, const int& count, const int& threshVal);
+
+//element wise min/max of two gray rows, the building block of the min/max filters
+void MinRow(const uchar* a, const uchar* b, uchar* dst, const int& count);
+
+void MaxRow(const uchar* a, const uchar* b, uchar* dst, const int& count);
+
+//a - b, clamped at 0
+void SubtractRow(const uchar* a, const uchar* b, uchar* dst, const int& count);
+
+//src * gain rounded to nearest (half to even) and clamped to 0..255
+void GainRow(const uchar* src, const float* gain, uchar* dst, const int& count);
+
+//float rows for the filters in Denoise. None of them fuse multiplies into adds,
+//so every dispatch level gives bit for bit the same answer.
+
+//acc += src * weight
+void AccumulateRow(const uchar* src, const float& weight, float* acc, const int& count);
+
+void GrayToFloatRow(const uchar* src, float* dst, const int& count);
+
+//rounded to nearest (half to even) and clamped to 0..255
+void FloatToGrayRow(const float* src, uchar* dst, const int& count);
+
+//out = c[0] * in + c[1] * p1 + c[2] * p2 + c[3] * p3, one step of a third
+//order recursive filter run down a set of columns at once
+void RecursiveRow(const float* in, const float* p1, const float* p2, const float* p3, const float c[4], float* out, const int& count);
+
+//hist += add - remove, for sliding histogram windows
+void HistogramUpdate(quint16* hist, const quint16* add, const quint16* remove, const int& count);
+
+//whole image versions, split over rows on the global thread pool for large frames
+
+//returns a Format_Grayscale8 image
+QImage ToGray(const QImage& img);
+
+//Format_Grayscale16 pictures as they are, anything else converted to 8 bit
+//gray and scaled up by 257 so 255 lands on 65535
+QImage ToGray16(const QImage& img);
+
+//gray > threshVal becomes 255, everything else 0. Format_Grayscale8 out,
+//anything else is converted to gray first. Format_Grayscale16 is compared as
+//it is, with threshVal in its own 0..65535 units.
+QImage ThresholdMask(const QImage& img, const int& threshVal);
+
+//same as ThresholdMask but packed into a Format_MonoLSB image (index 1 is white)
+QImage ThresholdBitMask(const QImage& img, const int& threshVal);
+
+//drop in replacement for ImageOps::Threshold. Format_Grayscale16 goes
+//through ThresholdMask, so threshVal is in 16 bit units for those.
+QImage Threshold(const QImage& img, const int& threshVal);
+
+//Format_Grayscale8 with x and y swapped, so a filter that only knows how to
+//run down columns can do the rows too
+QImage Transpose(const QImage& img);
+
+}
+
+#endif /* SimdKernels_h */
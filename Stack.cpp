@@ -0,0 +1,527 @@
+#include "Stack.h"
+#include "BitDepth.h"
+#include "MaxTree.h"
+#include "Otsu.h"
+#include "Parallel.h"
+#include "ShapeFilter.h"
+#include "SimdKernels.h"
+
+#include <QColor>
+#include <QElapsedTimer>
+#include <QMap>
+#include <QSet>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+namespace
+{
+
+int PageCount(QImageReader& reader)
+{
+   //formats that can't tell give back 0
+   return qMax(1, reader.imageCount());
+}
+
+}
+
+Stack::FrameReader::FrameReader(const QStringList& paths)
+   : paths(paths)
+{
+   for (const auto& path : paths)
+   {
+      QImageReader header(path);
+      count += PageCount(header);
+   }
+}
+
+bool Stack::FrameReader::Next(QImage& img)
+{
+   while (true)
+   {
+      if (reader.isNull() || page + 1 >= pages)
+      {
+         if (file + 1 >= paths.count())
+         {
+            return false;
+         }
+
+         file++;
+         page = 0;
+         reader = QSharedPointer<QImageReader>(new QImageReader(paths[file]));
+         pages = PageCount(*reader);
+      }
+      else
+      {
+         page++;
+
+         if (!reader->jumpToNextImage())
+         {
+            page = pages;
+            continue;
+         }
+      }
+
+      if (reader->read(&img))
+      {
+         source = pages > 1 ? paths[file] + ":" + QString::number(page) : paths[file];
+         return true;
+      }
+   }
+}
+
+QVector<QRect> Stack::Tracker::ChangedRegions(const QImage& gray) const
+{
+   const int tile = options.tileSize;
+   const int tilesX = (width + tile - 1) / tile;
+   const int tilesY = (height + tile - 1) / tile;
+   QVector<char> changed(tilesX * tilesY, 0);
+
+   const uchar* bits = gray.constBits();
+   const int stride = gray.bytesPerLine();
+   const uchar* refBits = reference.constBits();
+   const int refStride = reference.bytesPerLine();
+   char* changedData = changed.data();
+   const bool deep = BitDepth::IsDeep(gray);
+   const int tolerance = deep ? qRound(options.changeTolerance * BitDepth::Scale(frameParams.bitDepth)) : options.changeTolerance;
+   const int w = width;
+   const int h = height;
+
+   //one tile row per block so no two blocks write the same flag
+   Parallel::ForRows(tilesY, width * tile, [=](const int& begin, const int& end) {
+      for (int ty = begin; ty < end; ty++)
+      {
+         for (int y = ty * tile; y < std::min(h, (ty + 1) * tile); y++)
+         {
+            const uchar* line = bits + (qint64)y * stride;
+            const uchar* refLine = refBits + (qint64)y * refStride;
+
+            for (int x = 0; x < w; x++)
+            {
+               const int difference = deep ? (int)((const quint16*)line)[x] - ((const quint16*)refLine)[x] : line[x] - refLine[x];
+
+               if (std::abs(difference) > tolerance)
+               {
+                  changedData[ty * tilesX + x / tile] = 1;
+                  x = (x / tile + 1) * tile - 1;
+               }
+            }
+         }
+      }
+   });
+
+   const QRect whole(0, 0, width, height);
+   const int changedCount = std::count(changed.begin(), changed.end(), 1);
+
+   if (changedCount > options.fullPassFraction * changed.count())
+   {
+      return QVector<QRect>({ whole });
+   }
+
+   //clumps of touching changed tiles, each clump's box is one region
+   QVector<QRect> regions;
+   QVector<int> stack;
+
+   for (int start = 0; start < changed.count(); start++)
+   {
+      if (changed[start] != 1)
+      {
+         continue;
+      }
+
+      QRect box;
+      changed[start] = 2;
+      stack.push_back(start);
+
+      while (!stack.isEmpty())
+      {
+         const int t = stack.takeLast();
+         const int tx = t % tilesX;
+         const int ty = t / tilesX;
+         box |= QRect(tx * tile, ty * tile, tile, tile);
+
+         for (int ny = std::max(0, ty - 1); ny <= std::min(tilesY - 1, ty + 1); ny++)
+         {
+            for (int nx = std::max(0, tx - 1); nx <= std::min(tilesX - 1, tx + 1); nx++)
+            {
+               if (changed[ny * tilesX + nx] == 1)
+               {
+                  changed[ny * tilesX + nx] = 2;
+                  stack.push_back(ny * tilesX + nx);
+               }
+            }
+         }
+      }
+
+      regions.push_back(box.adjusted(-options.padding, -options.padding, options.padding, options.padding) & whole);
+   }
+
+   return regions;
+}
+
+QVector<QRect> Stack::Tracker::MergeRegions(QVector<QRect> regions) const
+{
+   bool grew = true;
+
+   while (grew)
+   {
+      grew = false;
+
+      for (auto& region : regions)
+      {
+         for (const auto& cell : live)
+         {
+            if (region.intersects(cell.cell.bounds) && !region.contains(cell.cell.bounds))
+            {
+               region |= cell.cell.bounds;
+               grew = true;
+            }
+         }
+      }
+
+      for (int i = 0; i < regions.count(); i++)
+      {
+         for (int j = regions.count() - 1; j > i; j--)
+         {
+            if (regions[i].intersects(regions[j]))
+            {
+               regions[i] |= regions[j];
+               regions.remove(j);
+               grew = true;
+            }
+         }
+      }
+   }
+
+   return regions;
+}
+
+bool Stack::Tracker::SegmentRegion(const QImage& gray, const QRect& region, QVector<Found>& found) const
+{
+   //the local thresholds look up to area pixels around each pixel, give them
+   //the same neighbourhood they'd see in a full frame pass
+   const bool local = frameParams.mode != Pipeline::ThresholdMode::Manual;
+   const int margin = local ? frameParams.area : 0;
+   const QRect context = region.adjusted(-margin, -margin, margin, margin) & QRect(0, 0, width, height);
+
+   const QImage mask = Pipeline::Segment(gray.copy(context), frameParams).copy(region.translated(-context.topLeft()));
+
+   //everything, however small, so a cut off piece of a big cell still shows up
+   //against the border
+   const MaxTree tree = MaxTree::Build(mask);
+   const QVector<int> components = tree.ComponentsAbove(MAX_THRESH_VAL - 1, 0);
+
+   for (const auto& n : components)
+   {
+      const MaxTree::Node& node = tree.Nodes()[n];
+
+      if ((node.minX == 0 && region.left() > 0)
+          || (node.minY == 0 && region.top() > 0)
+          || (node.maxX == region.width() - 1 && region.right() < width - 1)
+          || (node.maxY == region.height() - 1 && region.bottom() < height - 1))
+      {
+         return false;
+      }
+   }
+
+   const ShapeFilter filter(frameParams.shapeFilter);
+
+   for (const auto& n : components)
+   {
+      const MaxTree::Node& node = tree.Nodes()[n];
+
+      if (node.area <= frameParams.minSize || !filter.Accepts(filter.Measure(tree, n)))
+      {
+         continue;
+      }
+
+      Found f;
+      f.cell = Pipeline::MeasureComponent(tree, n, frameParams);
+      f.cell.bounds.translate(region.topLeft());
+      f.cell.centroidX += region.left();
+      f.cell.centroidY += region.top();
+      f.pixels.reserve(node.area);
+
+      for (int y = node.minY; y <= node.maxY; y++)
+      {
+         for (int x = node.minX; x <= node.maxX; x++)
+         {
+            if (tree.NodeAt(x, y) == n)
+            {
+               f.pixels.push_back((y + region.top()) * width + x + region.left());
+            }
+         }
+      }
+
+      found.push_back(f);
+   }
+
+   return true;
+}
+
+Stack::FrameStats Stack::Tracker::Push(const QImage& img)
+{
+   QElapsedTimer timer;
+   timer.start();
+
+   const QImage gray = Pipeline::Preprocess(img, options.params);
+   const QRect whole(0, 0, gray.width(), gray.height());
+
+   FrameStats stats;
+   stats.frame = frame;
+
+   QVector<QRect> regions;
+
+   if (frame == 0 || gray.size() != reference.size() || gray.format() != reference.format())
+   {
+      width = gray.width();
+      height = gray.height();
+      labels = QVector<int>(width * height, -1);
+      live.clear();
+
+      //a global threshold is worked out once and then held for the rest of the
+      //stack, otherwise every frame's cells would have to be redone whenever
+      //the histogram wobbled
+      frameParams = options.params;
+
+      //filtered once for the whole frame above, a crop can't be filtered on
+      //its own without its edges coming out different
+      frameParams.medianRadius = 0;
+      frameParams.smoothSigma = 0;
+      frameParams.backgroundRadius = 0;
+      frameParams.flatFieldGain.clear();
+
+      if (frameParams.mode == Pipeline::ThresholdMode::GlobalOtsu)
+      {
+         frameParams.mode = Pipeline::ThresholdMode::Manual;
+         frameParams.threshold = BitDepth::IsDeep(gray) ? Otsu::GlobalThreshold16(gray) : Otsu::GlobalThreshold(Otsu::ImageHistogram(gray));
+      }
+
+      //a crop's brightest pixel says nothing about the camera
+      if (frameParams.bitDepth <= 0)
+      {
+         frameParams.bitDepth = BitDepth::SignificantBits(gray);
+      }
+
+      regions.push_back(whole);
+   }
+   else
+   {
+      regions = ChangedRegions(gray);
+   }
+
+   QVector<Found> found;
+
+   for (int attempt = 0; ; attempt++)
+   {
+      regions = MergeRegions(regions);
+      found.clear();
+      bool settled = true;
+
+      for (auto& region : regions)
+      {
+         if (!SegmentRegion(gray, region, found))
+         {
+            region = region.adjusted(-options.tileSize, -options.tileSize, options.tileSize, options.tileSize) & whole;
+            settled = false;
+         }
+      }
+
+      if (settled)
+      {
+         break;
+      }
+
+      //a cell keeps running out of its region, stop chasing it
+      if (attempt == 3)
+      {
+         regions = QVector<QRect>({ whole });
+      }
+   }
+
+   stats.fullPass = regions.count() == 1 && regions[0] == whole;
+
+   //cells nowhere near a change keep their measurements and their pixels
+   QVector<LiveCell> next;
+   QSet<int> taken;
+
+   for (const auto& cell : live)
+   {
+      bool touched = false;
+
+      for (const auto& region : regions)
+      {
+         touched = touched || region.intersects(cell.cell.bounds);
+      }
+
+      if (!touched)
+      {
+         next.push_back(cell);
+         taken.insert(cell.track);
+
+         TrackPoint point;
+         point.frame = frame;
+         point.cell = cell.cell;
+         point.reused = true;
+         tracks[cell.track].points.push_back(point);
+         stats.reused++;
+      }
+   }
+
+   //link each new cell to the old track it overlaps most, biggest overlaps
+   //first so a cell that split keeps its track on the larger half
+   struct Overlap
+   {
+      int found;
+      int track;
+      int pixels;
+   };
+
+   QVector<Overlap> overlaps;
+
+   for (int i = 0; i < found.count(); i++)
+   {
+      QMap<int, int> counts;
+
+      for (const auto& px : found[i].pixels)
+      {
+         if (labels[px] >= 0)
+         {
+            counts[labels[px]]++;
+         }
+      }
+
+      for (auto it = counts.begin(); it != counts.end(); ++it)
+      {
+         overlaps.push_back({ i, it.key(), it.value() });
+      }
+   }
+
+   std::sort(overlaps.begin(), overlaps.end(), [](const Overlap& a, const Overlap& b) { return a.pixels > b.pixels; });
+
+   QVector<int> assigned(found.count(), -1);
+
+   for (const auto& o : overlaps)
+   {
+      if (assigned[o.found] < 0 && !taken.contains(o.track))
+      {
+         assigned[o.found] = o.track;
+         taken.insert(o.track);
+      }
+   }
+
+   //the regions hold the whole of every cell they touched, so clearing them
+   //clears those cells' old pixels and nothing else
+   //and the reference moves on only where things were redone, so slow drift
+   //below the tolerance still adds up to a change eventually
+   if (stats.fullPass)
+   {
+      reference = gray;
+   }
+
+   for (const auto& region : regions)
+   {
+      for (int y = region.top(); y <= region.bottom(); y++)
+      {
+         std::fill(labels.begin() + y * width + region.left(), labels.begin() + y * width + region.right() + 1, -1);
+
+         if (!stats.fullPass)
+         {
+            const int bytes = gray.depth() / 8;
+            memcpy(reference.scanLine(y) + region.left() * bytes, gray.constScanLine(y) + region.left() * bytes, region.width() * bytes);
+         }
+      }
+
+      stats.pixelsProcessed += (qint64)region.width() * region.height();
+   }
+
+   for (int i = 0; i < found.count(); i++)
+   {
+      if (assigned[i] < 0)
+      {
+         Track track;
+         track.id = tracks.count();
+         tracks.push_back(track);
+         assigned[i] = track.id;
+      }
+
+      for (const auto& px : found[i].pixels)
+      {
+         labels[px] = assigned[i];
+      }
+
+      TrackPoint point;
+      point.frame = frame;
+      point.cell = found[i].cell;
+      tracks[assigned[i]].points.push_back(point);
+
+      LiveCell cell;
+      cell.track = assigned[i];
+      cell.cell = found[i].cell;
+      next.push_back(cell);
+   }
+
+   live = next;
+   stats.cells = live.count();
+   stats.ns = timer.nsecsElapsed();
+   frame++;
+
+   return stats;
+}
+
+QImage Stack::Tracker::Render() const
+{
+   QImage returnImg(width, height, QImage::Format_ARGB32);
+   returnImg.fill(Qt::transparent);
+
+   for (int y = 0; y < height; y++)
+   {
+      QRgb* line = (QRgb*)returnImg.scanLine(y);
+
+      for (int x = 0; x < width; x++)
+      {
+         const int track = labels[y * width + x];
+
+         if (track >= 0)
+         {
+            line[x] = QColor::fromHsv((track * 47) % 360, 255, 255).rgb();
+         }
+      }
+   }
+
+   return returnImg;
+}
+
+QString Stack::TracksCsvHeader()
+{
+   return "track,frame,x,y,width,height,area,centroid_x,centroid_y,skeleton_pixels,length,reused";
+}
+
+QString Stack::TracksCsv(const QVector<Track>& tracks)
+{
+   QStringList rows;
+
+   for (const auto& track : tracks)
+   {
+      for (const auto& point : track.points)
+      {
+         const Pipeline::Cell& cell = point.cell;
+
+         rows.append(QStringList({ QString::number(track.id),
+                                   QString::number(point.frame),
+                                   QString::number(cell.bounds.x()),
+                                   QString::number(cell.bounds.y()),
+                                   QString::number(cell.bounds.width()),
+                                   QString::number(cell.bounds.height()),
+                                   QString::number(cell.area),
+                                   QString::number(cell.centroidX, 'f', 2),
+                                   QString::number(cell.centroidY, 'f', 2),
+                                   QString::number(cell.skeletonPixels),
+                                   QString::number(cell.length, 'f', 3),
+                                   point.reused ? "1" : "0" }).join(","));
+      }
+   }
+
+   return rows.join("\n");
+}
@@ -0,0 +1,156 @@
+#ifndef Stack_h
+#define Stack_h
+
+#include <QImage>
+#include <QImageReader>
+#include <QRect>
+#include <QSharedPointer>
+#include <QStringList>
+#include <QVector>
+
+#include "Pipeline.h"
+
+//Time-lapse sequences and multi-page TIFF stacks. Frames go through the same
+//threshold -> clean -> label -> thin stages as Pipeline::Run, but only where
+//something moved since the last frame: the picture is compared tile by tile
+//against what was last processed, the changed tiles plus the bounding boxes of
+//the cells they touch become the regions that get redone, and every cell
+//outside them is carried over as is. Cells are linked to the previous frame
+//by pixel overlap, which gives a length-over-time track per cell.
+namespace Stack
+{
+
+//hands out the frames of a list of files in order, every page of a multi-page
+//file being a frame of its own
+class FrameReader
+{
+public:
+   FrameReader(const QStringList& paths);
+
+   //total frames, read from the headers
+   int Count() const { return count; }
+
+   bool Next(QImage& frame);
+
+   //file[:page] of the frame Next handed out last
+   QString Source() const { return source; }
+
+private:
+   QStringList paths;
+   QSharedPointer<QImageReader> reader;
+   int count = 0;
+   int file = -1;
+   int page = 0;
+   int pages = 0;
+   QString source;
+};
+
+struct Options
+{
+   Pipeline::Params params;
+
+   int tileSize = 32;
+
+   //largest gray level change inside a tile that still counts as unchanged, in
+   //8 bit levels (scaled up for 16 bit frames)
+   int changeTolerance = 12;
+
+   //past this fraction of changed tiles the frame just gets a full pass
+   double fullPassFraction = 0.5;
+
+   //changed tiles grow by this much before they become regions
+   int padding = 8;
+};
+
+struct TrackPoint
+{
+   int frame = 0;
+   Pipeline::Cell cell;
+
+   //carried over from the frame before without being looked at again
+   bool reused = false;
+};
+
+struct Track
+{
+   int id = 0;
+   QVector<TrackPoint> points;
+};
+
+struct FrameStats
+{
+   int frame = 0;
+   int cells = 0;
+   int reused = 0;
+   bool fullPass = false;
+   qint64 pixelsProcessed = 0;
+   qint64 ns = 0;
+};
+
+class Tracker
+{
+public:
+   Tracker(const Options& options)
+      : options(options)
+      , frameParams(options.params) {};
+
+   FrameStats Push(const QImage& frame);
+
+   int FrameCount() const { return frame; }
+
+   //track ids index this
+   const QVector<Track>& Tracks() const { return tracks; }
+
+   //the cells of the last frame on transparent, one colour per track
+   QImage Render() const;
+
+private:
+   struct LiveCell
+   {
+      int track = 0;
+      Pipeline::Cell cell;
+   };
+
+   struct Found
+   {
+      Pipeline::Cell cell;
+
+      //y * width + x
+      QVector<int> pixels;
+   };
+
+   QVector<QRect> ChangedRegions(const QImage& gray) const;
+
+   //unions overlapping regions and pulls in the whole box of every live cell a
+   //region touches, so a cell is either redone completely or carried over
+   QVector<QRect> MergeRegions(QVector<QRect> regions) const;
+
+   //false when a component runs into a side of the region that isn't the edge
+   //of the picture, the region has to grow before its cells can be trusted
+   bool SegmentRegion(const QImage& gray, const QRect& region, QVector<Found>& found) const;
+
+   Options options;
+
+   //params with the threshold locked, see Push
+   Pipeline::Params frameParams;
+
+   int frame = 0;
+   int width = 0;
+   int height = 0;
+
+   //gray values as of the last time each pixel was processed
+   QImage reference;
+
+   //track id per pixel, -1 for background
+   QVector<int> labels;
+
+   QVector<LiveCell> live;
+   QVector<Track> tracks;
+};
+
+QString TracksCsvHeader();
+QString TracksCsv(const QVector<Track>& tracks);
+
+}
+
+#endif /* Stack_h */
@@ -0,0 +1,473 @@
+#include "Sweep.h"
+#include "BitDepth.h"
+#include "LocalThreshold.h"
+#include "MaxTree.h"
+#include "Otsu.h"
+#include "Scheduler.h"
+#include "ShapeFilter.h"
+
+#include <QAtomicInt>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QFileInfo>
+#include <QTextStream>
+#include <QThread>
+#include <QtMath>
+
+#include <algorithm>
+#include <functional>
+
+namespace
+{
+
+//runs body on a thread of its own under the scheduler context that started the
+//sweep, so cancelling that job stops the workers too
+class SweepWorker : public QThread
+{
+public:
+   SweepWorker(const std::function<void()>& body, Scheduler::Context* context)
+      : body(body)
+      , context(context) {};
+
+   void run() override
+   {
+      Scheduler::ContextScope scope(context);
+      body();
+   }
+
+private:
+   std::function<void()> body;
+   Scheduler::Context* context = nullptr;
+};
+
+void RunWorkers(const int& count, const std::function<void()>& body, Scheduler::Context* context, const QThread::Priority& priority)
+{
+   QVector<SweepWorker*> pool;
+
+   for (int i = 0; i < count; i++)
+   {
+      SweepWorker* worker = new SweepWorker(body, context);
+      pool.push_back(worker);
+      worker->start(priority);
+   }
+
+   for (auto worker : pool)
+   {
+      worker->wait();
+      delete worker;
+   }
+}
+
+//what every setting shares for one picture
+struct Prepared
+{
+   bool ok = false;
+   QImage gray;
+   int otsu = -1;
+   LocalThreshold::IntegralImages integral;
+};
+
+//the part of a setting that decides the thresholded picture
+struct Binarization
+{
+   Pipeline::ThresholdMode mode;
+   int area;
+   int c;
+};
+
+bool IsLocal(const Pipeline::ThresholdMode& mode)
+{
+   return mode != Pipeline::ThresholdMode::Manual && mode != Pipeline::ThresholdMode::GlobalOtsu;
+}
+
+}
+
+QVector<Sweep::Reference> Sweep::ReadReferences(const QString& csvPath, QString* error)
+{
+   QFile file(csvPath);
+
+   if (!file.open(QIODevice::ReadOnly | QIODevice::Text))
+   {
+      if (error != nullptr)
+      {
+         *error = "Could not read " + csvPath;
+      }
+
+      return QVector<Reference>();
+   }
+
+   const QDir dir = QFileInfo(csvPath).absoluteDir();
+   QVector<Reference> references;
+   QTextStream in(&file);
+
+   while (!in.atEnd())
+   {
+      const QString line = in.readLine().trimmed();
+      const int comma = line.lastIndexOf(',');
+
+      if (comma <= 0)
+      {
+         continue;
+      }
+
+      bool ok = false;
+      const double length = line.mid(comma + 1).trimmed().toDouble(&ok);
+
+      if (!ok || length <= 0)
+      {
+         continue;
+      }
+
+      const QString path = QDir::cleanPath(dir.absoluteFilePath(line.left(comma).trimmed()));
+      auto reference = std::find_if(references.begin(), references.end(), [&](const Reference& r) { return r.path == path; });
+
+      if (reference == references.end())
+      {
+         references.push_back({ path, QVector<double>() });
+         reference = references.end() - 1;
+      }
+
+      reference->lengths.push_back(length);
+   }
+
+   if (references.isEmpty() && error != nullptr)
+   {
+      *error = "No path,length lines in " + csvPath;
+   }
+
+   return references;
+}
+
+double Sweep::MatchError(QVector<double> measured, QVector<double> reference, int* matched)
+{
+   std::sort(measured.begin(), measured.end());
+   std::sort(reference.begin(), reference.end());
+
+   const int m = measured.count();
+   const int r = reference.count();
+
+   //cost[i][j] and pairs[i][j] for the first i references against the first j
+   //measured cells, one row at a time
+   QVector<double> cost((r + 1) * (m + 1));
+   QVector<int> pairs((r + 1) * (m + 1), 0);
+   auto at = [=](const int& i, const int& j) { return i * (m + 1) + j; };
+
+   for (int i = 0; i <= r; i++)
+   {
+      for (int j = 0; j <= m; j++)
+      {
+         if (i == 0 || j == 0)
+         {
+            cost[at(i, j)] = i + j;
+            continue;
+         }
+
+         double best = cost[at(i - 1, j)] + 1;
+         int bestPairs = pairs[at(i - 1, j)];
+
+         if (cost[at(i, j - 1)] + 1 < best)
+         {
+            best = cost[at(i, j - 1)] + 1;
+            bestPairs = pairs[at(i, j - 1)];
+         }
+
+         //a cell measured at 0 can't pair with anything
+         if (measured[j - 1] > 0)
+         {
+            const double pair = cost[at(i - 1, j - 1)] + qAbs(qLn(measured[j - 1] / reference[i - 1]));
+
+            if (pair < best)
+            {
+               best = pair;
+               bestPairs = pairs[at(i - 1, j - 1)] + 1;
+            }
+         }
+
+         cost[at(i, j)] = best;
+         pairs[at(i, j)] = bestPairs;
+      }
+   }
+
+   if (matched != nullptr)
+   {
+      *matched = pairs[at(r, m)];
+   }
+
+   return cost[at(r, m)] / qMax(1, r);
+}
+
+QString Sweep::Report::Summary() const
+{
+   const QString timing = QString("%1 settings on %2 images in %3 s (decode %4 s, precompute %5 s, threshold %6 s, measure %7 s)")
+                                .arg(scores.count())
+                                .arg(images - failed)
+                                .arg(wallNs / 1e9, 0, 'f', 2)
+                                .arg(decodeNs / 1e9, 0, 'f', 2)
+                                .arg(precomputeNs / 1e9, 0, 'f', 2)
+                                .arg(thresholdNs / 1e9, 0, 'f', 2)
+                                .arg(measureNs / 1e9, 0, 'f', 2);
+
+   if (cancelled || scores.isEmpty() || images == failed)
+   {
+      return (cancelled ? "Sweep cancelled, " : "Nothing to score, ") + timing;
+   }
+
+   const Score& best = scores.first();
+   const bool local = IsLocal(best.params.mode);
+
+   return QString("Best: %1%2, opening %3, min size %4, error %5 (%6/%7 cells matched). %8")
+         .arg(Pipeline::ModeName(best.params.mode))
+         .arg(local ? QString(" area %1 C %2").arg(best.params.area).arg(best.params.c) : QString())
+         .arg(best.params.openingRadius)
+         .arg(best.params.minSize)
+         .arg(best.error, 0, 'f', 3)
+         .arg(best.matched)
+         .arg(best.references)
+         .arg(timing);
+}
+
+QString Sweep::Report::Csv() const
+{
+   QStringList rows({ "rank,mode,area,c,opening_radius,min_size,error,matched,references" });
+
+   for (int i = 0; i < scores.count(); i++)
+   {
+      const Score& score = scores[i];
+      const bool local = IsLocal(score.params.mode);
+
+      rows.append(QStringList({ QString::number(i + 1),
+                                Pipeline::ModeName(score.params.mode),
+                                local ? QString::number(score.params.area) : QString(),
+                                local ? QString::number(score.params.c) : QString(),
+                                QString::number(score.params.openingRadius),
+                                QString::number(score.params.minSize),
+                                QString::number(score.error, 'f', 4),
+                                QString::number(score.matched),
+                                QString::number(score.references) }).join(","));
+   }
+
+   return rows.join("\n") + "\n";
+}
+
+Sweep::Report Sweep::Run(const QVector<Reference>& references, const Grid& grid, const Pipeline::Params& params, const DecodeOptions& decode, const int& workerThreads)
+{
+   Report report;
+   report.images = references.count();
+
+   QElapsedTimer wall;
+   wall.start();
+
+   //the threshold settings that actually give different pictures
+   QVector<Binarization> binarizations;
+   int largestArea = 1;
+
+   for (const auto& mode : grid.modes)
+   {
+      if (!IsLocal(mode))
+      {
+         binarizations.push_back({ mode, params.area, params.c });
+         continue;
+      }
+
+      for (const auto& area : grid.areas)
+      {
+         largestArea = qMax(largestArea, area);
+
+         for (const auto& c : grid.cs)
+         {
+            binarizations.push_back({ mode, area, c });
+         }
+      }
+   }
+
+   const bool anyLocal = std::any_of(binarizations.begin(), binarizations.end(), [](const Binarization& b) { return IsLocal(b.mode); });
+   const QVector<int> openings = grid.openingRadii.isEmpty() ? QVector<int>({ params.openingRadius }) : grid.openingRadii;
+   const QVector<int> minSizes = grid.minSizes.isEmpty() ? QVector<int>({ params.minSize }) : grid.minSizes;
+   const int smallestMinSize = *std::min_element(minSizes.begin(), minSizes.end());
+
+   Scheduler::Context* context = Scheduler::CurrentContext();
+   const bool background = context != nullptr && context->priority == Scheduler::Priority::Background;
+
+   //same split as Batch: background jobs are serial inside, so all the cores
+   //go to running pieces side by side
+   const int cores = qMax(1, QThread::idealThreadCount());
+   const int workers = workerThreads > 0 ? workerThreads : background ? qMax(1, cores - 1) : qMax(1, cores / 4);
+   const QThread::Priority priority = background ? QThread::LowPriority : QThread::InheritPriority;
+
+   //decode and precompute every picture, the decoders reading ahead while the
+   //workers build the shared pieces
+   QStringList paths;
+
+   for (const auto& reference : references)
+   {
+      paths.append(reference.path);
+   }
+
+   QVector<Prepared> prepared(references.count());
+   QVector<qint64> precomputeNs(references.count(), 0);
+
+   DecodeQueue queue(paths, decode, qMax(1, cores / 4), 512ll * 1024 * 1024);
+   queue.Start(priority);
+
+   RunWorkers(workers, [&]() {
+      DecodedFrame frame;
+
+      while (!Scheduler::Cancelled() && queue.Take(frame))
+      {
+         //the prepared gray copy is held from here on, not the frame
+         const QImage image = frame.image;
+         queue.Release(frame);
+
+         if (!frame.error.isEmpty())
+         {
+            continue;
+         }
+
+         QElapsedTimer timer;
+         timer.start();
+
+         Prepared& p = prepared[frame.index];
+         p.gray = Pipeline::Preprocess(image, params);
+
+         if (grid.modes.contains(Pipeline::ThresholdMode::GlobalOtsu))
+         {
+            p.otsu = BitDepth::IsDeep(p.gray) ? Otsu::GlobalThreshold16(p.gray) : Otsu::GlobalThreshold(Otsu::ImageHistogram(p.gray));
+         }
+
+         //built for the largest window, which is good for all the smaller ones
+         if (anyLocal)
+         {
+            p.integral = LocalThreshold::BuildIntegralImages(p.gray, largestArea);
+         }
+
+         p.ok = true;
+         precomputeNs[frame.index] = timer.nsecsElapsed();
+      }
+   }, context, priority);
+
+   report.decodeNs = queue.DecodeNs();
+
+   for (int i = 0; i < prepared.count(); i++)
+   {
+      report.precomputeNs += precomputeNs[i];
+      report.failed += prepared[i].ok ? 0 : 1;
+   }
+
+   //one task per picture, threshold setting and opening. Each one labels and
+   //thins once and scores every minimum size off the same cells.
+   const int settings = binarizations.count() * openings.count() * minSizes.count();
+   const int tasks = references.count() * binarizations.count() * openings.count();
+
+   QVector<double> errors(tasks * minSizes.count(), 0);
+   QVector<int> matched(tasks * minSizes.count(), 0);
+   QVector<qint64> thresholdNs(tasks, 0);
+   QVector<qint64> measureNs(tasks, 0);
+   QAtomicInt next(0);
+
+   RunWorkers(workers, [&]() {
+      for (int t = next.fetchAndAddRelaxed(1); t < tasks && !Scheduler::Cancelled(); t = next.fetchAndAddRelaxed(1))
+      {
+         const int image = t / (binarizations.count() * openings.count());
+         const Binarization& b = binarizations[t / openings.count() % binarizations.count()];
+         const Prepared& p = prepared[image];
+
+         if (!p.ok)
+         {
+            continue;
+         }
+
+         QElapsedTimer timer;
+         timer.start();
+
+         Pipeline::Params setting = params;
+         setting.mode = b.mode;
+         setting.area = b.area;
+         setting.c = b.c;
+         setting.openingRadius = openings[t % openings.count()];
+
+         //Otsu's threshold is already known, so that one is just a manual threshold
+         Pipeline::Params binarize = setting;
+
+         if (b.mode == Pipeline::ThresholdMode::GlobalOtsu)
+         {
+            binarize.mode = Pipeline::ThresholdMode::Manual;
+            binarize.threshold = p.otsu;
+         }
+
+         const QImage mask = Pipeline::Separate(Pipeline::Binarize(p.gray, binarize, &p.integral), setting);
+         thresholdNs[t] = timer.nsecsElapsed();
+         timer.restart();
+
+         const MaxTree tree = MaxTree::Build(mask);
+         const ShapeFilter filter(params.shapeFilter);
+         QVector<Pipeline::Cell> cells;
+
+         for (const auto& n : filter.Filter(tree, tree.ComponentsAbove(MAX_THRESH_VAL - 1, smallestMinSize)))
+         {
+            cells.push_back(Pipeline::MeasureComponent(tree, n, setting));
+         }
+
+         for (int s = 0; s < minSizes.count(); s++)
+         {
+            QVector<double> lengths;
+
+            for (const auto& cell : cells)
+            {
+               if (cell.area > minSizes[s])
+               {
+                  lengths.push_back(cell.length);
+               }
+            }
+
+            errors[t * minSizes.count() + s] = MatchError(lengths, references[image].lengths, &matched[t * minSizes.count() + s]);
+         }
+
+         measureNs[t] = timer.nsecsElapsed();
+      }
+   }, context, priority);
+
+   report.cancelled = Scheduler::Cancelled();
+
+   for (int t = 0; t < tasks; t++)
+   {
+      report.thresholdNs += thresholdNs[t];
+      report.measureNs += measureNs[t];
+   }
+
+   const int usable = report.images - report.failed;
+
+   for (int s = 0; s < settings && usable > 0; s++)
+   {
+      const int setting = s / minSizes.count();
+      const Binarization& b = binarizations[setting / openings.count()];
+
+      Score score;
+      score.params = params;
+      score.params.mode = b.mode;
+      score.params.area = b.area;
+      score.params.c = b.c;
+      score.params.openingRadius = openings[setting % openings.count()];
+      score.params.minSize = minSizes[s % minSizes.count()];
+
+      for (int image = 0; image < references.count(); image++)
+      {
+         if (!prepared[image].ok)
+         {
+            continue;
+         }
+
+         const int index = (image * binarizations.count() * openings.count() + setting) * minSizes.count() + s % minSizes.count();
+         score.error += errors[index] / usable;
+         score.matched += matched[index];
+         score.references += references[image].lengths.count();
+      }
+
+      report.scores.push_back(score);
+   }
+
+   std::stable_sort(report.scores.begin(), report.scores.end(), [](const Score& a, const Score& b) { return a.error < b.error; });
+
+   report.wallNs = wall.nsecsElapsed();
+   return report;
+}
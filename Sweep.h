@@ -0,0 +1,100 @@
+#ifndef Sweep_h
+#define Sweep_h
+
+#include <QString>
+#include <QStringList>
+#include <QVector>
+
+#include "DecodeQueue.h"
+#include "Pipeline.h"
+
+//Auto-tuning. Runs a grid of threshold modes, windows, C offsets, opening
+//radii and minimum sizes over a few sample pictures somebody has measured by
+//hand and ranks every combination by how close its lengths come to theirs.
+//
+//Nothing that doesn't depend on a setting gets done twice: each picture is
+//decoded, preprocessed, Otsu'd and turned into integral images once, each
+//threshold + opening combination is labelled and thinned once, and the minimum
+//sizes are only a filter over the cells that produced. Those pieces run on
+//every core at once.
+namespace Sweep
+{
+
+struct Grid
+{
+   //area and c only matter to the local modes, Manual and GlobalOtsu get run
+   //once whatever they hold
+   QVector<Pipeline::ThresholdMode> modes = { Pipeline::ThresholdMode::GlobalOtsu, Pipeline::ThresholdMode::Mean,
+                                              Pipeline::ThresholdMode::Niblack, Pipeline::ThresholdMode::Sauvola };
+   QVector<int> areas = { 7, 15, 25 };
+   QVector<int> cs = { -10, 0, 10 };
+   QVector<int> openingRadii = { 0, 1, 2 };
+   QVector<int> minSizes = { MIN_COMPONENT_SIZE / 2, MIN_COMPONENT_SIZE, MIN_COMPONENT_SIZE * 2 };
+};
+
+//the lengths somebody measured on one picture, in the same units as
+//Params::pixelsPerUnit gives
+struct Reference
+{
+   QString path;
+   QVector<double> lengths;
+};
+
+//"path,length" lines, one per hand-measured cell, grouped by path in the
+//order they first turn up. Relative paths are relative to the CSV, lines whose
+//length isn't a number (a header) are skipped. Empty with error set when the
+//file can't be read.
+QVector<Reference> ReadReferences(const QString& csvPath, QString* error = nullptr);
+
+//cost of the best pairing of measured lengths with reference ones, over the
+//number of references. A pair costs |ln(measured / reference)|, about the
+//relative error for anything close, and a cell on either side left without a
+//partner costs 1, so a setting can't win by finding extra cells or by missing
+//the awkward ones. Sorted, the best pairing never crosses, which makes it a
+//small dynamic program instead of an assignment problem.
+//matched gets how many reference cells found a partner.
+double MatchError(QVector<double> measured, QVector<double> reference, int* matched = nullptr);
+
+struct Score
+{
+   Pipeline::Params params;
+
+   //MatchError averaged over the pictures
+   double error = 0;
+   int matched = 0;
+   int references = 0;
+};
+
+struct Report
+{
+   //best first
+   QVector<Score> scores;
+
+   int images = 0;
+   int failed = 0;
+   bool cancelled = false;
+
+   //summed over threads like Batch::Stats. precompute is the preprocessing,
+   //Otsu and integral images, threshold the thresholding, opening and split,
+   //measure the labelling, thinning and scoring.
+   qint64 decodeNs = 0;
+   qint64 precomputeNs = 0;
+   qint64 thresholdNs = 0;
+   qint64 measureNs = 0;
+   qint64 wallNs = 0;
+
+   QString Summary() const;
+
+   //one line per setting, best first
+   QString Csv() const;
+};
+
+//everything in params that the grid doesn't cover (denoising, shape and split
+//filters, pixelsPerUnit, ...) is used as is for every setting. workerThreads of
+//0 picks from QThread::idealThreadCount().
+Report Run(const QVector<Reference>& references, const Grid& grid, const Pipeline::Params& params,
+           const DecodeOptions& decode = DecodeOptions(), const int& workerThreads = 0);
+
+}
+
+#endif /* Sweep_h */
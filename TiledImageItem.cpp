@@ -0,0 +1,282 @@
+#include "TiledImageItem.h"
+
+#include <QPainter>
+#include <QStyleOptionGraphicsItem>
+#include <QtMath>
+
+#include <cstring>
+
+namespace
+{
+
+//levels past this would need a picture a million tiles wide
+static constexpr int MAX_LEVEL = 20;
+
+//every step'th pixel of count along a row, P the size of one pixel
+template <typename P>
+void SampleRow(const uchar* in, uchar* out, const int& count, const int& step)
+{
+   const P* from = (const P*)in;
+   P* to = (P*)out;
+
+   for (int x = 0; x < count; x++)
+   {
+      to[x] = from[(qint64)x * step];
+   }
+}
+
+template <typename P>
+bool SameRow(const uchar* a, const uchar* b, const int& count, const int& step)
+{
+   const P* first = (const P*)a;
+   const P* second = (const P*)b;
+
+   for (int x = 0; x < count; x++)
+   {
+      if (first[(qint64)x * step] != second[(qint64)x * step])
+      {
+         return false;
+      }
+   }
+
+   return true;
+}
+
+//the picture pixels tile (tx, ty) starts at and how many tile pixels it has
+QRect TileRect(const QSize& size, const int& level, const int& tx, const int& ty)
+{
+   const int span = TiledImageItem::TILE_SIZE << level;
+   const int step = 1 << level;
+   const int x0 = tx * span;
+   const int y0 = ty * span;
+
+   return QRect(x0, y0, (qMin(span, size.width() - x0) + step - 1) >> level, (qMin(span, size.height() - y0) + step - 1) >> level);
+}
+
+}
+
+TiledImageItem::TiledImageItem(QGraphicsItem* parent)
+   : QGraphicsItem(parent)
+{
+   //paint gets the exposed rect, so only the tiles in view get looked at
+   setFlag(QGraphicsItem::ItemUsesExtendedStyleOption);
+   SetCacheBytes(256ll * 1024 * 1024);
+}
+
+void TiledImageItem::SetImage(const QImage& img)
+{
+   if (img.cacheKey() == image.cacheKey())
+   {
+      return;
+   }
+
+   //tiles are sampled straight out of the bytes, so sub byte formats get
+   //widened first
+   const QImage widened = img.depth() < 8 ? img.convertToFormat(QImage::Format_ARGB32) : img;
+
+   if (widened.size() != image.size())
+   {
+      prepareGeometryChange();
+   }
+
+   //tiles of a picture with the same layout may well still be right, anything
+   //else has nothing worth keeping
+   if (widened.size() == image.size() && widened.format() == image.format())
+   {
+      previous = image;
+   }
+   else
+   {
+      previous = QImage();
+      tiles.clear();
+   }
+
+   image = widened;
+   generation++;
+   update();
+}
+
+void TiledImageItem::SetCacheBytes(const qint64& bytes)
+{
+   tiles.setMaxCost((int)qMax(1ll, bytes / 1024));
+}
+
+QRectF TiledImageItem::boundingRect() const
+{
+   return QRectF(0, 0, image.width(), image.height());
+}
+
+int TiledImageItem::Level(const qreal& lod, const QSize& size)
+{
+   const int longest = qMax(size.width(), size.height());
+   int level = 0;
+
+   while (level < MAX_LEVEL && lod * (2 << level) <= 1 && (longest >> (level + 1)) >= TILE_SIZE)
+   {
+      level++;
+   }
+
+   return level;
+}
+
+QImage TiledImageItem::RenderTile(const QImage& img, const int& level, const int& tx, const int& ty)
+{
+   const QRect tile = TileRect(img.size(), level, tx, ty);
+   const int step = 1 << level;
+   const int bytes = img.depth() / 8;
+
+   QImage out(tile.width(), tile.height(), img.format());
+   out.setColorTable(img.colorTable());
+
+   for (int y = 0; y < tile.height(); y++)
+   {
+      const uchar* in = img.constScanLine(tile.y() + y * step) + (qint64)tile.x() * bytes;
+      uchar* line = out.scanLine(y);
+
+      switch (step == 1 ? 0 : bytes)
+      {
+      case 1:
+         SampleRow<quint8>(in, line, tile.width(), step);
+         break;
+      case 2:
+         SampleRow<quint16>(in, line, tile.width(), step);
+         break;
+      case 4:
+         SampleRow<quint32>(in, line, tile.width(), step);
+         break;
+      default:
+         if (step == 1)
+         {
+            std::memcpy(line, in, (size_t)tile.width() * bytes);
+            break;
+         }
+
+         for (int x = 0; x < tile.width(); x++)
+         {
+            std::memcpy(line + (qint64)x * bytes, in + (qint64)x * step * bytes, bytes);
+         }
+
+         break;
+      }
+   }
+
+   return out;
+}
+
+bool TiledImageItem::SameTile(const QImage& a, const QImage& b, const int& level, const int& tx, const int& ty)
+{
+   const QRect tile = TileRect(a.size(), level, tx, ty);
+   const int step = 1 << level;
+   const int bytes = a.depth() / 8;
+
+   for (int y = 0; y < tile.height(); y++)
+   {
+      const qint64 offset = (qint64)tile.x() * bytes;
+      const uchar* first = a.constScanLine(tile.y() + y * step) + offset;
+      const uchar* second = b.constScanLine(tile.y() + y * step) + offset;
+      bool same = true;
+
+      switch (step == 1 ? 0 : bytes)
+      {
+      case 1:
+         same = SameRow<quint8>(first, second, tile.width(), step);
+         break;
+      case 2:
+         same = SameRow<quint16>(first, second, tile.width(), step);
+         break;
+      case 4:
+         same = SameRow<quint32>(first, second, tile.width(), step);
+         break;
+      default:
+         if (step == 1)
+         {
+            same = std::memcmp(first, second, (size_t)tile.width() * bytes) == 0;
+            break;
+         }
+
+         for (int x = 0; x < tile.width() && same; x++)
+         {
+            same = std::memcmp(first + (qint64)x * step * bytes, second + (qint64)x * step * bytes, bytes) == 0;
+         }
+
+         break;
+      }
+
+      if (!same)
+      {
+         return false;
+      }
+   }
+
+   return true;
+}
+
+QPixmap TiledImageItem::TilePixmap(const int& level, const int& tx, const int& ty)
+{
+   const quint64 key = ((quint64)level << 48) | ((quint64)ty << 24) | (quint64)tx;
+   Tile* cached = tiles.object(key);
+
+   if (cached != nullptr)
+   {
+      if (cached->generation == generation)
+      {
+         return cached->pixmap;
+      }
+
+      //made from the picture before this one, still good if the pixels it
+      //shows didn't change
+      if (cached->generation + 1 == generation && !previous.isNull() && SameTile(previous, image, level, tx, ty))
+      {
+         cached->generation = generation;
+         revalidated++;
+         return cached->pixmap;
+      }
+   }
+
+   Tile* tile = new Tile();
+   tile->pixmap = QPixmap::fromImage(RenderTile(image, level, tx, ty));
+   tile->generation = generation;
+   uploads++;
+
+   //insert can delete the tile straight away if it's over the whole budget
+   const QPixmap pixmap = tile->pixmap;
+   tiles.insert(key, tile, qMax(1, pixmap.width() * pixmap.height() * 4 / 1024));
+
+   return pixmap;
+}
+
+void TiledImageItem::paint(QPainter* painter, const QStyleOptionGraphicsItem* option, QWidget* widget)
+{
+   Q_UNUSED(widget);
+
+   if (image.isNull())
+   {
+      return;
+   }
+
+   const int level = Level(QStyleOptionGraphicsItem::levelOfDetailFromTransform(painter->worldTransform()), image.size());
+   const int span = TILE_SIZE << level;
+   const QRectF exposed = option->exposedRect.intersected(boundingRect());
+
+   if (exposed.isEmpty())
+   {
+      return;
+   }
+
+   const int firstX = qMax(0, (int)exposed.left() / span);
+   const int firstY = qMax(0, (int)exposed.top() / span);
+   const int lastX = qMin((image.width() - 1) / span, qCeil(exposed.right()) / span);
+   const int lastY = qMin((image.height() - 1) / span, qCeil(exposed.bottom()) / span);
+
+   for (int ty = firstY; ty <= lastY; ty++)
+   {
+      for (int tx = firstX; tx <= lastX; tx++)
+      {
+         //the tile's last pixel can stand for fewer than step picture pixels,
+         //so it gets stretched onto exactly the part of the picture it covers
+         const QRectF target(tx * span, ty * span, qMin(span, image.width() - tx * span), qMin(span, image.height() - ty * span));
+         const QPixmap pixmap = TilePixmap(level, tx, ty);
+         painter->drawPixmap(target, pixmap, QRectF(pixmap.rect()));
+      }
+   }
+}
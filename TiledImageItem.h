@@ -0,0 +1,76 @@
+#ifndef TiledImageItem_h
+#define TiledImageItem_h
+
+#include <QCache>
+#include <QGraphicsItem>
+#include <QImage>
+#include <QPixmap>
+
+//Scene item for pictures too big to hand the view as one pixmap. The picture
+//is cut into TILE_SIZE squares that are only turned into pixmaps when they
+//come into view, at the coarsest power of two downsampling that still has a
+//picture pixel per screen pixel at the view's zoom, so a zoomed out 200 MP
+//frame costs a screenful of tiles and not 800 MB of upload.
+//
+//Tiles stay in an LRU cache (QCache) between paints. A new picture from
+//SetImage doesn't throw the cache away: a tile is checked against the
+//picture before it the next time it's painted and only rendered and
+//uploaded again if the pixels it shows actually changed, so a stage that
+//touched one cell re-uploads the tiles round that cell.
+class TiledImageItem : public QGraphicsItem
+{
+public:
+   static constexpr int TILE_SIZE = 256;
+
+   TiledImageItem(QGraphicsItem* parent = nullptr);
+
+   void SetImage(const QImage& img);
+   const QImage& Image() const { return image; }
+
+   //pixmap bytes the cache may hold, 256 MB to start with
+   void SetCacheBytes(const qint64& bytes);
+
+   //tiles rendered and uploaded, and stale tiles that turned out unchanged
+   qint64 Uploads() const { return uploads; }
+   qint64 Revalidated() const { return revalidated; }
+
+   QRectF boundingRect() const override;
+   void paint(QPainter* painter, const QStyleOptionGraphicsItem* option, QWidget* widget = nullptr) override;
+
+   //downsampling level for a view scale of lod screen pixels per picture
+   //pixel, each level halves the size. Never so coarse the picture is smaller
+   //than a tile.
+   static int Level(const qreal& lod, const QSize& size);
+
+   //the pixels of tile (tx, ty) at level, every (1 << level)th one of img,
+   //in img's format
+   static QImage RenderTile(const QImage& img, const int& level, const int& tx, const int& ty);
+
+private:
+   struct Tile
+   {
+      QPixmap pixmap;
+
+      //SetImage count the tile is known good for
+      quint64 generation = 0;
+   };
+
+   //whether tile (tx, ty) at level shows the same pixels in a and b
+   static bool SameTile(const QImage& a, const QImage& b, const int& level, const int& tx, const int& ty);
+
+   QPixmap TilePixmap(const int& level, const int& tx, const int& ty);
+
+   QImage image;
+
+   //the picture before the last SetImage, for checking tiles against
+   QImage previous;
+   quint64 generation = 0;
+
+   //cost in KB
+   QCache<quint64, Tile> tiles;
+
+   qint64 uploads = 0;
+   qint64 revalidated = 0;
+};
+
+#endif /* TiledImageItem_h */
@@ -0,0 +1,285 @@
+#include "Watershed.h"
+#include "DistanceTransform.h"
+#include "MaxTree.h"
+#include "Scratch.h"
+#include "ShapeFilter.h"
+#include "SimdKernels.h"
+
+#include <QtMath>
+
+namespace
+{
+
+static constexpr int LEVELS = 256;
+
+//distance levels per pixel of distance
+static constexpr double LEVELS_PER_PIXEL = 2;
+
+//one FIFO per level, threaded through next[] so nothing gets allocated per push
+class BucketQueue
+{
+public:
+   BucketQueue(const int& count)
+      : next(count, -1)
+   {
+      std::fill(head, head + LEVELS, -1);
+      std::fill(tail, tail + LEVELS, -1);
+   };
+
+   void Push(const int& p, const int& level)
+   {
+      next[p] = -1;
+
+      if (tail[level] < 0)
+      {
+         head[level] = p;
+      }
+      else
+      {
+         next[tail[level]] = p;
+      }
+
+      tail[level] = p;
+   }
+
+   //-1 when the bucket is empty
+   int Pop(const int& level)
+   {
+      const int p = head[level];
+
+      if (p >= 0)
+      {
+         head[level] = next[p];
+
+         if (head[level] < 0)
+         {
+            tail[level] = -1;
+         }
+      }
+
+      return p;
+   }
+
+private:
+   Scratch::Buffer<int> next;
+   int head[LEVELS];
+   int tail[LEVELS];
+};
+
+}
+
+void Watershed::Flood(const QImage& level, QVector<int>& labels)
+{
+   const QImage gray = SimdKernels::ToGray(level);
+   const int width = gray.width();
+   const int height = gray.height();
+   const int count = width * height;
+
+   Scratch::Buffer<uchar> f(count);
+
+   for (int y = 0; y < height; y++)
+   {
+      std::copy(gray.constScanLine(y), gray.constScanLine(y) + width, f.data() + y * width);
+   }
+
+   BucketQueue queue(count);
+
+   for (int p = 0; p < count; p++)
+   {
+      if (labels[p] > 0)
+      {
+         queue.Push(p, f[p]);
+      }
+   }
+
+   //a pixel found from a lower level waits in that level's bucket even if
+   //it's higher itself, so the levels only ever go down
+   for (int current = LEVELS - 1; current >= 0; current--)
+   {
+      for (int p = queue.Pop(current); p >= 0; p = queue.Pop(current))
+      {
+         const int x = p % width;
+         const int y = p / width;
+
+         for (int ny = qMax(0, y - 1); ny <= qMin(height - 1, y + 1); ny++)
+         {
+            for (int nx = qMax(0, x - 1); nx <= qMin(width - 1, x + 1); nx++)
+            {
+               const int q = ny * width + nx;
+
+               if (labels[q] == 0)
+               {
+                  labels[q] = labels[p];
+                  queue.Push(q, qMin((int)f[q], current));
+               }
+            }
+         }
+      }
+   }
+}
+
+QImage Watershed::Split(const QImage& mask, const double& depth)
+{
+   const QImage gray = SimdKernels::ToGray(mask);
+   const int width = gray.width() + 2;
+   const int height = gray.height() + 2;
+
+   //a frame of background round it, so the edges of a crop count as edges
+   QImage padded(width, height, QImage::Format_Grayscale8);
+   padded.fill(0);
+
+   for (int y = 0; y < gray.height(); y++)
+   {
+      std::copy(gray.constScanLine(y), gray.constScanLine(y) + gray.width(), padded.scanLine(y + 1) + 1);
+   }
+
+   const QVector<qint32> distance = DistanceTransform::SquaredDistance(padded, false);
+   QImage level(width, height, QImage::Format_Grayscale8);
+
+   for (int y = 0; y < height; y++)
+   {
+      const uchar* in = padded.constScanLine(y);
+      uchar* out = level.scanLine(y);
+
+      for (int x = 0; x < width; x++)
+      {
+         out[x] = in[x] == 0 ? 0 : (uchar)qBound(1, qRound(qSqrt(distance[y * width + x]) * LEVELS_PER_PIXEL), LEVELS - 1);
+      }
+   }
+
+   //a branch of the distance's max tree whose peak stands depth above where it
+   //joins the rest is a cell of its own. The deepest node on such a branch
+   //that still does is its marker, the pixels within depth of the peak.
+   const MaxTree tree = MaxTree::Build(level);
+   const QVector<MaxTree::Node>& nodes = tree.Nodes();
+   const int minRise = qMax(1, qRound(depth * LEVELS_PER_PIXEL));
+
+   QVector<int> peak(nodes.count());
+
+   for (int n = 0; n < nodes.count(); n++)
+   {
+      peak[n] = nodes[n].level;
+   }
+
+   for (int n = nodes.count() - 1; n > 0; n--)
+   {
+      peak[nodes[n].parent] = qMax(peak[nodes[n].parent], peak[n]);
+   }
+
+   QVector<bool> significant(nodes.count(), false);
+   QVector<bool> significantChild(nodes.count(), false);
+
+   for (int n = 1; n < nodes.count(); n++)
+   {
+      if (nodes[n].level > 0 && peak[n] - nodes[nodes[n].parent].level >= minRise)
+      {
+         significant[n] = true;
+         significantChild[nodes[n].parent] = true;
+      }
+   }
+
+   //parents first, so a marker's whole subtree picks up its label
+   QVector<int> nodeMarker(nodes.count(), 0);
+   int markers = 0;
+
+   for (int n = 1; n < nodes.count(); n++)
+   {
+      nodeMarker[n] = significant[n] && !significantChild[n] ? ++markers : nodeMarker[nodes[n].parent];
+   }
+
+   if (markers < 2)
+   {
+      return gray;
+   }
+
+   QVector<int> labels(width * height);
+
+   for (int y = 0; y < height; y++)
+   {
+      for (int x = 0; x < width; x++)
+      {
+         labels[y * width + x] = level.constScanLine(y)[x] == 0 ? -1 : nodeMarker[tree.NodeAt(x, y)];
+      }
+   }
+
+   Flood(level, labels);
+
+   //where two basins touch the higher label gives way, which leaves no two
+   //different labels touching even diagonally
+   QImage out = gray.copy();
+
+   for (int y = 1; y + 1 < height; y++)
+   {
+      for (int x = 1; x + 1 < width; x++)
+      {
+         const int label = labels[y * width + x];
+
+         if (label <= 0)
+         {
+            continue;
+         }
+
+         for (int ny = y - 1; ny <= y + 1; ny++)
+         {
+            for (int nx = x - 1; nx <= x + 1; nx++)
+            {
+               const int other = labels[ny * width + nx];
+
+               if (other > 0 && other < label)
+               {
+                  out.scanLine(y - 1)[x - 1] = 0;
+               }
+            }
+         }
+      }
+   }
+
+   return out;
+}
+
+QImage Watershed::SplitComponents(const QImage& mask, const QString& suspicious, const double& depth)
+{
+   const QImage gray = SimdKernels::ToGray(mask);
+   const ShapeFilter filter(suspicious);
+
+   if (suspicious.trimmed().isEmpty() || !filter.IsValid())
+   {
+      return gray;
+   }
+
+   const MaxTree tree = MaxTree::Build(gray);
+   QImage out;
+
+   for (const auto& n : tree.ComponentsAbove(MAX_THRESH_VAL - 1, 0))
+   {
+      if (!filter.Accepts(filter.Measure(tree, n)))
+      {
+         continue;
+      }
+
+      const MaxTree::Node& node = tree.Nodes()[n];
+      const QImage crop = tree.ComponentMask(n);
+      const QImage split = Split(crop, depth);
+
+      for (int y = 0; y < crop.height(); y++)
+      {
+         const uchar* before = crop.constScanLine(y);
+         const uchar* after = split.constScanLine(y);
+
+         for (int x = 0; x < crop.width(); x++)
+         {
+            if (before[x] != after[x])
+            {
+               if (out.isNull())
+               {
+                  out = gray.copy();
+               }
+
+               out.scanLine(y + node.minY)[x + node.minX] = 0;
+            }
+         }
+      }
+   }
+
+   return out.isNull() ? gray : out;
+}
@@ -0,0 +1,41 @@
+#ifndef Watershed_h
+#define Watershed_h
+
+#include <QImage>
+#include <QString>
+#include <QVector>
+
+//Marker controlled watershed for pulling apart cells that touch, so they get
+//labelled and thinned one at a time instead of as one blob with a nonsense
+//skeleton.
+//
+//The flooding uses a queue with one FIFO bucket per gray level instead of a
+//heap, every pixel goes in and out once, so it's linear in the pixel count.
+namespace Watershed
+{
+
+//labels[] row major over level, > 0 for marker pixels, 0 for pixels still to
+//be flooded and -1 for pixels that never get a label (background). Floods from
+//the markers outwards, highest level first, each pixel taking the label of the
+//neighbour (8 connected) that reached it first. Equal levels go first in,
+//first out, so plateaus get shared out evenly. Anything not connected to a
+//marker stays at 0.
+void Flood(const QImage& level, QVector<int>& labels);
+
+//splits the white pixels of mask along the valleys between its thick parts.
+//The levels are the distance to the background in half pixels, the markers
+//the peaks of it that stand at least depth pixels above the saddle to any
+//other peak. Pixels where two basins meet go black, just enough that the
+//pieces are separate 8 connected components. Format_Grayscale8, 255 on 0.
+QImage Split(const QImage& mask, const double& depth);
+
+//Split on just the components of mask that the ShapeFilter expression
+//suspicious accepts, e.g. "solidity < 0.85" for blobs with a waist. The rest
+//of mask is copied over as is, and with an empty (or invalid) expression, or
+//nothing suspicious, mask comes back untouched without anything being
+//computed past the labelling.
+QImage SplitComponents(const QImage& mask, const QString& suspicious, const double& depth);
+
+}
+
+#endif /* Watershed_h */
@@ -0,0 +1,111 @@
+#include "ImageOps.h"
+#include "SimdKernels.h"
+
+#include <QCoreApplication>
+#include <QElapsedTimer>
+#include <QRandomGenerator>
+#include <QThreadPool>
+
+#include <cstdio>
+#include <functional>
+
+//Prints GB/s (of ARGB input read) for the reference ImageOps::Threshold and the
+//SimdKernels versions at every dispatch level the CPU supports, single threaded
+//and split over the thread pool.
+//
+//usage: CellLengthBenchmarks [width height [iterations]]
+//defaults to a 20 MP frame, which is what the cameras on the scopes produce.
+
+namespace
+{
+
+QImage RandomImage(const int& width, const int& height)
+{
+   QImage img(width, height, QImage::Format_RGB32);
+   QRandomGenerator rng(1234);
+
+   for (int y = 0; y < img.height(); y++)
+   {
+      QRgb* line = (QRgb*)img.scanLine(y);
+
+      for (int x = 0; x < img.width(); x++)
+      {
+         line[x] = rng.generate() | 0xff000000u;
+      }
+   }
+
+   return img;
+}
+
+//best of n runs, in seconds
+double Time(const int& iterations, const std::function<void()>& fn)
+{
+   double best = 1e30;
+
+   for (int i = 0; i < iterations; i++)
+   {
+      QElapsedTimer timer;
+      timer.start();
+      fn();
+      best = qMin(best, timer.nsecsElapsed() / 1e9);
+   }
+
+   return best;
+}
+
+void Report(const char* name, const char* level, const int& threads, const double& seconds, const double& bytes, const double& baseline)
+{
+   std::printf("%-20s %-7s %3d  %9.2f ms  %7.2f GB/s  %8.1fx\n", name, level, threads, seconds * 1e3, bytes / seconds / 1e9, baseline / seconds);
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+   QCoreApplication app(argc, argv);
+
+   const int width = argc > 2 ? QString(argv[1]).toInt() : 5472;
+   const int height = argc > 2 ? QString(argv[2]).toInt() : 3648;
+   const int iterations = argc > 3 ? QString(argv[3]).toInt() : 5;
+   const int threshVal = 128;
+
+   const QImage img = RandomImage(width, height);
+   const double bytes = (double)img.width() * img.height() * sizeof(QRgb);
+   const int poolThreads = QThreadPool::globalInstance()->maxThreadCount();
+
+   std::printf("%d x %d, best of %d, detected %s\n\n", width, height, iterations,
+               SimdKernels::CpuLevelName(SimdKernels::DetectCpuLevel()));
+   std::printf("%-20s %-7s %3s  %12s  %12s  %9s\n", "kernel", "level", "thr", "time", "throughput", "speedup");
+
+   //the reference is slow enough that one run is plenty
+   const QImage reference = ImageOps::Threshold(img, threshVal);
+   const double baseline = Time(1, [&]() { ImageOps::Threshold(img, threshVal); });
+   Report("ImageOps::Threshold", "-", 1, baseline, bytes, baseline);
+
+   const QImage gray = SimdKernels::ToGray(img);
+
+   for (int level = (int)SimdKernels::CpuLevel::Scalar; level <= (int)SimdKernels::DetectCpuLevel(); level++)
+   {
+      const char* levelName = SimdKernels::CpuLevelName(SimdKernels::SetCpuLevel((SimdKernels::CpuLevel)level));
+
+      if (SimdKernels::Threshold(img, threshVal) != reference)
+      {
+         std::printf("!! %s Threshold does not match ImageOps::Threshold\n", levelName);
+         return 1;
+      }
+
+      for (int threads : { 1, poolThreads })
+      {
+         QThreadPool::globalInstance()->setMaxThreadCount(threads);
+
+         Report("Threshold (argb)", levelName, threads, Time(iterations, [&]() { SimdKernels::Threshold(img, threshVal); }), bytes, baseline);
+         Report("ToGray", levelName, threads, Time(iterations, [&]() { SimdKernels::ToGray(img); }), bytes, baseline);
+         Report("ThresholdMask", levelName, threads, Time(iterations, [&]() { SimdKernels::ThresholdMask(gray, threshVal); }), bytes / 4, baseline);
+         Report("ThresholdBitMask", levelName, threads, Time(iterations, [&]() { SimdKernels::ThresholdBitMask(gray, threshVal); }), bytes / 4, baseline);
+      }
+
+      QThreadPool::globalInstance()->setMaxThreadCount(poolThreads);
+   }
+
+   return 0;
+}
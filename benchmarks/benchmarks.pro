@@ -0,0 +1,13 @@
+QT       += core gui
+QT 	+= concurrent
+greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
+
+CONFIG += c++11 console
+CONFIG -= app_bundle
+
+TARGET = CellLengthBenchmarks
+
+SOURCES += \
+    ThresholdBenchmark.cpp
+
+include(../CellLengthCore.pri)
@@ -1,9 +1,216 @@
 #include "mainwindow.h"
+#include "JobServer.h"
+#include "Shard.h"
 
 #include <QApplication>
+#include <QCommandLineParser>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonDocument>
+
+#include <iostream>
+
+//the server and the shard modes run without a window, which has to be known
+//before the application object gets made
+static bool HasOption(int argc, char *argv[], const QStringList& prefixes)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        const QString arg(argv[i]);
+
+        for (const auto& prefix : prefixes)
+        {
+            if (arg.startsWith(prefix))
+            {
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+static int RunServer(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Cell length measurement server");
+    parser.addHelpOption();
+
+    QCommandLineOption serveOption("serve", "Take jobs on the local socket <name>.", "name");
+    QCommandLineOption httpOption("http", "Take jobs on http://localhost:<port>.", "port");
+    QCommandLineOption workersOption("workers", "Jobs run at once, 0 picks from the core count.", "count", "0");
+    parser.addOption(serveOption);
+    parser.addOption(httpOption);
+    parser.addOption(workersOption);
+    parser.process(a);
+
+    JobServer server(parser.value(workersOption).toInt());
+
+    if (parser.isSet(serveOption) && !server.ListenLocal(parser.value(serveOption)))
+    {
+        std::cerr << "serve: " << server.ErrorString().toStdString() << std::endl;
+        return 1;
+    }
+
+    if (parser.isSet(httpOption) && !server.ListenHttp(parser.value(httpOption).toUShort()))
+    {
+        std::cerr << "http: " << server.ErrorString().toStdString() << std::endl;
+        return 1;
+    }
+
+    return a.exec();
+}
+
+//one line per image, relative paths are relative to the list
+static QStringList ReadImageList(const QString& listPath, QString* error)
+{
+    QFile list(listPath);
+    QStringList images;
+
+    if (!list.open(QIODevice::ReadOnly | QIODevice::Text))
+    {
+        *error = "Could not read " + listPath;
+        return images;
+    }
+
+    const QDir base = QFileInfo(listPath).absoluteDir();
+
+    while (!list.atEnd())
+    {
+        const QString line = QString::fromUtf8(list.readLine()).trimmed();
+
+        if (!line.isEmpty())
+        {
+            images.push_back(QDir::cleanPath(base.absoluteFilePath(line)));
+        }
+    }
+
+    return images;
+}
+
+static int RunShards(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Sharded batch runs over a work directory several machines can share");
+    parser.addHelpOption();
+
+    QCommandLineOption initOption("shard-init", "Make a run in <dir> out of the --images list.", "dir");
+    QCommandLineOption workOption("shard-work", "Claim and run shards of the run in <dir> until there are none left.", "dir");
+    QCommandLineOption statusOption("shard-status", "Say how far the run in <dir> is.", "dir");
+    QCommandLineOption mergeOption("shard-merge", "Put the finished shards of the run in <dir> into one --output CSV.", "dir");
+    QCommandLineOption imagesOption("images", "Pictures to run, one path per line.", "file");
+    QCommandLineOption shardSizeOption("shard-size", "Pictures per shard.", "count", "500");
+    QCommandLineOption paramsOption("params", "Job JSON with the pipeline settings, same keys as the server takes.", "file");
+    QCommandLineOption workersOption("workers", "Pictures processed at once, 0 picks from the core count.", "count", "0");
+    QCommandLineOption leaseOption("lease-timeout", "Seconds before a shard whose worker stopped renewing it can be taken over.", "seconds", "600");
+    QCommandLineOption maxShardsOption("max-shards", "Stop after this many shards, 0 for no limit.", "count", "0");
+    QCommandLineOption outputOption("output", "CSV the merge writes.", "file");
+    QCommandLineOption partialOption("partial", "Merge whatever shards are finished instead of failing.");
+    parser.addOptions({ initOption, workOption, statusOption, mergeOption, imagesOption, shardSizeOption, paramsOption,
+                        workersOption, leaseOption, maxShardsOption, outputOption, partialOption });
+    parser.process(a);
+
+    QString error;
+
+    if (parser.isSet(initOption))
+    {
+        Shard::Manifest manifest;
+        manifest.images = ReadImageList(parser.value(imagesOption), &error);
+        manifest.shardSize = parser.value(shardSizeOption).toInt();
+
+        if (error.isEmpty() && parser.isSet(paramsOption))
+        {
+            QFile params(parser.value(paramsOption));
+
+            if (params.open(QIODevice::ReadOnly))
+            {
+                manifest.params = QJsonDocument::fromJson(params.readAll()).object();
+            }
+            else
+            {
+                error = "Could not read " + parser.value(paramsOption);
+            }
+        }
+
+        if (!error.isEmpty() || !Shard::CreateManifest(parser.value(initOption), manifest, &error))
+        {
+            std::cerr << "shard-init: " << error.toStdString() << std::endl;
+            return 1;
+        }
+
+        std::cout << manifest.images.count() << " images in " << manifest.ShardCount() << " shards" << std::endl;
+    }
+
+    if (parser.isSet(workOption))
+    {
+        Shard::Manifest manifest;
+
+        if (!Shard::ReadManifest(parser.value(workOption), manifest, &error))
+        {
+            std::cerr << "shard-work: " << error.toStdString() << std::endl;
+            return 1;
+        }
+
+        Shard::WorkOptions options;
+        options.batch.params = JobServer::ParamsFromJson(manifest.params, &error);
+
+        if (!error.isEmpty())
+        {
+            std::cerr << "shard-work: " << error.toStdString() << std::endl;
+            return 1;
+        }
+
+        options.batch.workerThreads = parser.value(workersOption).toInt();
+        options.leaseTimeoutMs = parser.value(leaseOption).toLongLong() * 1000;
+        options.maxShards = parser.value(maxShardsOption).toInt();
+
+        const Shard::WorkStats stats = Shard::Work(parser.value(workOption), options);
+        std::cout << stats.Summary().toStdString() << std::endl;
+
+        if (!stats.error.isEmpty())
+        {
+            return 1;
+        }
+    }
+
+    if (parser.isSet(statusOption))
+    {
+        const qint64 leaseTimeoutMs = parser.value(leaseOption).toLongLong() * 1000;
+        std::cout << Shard::Status(parser.value(statusOption), leaseTimeoutMs).Summary().toStdString() << std::endl;
+    }
+
+    if (parser.isSet(mergeOption) && !parser.isSet(outputOption))
+    {
+        std::cerr << "shard-merge: needs an --output file" << std::endl;
+        return 1;
+    }
+
+    if (parser.isSet(mergeOption) && !Shard::Merge(parser.value(mergeOption), parser.value(outputOption), parser.isSet(partialOption), &error))
+    {
+        std::cerr << "shard-merge: " << error.toStdString() << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
 
 int main(int argc, char *argv[])
 {
+    if (HasOption(argc, argv, { "--shard" }))
+    {
+        return RunShards(argc, argv);
+    }
+
+    if (HasOption(argc, argv, { "--serve", "--http" }))
+    {
+        return RunServer(argc, argv);
+    }
+
     QApplication a(argc, argv);
     MainWindow w;
     w.show();
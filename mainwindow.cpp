@@ -42,34 +42,257 @@ void MainWindow::OpenFile()
 	initializeImageFileDialog(dialog, QFileDialog::AcceptOpen);
 	auto filePath = dialog.getOpenFileName();
 
-	img = QImage(filePath);
-	setWindowTitle(filePath);
+   if (filePath.isEmpty())
+   {
+      return;
+   }
 
-	if (p == nullptr)
-	{
-		p = scene->addPixmap(QPixmap::fromImage(img));
-	}
-	else
-	{
-		p->setPixmap(QPixmap::fromImage(img));
-	}
+   this->statusBarLabel->setText("Loading " + filePath);
+
+   OpenImageThread* workerThread = new OpenImageThread(filePath);
+   QObject::connect(workerThread, &OpenImageThread::resultReady, this, &MainWindow::HandleImageLoaded);
+   QObject::connect(workerThread, &OpenImageThread::finished, workerThread, &QObject::deleteLater);
+   Scheduler::Global().Submit(workerThread, Scheduler::Priority::Interactive, "open");
+}
+
+void MainWindow::HandleImageLoaded(const QImage& loaded, const QString& filePath)
+{
+   if (loaded.isNull())
+   {
+      this->statusBarLabel->setText("Could not open " + filePath);
+      return;
+   }
+
+	document.Open(loaded);
+	setWindowTitle(filePath);
+	ShowDocument();
 
 	view->fitInView(p, Qt::KeepAspectRatio);
+   this->statusBarLabel->setText("Ready");
    std::cout<< "ratio: " <<view->devicePixelRatio() <<std::endl;
 }
 
+void MainWindow::BatchMeasure()
+{
+   QFileDialog dialog;
+   initializeImageFileDialog(dialog, QFileDialog::AcceptOpen);
+   auto paths = dialog.getOpenFileNames(this, tr("Pictures to measure"));
+
+   if (paths.isEmpty())
+   {
+      return;
+   }
+
+   auto outputPath = QFileDialog::getSaveFileName(this, tr("Save measurements"), "", tr("CSV (*.csv)"));
+
+   if (outputPath.isEmpty())
+   {
+      return;
+   }
+
+   Batch::Options options;
+   options.params.shapeFilter = shapeFilter;
+   options.params.splitFilter = splitFilter;
+   options.params.splitDepth = splitDepth;
+   options.params.medianRadius = medianRadius;
+   options.params.smoothSigma = smoothSigma;
+   options.params.backgroundRadius = backgroundRadius;
+   options.params.flatFieldGain = flatFieldGain;
+
+   BatchThread* workerThread = new BatchThread(paths, outputPath, options);
+   QObject::connect(workerThread, &BatchThread::ProgressUpdate, this, &MainWindow::HandleProgressUpdate);
+   QObject::connect(workerThread, &BatchThread::resultReady, this, [=](const QString& summary) {
+      this->statusBarLabel->setText(summary);
+   });
+   QObject::connect(workerThread, &BatchThread::finished, workerThread, &QObject::deleteLater);
+   Scheduler::Global().Submit(workerThread, Scheduler::Priority::Background);
+}
+
+void MainWindow::SweepParameters()
+{
+   auto referencePath = QFileDialog::getOpenFileName(this, tr("Hand-measured lengths (path,length per cell)"), "", tr("CSV (*.csv)"));
+
+   if (referencePath.isEmpty())
+   {
+      return;
+   }
+
+   QString error;
+   const QVector<Sweep::Reference> references = Sweep::ReadReferences(referencePath, &error);
+
+   if (references.isEmpty())
+   {
+      this->statusBarLabel->setText(error);
+      return;
+   }
+
+   auto outputPath = QFileDialog::getSaveFileName(this, tr("Save scores"), "", tr("CSV (*.csv)"));
+
+   if (outputPath.isEmpty())
+   {
+      return;
+   }
+
+   //the grid covers the threshold, opening and size, the rest comes from the window
+   Pipeline::Params params;
+   params.shapeFilter = shapeFilter;
+   params.splitFilter = splitFilter;
+   params.splitDepth = splitDepth;
+   params.medianRadius = medianRadius;
+   params.smoothSigma = smoothSigma;
+   params.backgroundRadius = backgroundRadius;
+   params.flatFieldGain = flatFieldGain;
+
+   SweepThread* workerThread = new SweepThread(references, outputPath, params);
+   QObject::connect(workerThread, &SweepThread::ProgressUpdate, this, &MainWindow::HandleProgressUpdate);
+   QObject::connect(workerThread, &SweepThread::resultReady, this, [=](const QString& summary) {
+      this->statusBarLabel->setText(summary);
+   });
+   QObject::connect(workerThread, &SweepThread::finished, workerThread, &QObject::deleteLater);
+   Scheduler::Global().Submit(workerThread, Scheduler::Priority::Background);
+}
+
+void MainWindow::OpenStack()
+{
+   QFileDialog dialog;
+   initializeImageFileDialog(dialog, QFileDialog::AcceptOpen);
+   auto paths = dialog.getOpenFileNames(this, tr("Frames or a multi-page TIFF"));
+
+   if (paths.isEmpty())
+   {
+      return;
+   }
+
+   auto outputPath = QFileDialog::getSaveFileName(this, tr("Save tracks"), "", tr("CSV (*.csv)"));
+
+   if (outputPath.isEmpty())
+   {
+      return;
+   }
+
+   Stack::Options options;
+   options.params.shapeFilter = shapeFilter;
+   options.params.splitFilter = splitFilter;
+   options.params.splitDepth = splitDepth;
+   options.params.medianRadius = medianRadius;
+   options.params.smoothSigma = smoothSigma;
+   options.params.backgroundRadius = backgroundRadius;
+   options.params.flatFieldGain = flatFieldGain;
+
+   StackThread* workerThread = new StackThread(paths, outputPath, options);
+   QObject::connect(workerThread, &StackThread::ProgressUpdate, this, &MainWindow::HandleProgressUpdate);
+   QObject::connect(workerThread, &StackThread::frameReady, this, &MainWindow::HandleStackFrame);
+   QObject::connect(workerThread, &StackThread::resultReady, this, [=](const QString& summary) {
+      this->statusBarLabel->setText(summary);
+   });
+   QObject::connect(workerThread, &StackThread::finished, workerThread, &QObject::deleteLater);
+   Scheduler::Global().Submit(workerThread, Scheduler::Priority::Background);
+}
+
+void MainWindow::HandleStackFrame(const QImage& frame, const QImage& cells, const QString& status)
+{
+   const bool first = p == nullptr;
+
+   //every frame starts its own history, undo within a frame only
+   document.Open(frame);
+   document.CommitOverlay(tr("Cells"), cells);
+   ShowDocument();
+
+   if (first)
+   {
+      view->fitInView(p, Qt::KeepAspectRatio);
+   }
+
+   this->statusBarLabel->setText(status);
+}
+
+QImage MainWindow::ThresholdInput() const
+{
+   return document.Input();
+}
+
+void MainWindow::UpdateSliderLut()
+{
+   const QImage input = ThresholdInput();
+
+   if (!sliderLut.isEmpty() && input.cacheKey() == sliderLutKey)
+   {
+      return;
+   }
+
+   sliderLutKey = input.cacheKey();
+   sliderLut = BitDepth::SliderLut(input);
+   sliderLevels = BitDepth::SliderLevels(input, sliderLut);
+}
+
+void MainWindow::ShowDocument()
+{
+   //tiled, so only what's in view goes up to the screen, and of that only
+   //the tiles a stage actually changed
+   if (p == nullptr)
+   {
+      p = new TiledImageItem();
+      overlay = new TiledImageItem();
+      scene->addItem(p);
+      scene->addItem(overlay);
+   }
+
+   p->SetImage(document.Working());
+   overlay->SetImage(document.Overlay());
+
+   undoAct->setEnabled(document.CanUndo());
+   undoAct->setText(document.CanUndo() ? tr("&Undo ") + document.UndoLabel() : tr("&Undo"));
+   redoAct->setEnabled(document.CanRedo());
+   redoAct->setText(document.CanRedo() ? tr("&Redo ") + document.RedoLabel() : tr("&Redo"));
+}
+
 void MainWindow::CreateActions()
 {
 	openAct = new QAction(tr("&Open"), this);
 	openAct->setShortcuts(QKeySequence::Open);
 	openAct->setStatusTip(tr("Open a sperm cell picture"));
 	connect(openAct, &QAction::triggered, this, &MainWindow::OpenFile);
+
+   batchAct = new QAction(tr("&Batch Measure..."), this);
+   batchAct->setStatusTip(tr("Measure every cell in a set of pictures and save a CSV"));
+   connect(batchAct, &QAction::triggered, this, &MainWindow::BatchMeasure);
+
+   sweepAct = new QAction(tr("&Tune Parameters..."), this);
+   sweepAct->setStatusTip(tr("Try a grid of threshold settings on hand-measured pictures and rank them"));
+   connect(sweepAct, &QAction::triggered, this, &MainWindow::SweepParameters);
+
+   stackAct = new QAction(tr("Open &Stack..."), this);
+   stackAct->setStatusTip(tr("Track cells through a time-lapse or multi-page TIFF and save their lengths over time"));
+   connect(stackAct, &QAction::triggered, this, &MainWindow::OpenStack);
+
+   undoAct = new QAction(tr("&Undo"), this);
+   undoAct->setShortcuts(QKeySequence::Undo);
+   undoAct->setEnabled(false);
+   connect(undoAct, &QAction::triggered, this, [=]() {
+      document.Undo();
+      ShowDocument();
+   });
+
+   redoAct = new QAction(tr("&Redo"), this);
+   redoAct->setShortcuts(QKeySequence::Redo);
+   redoAct->setEnabled(false);
+   connect(redoAct, &QAction::triggered, this, [=]() {
+      document.Redo();
+      ShowDocument();
+   });
 }
 
 void MainWindow::CreateMenus()
 {
 	fileMenu = menuBar()->addMenu(tr("&File"));
 	fileMenu->addAction(openAct);
+   fileMenu->addAction(stackAct);
+   fileMenu->addAction(batchAct);
+   fileMenu->addAction(sweepAct);
+
+   editMenu = menuBar()->addMenu(tr("&Edit"));
+   editMenu->addAction(undoAct);
+   editMenu->addAction(redoAct);
 }
 
 void MainWindow::CreateToolbars()
@@ -79,46 +302,154 @@ void MainWindow::CreateToolbars()
    
    QPushButton* cleanButton = new QPushButton(tr("Clean"));
    QObject::connect(cleanButton, &QPushButton::clicked, this, [=]() {
-      CleanThread* thinThread = new CleanThread(p->pixmap().toImage());
+      if (!document.IsOpen())
+      {
+         return;
+      }
+
+      const ShapeFilter filter(shapeFilter);
+
+      if (!filter.IsValid())
+      {
+         statusBarLabel->setText(tr("Shape filter: ") + filter.Error());
+         return;
+      }
+
+      CleanThread* thinThread = new CleanThread(document.Working(), filter);
 
       connect(thinThread, &CleanThread::ProgressUpdate, this, &MainWindow::HandleProgressUpdate);
-      connect(thinThread, &CleanThread::resultReady, this, &MainWindow::HandleThresholdFinished);
+      connect(thinThread, &CleanThread::resultReady, this, [=](const QImage& s) { HandleStageFinished(tr("Clean"), s); });
       connect(thinThread, &CleanThread::finished, thinThread, &QObject::deleteLater);
-      thinThread->start();
+      Scheduler::Global().Submit(thinThread, Scheduler::Priority::Full, "clean");
       });
    
+   //on top of the MIN_COMPONENT_SIZE cut, batch and stack runs use it too
+   QLineEdit* shapeFilterEdit = new QLineEdit();
+   shapeFilterEdit->setPlaceholderText(tr("e.g. elongation > 3 && solidity > 0.8"));
+   shapeFilterEdit->setToolTip(tr("Components Clean keeps, by area, perimeter, extent, elongation, eccentricity and solidity"));
+   QObject::connect(shapeFilterEdit, &QLineEdit::textChanged, this, [=](const QString& text) {
+      this->shapeFilter = text;
+      });
+
+   //touching cells come out of the threshold as one component, these pull
+   //apart the ones that look like more than one cell
+   QLineEdit* splitFilterEdit = new QLineEdit();
+   splitFilterEdit->setPlaceholderText(tr("e.g. solidity < 0.85"));
+   splitFilterEdit->setToolTip(tr("Components Split cuts apart, same names as the shape filter"));
+   QObject::connect(splitFilterEdit, &QLineEdit::textChanged, this, [=](const QString& text) {
+      this->splitFilter = text;
+      });
+
+   QDoubleSpinBox* splitDepthSpinBox = new QDoubleSpinBox();
+   splitDepthSpinBox->setRange(0.5, 50);
+   splitDepthSpinBox->setSingleStep(0.5);
+   splitDepthSpinBox->setValue(splitDepth);
+   splitDepthSpinBox->setPrefix(tr("Depth: "));
+   splitDepthSpinBox->setToolTip(tr("How much thicker (pixels) a cell has to be than the waist joining it to the next one"));
+   QObject::connect(splitDepthSpinBox, QOverload<double>::of(&QDoubleSpinBox::valueChanged), this, [=](double depth) {
+      this->splitDepth = depth;
+      });
+
+   QPushButton* splitButton = new QPushButton(tr("Split"));
+   QObject::connect(splitButton, &QPushButton::clicked, this, [=]() {
+      if (!document.IsOpen())
+      {
+         return;
+      }
+
+      const ShapeFilter filter(splitFilter);
+
+      if (!filter.IsValid())
+      {
+         statusBarLabel->setText(tr("Split filter: ") + filter.Error());
+         return;
+      }
+
+      //an empty filter would make Split a no-op, so the button splits everything
+      WatershedThread* workerThread = new WatershedThread(document.Working(), splitFilter.trimmed().isEmpty() ? QString("area > 0") : splitFilter, splitDepth);
+      connect(workerThread, &WatershedThread::resultReady, this, [=](const QImage& s) { HandleStageFinished(tr("Split"), s); });
+      connect(workerThread, &WatershedThread::finished, workerThread, &QObject::deleteLater);
+      Scheduler::Global().Submit(workerThread, Scheduler::Priority::Full, "split");
+      });
+
+   //radius 1 is the original 3x3 pass, anything bigger is a disk
+   QSpinBox* morphRadiusSpinBox = new QSpinBox();
+   morphRadiusSpinBox->setRange(1, 500);
+   morphRadiusSpinBox->setPrefix(tr("Radius: "));
+
    QPushButton* dilateButton = new QPushButton(tr("Dilate"));
    QObject::connect(dilateButton, &QPushButton::clicked, this, [=]() {
-      HandleThresholdFinished(ImageOps::Dilate(p->pixmap().toImage()));
+      if (!document.IsOpen())
+      {
+         return;
+      }
+
+      MorphologyThread* workerThread = new MorphologyThread(MorphologyThread::Op::Dilate, morphRadiusSpinBox->value(), document.Working());
+      connect(workerThread, &MorphologyThread::resultReady, this, [=](const QImage& s) { HandleStageFinished(tr("Dilate"), s); });
+      connect(workerThread, &MorphologyThread::finished, workerThread, &QObject::deleteLater);
+      Scheduler::Global().Submit(workerThread, Scheduler::Priority::Full, "morphology");
       });
    
    QPushButton* erodeButton = new QPushButton(tr("Erode"));
    QObject::connect(erodeButton, &QPushButton::clicked, this, [=]() {
-      HandleThresholdFinished(ImageOps::Erode(p->pixmap().toImage()));
+      if (!document.IsOpen())
+      {
+         return;
+      }
+
+      MorphologyThread* workerThread = new MorphologyThread(MorphologyThread::Op::Erode, morphRadiusSpinBox->value(), document.Working());
+      connect(workerThread, &MorphologyThread::resultReady, this, [=](const QImage& s) { HandleStageFinished(tr("Erode"), s); });
+      connect(workerThread, &MorphologyThread::finished, workerThread, &QObject::deleteLater);
+      Scheduler::Global().Submit(workerThread, Scheduler::Priority::Full, "morphology");
       });
 
    QPushButton* thinButton = new QPushButton(tr("Thin"));
    QObject::connect(thinButton, &QPushButton::clicked, this, [=]() {
-      ThinThread* thinThread = new ThinThread(overlay->pixmap().toImage());
+      if (!document.IsOpen())
+      {
+         return;
+      }
 
-      connect(thinThread, &ThinThread::resultReady, this, &MainWindow::HandleFloodFinished);
+      ThinThread* thinThread = new ThinThread(document.Overlay());
+
+      //the skeleton goes over the untouched picture
+      connect(thinThread, &ThinThread::resultReady, this, [=](const QImage& s, const int& numPixels) {
+         document.CommitBoth(tr("Thin"), document.Source(), s);
+         ShowDocument();
+         this->statusBarLabel->setText(QString::number(numPixels/3.06) + " mm");
+      });
+      connect(thinThread, &ThinThread::widthReady, this, &MainWindow::HandleWidthProfile);
       connect(thinThread, &ThinThread::finished, thinThread, &QObject::deleteLater);
-      thinThread->start();
-      p->setPixmap(QPixmap::fromImage(img));
+      Scheduler::Global().Submit(thinThread, Scheduler::Priority::Full, "thin");
       });
 
    
    QPushButton* labelButton = new QPushButton(tr("Label"));
    QObject::connect(labelButton, &QPushButton::clicked, this, [=]() {
-      LabelThread* thinThread = new LabelThread(p->pixmap().toImage());
-      connect(thinThread, &LabelThread::resultReady, this, &MainWindow::HandleFloodFinished);
+      if (!document.IsOpen())
+      {
+         return;
+      }
+
+      LabelThread* thinThread = new LabelThread(document.Working());
+      connect(thinThread, &LabelThread::resultReady, this, [=](const QImage& s, const int& numPixels) {
+         document.CommitOverlay(tr("Label"), s);
+         ShowDocument();
+         this->statusBarLabel->setText(QString::number(numPixels/3.06) + " mm");
+      });
       connect(thinThread, &LabelThread::finished, thinThread, &QObject::deleteLater);
-      thinThread->start();
+      Scheduler::Global().Submit(thinThread, Scheduler::Priority::Full, "label");
       });
 
+   toolbar->addWidget(CreateDenoiseControls());
 	toolbar->addWidget(CreateThresholdControls());
    toolbar->addWidget(CreateConnectivityButtons());
    toolbar->addWidget(cleanButton);
+   toolbar->addWidget(shapeFilterEdit);
+   toolbar->addWidget(splitButton);
+   toolbar->addWidget(splitFilterEdit);
+   toolbar->addWidget(splitDepthSpinBox);
+   toolbar->addWidget(morphRadiusSpinBox);
    toolbar->addWidget(dilateButton);
    toolbar->addWidget(erodeButton);
 
@@ -126,6 +457,95 @@ void MainWindow::CreateToolbars()
    toolbar->addWidget(labelButton);
 }
 
+QGroupBox* MainWindow::CreateDenoiseControls()
+{
+   //these work on whatever the thresholds would see, so Median, Smooth and
+   //Correct can be chained and the result is what gets thresholded
+   QGroupBox* denoiseBox = new QGroupBox(tr("Denoise"));
+   QVBoxLayout* denoiseControls = new QVBoxLayout(denoiseBox);
+   denoiseControls->setContentsMargins(0, 0, 0, 0);
+
+   QWidget* medianWidget = new QWidget();
+   QHBoxLayout* medianLayout = new QHBoxLayout(medianWidget);
+   medianLayout->setContentsMargins(0, 0, 0, 0);
+
+   QSpinBox* medianRadiusSpinBox = new QSpinBox();
+   medianRadiusSpinBox->setRange(0, Denoise::MAX_MEDIAN_RADIUS);
+   medianRadiusSpinBox->setSpecialValueText(tr("Off"));
+   QPushButton* medianButton = new QPushButton(tr("Median"));
+   medianLayout->addWidget(new QLabel("Radius:"));
+   medianLayout->addWidget(medianRadiusSpinBox);
+   medianLayout->addWidget(medianButton);
+
+   QWidget* smoothWidget = new QWidget();
+   QHBoxLayout* smoothLayout = new QHBoxLayout(smoothWidget);
+   smoothLayout->setContentsMargins(0, 0, 0, 0);
+
+   QDoubleSpinBox* sigmaSpinBox = new QDoubleSpinBox();
+   sigmaSpinBox->setRange(0, 100);
+   sigmaSpinBox->setSingleStep(0.5);
+   sigmaSpinBox->setSpecialValueText(tr("Off"));
+   QPushButton* smoothButton = new QPushButton(tr("Smooth"));
+   smoothLayout->addWidget(new QLabel("Sigma:"));
+   smoothLayout->addWidget(sigmaSpinBox);
+   smoothLayout->addWidget(smoothButton);
+
+   QObject::connect(medianRadiusSpinBox, QOverload<int>::of(&QSpinBox::valueChanged), this, [=](int radius) {
+      this->medianRadius = radius;
+      });
+
+   QObject::connect(sigmaSpinBox, QOverload<double>::of(&QDoubleSpinBox::valueChanged), this, [=](double sigma) {
+      this->smoothSigma = sigma;
+      });
+
+   QObject::connect(medianButton, &QPushButton::clicked, this, [=]() {
+      if (!document.IsOpen() || medianRadius <= 0)
+      {
+         return;
+      }
+
+      Pipeline::Params preprocessing = document.Preprocessing();
+      preprocessing.medianRadius = medianRadius;
+      Preprocess(tr("Median"), preprocessing);
+      });
+
+   QObject::connect(smoothButton, &QPushButton::clicked, this, [=]() {
+      if (!document.IsOpen() || smoothSigma <= 0)
+      {
+         return;
+      }
+
+      Pipeline::Params preprocessing = document.Preprocessing();
+      preprocessing.smoothSigma = smoothSigma;
+      Preprocess(tr("Smooth"), preprocessing);
+      });
+
+   denoiseControls->addWidget(medianWidget);
+   denoiseControls->addWidget(smoothWidget);
+
+   return denoiseBox;
+}
+
+void MainWindow::Preprocess(const QString& label, const Pipeline::Params& preprocessing)
+{
+   //always from the source, so pressing a button twice doesn't apply it twice
+   const QImage source = document.Source();
+   PreprocessThread* workerThread = new PreprocessThread(source, preprocessing);
+
+   QObject::connect(workerThread, &PreprocessThread::resultReady, this, [=](const QImage& result) {
+      //a different picture got opened in the meantime
+      if (document.Source().cacheKey() != source.cacheKey())
+      {
+         return;
+      }
+
+      document.CommitInput(label, result, preprocessing);
+      ShowDocument();
+      });
+   QObject::connect(workerThread, &PreprocessThread::finished, workerThread, &QObject::deleteLater);
+   Scheduler::Global().Submit(workerThread, Scheduler::Priority::Full, "preprocess");
+}
+
 QGroupBox* MainWindow::CreateThresholdControls()
 {
    QGroupBox* threshBox = new QGroupBox(tr("Threshold"));
@@ -142,8 +562,16 @@ QGroupBox* MainWindow::CreateThresholdControls()
    QSpinBox* threshSpinBox = new QSpinBox();
    threshSpinBox->setRange(MIN_THRESH_VAL, MAX_THRESH_VAL);
 
+   QCheckBox* liveCleanCheckBox = new QCheckBox(tr("Live Clean"));
+
    threshSliderLayout->addWidget(threshSlider);
    threshSliderLayout->addWidget(threshSpinBox);
+   threshSliderLayout->addWidget(liveCleanCheckBox);
+
+   QObject::connect(liveCleanCheckBox, &QCheckBox::toggled, this, [=](bool checked) {
+      this->liveClean = checked;
+      HandleThresholdSliderChanged(threshSlider->value());
+      });
 
    QObject::connect(threshSlider, &QSlider::valueChanged, this, &MainWindow::HandleThresholdSliderChanged);
 
@@ -154,6 +582,60 @@ QGroupBox* MainWindow::CreateThresholdControls()
                     [=](int threshValue){ threshSlider->setValue(threshValue); });
    
    
+   //flat field and background subtraction, run before any of the thresholds
+   //below. With the illumination evened out the manual slider or Auto Otsu
+   //usually does what the local thresholds were needed for.
+   QWidget* backgroundWidget = new QWidget();
+   QHBoxLayout* backgroundLayout = new QHBoxLayout(backgroundWidget);
+   backgroundLayout->setContentsMargins(0, 0, 0, 0);
+
+   QSpinBox* backgroundRadiusSpinBox = new QSpinBox();
+   backgroundRadiusSpinBox->setRange(0, 500);
+   backgroundRadiusSpinBox->setSpecialValueText(tr("Off"));
+   QPushButton* flatFieldButton = new QPushButton(tr("Flat Field..."));
+   QPushButton* correctButton = new QPushButton(tr("Correct"));
+   backgroundLayout->addWidget(new QLabel("Background Radius:"));
+   backgroundLayout->addWidget(backgroundRadiusSpinBox);
+   backgroundLayout->addWidget(flatFieldButton);
+   backgroundLayout->addWidget(correctButton);
+
+   QObject::connect(backgroundRadiusSpinBox, QOverload<int>::of(&QSpinBox::valueChanged), this, [=](int radius) {
+      this->backgroundRadius = radius;
+      });
+
+   QObject::connect(flatFieldButton, &QPushButton::clicked, this, [=]() {
+      QFileDialog dialog;
+      initializeImageFileDialog(dialog, QFileDialog::AcceptOpen);
+      auto filePath = dialog.getOpenFileName(this, tr("Empty slide reference"));
+
+      if (filePath.isEmpty())
+      {
+         flatFieldGain.clear();
+         this->statusBarLabel->setText("Flat field off");
+         return;
+      }
+
+      OpenImageThread* workerThread = new OpenImageThread(filePath);
+      QObject::connect(workerThread, &OpenImageThread::resultReady, this, [=](const QImage& reference, const QString& path) {
+         flatFieldGain = Background::FlatFieldGain(reference);
+         this->statusBarLabel->setText(flatFieldGain.isEmpty() ? "Could not open " + path : "Flat field " + path);
+         });
+      QObject::connect(workerThread, &OpenImageThread::finished, workerThread, &QObject::deleteLater);
+      Scheduler::Global().Submit(workerThread, Scheduler::Priority::Interactive, "flatfield");
+      });
+
+   QObject::connect(correctButton, &QPushButton::clicked, this, [=]() {
+      if (!document.IsOpen())
+      {
+         return;
+      }
+
+      Pipeline::Params preprocessing = document.Preprocessing();
+      preprocessing.flatFieldGain = flatFieldGain;
+      preprocessing.backgroundRadius = backgroundRadius;
+      Preprocess(tr("Background"), preprocessing);
+      });
+
    QWidget* otsuCalcWidget = new QWidget();
    QHBoxLayout* otsuLayout = new QHBoxLayout(otsuCalcWidget);
    otsuLayout->setContentsMargins(0, 0, 0, 0);
@@ -173,14 +655,45 @@ QGroupBox* MainWindow::CreateThresholdControls()
 //   otsuLayout->addWidget(this->otsuThresholdLabel);
 //   otsuLayout->addWidget(otsuButton);
    QObject::connect(otsuButton, &QPushButton::clicked, this, [=]() {
-      OtsuThresholdThread* otsuThread = new OtsuThresholdThread(otsuAreaLineEdit->text().toInt(), otsuCLineEdit->text().toInt(), img);
+      OtsuThresholdThread* otsuThread = new OtsuThresholdThread(otsuAreaLineEdit->text().toInt(), otsuCLineEdit->text().toInt(), ThresholdInput());
 
       QObject::connect(otsuThread, &OtsuThresholdThread::ProgressUpdate, this, &MainWindow::HandleProgressUpdate);
       connect(otsuThread, &OtsuThresholdThread::resultReady, this, &MainWindow::HandleThresholdFinished);
       connect(otsuThread, &OtsuThresholdThread::finished, otsuThread, &QObject::deleteLater);
-      otsuThread->start();
+      Scheduler::Global().Submit(otsuThread, Scheduler::Priority::Full, "threshold");
       });
    
+   QWidget* globalOtsuWidget = new QWidget();
+   QHBoxLayout* globalOtsuLayout = new QHBoxLayout(globalOtsuWidget);
+   globalOtsuLayout->setContentsMargins(0, 0, 0, 0);
+
+   //more than one level is for the halo around the cells, the slider gets the
+   //top threshold so only the brightest class is kept
+   QSpinBox* otsuLevelsSpinBox = new QSpinBox();
+   otsuLevelsSpinBox->setRange(1, 4);
+   QPushButton* globalOtsuButton = new QPushButton(tr("Auto Otsu"));
+   globalOtsuLayout->addWidget(new QLabel("Levels:"));
+   globalOtsuLayout->addWidget(otsuLevelsSpinBox);
+   globalOtsuLayout->addWidget(globalOtsuButton);
+   globalOtsuLayout->addWidget(this->otsuThresholdLabel);
+
+   QObject::connect(globalOtsuButton, &QPushButton::clicked, this, [=]() {
+      GlobalOtsuThread* globalOtsuThread = new GlobalOtsuThread(otsuLevelsSpinBox->value(), ThresholdInput());
+
+      connect(globalOtsuThread, &GlobalOtsuThread::resultReady, this, [=](const QVector<int>& thresholds) {
+         HandleOtsuThresholdReady(thresholds);
+
+         //for a 16 bit picture the nearest slider position at or below it
+         if (!thresholds.isEmpty())
+         {
+            UpdateSliderLut();
+            threshSlider->setValue(BitDepth::SliderPosition(sliderLut, thresholds.last()));
+         }
+         });
+      connect(globalOtsuThread, &GlobalOtsuThread::finished, globalOtsuThread, &QObject::deleteLater);
+      Scheduler::Global().Submit(globalOtsuThread, Scheduler::Priority::Full, "otsu");
+      });
+
    QWidget* adaptThreshWidget = new QWidget();
    QHBoxLayout* adaptThreshLayout = new QHBoxLayout(adaptThreshWidget);
    adaptThreshLayout->setContentsMargins(0, 0, 0, 0);
@@ -197,54 +710,142 @@ QGroupBox* MainWindow::CreateThresholdControls()
    adaptThreshLayout->addWidget(adaptButton);
 
    QObject::connect(adaptButton, &QPushButton::clicked, this, [=]() {
-      AdaptThresholdThread* workerThread = new AdaptThresholdThread(areaLineEdit->text().toInt(), cLineEdit->text().toInt(), img);
+      AdaptThresholdThread* workerThread = new AdaptThresholdThread(areaLineEdit->text().toInt(), cLineEdit->text().toInt(), ThresholdInput());
       this->statusBarLabel->setText("Calculating Adaptive Threshold:");
       QObject::connect(workerThread, &AdaptThresholdThread::resultReady, this, &MainWindow::HandleThresholdFinished);
       QObject::connect(workerThread, &AdaptThresholdThread::ProgressUpdate, this, &MainWindow::HandleProgressUpdate);
       QObject::connect(workerThread, &AdaptThresholdThread::finished, workerThread, &QObject::deleteLater);
-      workerThread->start();
+      Scheduler::Global().Submit(workerThread, Scheduler::Priority::Full, "threshold");
       
       });
    
+   QWidget* localThreshWidget = new QWidget();
+   QHBoxLayout* localThreshLayout = new QHBoxLayout(localThreshWidget);
+   localThreshLayout->setContentsMargins(0, 0, 0, 0);
+
+   QComboBox* localModeCombo = new QComboBox();
+   localModeCombo->addItem(tr("Sauvola"), (int)LocalThreshold::Mode::Sauvola);
+   localModeCombo->addItem(tr("Niblack"), (int)LocalThreshold::Mode::Niblack);
+   QLineEdit* localAreaLineEdit = new QLineEdit();
+   localAreaLineEdit->setMaximumWidth(40);
+   QLineEdit* localKLineEdit = new QLineEdit();
+   localKLineEdit->setMaximumWidth(40);
+   QLineEdit* localCLineEdit = new QLineEdit();
+   localCLineEdit->setMaximumWidth(40);
+   QPushButton* localButton = new QPushButton(tr("Run"));
+   localThreshLayout->addWidget(localModeCombo);
+   localThreshLayout->addWidget(new QLabel("Area:"));
+   localThreshLayout->addWidget(localAreaLineEdit);
+   localThreshLayout->addWidget(new QLabel("k:"));
+   localThreshLayout->addWidget(localKLineEdit);
+   localThreshLayout->addWidget(new QLabel("C:"));
+   localThreshLayout->addWidget(localCLineEdit);
+   localThreshLayout->addWidget(localButton);
+
+   QObject::connect(localButton, &QPushButton::clicked, this, [=]() {
+      LocalThresholdThread* workerThread = new LocalThresholdThread((LocalThreshold::Mode)localModeCombo->currentData().toInt(),
+                                                                    localAreaLineEdit->text().toInt(),
+                                                                    localKLineEdit->text().toDouble(),
+                                                                    localCLineEdit->text().toInt(),
+                                                                    ThresholdInput());
+
+      QObject::connect(workerThread, &LocalThresholdThread::resultReady, this, &MainWindow::HandleThresholdFinished);
+      QObject::connect(workerThread, &LocalThresholdThread::finished, workerThread, &QObject::deleteLater);
+      Scheduler::Global().Submit(workerThread, Scheduler::Priority::Full, "threshold");
+      });
+
+   thresholdControls->addWidget(backgroundWidget);
    thresholdControls->addWidget(manualSlider);
    thresholdControls->addWidget(otsuCalcWidget);
+   thresholdControls->addWidget(globalOtsuWidget);
    thresholdControls->addWidget(adaptThreshWidget);
+   thresholdControls->addWidget(localThreshWidget);
    this->operationProgress->setVisible(false);
 
    
    return threshBox;
 }
 
-void MainWindow::HandleOtsuThresholdReady(const int& t)
+void MainWindow::HandleOtsuThresholdReady(const QVector<int>& thresholds)
 {
-   this->otsuThresholdLabel->setText(QString::number(t));
+   QStringList text;
+
+   for (const auto& t : thresholds)
+   {
+      text.append(QString::number(t));
+   }
+
+   this->otsuThresholdLabel->setText(text.isEmpty() ? "NA" : text.join(", "));
 }
 
 void MainWindow::HandleThresholdSliderChanged(int value)
 {
-   ThresholdThread* workerThread = new ThresholdThread(value, img);
+   UpdateSliderLut();
+
+   if (liveClean)
+   {
+      labeler->Request(value);
+
+      IncrementalCleanThread* cleanThread = new IncrementalCleanThread(labeler, sliderLevels, MIN_COMPONENT_SIZE);
 
-   QObject::connect(workerThread, &ThresholdThread::resultReady, this, &MainWindow::HandleThresholdFinished);
+      QObject::connect(cleanThread, &IncrementalCleanThread::resultReady, this, &MainWindow::HandleThresholdPreview);
+      QObject::connect(cleanThread, &IncrementalCleanThread::finished, cleanThread, &QObject::deleteLater);
+      Scheduler::Global().Submit(cleanThread, Scheduler::Priority::Interactive, "preview");
+      return;
+   }
+
+   ThresholdThread* workerThread = new ThresholdThread(sliderLut[value], ThresholdInput());
+
+   QObject::connect(workerThread, &ThresholdThread::resultReady, this, &MainWindow::HandleThresholdPreview);
    QObject::connect(workerThread, &ThresholdThread::finished, workerThread, &QObject::deleteLater);
-	workerThread->start();
+	Scheduler::Global().Submit(workerThread, Scheduler::Priority::Interactive, "preview");
 }
 
 void MainWindow::HandleThresholdFinished(const QImage& val)
 {
-	p->setPixmap(QPixmap::fromImage(val));
+   HandleStageFinished(tr("Threshold"), val);
+}
+
+void MainWindow::HandleThresholdPreview(const QImage& val)
+{
+   //a slider drag is one undo step
+   document.Commit(tr("Threshold"), val, true);
+   ShowDocument();
+}
+
+void MainWindow::HandleStageFinished(const QString& label, const QImage& val)
+{
+   document.Commit(label, val);
+   ShowDocument();
 }
 
 void MainWindow::HandleFloodFinished(const QImage& val, const int& numPixels)
 {
    this->statusBarLabel->setText(QString::number(numPixels/3.06) + " mm");
-	if (overlay == nullptr)
-	{
-		overlay = scene->addPixmap(QPixmap::fromImage(val));
-	}
-	else
-	{
-		overlay->setPixmap(QPixmap::fromImage(val));
-	}
+   document.CommitOverlay(tr("Select"), val, true);
+   ShowDocument();
+}
+
+void MainWindow::HandleWidthProfile(const QVector<double>& widths)
+{
+   if (widths.isEmpty())
+   {
+      return;
+   }
+
+   double sum = 0;
+   double widest = 0;
+
+   for (const auto& w : widths)
+   {
+      sum += w;
+      widest = std::max(widest, w);
+   }
+
+   //same pixel scale the length uses
+   this->statusBarLabel->setText(this->statusBarLabel->text()
+                                 + "  width: " + QString::number(sum / widths.count() / 3.06)
+                                 + " mm (max " + QString::number(widest / 3.06) + " mm)");
 }
 
 void MainWindow::HandleProgressUpdate(const int& percentDone, const QString& operation)
@@ -274,22 +875,22 @@ void MainWindow::HandleClickEvent(QEvent* event)
 
 	QString stat = "";
 
-	if (img.valid(n->scenePos().toPoint()))
+	if (document.Source().valid(n->scenePos().toPoint()))
 	{
 		stat = "Clicked: {"
 			+ QString::number(n->scenePos().toPoint().x())
 			+ " , "
 			+ QString::number(n->scenePos().toPoint().y())
 			+ "} Value: "
-			+ QString::number(qGray(img.pixel(n->scenePos().toPoint())));
+			+ QString::number(qGray(document.Source().pixel(n->scenePos().toPoint())));
 
 		this->lastClickedPixel = Pixel(n);
 
-		FloodThread* workerThread = new FloodThread(p->pixmap().toImage(), Pixel(n), (*currentConn));
+		FloodThread* workerThread = new FloodThread(document.Working(), Pixel(n), (*currentConn));
 
       QObject::connect(workerThread, &FloodThread::resultReady, this, &MainWindow::HandleFloodFinished);
       QObject::connect(workerThread, &FloodThread::finished, workerThread, &QObject::deleteLater);
-		workerThread->start();
+		Scheduler::Global().Submit(workerThread, Scheduler::Priority::Interactive, "flood");
 	}
 	else
 	{
@@ -346,21 +947,21 @@ QGroupBox* MainWindow::CreateConnectivityButtons()
 	QObject::connect(fourWay, &QRadioButton::clicked, this, [=]() {
 		currentConn = fourConnn;
 
-		FloodThread* workerThread = new FloodThread(p->pixmap().toImage(), Pixel(this->lastClickedPixel), (*currentConn));
+		FloodThread* workerThread = new FloodThread(document.Working(), Pixel(this->lastClickedPixel), (*currentConn));
 
 		connect(workerThread, &FloodThread::resultReady, this, &MainWindow::HandleFloodFinished);
 		connect(workerThread, &FloodThread::finished, workerThread, &QObject::deleteLater);
-		workerThread->start();
+		Scheduler::Global().Submit(workerThread, Scheduler::Priority::Interactive, "flood");
 		});
 
 	QObject::connect(eightWay, &QRadioButton::clicked, this, [=]() {
 		currentConn = eightConn;
 
-		FloodThread* workerThread = new FloodThread(p->pixmap().toImage(), Pixel(this->lastClickedPixel), (*currentConn));
+		FloodThread* workerThread = new FloodThread(document.Working(), Pixel(this->lastClickedPixel), (*currentConn));
 
 		connect(workerThread, &FloodThread::resultReady, this, &MainWindow::HandleFloodFinished);
 		connect(workerThread, &FloodThread::finished, workerThread, &QObject::deleteLater);
-		workerThread->start();
+		Scheduler::Global().Submit(workerThread, Scheduler::Priority::Interactive, "flood");
 		});
 
 	return groupBox;
@@ -18,6 +18,8 @@
 #include <QPixmap>
 #include <QProgressBar>
 #include <QPushButton>
+#include <QCheckBox>
+#include <QComboBox>
 #include <QRadioButton>
 #include <QRect>
 #include <QScreen>
@@ -34,11 +36,32 @@
 #include <QVector>
 #include <QtConcurrent/QtConcurrent>
 #include <QFuture>
+#include <QFile>
+#include <QTextStream>
+#include <QSharedPointer>
 
 #include <iostream>
 #include <algorithm>
 
 #include "ImageOps.h"
+#include "SimdKernels.h"
+#include "Otsu.h"
+#include "LocalThreshold.h"
+#include "DistanceTransform.h"
+#include "IncrementalLabel.h"
+#include "MaxTree.h"
+#include "Batch.h"
+#include "Stack.h"
+#include "Sweep.h"
+#include "Scheduler.h"
+#include "Document.h"
+#include "Background.h"
+#include "BitDepth.h"
+#include "Denoise.h"
+#include "Contour.h"
+#include "ShapeFilter.h"
+#include "Watershed.h"
+#include "TiledImageItem.h"
 
 class MainWindow : public QMainWindow
 {
@@ -54,32 +77,350 @@ public:
 
 private slots:
 	void OpenFile();
+   void HandleImageLoaded(const QImage& loaded, const QString& filePath);
+   void BatchMeasure();
+   void SweepParameters();
+   void OpenStack();
+   void HandleStackFrame(const QImage& frame, const QImage& cells, const QString& status);
 	void HandleClickEvent(QEvent* event);
 	void HandleThresholdSliderChanged(int value);
 	void HandleThresholdFinished(const QImage& val);
+   void HandleThresholdPreview(const QImage& val);
 	void HandleFloodFinished(const QImage& val, const int& numberPixels);
    void HandleProgressUpdate(const int& percentDone, const QString& operation);
-   void HandleOtsuThresholdReady(const int& t);
+   void HandleWidthProfile(const QVector<double>& widths);
+   void HandleOtsuThresholdReady(const QVector<int>& thresholds);
 	bool eventFilter(QObject* target, QEvent* event);
 
 private:
 	QMenu* fileMenu;
+   QMenu* editMenu;
 	QAction* openAct;
+   QAction* batchAct;
+   QAction* sweepAct;
+   QAction* stackAct;
+   QAction* undoAct;
+   QAction* redoAct;
 	QGraphicsScene* scene;
 	QGraphicsView* view;
-	QImage img;
+
+   //source image plus the undo history of every edit made to it
+   Document document;
+   void ShowDocument();
+
+   //the settings the Median, Smooth and Correct buttons add to the document's
+   //preprocessing when they're pressed
+   QVector<float> flatFieldGain;
+   int backgroundRadius = 0;
+   int medianRadius = 0;
+   double smoothSigma = 0;
+   QString shapeFilter;
+   QString splitFilter;
+   double splitDepth = 2;
+   QImage ThresholdInput() const;
+
+   //what each slider position thresholds ThresholdInput() at, and the 8 bit
+   //copy of it the live clean labels. Only differ from the identity and the
+   //picture itself for 16 bit pictures.
+   QVector<int> sliderLut;
+   QImage sliderLevels;
+   qint64 sliderLutKey = 0;
+   void UpdateSliderLut();
+   void Preprocess(const QString& label, const Pipeline::Params& preprocessing);
+   QGroupBox* CreateDenoiseControls();
+   void HandleStageFinished(const QString& label, const QImage& val);
    QProgressBar* operationProgress = nullptr;
    QLabel* statusBarLabel = nullptr;
 	Pixel lastClickedPixel = {};
-	QGraphicsPixmapItem* p = nullptr;
-	QGraphicsPixmapItem* overlay = nullptr;
+	TiledImageItem* p = nullptr;
+	TiledImageItem* overlay = nullptr;
    QLabel* otsuThresholdLabel = new QLabel("NA");
 	QGroupBox* CreateConnectivityButtons();
    QGroupBox* CreateThresholdControls();
 	QVector<Pixel>* currentConn = nullptr;
+
+   //when set the slider drives the incremental labeler and shows the cleaned
+   //components instead of the raw threshold
+   bool liveClean = false;
+   QSharedPointer<IncrementalLabeler> labeler = QSharedPointer<IncrementalLabeler>(new IncrementalLabeler());
+};
+
+//the source through the median, smooth and background settings, see
+//Document::CommitInput
+class PreprocessThread : public ScheduledJob
+{
+   Q_OBJECT
+public:
+   PreprocessThread(const QImage& img, const Pipeline::Params& params)
+      : img(img)
+      , params(params) {};
+
+   void run() override
+   {
+      QImage result = Pipeline::Preprocess(img, params);
+
+      if (!Cancelled())
+      {
+         emit resultReady(result);
+      }
+   }
+
+private:
+   QImage img;
+   Pipeline::Params params;
+
+signals:
+   void resultReady(const QImage& result);
+};
+
+class OpenImageThread : public ScheduledJob
+{
+   Q_OBJECT
+public:
+   OpenImageThread(const QString& filePath)
+      : filePath(filePath) {};
+
+   void run() override
+   {
+      //big TIFFs take a while to decode, keep that off the GUI thread
+      QImageReader reader(filePath);
+      QImage loaded = reader.read();
+
+      if (!Cancelled())
+      {
+         emit resultReady(loaded, filePath);
+      }
+   }
+
+private:
+   QString filePath;
+
+signals:
+   void resultReady(const QImage& s, const QString& filePath);
+};
+
+class BatchThread : public ScheduledJob
+{
+   Q_OBJECT
+public:
+   BatchThread(const QStringList& paths, const QString& outputPath, const Batch::Options& options)
+      : paths(paths)
+      , outputPath(outputPath)
+      , options(options) {};
+
+   void run() override
+   {
+      QFile output(outputPath);
+
+      if (!output.open(QIODevice::WriteOnly | QIODevice::Text))
+      {
+         emit resultReady("Could not write " + outputPath);
+         return;
+      }
+
+      QTextStream out(&output);
+      out << Pipeline::CsvHeader() << "\n";
+
+      //pictures that couldn't be read go to the status bar with the progress
+      //and the summary, stdout is the command line's
+      int done = 0;
+      QStringList failures;
+      auto stats = Batch::Run(paths, options, [&](const DecodedFrame& frame, const Pipeline::Result& result) {
+         if (frame.error.isEmpty())
+         {
+            const QString rows = Pipeline::CsvRows(frame.path, result);
+
+            //CsvRows leaves the last newline off, the next image's rows need it
+            if (!rows.isEmpty())
+            {
+               out << rows << "\n";
+            }
+         }
+         else
+         {
+            failures.push_back(frame.path + ": " + frame.error);
+         }
+
+         done++;
+         emit ProgressUpdate(((double)done / paths.count()) * 98, "Batch: " + QString::number(done) + "/" + QString::number(paths.count())
+                                                                 + (failures.isEmpty() ? QString() : ", " + failures.back()));
+      });
+
+      emit ProgressUpdate(100, "");
+
+      if (failures.isEmpty())
+      {
+         emit resultReady(stats.Summary());
+         return;
+      }
+
+      //the first few, a whole folder of them wouldn't fit on the status bar
+      const int listed = qMin(failures.count(), 3);
+      QString failed = failures.mid(0, listed).join("; ");
+
+      if (listed < failures.count())
+      {
+         failed += QString("; and %1 more").arg(failures.count() - listed);
+      }
+
+      emit resultReady(stats.Summary() + ". Could not read " + failed);
+   }
+
+private:
+   QStringList paths;
+   QString outputPath;
+   Batch::Options options;
+
+signals:
+   void ProgressUpdate(const int& value, const QString& operationName);
+   void resultReady(const QString& summary);
+};
+
+class SweepThread : public ScheduledJob
+{
+   Q_OBJECT
+public:
+   SweepThread(const QVector<Sweep::Reference>& references, const QString& outputPath, const Pipeline::Params& params)
+      : references(references)
+      , outputPath(outputPath)
+      , params(params) {};
+
+   void run() override
+   {
+      emit ProgressUpdate(5, "Sweep: " + QString::number(references.count()) + " pictures");
+      auto report = Sweep::Run(references, Sweep::Grid(), params);
+
+      QFile output(outputPath);
+
+      if (!output.open(QIODevice::WriteOnly | QIODevice::Text))
+      {
+         emit ProgressUpdate(100, "");
+         emit resultReady("Could not write " + outputPath);
+         return;
+      }
+
+      QTextStream out(&output);
+      out << report.Csv();
+
+      emit ProgressUpdate(100, "");
+      emit resultReady(report.Summary());
+   }
+
+private:
+   QVector<Sweep::Reference> references;
+   QString outputPath;
+   Pipeline::Params params;
+
+signals:
+   void ProgressUpdate(const int& value, const QString& operationName);
+   void resultReady(const QString& summary);
+};
+
+class StackThread : public ScheduledJob
+{
+   Q_OBJECT
+public:
+   StackThread(const QStringList& paths, const QString& outputPath, const Stack::Options& options)
+      : paths(paths)
+      , outputPath(outputPath)
+      , options(options) {};
+
+   void run() override
+   {
+      Stack::FrameReader reader(paths);
+      Stack::Tracker tracker(options);
+      QImage frame;
+      qint64 processed = 0;
+      qint64 total = 0;
+      qint64 ns = 0;
+
+      while (!Cancelled() && reader.Next(frame))
+      {
+         auto stats = tracker.Push(frame);
+         processed += stats.pixelsProcessed;
+         total += (qint64)frame.width() * frame.height();
+         ns += stats.ns;
+
+         emit frameReady(frame, tracker.Render(), reader.Source() + "  cells: " + QString::number(stats.cells)
+                         + " (" + QString::number(stats.reused) + " unchanged)");
+         emit ProgressUpdate(((double)tracker.FrameCount() / qMax(1, reader.Count())) * 98, "Stack: ");
+      }
+
+      QFile output(outputPath);
+
+      if (!output.open(QIODevice::WriteOnly | QIODevice::Text))
+      {
+         emit resultReady("Could not write " + outputPath);
+         return;
+      }
+
+      QTextStream out(&output);
+      out << Stack::TracksCsvHeader() << "\n" << Stack::TracksCsv(tracker.Tracks()) << "\n";
+
+      emit ProgressUpdate(100, "");
+      emit resultReady(QString::number(tracker.FrameCount()) + " frames, "
+                       + QString::number(tracker.Tracks().count()) + " tracks in "
+                       + QString::number(ns / 1e9, 'f', 2) + " s, "
+                       + QString::number(total > 0 ? 100.0 * processed / total : 0, 'f', 1) + "% of pixels processed");
+   }
+
+private:
+   QStringList paths;
+   QString outputPath;
+   Stack::Options options;
+
+signals:
+   void ProgressUpdate(const int& value, const QString& operationName);
+   void frameReady(const QImage& frame, const QImage& cells, const QString& status);
+   void resultReady(const QString& summary);
+};
+
+class MorphologyThread : public ScheduledJob
+{
+   Q_OBJECT
+public:
+   enum class Op
+   {
+      Dilate,
+      Erode
+   };
+
+   MorphologyThread(const Op& op, const int& radius, const QImage& img)
+      : op(op)
+      , radius(radius)
+      , img(img) {};
+
+   void run() override
+   {
+      QImage result;
+
+      //radius 1 is the original 3x3 pass, anything bigger is a disk done in one
+      //go off the distance transform
+      if (radius > 1)
+      {
+         result = op == Op::Dilate ? DistanceTransform::DilateDisk(img, radius) : DistanceTransform::ErodeDisk(img, radius);
+      }
+      else
+      {
+         result = op == Op::Dilate ? ImageOps::Dilate(img) : ImageOps::Erode(img);
+      }
+
+      if (!Cancelled())
+      {
+         emit resultReady(result);
+      }
+   }
+
+private:
+   Op op = Op::Dilate;
+   int radius = 1;
+   QImage img;
+
+signals:
+   void resultReady(const QImage& s);
 };
 
-class ThresholdThread : public QThread
+class ThresholdThread : public ScheduledJob
 {
 	Q_OBJECT
 public:
@@ -89,7 +430,12 @@ public:
 
 	void run() override
 	{
-		emit resultReady(ImageOps::Threshold(img, threshVal));
+		QImage result = SimdKernels::Threshold(img, threshVal);
+
+		if (!Cancelled())
+		{
+			emit resultReady(result);
+		}
 	}
 
 private:
@@ -100,7 +446,35 @@ signals:
 	void resultReady(const QImage& s);
 };
 
-class AdaptThresholdThread : public QThread
+class IncrementalCleanThread : public ScheduledJob
+{
+   Q_OBJECT
+public:
+   IncrementalCleanThread(const QSharedPointer<IncrementalLabeler>& labeler, const QImage& img, const int& minSize)
+      : labeler(labeler)
+      , img(img)
+      , minSize(minSize) {};
+
+   void run() override
+   {
+      QImage result = labeler->Update(img, minSize);
+
+      if (!Cancelled())
+      {
+         emit resultReady(result);
+      }
+   }
+
+private:
+   QSharedPointer<IncrementalLabeler> labeler;
+   QImage img;
+   int minSize = MIN_COMPONENT_SIZE;
+
+signals:
+   void resultReady(const QImage& s);
+};
+
+class AdaptThresholdThread : public ScheduledJob
 {
    Q_OBJECT
 public:
@@ -111,22 +485,15 @@ public:
 
    void run() override
    {
-      QImage returnImg = img;
+      //window mean less C is Niblack with k = 0, off the integral images and
+      //at the picture's own depth
+      const QImage returnImg = LocalThreshold::Threshold(img, LocalThreshold::Mode::Niblack, area, 0, 128, c);
+      emit ProgressUpdate(100, "");
 
-      for (int y = 0; y < img.height(); y++)
+      if (!Cancelled())
       {
-         QRgb* line = (QRgb*)returnImg.scanLine(y);
-         
-         for (int x = 0; x < img.width(); x++)
-         {
-            // line[x] has an individual pixel
-            line[x] = (qGray(img.pixel(x, y)) > (ImageOps::GetAreaMean(img, Pixel(x,y), area) - c))? QColor(Qt::white).rgb() : 0;
-         }
-         
-         emit ProgressUpdate(((double)y/img.height())*100, "Adapt Threshold: ");
+         emit resultReady(returnImg);
       }
-      
-      emit resultReady(returnImg);
    }
 
 private:
@@ -139,7 +506,7 @@ signals:
    void resultReady(const QImage& s);
 };
 
-class OtsuThresholdThread : public QThread
+class OtsuThresholdThread : public ScheduledJob
 {
    Q_OBJECT
 public:
@@ -150,22 +517,17 @@ public:
 
    void run() override
    {
-      QImage returnImg = img;
+      ProgressIndicator progress;
+      QObject::connect(&progress, &ProgressIndicator::ProgressUpdate, this, [this](const int& value, const QString& name) { emit ProgressUpdate(value, name); }, Qt::DirectConnection);
 
-      for (int y = 0; y < img.height(); y++)
-      {
-         QRgb* line = (QRgb*)returnImg.scanLine(y);
-         
-         for (int x = 0; x < img.width(); x++)
-         {
-            auto hist = ImageOps::GetAreaHistogram(img, Pixel(x,y), area);
+      const QImage returnImg = ImageOps::LocalOtsuThreshold(img, area, c, &progress);
 
-            line[x] = qGray(img.pixel(x, y)) > (ImageOps::CalculateOtsu(img, hist, 4*area*area)-c) ? QColor(Qt::white).rgb() : 0;
-         }
-         
-         emit ProgressUpdate(((double)y/img.height())*100, "Otsu Threshold: ");
+      if (Cancelled())
+      {
+         emit ProgressUpdate(100, "");
+         return;
       }
-      
+
       emit resultReady(returnImg);
    }
 
@@ -178,7 +540,109 @@ signals:
    void resultReady(const QImage& s);
 };
 
-class FloodThread : public QThread
+class LocalThresholdThread : public ScheduledJob
+{
+   Q_OBJECT
+public:
+   LocalThresholdThread(const LocalThreshold::Mode& mode, const int& area, const double& k, const int& c, const QImage& img)
+      : mode(mode)
+      , area(area)
+      , k(k)
+      , c(c)
+      , img(img) {};
+
+   void run() override
+   {
+      QImage result = LocalThreshold::Threshold(img, mode, area, k, 128, c);
+
+      if (!Cancelled())
+      {
+         emit resultReady(result);
+      }
+   }
+
+private:
+   LocalThreshold::Mode mode = LocalThreshold::Mode::Sauvola;
+   int area = 0;
+   double k = 0;
+   int c = 0;
+   QImage img;
+
+signals:
+   void resultReady(const QImage& s);
+};
+
+class GlobalOtsuThread : public ScheduledJob
+{
+   Q_OBJECT
+public:
+   GlobalOtsuThread(const int& levels, const QImage& img)
+      : levels(levels)
+      , img(img) {};
+
+   void run() override
+   {
+      if (BitDepth::IsDeep(img))
+      {
+         RunDeep();
+         return;
+      }
+
+      auto hist = Otsu::ImageHistogram(img);
+
+      if (Cancelled())
+      {
+         return;
+      }
+
+      if (levels <= 1)
+      {
+         emit resultReady(QVector<int>({ Otsu::GlobalThreshold(hist) }));
+      }
+      else
+      {
+         emit resultReady(Otsu::MultiThresholds(hist, levels));
+      }
+   }
+
+private:
+   //one threshold at full depth, more than one by the slider's 256 levels since
+   //MultiThresholds' tables at 4096 levels would be 128 MB. 16 bit units either way.
+   void RunDeep()
+   {
+      if (levels <= 1)
+      {
+         const int threshold = Otsu::GlobalThreshold16(img);
+
+         if (!Cancelled())
+         {
+            emit resultReady(QVector<int>({ threshold }));
+         }
+         return;
+      }
+
+      const QVector<int> lut = BitDepth::SliderLut(img);
+      QVector<int> thresholds = Otsu::MultiThresholds(Otsu::ImageHistogram(BitDepth::SliderLevels(img, lut)), levels);
+
+      for (auto& t : thresholds)
+      {
+         t = lut[t];
+      }
+
+      if (!Cancelled())
+      {
+         emit resultReady(thresholds);
+      }
+   }
+
+   int levels = 1;
+   QImage img;
+
+signals:
+   void resultReady(const QVector<int>& thresholds);
+};
+
+class FloodThread : public ScheduledJob
 {
 	Q_OBJECT
 public:
@@ -191,6 +655,11 @@ public:
 	{
       QVector<Pixel> s = ImageOps::Flood(img, startPixel, conn);
 
+      if (Cancelled())
+      {
+         return;
+      }
+
 		emit resultReady(ImageOps::ImageFromPixelSet(img, s, QColor(Qt::red)), s.count());
 	}
 
@@ -203,7 +672,7 @@ signals:
 	void resultReady(const QImage& s, const int& numPixels);
 };
 
-class ThinThread : public QThread
+class ThinThread : public ScheduledJob
 {
    Q_OBJECT
 public:
@@ -212,40 +681,20 @@ public:
 
    void run() override
    {
-      while (true)
-      {
-         auto borderPixels = ImageOps::GetBorderPixels(img);
-         int numRemoved = 0;
-
-         for (const auto& currentPix : borderPixels)
-         {
-            if (ImageOps::IsSimple(img, currentPix) && !ImageOps::IsCurveEnd(img, currentPix))
-            {
-               numRemoved++;
+      //each cell thinned on its own crop, with the distances to the edge of
+      //the untouched cell sampled along its skeleton to get the width for free
+      const QImage objectMask = DistanceTransform::RedForeground(img);
 
-               img.setPixel(QPoint(currentPix.x, currentPix.y), QColor(Qt::black).rgb());
-            }
-         }
+      QVector<double> widths;
+      QVector<Pixel> s = Pipeline::ThinComponents(objectMask, &widths);
 
-         if (numRemoved == 0)
-         {
-            break;
-         }
-      }
-
-      QVector<Pixel> s;
-      for (int y = 0; y < img.height(); y++)
+      if (Cancelled())
       {
-         for (int x = 0; x < img.width(); x++)
-         {
-            if (img.pixel(x, y) == QColor(Qt::red).rgb())
-            {
-               s.push_back(Pixel(x,y));
-            }
-         }
+         return;
       }
 
       emit resultReady(ImageOps::ImageFromPixelSet(img, s, QColor(Qt::red)), s.count());
+      emit widthReady(widths);
    }
 
 private:
@@ -254,6 +703,7 @@ private:
    
 signals:
    void resultReady(const QImage& s, const int& numPix);
+   void widthReady(const QVector<double>& widths);
 };
 
 static bool sorty(const QVector<Pixel> &s1, const QVector<Pixel> &s2)
@@ -261,7 +711,7 @@ static bool sorty(const QVector<Pixel> &s1, const QVector<Pixel> &s2)
    return s1.count() < s2.count();
 }
 
-class LabelThread : public QThread
+class LabelThread : public ScheduledJob
 {
    Q_OBJECT
 public:
@@ -274,6 +724,12 @@ public:
       
       auto b = ImageOps::LabelComponents(img, p);
       
+      if (Cancelled() || b.isEmpty())
+      {
+         delete p;
+         return;
+      }
+
       std::sort(b.begin(), b.end(), sorty);
       emit resultReady(ImageOps::ImageFromPixelSet(img, b.back(), QColor(Qt::red)), b.back().count());
       delete p;
@@ -287,49 +743,65 @@ signals:
    void resultReady(const QImage& s, const int&);
 };
 
-class CleanThread : public QThread
+class CleanThread : public ScheduledJob
 {
    Q_OBJECT
 public:
-   CleanThread(const QImage& img)
-      : img(img) {};
+   CleanThread(const QImage& img, const ShapeFilter& filter)
+      : img(img)
+      , filter(filter) {};
 
    void run() override
    {
-      ProgressIndicator *p = new ProgressIndicator();
-      connect(p, &ProgressIndicator::ProgressUpdate, this, &CleanThread::Handle);
-
-      auto b = ImageOps::LabelComponents(img, p);
-      
-      std::sort(b.begin(), b.end(), sorty);
-      
-      QVector<Pixel>daddyObject;
-      
-      for (const auto& comp : b)
+      //the picture is binary, so the white components are the nodes above the
+      //root of the max tree and cleaning is an area opening on them, plus
+      //whatever the shape filter throws out
+      MaxTree tree = MaxTree::Build(img);
+      const QVector<int> components = tree.ComponentsAbove(MAX_THRESH_VAL - 1, MIN_COMPONENT_SIZE);
+      QImage result = tree.Select(MAX_THRESH_VAL - 1, filter.Filter(tree, components));
+
+      if (!Cancelled())
       {
-         if (comp.count() > 200)
-         {
-            daddyObject.append(comp);
-         }
+         emit resultReady(result);
       }
 
-      emit resultReady(ImageOps::ImageFromPixelSet(img, daddyObject, QColor(Qt::white)));
       emit ProgressUpdate(100, "");
-
-      delete p;
    }
 
 private:
    QImage img;
+   ShapeFilter filter;
    
-public slots:
-   void Handle(const int& value, const QString& operationName)
+signals:
+   void ProgressUpdate(const int& value, const QString& operationName);
+   void resultReady(const QImage& s);
+};
+
+class WatershedThread : public ScheduledJob
+{
+   Q_OBJECT
+public:
+   WatershedThread(const QImage& img, const QString& suspicious, const double& depth)
+      : img(img)
+      , suspicious(suspicious)
+      , depth(depth) {};
+
+   void run() override
    {
-      emit ProgressUpdate(value, operationName);
+      QImage result = Watershed::SplitComponents(img, suspicious, depth);
+
+      if (!Cancelled())
+      {
+         emit resultReady(result);
+      }
    }
-   
+
+private:
+   QImage img;
+   QString suspicious;
+   double depth;
+
 signals:
-   void ProgressUpdate(const int& value, const QString& operationName);
    void resultReady(const QImage& s);
 };
 
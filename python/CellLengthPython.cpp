@@ -0,0 +1,352 @@
+//Python module over the core stages, the same code the GUI and the batch
+//runs use:
+//
+//   import numpy as np, cellength
+//   gray = np.asarray(PIL.Image.open("plate.tif"))       #uint8 or uint16, 2D
+//   mask, t = cellength.binarize(gray, mode="sauvola", area=15)
+//   mask = cellength.open(mask, 2)
+//   labels, count = cellength.label(mask, min_size=200)
+//   cells = cellength.measure(mask, pixels_per_unit=3.06)
+//
+//Pictures are 2D uint8 or uint16 arrays. Masks are too, any pixel that isn't
+//0 is foreground, so (a > t).astype(np.uint8) works as well as the 0/255 ones
+//the stages hand back. Nothing gets copied on the way in: the array's memory
+//is handed to the stage as a QImage, rows may be padded but the pixels in a
+//row have to sit next to each other (np.ascontiguousarray otherwise). Masks
+//other than 0/255 are the exception, the stages get a 0/255 copy. Masks coming back
+//are numpy views of the QImage the stage made, which the array keeps alive.
+//Every stage runs with the GIL released, so a ThreadPoolExecutor over a
+//stack of pictures keeps all the cores busy.
+
+#include <pybind11/pybind11.h>
+#include <pybind11/numpy.h>
+
+#include <QImage>
+
+#include "Contour.h"
+#include "DistanceTransform.h"
+#include "MaxTree.h"
+#include "Otsu.h"
+#include "Pipeline.h"
+#include "SimdKernels.h"
+
+#include <algorithm>
+#include <string>
+
+namespace py = pybind11;
+
+namespace
+{
+
+//a QImage over the array's own memory
+QImage Wrap(const py::array& array)
+{
+   const py::buffer_info info = array.request();
+
+   if (info.ndim != 2)
+   {
+      throw py::value_error("expected a 2D array, got " + std::to_string(info.ndim) + "D");
+   }
+
+   QImage::Format format;
+
+   if (info.format == py::format_descriptor<quint8>::format())
+   {
+      format = QImage::Format_Grayscale8;
+   }
+   else if (info.format == py::format_descriptor<quint16>::format())
+   {
+      format = QImage::Format_Grayscale16;
+   }
+   else
+   {
+      throw py::type_error("expected uint8 or uint16 pixels, got " + info.format);
+   }
+
+   if (info.strides[1] != info.itemsize || info.strides[0] < info.shape[1] * info.itemsize)
+   {
+      throw py::value_error("the pixels in a row have to be contiguous, np.ascontiguousarray() it first");
+   }
+
+   return QImage((const uchar*)info.ptr, (int)info.shape[1], (int)info.shape[0], (int)info.strides[0], format);
+}
+
+//a mask as the stages want it, 255 for foreground. 0/255 ones are used as
+//they are, anything else gets every nonzero pixel set to 255 in a copy.
+QImage WrapMask(const py::array& array)
+{
+   const QImage img = Wrap(array);
+
+   if (img.format() == QImage::Format_Grayscale8)
+   {
+      bool binary = true;
+
+      for (int y = 0; y < img.height() && binary; y++)
+      {
+         const uchar* line = img.constScanLine(y);
+
+         for (int x = 0; x < img.width(); x++)
+         {
+            if (line[x] != 0 && line[x] != MAX_THRESH_VAL)
+            {
+               binary = false;
+               break;
+            }
+         }
+      }
+
+      if (binary)
+      {
+         return img;
+      }
+   }
+
+   return SimdKernels::ThresholdMask(img, 0);
+}
+
+//img as an array without copying it, the array holds on to the QImage.
+//Stages hand their input straight back when there's nothing to do, that
+//memory is source's and not the QImage's to give.
+py::array ToArray(const QImage& img, const py::array& source)
+{
+   if (img.constBits() == source.data())
+   {
+      return source;
+   }
+
+   const bool deep = img.format() == QImage::Format_Grayscale16;
+   QImage* owner = new QImage(img);
+   py::capsule base(owner, [](void* p) { delete (QImage*)p; });
+
+   return py::array(deep ? py::dtype::of<quint16>() : py::dtype::of<quint8>(),
+                    { (py::ssize_t)owner->height(), (py::ssize_t)owner->width() },
+                    { (py::ssize_t)owner->bytesPerLine(), (py::ssize_t)(deep ? 2 : 1) },
+                    owner->constBits(), base);
+}
+
+Pipeline::ThresholdMode ModeFromName(const std::string& name)
+{
+   for (const auto& m : { Pipeline::ThresholdMode::Manual, Pipeline::ThresholdMode::GlobalOtsu, Pipeline::ThresholdMode::Mean,
+                          Pipeline::ThresholdMode::Niblack, Pipeline::ThresholdMode::Sauvola })
+   {
+      if (Pipeline::ModeName(m) == QString::fromStdString(name))
+      {
+         return m;
+      }
+   }
+
+   throw py::value_error("unknown threshold mode " + name);
+}
+
+py::list CellList(const Pipeline::Result& result)
+{
+   py::list cells;
+
+   for (const auto& cell : result.cells)
+   {
+      py::dict d;
+      d["x"] = cell.bounds.x();
+      d["y"] = cell.bounds.y();
+      d["width"] = cell.bounds.width();
+      d["height"] = cell.bounds.height();
+      d["area"] = cell.area;
+      d["centroid_x"] = cell.centroidX;
+      d["centroid_y"] = cell.centroidY;
+      d["skeleton_pixels"] = cell.skeletonPixels;
+      d["length"] = cell.length;
+      cells.append(d);
+   }
+
+   return cells;
+}
+
+}
+
+PYBIND11_MODULE(cellength, m)
+{
+   m.doc() = "CellLength's threshold, morphology, labelling, thinning and length stages over numpy arrays";
+
+   m.def("threshold", [](const py::array& image, const int& level)
+   {
+      const QImage img = Wrap(image);
+      QImage mask;
+
+      {
+         py::gil_scoped_release release;
+         mask = SimdKernels::ThresholdMask(img, level);
+      }
+
+      return ToArray(mask, image);
+   }, py::arg("image"), py::arg("level"),
+   "255 where the picture is above level, 0 elsewhere");
+
+   m.def("otsu_threshold", [](const py::array& image)
+   {
+      const QImage img = Wrap(image);
+      py::gil_scoped_release release;
+
+      return img.format() == QImage::Format_Grayscale16 ? Otsu::GlobalThreshold16(img) : Otsu::GlobalThreshold(Otsu::ImageHistogram(img));
+   }, py::arg("image"));
+
+   m.def("binarize", [](const py::array& image, const std::string& mode, const int& threshold, const int& area, const double& k, const int& c, const int& bitDepth)
+   {
+      const QImage img = Wrap(image);
+      Pipeline::Params params;
+      params.mode = ModeFromName(mode);
+      params.threshold = threshold;
+      params.area = area;
+      params.k = k;
+      params.c = c;
+      params.bitDepth = bitDepth;
+
+      QImage mask;
+      int used = -1;
+
+      {
+         py::gil_scoped_release release;
+         mask = Pipeline::Binarize(img, params, nullptr, &used);
+      }
+
+      return py::make_tuple(ToArray(mask, image), used);
+   }, py::arg("image"), py::arg("mode") = "otsu", py::arg("threshold") = 128, py::arg("area") = 15, py::arg("k") = 0.2, py::arg("c") = 0, py::arg("bit_depth") = 0,
+   "(mask, threshold) by any of the pipeline's modes, threshold is -1 for the local ones");
+
+   m.def("dilate", [](const py::array& mask, const double& radius)
+   {
+      const QImage img = WrapMask(mask);
+      QImage out;
+
+      {
+         py::gil_scoped_release release;
+         out = DistanceTransform::DilateMask(img, radius);
+      }
+
+      return ToArray(out, mask);
+   }, py::arg("mask"), py::arg("radius"));
+
+   m.def("erode", [](const py::array& mask, const double& radius)
+   {
+      const QImage img = WrapMask(mask);
+      QImage out;
+
+      {
+         py::gil_scoped_release release;
+         out = DistanceTransform::ErodeMask(img, radius);
+      }
+
+      return ToArray(out, mask);
+   }, py::arg("mask"), py::arg("radius"));
+
+   m.def("open", [](const py::array& mask, const double& radius)
+   {
+      const QImage img = WrapMask(mask);
+      QImage out;
+
+      {
+         py::gil_scoped_release release;
+         out = DistanceTransform::Open(img, radius);
+      }
+
+      return ToArray(out, mask);
+   }, py::arg("mask"), py::arg("radius"));
+
+   m.def("label", [](const py::array& mask, const int& minSize)
+   {
+      const QImage img = WrapMask(mask);
+      py::array_t<qint32> labels({ (py::ssize_t)img.height(), (py::ssize_t)img.width() });
+      qint32* out = labels.mutable_data();
+      int count = 0;
+
+      {
+         py::gil_scoped_release release;
+
+         //binary mask, so each component is one node right under the root
+         const MaxTree tree = MaxTree::Build(img);
+         const QVector<int> components = tree.ComponentsAbove(MAX_THRESH_VAL - 1, minSize);
+         QVector<qint32> labelOf(tree.Nodes().count(), 0);
+         count = components.count();
+
+         for (int i = 0; i < count; i++)
+         {
+            labelOf[components[i]] = i + 1;
+         }
+
+         for (int y = 0; y < img.height(); y++)
+         {
+            for (int x = 0; x < img.width(); x++)
+            {
+               out[(qint64)y * img.width() + x] = labelOf[tree.NodeAt(x, y)];
+            }
+         }
+      }
+
+      return py::make_tuple(labels, count);
+   }, py::arg("mask"), py::arg("min_size") = 0,
+   "(labels, count), int32 labels 1..count for the components bigger than min_size and 0 for the rest");
+
+   m.def("thin", [](const py::array& mask)
+   {
+      const QImage img = WrapMask(mask);
+      py::array_t<quint8> skeleton({ (py::ssize_t)img.height(), (py::ssize_t)img.width() });
+      quint8* out = skeleton.mutable_data();
+
+      {
+         py::gil_scoped_release release;
+         std::fill(out, out + (qint64)img.width() * img.height(), 0);
+
+         for (const auto& p : Contour::Thin(img))
+         {
+            out[(qint64)p.y * img.width() + p.x] = MAX_THRESH_VAL;
+         }
+      }
+
+      return skeleton;
+   }, py::arg("mask"),
+   "the mask's skeleton, 255 on 0");
+
+   m.def("measure", [](const py::array& mask, const int& minSize, const double& pixelsPerUnit, const std::string& shapeFilter)
+   {
+      const QImage img = WrapMask(mask);
+      Pipeline::Params params;
+      params.minSize = minSize;
+      params.pixelsPerUnit = pixelsPerUnit;
+      params.shapeFilter = QString::fromStdString(shapeFilter);
+
+      Pipeline::Result result;
+
+      {
+         py::gil_scoped_release release;
+         result = Pipeline::Measure(img, params);
+      }
+
+      return CellList(result);
+   }, py::arg("mask"), py::arg("min_size") = MIN_COMPONENT_SIZE, py::arg("pixels_per_unit") = 3.06, py::arg("shape_filter") = "",
+   "a dict per cell, biggest first: bounds, area, centroid, skeleton pixels and length");
+
+   m.def("run", [](const py::array& image, const std::string& mode, const int& threshold, const int& area, const double& k, const int& c,
+                   const int& openingRadius, const int& minSize, const double& pixelsPerUnit, const std::string& shapeFilter)
+   {
+      const QImage img = Wrap(image);
+      Pipeline::Params params;
+      params.mode = ModeFromName(mode);
+      params.threshold = threshold;
+      params.area = area;
+      params.k = k;
+      params.c = c;
+      params.openingRadius = openingRadius;
+      params.minSize = minSize;
+      params.pixelsPerUnit = pixelsPerUnit;
+      params.shapeFilter = QString::fromStdString(shapeFilter);
+
+      Pipeline::Result result;
+
+      {
+         py::gil_scoped_release release;
+         result = Pipeline::Run(img, params);
+      }
+
+      return py::make_tuple(CellList(result), result.threshold);
+   }, py::arg("image"), py::arg("mode") = "otsu", py::arg("threshold") = 128, py::arg("area") = 15, py::arg("k") = 0.2, py::arg("c") = 0,
+   py::arg("opening_radius") = 0, py::arg("min_size") = MIN_COMPONENT_SIZE, py::arg("pixels_per_unit") = 3.06, py::arg("shape_filter") = "",
+   "the whole pipeline on a picture, (cells, threshold)");
+}
@@ -0,0 +1,27 @@
+# The cellength Python module, built on the same core the GUI and the tests
+# use. Needs pybind11 (pip install pybind11) for the python3 it gets built
+# against, then import it from this directory or copy it into site-packages.
+# python3 test_cellength.py, run from the build directory, is its smoke test.
+QT       += core gui
+QT 	+= concurrent
+greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
+
+TEMPLATE = lib
+CONFIG += c++11 plugin no_plugin_name_prefix hide_symbols
+CONFIG -= app_bundle
+
+PYTHON = python3
+
+TARGET = cellength
+
+# the suffix python looks for, cellength.cpython-311-x86_64-linux-gnu.so and the like
+QMAKE_CXXFLAGS += $$system($$PYTHON -m pybind11 --includes)
+QMAKE_EXTENSION_SHLIB = $$system($$PYTHON -c \"import sysconfig; print(sysconfig.get_config_var(\'EXT_SUFFIX\')[1:])\")
+
+# symbols from libpython get resolved by the interpreter that loads the module
+macx: QMAKE_LFLAGS_PLUGIN += -undefined dynamic_lookup
+
+SOURCES += \
+    CellLengthPython.cpp
+
+include(../CellLengthCore.pri)
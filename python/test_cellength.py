@@ -0,0 +1,111 @@
+#!/usr/bin/env python3
+# Smoke test for the cellength module: every stage once on a small picture,
+# checking what comes back has the right type and shape and agrees with numpy
+# where that's easy to work out. Run it from wherever the module got built:
+#
+#   python3 test_cellength.py
+
+import os
+import sys
+import unittest
+
+import numpy as np
+
+sys.path.insert(0, os.getcwd())
+sys.path.insert(0, os.path.dirname(os.path.abspath(__file__)))
+
+import cellength
+
+
+def picture():
+    # two bright bars on a dark background, long enough to have a length
+    gray = np.full((60, 80), 20, dtype=np.uint8)
+    gray[10:18, 5:70] = 220
+    gray[35:50, 20:30] = 220
+    return gray
+
+
+class CellLengthTest(unittest.TestCase):
+    def test_threshold(self):
+        gray = picture()
+        mask = cellength.threshold(gray, 100)
+        self.assertEqual(mask.dtype, np.uint8)
+        self.assertEqual(mask.shape, gray.shape)
+        np.testing.assert_array_equal(mask, np.where(gray > 100, 255, 0))
+
+        deep = gray.astype(np.uint16) * 257
+        np.testing.assert_array_equal(cellength.threshold(deep, 100 * 257), mask)
+
+    def test_otsu_threshold(self):
+        t = cellength.otsu_threshold(picture())
+        self.assertGreaterEqual(t, 20)
+        self.assertLess(t, 220)
+
+    def test_binarize(self):
+        gray = picture()
+        mask, t = cellength.binarize(gray, mode="otsu")
+        np.testing.assert_array_equal(mask, cellength.threshold(gray, t))
+
+        mask, t = cellength.binarize(gray, mode="sauvola", area=15)
+        self.assertEqual(mask.shape, gray.shape)
+        self.assertEqual(t, -1)
+
+    def test_morphology(self):
+        mask = cellength.threshold(picture(), 100)
+
+        for stage in (cellength.dilate, cellength.erode, cellength.open):
+            out = stage(mask, 2)
+            self.assertEqual(out.dtype, np.uint8)
+            self.assertEqual(out.shape, mask.shape)
+            self.assertTrue(set(np.unique(out)) <= {0, 255})
+
+        self.assertGreater(np.count_nonzero(cellength.dilate(mask, 2)), np.count_nonzero(mask))
+        self.assertLess(np.count_nonzero(cellength.erode(mask, 2)), np.count_nonzero(mask))
+
+    def test_label(self):
+        mask = cellength.threshold(picture(), 100)
+        labels, count = cellength.label(mask)
+        self.assertEqual(labels.dtype, np.int32)
+        self.assertEqual(labels.shape, mask.shape)
+        self.assertEqual(count, 2)
+        np.testing.assert_array_equal(labels > 0, mask > 0)
+
+        # 0/1 masks count the same as 0/255 ones
+        ones, count = cellength.label((mask > 0).astype(np.uint8))
+        self.assertEqual(count, 2)
+        np.testing.assert_array_equal(ones, labels)
+
+    def test_thin(self):
+        mask = cellength.threshold(picture(), 100)
+        skeleton = cellength.thin(mask)
+        self.assertEqual(skeleton.shape, mask.shape)
+        self.assertGreater(np.count_nonzero(skeleton), 0)
+        self.assertFalse(np.any((skeleton > 0) & (mask == 0)))
+
+    def test_measure(self):
+        mask = cellength.threshold(picture(), 100)
+        cells = cellength.measure(mask, min_size=10)
+        self.assertEqual(len(cells), 2)
+        self.assertEqual(cells[0]["area"], 8 * 65)
+        self.assertGreater(cells[0]["length"], 0)
+
+        self.assertEqual(cellength.measure((mask > 0).astype(np.uint8), min_size=10), cells)
+
+    def test_run(self):
+        cells, t = cellength.run(picture(), mode="otsu", min_size=10)
+        self.assertEqual(len(cells), 2)
+        self.assertGreaterEqual(t, 20)
+
+    def test_bad_arrays(self):
+        with self.assertRaises(ValueError):
+            cellength.threshold(np.zeros((4, 4, 3), dtype=np.uint8), 1)
+
+        with self.assertRaises(TypeError):
+            cellength.threshold(np.zeros((4, 4), dtype=np.float32), 1)
+
+        with self.assertRaises(ValueError):
+            cellength.binarize(picture(), mode="nonsense")
+
+
+if __name__ == "__main__":
+    unittest.main()
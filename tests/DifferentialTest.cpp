@@ -0,0 +1,1917 @@
+#include "Background.h"
+#include "Batch.h"
+#include "BitDepth.h"
+#include "Contour.h"
+#include "Denoise.h"
+#include "DistanceTransform.h"
+#include "Document.h"
+#include "ImageOps.h"
+#include "IncrementalLabel.h"
+#include "LocalThreshold.h"
+#include "MaxTree.h"
+#include "Otsu.h"
+#include "Pipeline.h"
+#include "Scratch.h"
+#include "Shard.h"
+#include "ShapeFilter.h"
+#include "SimdKernels.h"
+#include "Sweep.h"
+#include "TiledImageItem.h"
+#include "Watershed.h"
+
+#include <QElapsedTimer>
+#include <QRandomGenerator>
+#include <QtTest>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <functional>
+#include <queue>
+#include <tuple>
+
+//Differential tests. The slow but readable functions in ImageOps are the
+//reference, every faster engine gets run next to them on the same random and
+//adversarial images (non square ones included) and has to come out exactly the
+//same, unless the test says what tolerance it allows and why. Where ImageOps
+//has nothing to compare against, a brute force version in here stands in.
+//
+//Both sides are timed, the table at the end shows the speed-up next to the
+//case that proved it correct.
+//
+//usage: CellLengthTests [QtTest options], e.g. CellLengthTests clean
+
+namespace
+{
+
+enum class Pattern
+{
+   Noise,      //random gray
+   Gradient,   //smooth ramp plus a little noise, what a real frame looks like to Otsu
+   Sparse,     //5% white specks, lots of tiny components
+   Dense,      //60% white, big ragged components
+   Checker,    //one pixel checkerboard, only connected through the diagonals
+   Stripes,    //one pixel wide vertical lines
+   Snake,      //one long winding component, deepest possible flood
+   Frame,      //white border only, everything touches the edge
+   Black,
+   White,
+   Dot         //a single white pixel in the last row and column
+};
+
+const char* PatternName(const Pattern& pattern)
+{
+   switch (pattern)
+   {
+   case Pattern::Noise: return "noise";
+   case Pattern::Gradient: return "gradient";
+   case Pattern::Sparse: return "sparse";
+   case Pattern::Dense: return "dense";
+   case Pattern::Checker: return "checker";
+   case Pattern::Stripes: return "stripes";
+   case Pattern::Snake: return "snake";
+   case Pattern::Frame: return "frame";
+   case Pattern::Black: return "black";
+   case Pattern::White: return "white";
+   case Pattern::Dot: return "dot";
+   }
+
+   return "";
+}
+
+//gray value of (x, y) for a pattern. The binary patterns only use 0 and 255.
+int PatternValue(const Pattern& pattern, const int& x, const int& y, const int& width, const int& height, QRandomGenerator& rng)
+{
+   switch (pattern)
+   {
+   case Pattern::Noise: return rng.bounded(256);
+   case Pattern::Gradient: return qBound(0, (x + y) * 255 / qMax(1, width + height - 2) + rng.bounded(-8, 9), 255);
+   case Pattern::Sparse: return rng.bounded(100) < 5 ? 255 : 0;
+   case Pattern::Dense: return rng.bounded(100) < 60 ? 255 : 0;
+   case Pattern::Checker: return (x + y) % 2 == 0 ? 255 : 0;
+   case Pattern::Stripes: return x % 2 == 0 ? 255 : 0;
+   case Pattern::Snake:
+      //every other row is solid, joined alternately at the right and left ends
+      if (y % 2 == 0)
+      {
+         return 255;
+      }
+      return x == ((y / 2) % 2 == 0 ? width - 1 : 0) ? 255 : 0;
+   case Pattern::Frame: return x == 0 || y == 0 || x == width - 1 || y == height - 1 ? 255 : 0;
+   case Pattern::Black: return 0;
+   case Pattern::White: return 255;
+   case Pattern::Dot: return x == width - 1 && y == height - 1 ? 255 : 0;
+   }
+
+   return 0;
+}
+
+//Format_RGB32 with r = g = b, which is what a decoded gray TIFF turns into
+QImage MakeImage(const Pattern& pattern, const int& width, const int& height)
+{
+   QImage img(width, height, QImage::Format_RGB32);
+   QRandomGenerator rng(width * 7919 + height * 104729 + (int)pattern);
+
+   for (int y = 0; y < height; y++)
+   {
+      QRgb* line = (QRgb*)img.scanLine(y);
+
+      for (int x = 0; x < width; x++)
+      {
+         const int v = PatternValue(pattern, x, y, width, height, rng);
+         line[x] = qRgb(v, v, v);
+      }
+   }
+
+   return img;
+}
+
+bool IsBinary(const Pattern& pattern)
+{
+   return pattern != Pattern::Noise && pattern != Pattern::Gradient;
+}
+
+//the first pixel where the two differ, empty when they match. Pixels within
+//frame of the image edge are skipped.
+QString FirstDifference(const QImage& expected, const QImage& actual, const int& frame = 0)
+{
+   if (expected.size() != actual.size())
+   {
+      return QString("size %1x%2, expected %3x%4").arg(actual.width()).arg(actual.height()).arg(expected.width()).arg(expected.height());
+   }
+
+   for (int y = frame; y < expected.height() - frame; y++)
+   {
+      for (int x = frame; x < expected.width() - frame; x++)
+      {
+         if (expected.pixel(x, y) != actual.pixel(x, y))
+         {
+            return QString("(%1, %2) is %3, expected %4").arg(x).arg(y)
+               .arg(actual.pixel(x, y), 8, 16, QChar('0')).arg(expected.pixel(x, y), 8, 16, QChar('0'));
+         }
+      }
+   }
+
+   return QString();
+}
+
+struct Timing
+{
+   QString kernel;
+   QString data;
+   double referenceMs = 0;
+   double optimizedMs = 0;
+};
+
+QVector<Timing>& Timings()
+{
+   static QVector<Timing> timings;
+   return timings;
+}
+
+template <typename F>
+double TimeMs(F fn)
+{
+   QElapsedTimer timer;
+   timer.start();
+   fn();
+   return timer.nsecsElapsed() / 1e6;
+}
+
+void Record(const double& referenceMs, const double& optimizedMs)
+{
+   Timing timing;
+   timing.kernel = QTest::currentTestFunction();
+   timing.data = QTest::currentDataTag();
+   timing.referenceMs = referenceMs;
+   timing.optimizedMs = optimizedMs;
+   Timings().push_back(timing);
+}
+
+bool PixelLess(const Pixel& a, const Pixel& b)
+{
+   return a.y < b.y || (a.y == b.y && a.x < b.x);
+}
+
+//the white pixels of mask as the red overlay ImageOps::Thin and
+//GetBorderPixels work on
+QImage RedOverlay(const QImage& mask)
+{
+   QImage overlay(mask.size(), QImage::Format_ARGB32);
+   overlay.fill(Qt::transparent);
+
+   for (int y = 0; y < mask.height(); y++)
+   {
+      for (int x = 0; x < mask.width(); x++)
+      {
+         if (mask.constScanLine(y)[x] != 0)
+         {
+            overlay.setPixel(x, y, QColor(Qt::red).rgb());
+         }
+      }
+   }
+
+   return overlay;
+}
+
+//area of the convex hull of points by gift wrapping, nothing shared with
+//Contour::ConvexHull
+double BruteForceHullArea(QVector<QPoint> points)
+{
+   std::sort(points.begin(), points.end(), [](const QPoint& a, const QPoint& b) { return a.x() < b.x() || (a.x() == b.x() && a.y() < b.y()); });
+   points.erase(std::unique(points.begin(), points.end()), points.end());
+
+   if (points.count() < 3)
+   {
+      return 0;
+   }
+
+   QVector<QPoint> hull;
+   int current = 0;
+
+   do
+   {
+      hull.push_back(points[current]);
+      int candidate = (current + 1) % points.count();
+
+      for (int i = 0; i < points.count(); i++)
+      {
+         const QPoint& o = points[current];
+         const qint64 cross = (qint64)(points[candidate].x() - o.x()) * (points[i].y() - o.y()) - (qint64)(points[candidate].y() - o.y()) * (points[i].x() - o.x());
+         const qint64 further = (qint64)(points[i].x() - o.x()) * (points[i].x() - o.x()) + (qint64)(points[i].y() - o.y()) * (points[i].y() - o.y())
+                                - (qint64)(points[candidate].x() - o.x()) * (points[candidate].x() - o.x()) - (qint64)(points[candidate].y() - o.y()) * (points[candidate].y() - o.y());
+
+         if (cross < 0 || (cross == 0 && further > 0))
+         {
+            candidate = i;
+         }
+      }
+
+      current = candidate;
+   } while (current != 0 && hull.count() <= points.count());
+
+   qint64 twice = 0;
+
+   for (int i = 0; i < hull.count(); i++)
+   {
+      const QPoint& a = hull[i];
+      const QPoint& b = hull[(i + 1) % hull.count()];
+      twice += (qint64)a.x() * b.y() - (qint64)b.x() * a.y();
+   }
+
+   return qAbs(twice) / 2.0;
+}
+
+//the old CleanThread: threshold, label, keep the components over minArea
+QImage ReferenceClean(const QImage& img, const int& threshVal, const int& minArea)
+{
+   ProgressIndicator progress;
+   const QImage binary = ImageOps::Threshold(img, threshVal);
+   const auto components = ImageOps::LabelComponents(binary, &progress);
+
+   QVector<Pixel> kept;
+
+   for (const auto& comp : components)
+   {
+      if (comp.count() > minArea)
+      {
+         kept.append(comp);
+      }
+   }
+
+   return ImageOps::ImageFromPixelSet(binary, kept, QColor(Qt::white));
+}
+
+//nothing in ImageOps computes this, so a plain double loop over every pair
+QVector<qint32> BruteForceSquaredDistance(const QImage& mask, const bool& toNonZero)
+{
+   const int width = mask.width();
+   const int height = mask.height();
+   QVector<Pixel> features;
+
+   for (int y = 0; y < height; y++)
+   {
+      for (int x = 0; x < width; x++)
+      {
+         if ((mask.constScanLine(y)[x] != 0) == toNonZero)
+         {
+            features.push_back(Pixel(x, y));
+         }
+      }
+   }
+
+   QVector<qint32> dist(width * height, DistanceTransform::INF);
+
+   for (int y = 0; y < height; y++)
+   {
+      for (int x = 0; x < width; x++)
+      {
+         for (const auto& f : features)
+         {
+            const qint32 d = (f.x - x) * (f.x - x) + (f.y - y) * (f.y - y);
+            dist[y * width + x] = qMin(dist[y * width + x], d);
+         }
+      }
+   }
+
+   return dist;
+}
+
+//min or max over the clipped square window, straight from the definition
+QImage BruteForceMinMax(const QImage& gray, const int& radius, const bool& isMin)
+{
+   QImage out(gray.size(), QImage::Format_Grayscale8);
+
+   for (int y = 0; y < gray.height(); y++)
+   {
+      for (int x = 0; x < gray.width(); x++)
+      {
+         int v = isMin ? 255 : 0;
+
+         for (int j = qMax(0, y - radius); j < qMin(gray.height(), y + radius + 1); j++)
+         {
+            for (int i = qMax(0, x - radius); i < qMin(gray.width(), x + radius + 1); i++)
+            {
+               const int p = gray.constScanLine(j)[i];
+               v = isMin ? qMin(v, p) : qMax(v, p);
+            }
+         }
+
+         out.scanLine(y)[x] = (uchar)v;
+      }
+   }
+
+   return out;
+}
+
+//sorts the clipped window, the upper median when the count is even
+QImage BruteForceMedian(const QImage& gray, const int& radius)
+{
+   QImage out(gray.size(), QImage::Format_Grayscale8);
+   QVector<uchar> window;
+
+   for (int y = 0; y < gray.height(); y++)
+   {
+      for (int x = 0; x < gray.width(); x++)
+      {
+         window.clear();
+
+         for (int j = qMax(0, y - radius); j < qMin(gray.height(), y + radius + 1); j++)
+         {
+            for (int i = qMax(0, x - radius); i < qMin(gray.width(), x + radius + 1); i++)
+            {
+               window.append(gray.constScanLine(j)[i]);
+            }
+         }
+
+         std::sort(window.begin(), window.end());
+         out.scanLine(y)[x] = window[window.count() / 2];
+      }
+   }
+
+   return out;
+}
+
+//the 2D kernel in double, not separated, edges repeated outwards
+QImage BruteForceGaussian(const QImage& gray, const double& sigma)
+{
+   const int radius = qMax(1, (int)std::ceil(3 * sigma));
+   QImage out(gray.size(), QImage::Format_Grayscale8);
+
+   for (int y = 0; y < gray.height(); y++)
+   {
+      for (int x = 0; x < gray.width(); x++)
+      {
+         double sum = 0;
+         double weights = 0;
+
+         for (int j = -radius; j <= radius; j++)
+         {
+            for (int i = -radius; i <= radius; i++)
+            {
+               const double w = std::exp(-(double)(i * i + j * j) / (2 * sigma * sigma));
+               const int sy = qBound(0, y + j, gray.height() - 1);
+               const int sx = qBound(0, x + i, gray.width() - 1);
+               sum += w * gray.constScanLine(sy)[sx];
+               weights += w;
+            }
+         }
+
+         out.scanLine(y)[x] = (uchar)qBound(0.0, std::floor(sum / weights + 0.5), 255.0);
+      }
+   }
+
+   return out;
+}
+
+//largest |expected - actual| over the image, -1 when the sizes differ
+int MaxDeviation(const QImage& expected, const QImage& actual)
+{
+   if (expected.size() != actual.size())
+   {
+      return -1;
+   }
+
+   int deviation = 0;
+
+   for (int y = 0; y < expected.height(); y++)
+   {
+      for (int x = 0; x < expected.width(); x++)
+      {
+         deviation = qMax(deviation, qAbs((int)expected.constScanLine(y)[x] - (int)actual.constScanLine(y)[x]));
+      }
+   }
+
+   return deviation;
+}
+
+//the flooding on a binary heap, ordered by the level a pixel was pushed at
+//and then by when it was pushed, which is what the buckets do
+void BruteForceWatershed(const QImage& gray, QVector<int>& labels)
+{
+   //(level, -sequence, pixel), highest level and then earliest first
+   std::priority_queue<std::tuple<int, qint64, int>> queue;
+   qint64 sequence = 0;
+
+   for (int p = 0; p < labels.count(); p++)
+   {
+      if (labels[p] > 0)
+      {
+         queue.push(std::make_tuple((int)gray.constScanLine(p / gray.width())[p % gray.width()], -sequence++, p));
+      }
+   }
+
+   while (!queue.empty())
+   {
+      const int level = std::get<0>(queue.top());
+      const int p = std::get<2>(queue.top());
+      queue.pop();
+
+      for (int dy = -1; dy <= 1; dy++)
+      {
+         for (int dx = -1; dx <= 1; dx++)
+         {
+            const int x = p % gray.width() + dx;
+            const int y = p / gray.width() + dy;
+            const int q = y * gray.width() + x;
+
+            if (x >= 0 && y >= 0 && x < gray.width() && y < gray.height() && labels[q] == 0)
+            {
+               labels[q] = labels[p];
+               queue.push(std::make_tuple(qMin((int)gray.constScanLine(y)[x], level), -sequence++, q));
+            }
+         }
+      }
+   }
+}
+
+//a 16 bit picture with the gray in the top byte and a different value in the
+//bottom one at every pixel, so nothing about it lines up with 8 bit levels
+QImage Deepen(const QImage& img)
+{
+   const QImage gray = SimdKernels::ToGray(img);
+   QImage deep(gray.size(), QImage::Format_Grayscale16);
+
+   for (int y = 0; y < gray.height(); y++)
+   {
+      for (int x = 0; x < gray.width(); x++)
+      {
+         ((quint16*)deep.scanLine(y))[x] = gray.constScanLine(y)[x] * 256 + ((x * 37 + y * 101) & 255);
+      }
+   }
+
+   return deep;
+}
+
+//16 bit gray > threshVal by hand, for ThresholdMask
+QImage BruteForceMask16(const QImage& deep, const int& threshVal)
+{
+   QImage mask(deep.size(), QImage::Format_Grayscale8);
+
+   for (int y = 0; y < deep.height(); y++)
+   {
+      for (int x = 0; x < deep.width(); x++)
+      {
+         mask.scanLine(y)[x] = ((const quint16*)deep.constScanLine(y))[x] > threshVal ? 255 : 0;
+      }
+   }
+
+   return mask;
+}
+
+//window sums added up pixel by pixel instead of read off the integral images.
+//The double maths after that is the same as LocalThreshold's, so the result
+//has to match bit for bit.
+QImage BruteForceLocalThreshold(const QImage& img, const LocalThreshold::Mode& mode, const int& area, const double& k, const double& r, const double& c)
+{
+   QImage returnImg(img.size(), QImage::Format_ARGB32);
+   const bool deep = BitDepth::IsDeep(img);
+   auto gray = [&](const int& x, const int& y) -> quint64 { return deep ? ((const quint16*)img.constScanLine(y))[x] : qGray(img.pixel(x, y)); };
+
+   for (int y = 0; y < img.height(); y++)
+   {
+      QRgb* out = (QRgb*)returnImg.scanLine(y);
+
+      for (int x = 0; x < img.width(); x++)
+      {
+         quint64 sum = 0;
+         quint64 squares = 0;
+         int n = 0;
+
+         for (int j = qMax(0, y - area); j < qMin(img.height(), y + area + 1); j++)
+         {
+            for (int i = qMax(0, x - area); i < qMin(img.width(), x + area + 1); i++)
+            {
+               const quint64 v = gray(i, j);
+               sum += v;
+               squares += v * v;
+               n++;
+            }
+         }
+
+         const double mean = sum / (double)n;
+         const double variance = squares / (double)n - mean * mean;
+         const double stddev = variance > 0 ? qSqrt(variance) : 0;
+         const double threshold = mode == LocalThreshold::Mode::Niblack ? mean + k * stddev - c
+                                                                       : mean * (1 + k * (stddev / r - 1)) - c;
+
+         out[x] = gray(x, y) > threshold ? QColor(Qt::white).rgb() : 0;
+      }
+   }
+
+   return returnImg;
+}
+
+//every way of pairing the references up with distinct measured cells
+double BruteForceMatchError(const QVector<double>& measured, const QVector<double>& reference, const int& i, QVector<bool>& used)
+{
+   if (i == reference.count())
+   {
+      //whatever is left over is an extra cell
+      return std::count(used.begin(), used.end(), false);
+   }
+
+   double best = 1 + BruteForceMatchError(measured, reference, i + 1, used);
+
+   for (int j = 0; j < measured.count(); j++)
+   {
+      if (!used[j])
+      {
+         used[j] = true;
+         best = qMin(best, qAbs(std::log(measured[j] / reference[i])) + BruteForceMatchError(measured, reference, i + 1, used));
+         used[j] = false;
+      }
+   }
+
+   return best;
+}
+
+}
+
+class DifferentialTest : public QObject
+{
+   Q_OBJECT
+
+private:
+   //every pattern at every size. The sizes are kept small because some of the
+   //references are quadratic, and lopsided because square images hide
+   //x/y mix-ups.
+   void AddImages(const bool& binaryOnly = false, const int& maxPixels = 1 << 30)
+   {
+      QTest::addColumn<int>("pattern");
+      QTest::addColumn<int>("width");
+      QTest::addColumn<int>("height");
+
+      const QVector<QSize> sizes = { {1, 1}, {1, 37}, {37, 1}, {64, 17}, {17, 64}, {97, 31} };
+
+      for (int p = (int)Pattern::Noise; p <= (int)Pattern::Dot; p++)
+      {
+         if (binaryOnly && !IsBinary((Pattern)p))
+         {
+            continue;
+         }
+
+         for (const auto& size : sizes)
+         {
+            if (size.width() * size.height() > maxPixels)
+            {
+               continue;
+            }
+
+            const QByteArray tag = QByteArray(PatternName((Pattern)p)) + " " + QByteArray::number(size.width()) + "x" + QByteArray::number(size.height());
+            QTest::newRow(tag.constData()) << p << size.width() << size.height();
+         }
+      }
+   }
+
+   QImage FetchImage()
+   {
+      QFETCH(int, pattern);
+      QFETCH(int, width);
+      QFETCH(int, height);
+      return MakeImage((Pattern)pattern, width, height);
+   }
+
+private slots:
+   void cleanupTestCase()
+   {
+      std::printf("\n%-16s %-20s %12s %12s %9s\n", "kernel", "data", "reference", "optimized", "speedup");
+
+      for (const auto& t : Timings())
+      {
+         std::printf("%-16s %-20s %9.3f ms %9.3f ms %8.1fx\n", qPrintable(t.kernel), qPrintable(t.data),
+                     t.referenceMs, t.optimizedMs, t.referenceMs / qMax(t.optimizedMs, 1e-6));
+      }
+   }
+
+   void threshold_data() { AddImages(); }
+
+   //SimdKernels::Threshold at every dispatch level the CPU has, exact
+   void threshold()
+   {
+      const QImage img = FetchImage();
+      const SimdKernels::CpuLevel active = SimdKernels::ActiveCpuLevel();
+      double referenceMs = 0;
+      double optimizedMs = 0;
+
+      for (const int& t : { 1, 127, 254 })
+      {
+         QImage expected;
+         referenceMs += TimeMs([&]() { expected = ImageOps::Threshold(img, t); });
+
+         for (int level = 0; level <= (int)SimdKernels::DetectCpuLevel(); level++)
+         {
+            SimdKernels::SetCpuLevel((SimdKernels::CpuLevel)level);
+
+            QImage actual;
+            const double ms = TimeMs([&]() { actual = SimdKernels::Threshold(img, t); });
+
+            if (level == (int)active)
+            {
+               optimizedMs += ms;
+            }
+
+            const QString diff = FirstDifference(expected, actual);
+            QVERIFY2(diff.isEmpty(), qPrintable(QString("threshold %1 at %2: %3").arg(t).arg(SimdKernels::CpuLevelName((SimdKernels::CpuLevel)level)).arg(diff)));
+         }
+      }
+
+      SimdKernels::SetCpuLevel(active);
+      Record(referenceMs, optimizedMs);
+   }
+
+   void otsu_data() { AddImages(); }
+
+   //Otsu::GlobalThreshold and one level MultiThresholds against CalculateOtsu, exact
+   void otsu()
+   {
+      const QImage img = FetchImage();
+
+      int expected = 0;
+      const double referenceMs = TimeMs([&]() {
+         QVector<int> histogram(MAX_THRESH_VAL + 1, 0);
+
+         for (int y = 0; y < img.height(); y++)
+         {
+            for (int x = 0; x < img.width(); x++)
+            {
+               histogram[qGray(img.pixel(x, y))]++;
+            }
+         }
+
+         expected = ImageOps::CalculateOtsu(img, histogram, img.width() * img.height());
+      });
+
+      int global = 0;
+      QVector<int> multi;
+      const double optimizedMs = TimeMs([&]() {
+         const QVector<qint64> histogram = Otsu::ImageHistogram(img);
+         global = Otsu::GlobalThreshold(histogram);
+         multi = Otsu::MultiThresholds(histogram, 1);
+      });
+
+      QCOMPARE(global, expected);
+      QCOMPARE(multi.count(), 1);
+      QCOMPARE(multi[0], expected);
+      Record(referenceMs, optimizedMs);
+   }
+
+   void dilate_data() { AddImages(true); }
+
+   //DilateDisk with a radius between sqrt(2) and 2 is the 3x3 square Dilate uses.
+   //Tolerance: Dilate counts everything outside the image as white, so its one
+   //pixel frame always comes out white. DilateDisk doesn't grow in from the
+   //edge, so the frame is left out of the comparison.
+   void dilate()
+   {
+      const QImage img = FetchImage();
+
+      QImage expected;
+      QImage actual;
+      const double referenceMs = TimeMs([&]() { expected = ImageOps::Dilate(img); });
+      const double optimizedMs = TimeMs([&]() { actual = DistanceTransform::DilateDisk(img, 1.5); });
+
+      const QString diff = FirstDifference(expected, actual, 1);
+      QVERIFY2(diff.isEmpty(), qPrintable(diff));
+      Record(referenceMs, optimizedMs);
+   }
+
+   void erode_data() { AddImages(true); }
+
+   //ErodeDisk keeps Erode's edge behaviour, so this one is exact everywhere
+   void erode()
+   {
+      const QImage img = FetchImage();
+
+      QImage expected;
+      QImage actual;
+      const double referenceMs = TimeMs([&]() { expected = ImageOps::Erode(img); });
+      const double optimizedMs = TimeMs([&]() { actual = DistanceTransform::ErodeDisk(img, 1.5); });
+
+      const QString diff = FirstDifference(expected, actual);
+      QVERIFY2(diff.isEmpty(), qPrintable(diff));
+      Record(referenceMs, optimizedMs);
+   }
+
+   void distance_data() { AddImages(true, 4000); }
+
+   //the separable transform against every pixel to every feature, both ways round, exact
+   void distance()
+   {
+      const QImage mask = DistanceTransform::Foreground(FetchImage());
+      double referenceMs = 0;
+      double optimizedMs = 0;
+
+      for (const bool& toNonZero : { true, false })
+      {
+         QVector<qint32> expected;
+         QVector<qint32> actual;
+         referenceMs += TimeMs([&]() { expected = BruteForceSquaredDistance(mask, toNonZero); });
+         optimizedMs += TimeMs([&]() { actual = DistanceTransform::SquaredDistance(mask, toNonZero); });
+
+         QCOMPARE(actual.count(), expected.count());
+
+         for (int i = 0; i < expected.count(); i++)
+         {
+            QVERIFY2(actual[i] == expected[i], qPrintable(QString("(%1, %2) is %3, expected %4")
+                     .arg(i % mask.width()).arg(i / mask.width()).arg(actual[i]).arg(expected[i])));
+         }
+      }
+
+      Record(referenceMs, optimizedMs);
+   }
+
+   void minMaxFilter_data() { AddImages(); }
+
+   //van Herk / Gil-Werman against the window scanned pixel by pixel, every
+   //dispatch level, radii either side of the image size. Exact.
+   void minMaxFilter()
+   {
+      const QImage gray = SimdKernels::ToGray(FetchImage());
+      const SimdKernels::CpuLevel active = SimdKernels::ActiveCpuLevel();
+      double referenceMs = 0;
+      double optimizedMs = 0;
+
+      for (const int& radius : { 1, 4, 40 })
+      {
+         for (const bool& isMin : { true, false })
+         {
+            QImage expected;
+            referenceMs += TimeMs([&]() { expected = BruteForceMinMax(gray, radius, isMin); });
+
+            for (int level = 0; level <= (int)SimdKernels::DetectCpuLevel(); level++)
+            {
+               SimdKernels::SetCpuLevel((SimdKernels::CpuLevel)level);
+
+               QImage actual;
+               const double ms = TimeMs([&]() { actual = isMin ? Background::MinFilter(gray, radius) : Background::MaxFilter(gray, radius); });
+
+               if (level == (int)active)
+               {
+                  optimizedMs += ms;
+               }
+
+               const QString diff = FirstDifference(expected, actual);
+               QVERIFY2(diff.isEmpty(), qPrintable(QString("%1 radius %2 at %3: %4").arg(isMin ? "min" : "max").arg(radius)
+                        .arg(SimdKernels::CpuLevelName((SimdKernels::CpuLevel)level)).arg(diff)));
+            }
+         }
+      }
+
+      SimdKernels::SetCpuLevel(active);
+      Record(referenceMs, optimizedMs);
+   }
+
+   void flatField_data() { AddImages(); }
+
+   //the vector gain rows against the scalar formula, exact at every level
+   void flatField()
+   {
+      const QImage gray = SimdKernels::ToGray(FetchImage());
+      const SimdKernels::CpuLevel active = SimdKernels::ActiveCpuLevel();
+
+      QRandomGenerator rng(gray.width() * 31 + gray.height());
+      QVector<float> gain(gray.width() * gray.height());
+
+      for (auto& g : gain)
+      {
+         //past 1 / 255 and 255 both ways, so the clamps get hit
+         g = (float)(rng.generateDouble() * 4);
+      }
+
+      QImage expected(gray.size(), QImage::Format_Grayscale8);
+      const double referenceMs = TimeMs([&]() {
+         for (int y = 0; y < gray.height(); y++)
+         {
+            for (int x = 0; x < gray.width(); x++)
+            {
+               const float v = std::nearbyint((float)gray.constScanLine(y)[x] * gain[y * gray.width() + x]);
+               expected.scanLine(y)[x] = (uchar)qBound(0.0f, v, 255.0f);
+            }
+         }
+      });
+
+      double optimizedMs = 0;
+
+      for (int level = 0; level <= (int)SimdKernels::DetectCpuLevel(); level++)
+      {
+         SimdKernels::SetCpuLevel((SimdKernels::CpuLevel)level);
+
+         QImage actual;
+         const double ms = TimeMs([&]() { actual = Background::ApplyFlatField(gray, gain); });
+
+         if (level == (int)active)
+         {
+            optimizedMs = ms;
+         }
+
+         const QString diff = FirstDifference(expected, actual);
+         QVERIFY2(diff.isEmpty(), qPrintable(QString("%1: %2").arg(SimdKernels::CpuLevelName((SimdKernels::CpuLevel)level)).arg(diff)));
+      }
+
+      SimdKernels::SetCpuLevel(active);
+      Record(referenceMs, optimizedMs);
+   }
+
+   void borders_data() { AddImages(true); }
+
+   //BorderPixels off the traced borders against GetBorderPixels, exact and in
+   //the same order. Every border has to close, stay on the object and nest
+   //outer/hole/outer, and there is one outer border per 8 connected component.
+   void borders()
+   {
+      const QImage mask = DistanceTransform::Foreground(FetchImage());
+      const QImage overlay = RedOverlay(mask);
+
+      QVector<Pixel> expected;
+      QVector<Pixel> actual;
+      const double referenceMs = TimeMs([&]() { expected = ImageOps::GetBorderPixels(overlay); });
+      const double optimizedMs = TimeMs([&]() { actual = Contour::BorderPixels(mask); });
+
+      QCOMPARE(actual.count(), expected.count());
+
+      for (int i = 0; i < expected.count(); i++)
+      {
+         QVERIFY2(actual[i].x == expected[i].x && actual[i].y == expected[i].y, qPrintable(QString("border pixel %1 is (%2, %3), expected (%4, %5)")
+                  .arg(i).arg(actual[i].x).arg(actual[i].y).arg(expected[i].x).arg(expected[i].y)));
+      }
+
+      for (const auto& connectivity : { Contour::Connectivity::Four, Contour::Connectivity::Eight })
+      {
+         const QVector<Contour::Border> borders = Contour::Trace(mask, connectivity);
+         int outer = 0;
+
+         for (int b = 0; b < borders.count(); b++)
+         {
+            const Contour::Border& border = borders[b];
+            int dx = 0;
+            int dy = 0;
+
+            for (const auto& code : border.chain)
+            {
+               dx += Contour::CHAIN_DX[code];
+               dy += Contour::CHAIN_DY[code];
+            }
+
+            QVERIFY2(dx == 0 && dy == 0, qPrintable(QString("border %1 doesn't close").arg(b)));
+            QVERIFY(border.parent < b);
+            QVERIFY(border.isHole ? border.parent >= 0 && !borders[border.parent].isHole
+                                  : border.parent < 0 || borders[border.parent].isHole);
+
+            for (const auto& p : Contour::Points(border))
+            {
+               QVERIFY2(mask.valid(p.x, p.y) && mask.constScanLine(p.y)[p.x] != 0, qPrintable(QString("border %1 leaves the object at (%2, %3)")
+                        .arg(b).arg(p.x).arg(p.y)));
+            }
+
+            outer += border.isHole ? 0 : 1;
+         }
+
+         if (connectivity == Contour::Connectivity::Eight)
+         {
+            QCOMPARE(outer, MaxTree::Build(mask).ComponentsAbove(MAX_THRESH_VAL - 1, 0).count());
+
+            //one outline per border, the outer ones running the other way round to the holes
+            const QVector<QPolygonF> outlines = Contour::Outlines(mask, 127.5);
+            QCOMPARE(outlines.count(), borders.count());
+
+            int anticlockwise = 0;
+
+            for (const auto& outline : outlines)
+            {
+               double area = 0;
+
+               for (int i = 0; i < outline.count(); i++)
+               {
+                  const QPointF& a = outline[i];
+                  const QPointF& c = outline[(i + 1) % outline.count()];
+                  area += a.x() * c.y() - c.x() * a.y();
+               }
+
+               anticlockwise += area < 0 ? 1 : 0;
+            }
+
+            QCOMPARE(anticlockwise, outer);
+         }
+      }
+
+      Record(referenceMs, optimizedMs);
+   }
+
+   void thin_data() { AddImages(true, 4000); }
+
+   //thinning from the traced borders against rescanning every pass, exact
+   void thin()
+   {
+      const QImage mask = DistanceTransform::Foreground(FetchImage());
+      const QImage overlay = RedOverlay(mask);
+
+      QVector<Pixel> expected;
+      QVector<Pixel> actual;
+      const double referenceMs = TimeMs([&]() { expected = ImageOps::Thin(overlay); });
+      const double optimizedMs = TimeMs([&]() { actual = Contour::Thin(mask); });
+
+      QCOMPARE(actual.count(), expected.count());
+
+      for (int i = 0; i < expected.count(); i++)
+      {
+         QVERIFY2(actual[i].x == expected[i].x && actual[i].y == expected[i].y, qPrintable(QString("skeleton pixel %1 is (%2, %3), expected (%4, %5)")
+                  .arg(i).arg(actual[i].x).arg(actual[i].y).arg(expected[i].x).arg(expected[i].y)));
+      }
+
+      Record(referenceMs, optimizedMs);
+   }
+
+   void thinComponents_data() { AddImages(true); }
+
+   //thinning every component on its own crop against thinning the whole
+   //mask, and the widths against the whole mask's distances, exact
+   void thinComponents()
+   {
+      const QImage mask = DistanceTransform::Foreground(FetchImage());
+
+      QVector<Pixel> expected;
+      QVector<double> expectedWidths;
+      const double referenceMs = TimeMs([&]() {
+         expected = Contour::Thin(mask);
+         expectedWidths = DistanceTransform::WidthProfile(mask, expected);
+      });
+
+      QVector<Pixel> actual;
+      QVector<double> widths;
+      const double optimizedMs = TimeMs([&]() { actual = Pipeline::ThinComponents(mask, &widths); });
+
+      QCOMPARE(actual.count(), expected.count());
+      QCOMPARE(widths.count(), actual.count());
+
+      //component by component on one side, raster order on the other
+      QVector<int> order(actual.count());
+
+      for (int i = 0; i < order.count(); i++)
+      {
+         order[i] = i;
+      }
+
+      std::sort(order.begin(), order.end(), [&](const int& a, const int& b) { return PixelLess(actual[a], actual[b]); });
+
+      QVector<int> expectedOrder(expected.count());
+
+      for (int i = 0; i < expectedOrder.count(); i++)
+      {
+         expectedOrder[i] = i;
+      }
+
+      std::sort(expectedOrder.begin(), expectedOrder.end(), [&](const int& a, const int& b) { return PixelLess(expected[a], expected[b]); });
+
+      for (int i = 0; i < order.count(); i++)
+      {
+         const Pixel& a = actual[order[i]];
+         const Pixel& e = expected[expectedOrder[i]];
+
+         QVERIFY2(a.x == e.x && a.y == e.y, qPrintable(QString("skeleton pixel %1 is (%2, %3), expected (%4, %5)").arg(i).arg(a.x).arg(a.y).arg(e.x).arg(e.y)));
+         QVERIFY2(widths[order[i]] == expectedWidths[expectedOrder[i]], qPrintable(QString("width at (%1, %2) is %3, expected %4")
+                  .arg(a.x).arg(a.y).arg(widths[order[i]]).arg(expectedWidths[expectedOrder[i]])));
+      }
+
+      Record(referenceMs, optimizedMs);
+   }
+
+   void moments_data() { AddImages(); }
+
+   //the moments, boxes and perimeters MaxTree adds up while it labels, against
+   //adding every pixel into every node it belongs to, exact
+   void moments()
+   {
+      const QImage gray = SimdKernels::ToGray(FetchImage());
+      const int width = gray.width();
+      const int height = gray.height();
+
+      MaxTree tree;
+      const double optimizedMs = TimeMs([&]() { tree = MaxTree::Build(gray); });
+      const QVector<MaxTree::Node>& nodes = tree.Nodes();
+
+      QVector<MaxTree::Node> expected(nodes.count());
+      QVector<int> pairs(nodes.count(), 0);
+
+      const double referenceMs = TimeMs([&]() {
+         for (auto& node : expected)
+         {
+            node.minX = width;
+            node.minY = height;
+            node.maxX = -1;
+            node.maxY = -1;
+         }
+
+         //every node up from the pixel's own is a component it's in
+         auto forEachNode = [&](const int& x, const int& y, const std::function<void(MaxTree::Node&, const int&)>& fn) {
+            for (int n = tree.NodeAt(x, y); ; n = nodes[n].parent)
+            {
+               fn(expected[n], n);
+
+               if (n == 0)
+               {
+                  break;
+               }
+            }
+         };
+
+         for (int y = 0; y < height; y++)
+         {
+            for (int x = 0; x < width; x++)
+            {
+               forEachNode(x, y, [&](MaxTree::Node& node, const int&) {
+                  node.area++;
+                  node.sumX += x;
+                  node.sumY += y;
+                  node.sumXX += (qint64)x * x;
+                  node.sumXY += (qint64)x * y;
+                  node.sumYY += (qint64)y * y;
+                  node.minX = qMin(node.minX, x);
+                  node.minY = qMin(node.minY, y);
+                  node.maxX = qMax(node.maxX, x);
+                  node.maxY = qMax(node.maxY, y);
+               });
+
+               //a 4 adjacent pair is inside every component its darker pixel is in
+               for (const auto& next : { QPoint(x + 1, y), QPoint(x, y + 1) })
+               {
+                  if (next.x() < width && next.y() < height)
+                  {
+                     const bool darker = gray.constScanLine(next.y())[next.x()] < gray.constScanLine(y)[x];
+                     forEachNode(darker ? next.x() : x, darker ? next.y() : y, [&](MaxTree::Node&, const int& n) { pairs[n]++; });
+                  }
+               }
+            }
+         }
+      });
+
+      for (int n = 0; n < nodes.count(); n++)
+      {
+         const MaxTree::Node& a = nodes[n];
+         const MaxTree::Node& e = expected[n];
+
+         QVERIFY2(a.area == e.area && a.sumX == e.sumX && a.sumY == e.sumY && a.sumXX == e.sumXX && a.sumXY == e.sumXY && a.sumYY == e.sumYY,
+                  qPrintable(QString("node %1 moments").arg(n)));
+         QVERIFY2(a.minX == e.minX && a.minY == e.minY && a.maxX == e.maxX && a.maxY == e.maxY, qPrintable(QString("node %1 bounding box").arg(n)));
+         QVERIFY2(a.perimeter == 4 * e.area - 2 * pairs[n], qPrintable(QString("node %1 perimeter is %2, expected %3").arg(n).arg(a.perimeter).arg(4 * e.area - 2 * pairs[n])));
+      }
+
+      Record(referenceMs, optimizedMs);
+   }
+
+   void shapeFilter_data() { AddImages(true); }
+
+   //the expression against the same test written out in C++, with the hull
+   //behind solidity done by gift wrapping over every pixel corner
+   void shapeFilter()
+   {
+      const QImage mask = DistanceTransform::Foreground(FetchImage());
+      const MaxTree tree = MaxTree::Build(mask);
+      const QVector<int> components = tree.ComponentsAbove(MAX_THRESH_VAL - 1, 0);
+
+      for (const auto& bad : { "area >", "size < 3", "(area > 1", "area > 1 &&", "area > 1 area", "area => 2" })
+      {
+         QVERIFY2(!ShapeFilter(bad).IsValid(), bad);
+         QVERIFY(ShapeFilter(bad).Accepts(ShapeFilter::Shape()));
+      }
+
+      const ShapeFilter filter("area > 3 && (elongation >= 2 || !(solidity > 0.9)) || perimeter == 4");
+      QVERIFY2(filter.IsValid(), qPrintable(filter.Error()));
+      QVERIFY(filter.UsesSolidity());
+
+      QVector<int> actual;
+      const double optimizedMs = TimeMs([&]() { actual = filter.Filter(tree, components); });
+
+      QVector<int> expected;
+      const double referenceMs = TimeMs([&]() {
+         for (const auto& n : components)
+         {
+            const MaxTree::Node& node = tree.Nodes()[n];
+            QVector<QPoint> corners;
+
+            for (int y = node.minY; y <= node.maxY; y++)
+            {
+               for (int x = node.minX; x <= node.maxX; x++)
+               {
+                  if (tree.NodeAt(x, y) == n)
+                  {
+                     corners << QPoint(x, y) << QPoint(x + 1, y) << QPoint(x, y + 1) << QPoint(x + 1, y + 1);
+                  }
+               }
+            }
+
+            const double solidity = node.area / BruteForceHullArea(corners);
+
+            if ((node.area > 3 && (node.Elongation() >= 2 || !(solidity > 0.9))) || node.perimeter == 4)
+            {
+               expected.push_back(n);
+            }
+         }
+      });
+
+      QCOMPARE(actual, expected);
+      Record(referenceMs, optimizedMs);
+   }
+
+   void watershed_data() { AddImages(false, 4000); }
+
+   //the bucket queue against a heap, exact, with markers scattered over the
+   //non zero pixels. Then Split on its own: it only ever takes pixels away,
+   //never joins anything and leaves the mask alone when no peak is deep enough.
+   void watershed()
+   {
+      const QImage gray = SimdKernels::ToGray(FetchImage());
+      QVector<int> expected(gray.width() * gray.height());
+
+      for (int y = 0; y < gray.height(); y++)
+      {
+         for (int x = 0; x < gray.width(); x++)
+         {
+            expected[y * gray.width() + x] = gray.constScanLine(y)[x] == 0 ? -1 : (x * 7 + y * 13) % 97 == 0 ? 1 + x + y * gray.width() : 0;
+         }
+      }
+
+      QVector<int> actual = expected;
+      const double referenceMs = TimeMs([&]() { BruteForceWatershed(gray, expected); });
+      const double optimizedMs = TimeMs([&]() { Watershed::Flood(gray, actual); });
+      QCOMPARE(actual, expected);
+
+      const QImage mask = DistanceTransform::Foreground(FetchImage());
+      const QImage split = Watershed::SplitComponents(mask, "area > 0", 1);
+
+      for (int y = 0; y < mask.height(); y++)
+      {
+         for (int x = 0; x < mask.width(); x++)
+         {
+            QVERIFY2(split.constScanLine(y)[x] <= mask.constScanLine(y)[x], qPrintable(QString("(%1, %2) was added").arg(x).arg(y)));
+         }
+      }
+
+      QVERIFY(MaxTree::Build(split).ComponentsAbove(MAX_THRESH_VAL - 1, 0).count() >= MaxTree::Build(mask).ComponentsAbove(MAX_THRESH_VAL - 1, 0).count());
+      QVERIFY(FirstDifference(mask, Watershed::SplitComponents(mask, "area > 0", 1000)).isEmpty());
+      QVERIFY(FirstDifference(mask, Watershed::SplitComponents(mask, "", 1)).isEmpty());
+
+      Record(referenceMs, optimizedMs);
+   }
+
+   void median_data() { AddImages(false, 4000); }
+
+   //the histogram median against sorting every window, every dispatch level,
+   //radii either side of the image size. Exact.
+   void median()
+   {
+      const QImage gray = SimdKernels::ToGray(FetchImage());
+      const SimdKernels::CpuLevel active = SimdKernels::ActiveCpuLevel();
+      double referenceMs = 0;
+      double optimizedMs = 0;
+
+      for (const int& radius : { 1, 3, 40 })
+      {
+         QImage expected;
+         referenceMs += TimeMs([&]() { expected = BruteForceMedian(gray, radius); });
+
+         for (int level = 0; level <= (int)SimdKernels::DetectCpuLevel(); level++)
+         {
+            SimdKernels::SetCpuLevel((SimdKernels::CpuLevel)level);
+
+            QImage actual;
+            const double ms = TimeMs([&]() { actual = Denoise::Median(gray, radius); });
+
+            if (level == (int)active)
+            {
+               optimizedMs += ms;
+            }
+
+            const QString diff = FirstDifference(expected, actual);
+            QVERIFY2(diff.isEmpty(), qPrintable(QString("radius %1 at %2: %3").arg(radius)
+                     .arg(SimdKernels::CpuLevelName((SimdKernels::CpuLevel)level)).arg(diff)));
+         }
+      }
+
+      SimdKernels::SetCpuLevel(active);
+      Record(referenceMs, optimizedMs);
+   }
+
+   void gaussian_data() { AddImages(false, 4000); }
+
+   //separable float FIR against the 2D kernel in double. The two passes round
+   //to 8 bits in between, so +-1 is allowed against the reference, but every
+   //dispatch level has to give the same bytes.
+   void gaussian()
+   {
+      const QImage gray = SimdKernels::ToGray(FetchImage());
+      const SimdKernels::CpuLevel active = SimdKernels::ActiveCpuLevel();
+      double referenceMs = 0;
+      double optimizedMs = 0;
+
+      for (const double& sigma : { 0.8, 2.0 })
+      {
+         QImage expected;
+         referenceMs += TimeMs([&]() { expected = BruteForceGaussian(gray, sigma); });
+
+         SimdKernels::SetCpuLevel(SimdKernels::CpuLevel::Scalar);
+         const QImage scalar = Denoise::Gaussian(gray, sigma);
+         const QImage scalarRecursive = Denoise::RecursiveGaussian(gray, sigma);
+
+         const int deviation = MaxDeviation(expected, scalar);
+         QVERIFY2(deviation >= 0 && deviation <= 1, qPrintable(QString("sigma %1 off by %2").arg(sigma).arg(deviation)));
+
+         for (int level = 0; level <= (int)SimdKernels::DetectCpuLevel(); level++)
+         {
+            SimdKernels::SetCpuLevel((SimdKernels::CpuLevel)level);
+
+            QImage actual;
+            const double ms = TimeMs([&]() { actual = Denoise::Gaussian(gray, sigma); });
+
+            if (level == (int)active)
+            {
+               optimizedMs += ms;
+            }
+
+            const QString name = SimdKernels::CpuLevelName((SimdKernels::CpuLevel)level);
+            const QString diff = FirstDifference(scalar, actual);
+            QVERIFY2(diff.isEmpty(), qPrintable(QString("sigma %1 at %2: %3").arg(sigma).arg(name).arg(diff)));
+
+            const QString recursiveDiff = FirstDifference(scalarRecursive, Denoise::RecursiveGaussian(gray, sigma));
+            QVERIFY2(recursiveDiff.isEmpty(), qPrintable(QString("recursive sigma %1 at %2: %3").arg(sigma).arg(name).arg(recursiveDiff)));
+         }
+      }
+
+      SimdKernels::SetCpuLevel(active);
+      Record(referenceMs, optimizedMs);
+   }
+
+   void localThreshold_data() { AddImages(); }
+
+   //Niblack and Sauvola off the integral images against window sums done by hand, exact
+   void localThreshold()
+   {
+      const QImage img = FetchImage();
+      double referenceMs = 0;
+      double optimizedMs = 0;
+
+      for (const auto& mode : { LocalThreshold::Mode::Niblack, LocalThreshold::Mode::Sauvola })
+      {
+         const double k = mode == LocalThreshold::Mode::Niblack ? -0.2 : 0.34;
+
+         QImage expected;
+         QImage actual;
+         referenceMs += TimeMs([&]() { expected = BruteForceLocalThreshold(img, mode, 7, k, 128, 2); });
+         optimizedMs += TimeMs([&]() { actual = LocalThreshold::Threshold(img, mode, 7, k, 128, 2); });
+
+         const QString diff = FirstDifference(expected, actual);
+         QVERIFY2(diff.isEmpty(), qPrintable(diff));
+
+         //the tables built once for a bigger window, the way Sweep shares them
+         const QImage shared = LocalThreshold::Threshold(img, LocalThreshold::BuildIntegralImages(img, 25), mode, 7, k, 128, 2);
+         const QString sharedDiff = FirstDifference(expected, shared);
+         QVERIFY2(sharedDiff.isEmpty(), qPrintable("shared tables: " + sharedDiff));
+      }
+
+      Record(referenceMs, optimizedMs);
+   }
+
+   void areaThresholds_data() { AddImages(false, 4000); }
+
+   //the Adapt and Otsu threshold buttons' row loops on a Format_Grayscale8
+   //picture, which is what Correct hands them, against the same picture as
+   //ARGB32. They used to write QRgb into a copy of their input. 16 bit
+   //pictures against their slider levels.
+   void areaThresholds()
+   {
+      const QImage gray = SimdKernels::ToGray(FetchImage());
+      const QImage argb = gray.convertToFormat(QImage::Format_ARGB32);
+
+      for (const auto& otsu : { false, true })
+      {
+         const QImage expected = otsu ? ImageOps::LocalOtsuThreshold(argb, 3, 2) : ImageOps::AdaptiveThreshold(argb, 3, 2);
+         const QImage actual = otsu ? ImageOps::LocalOtsuThreshold(gray, 3, 2) : ImageOps::AdaptiveThreshold(gray, 3, 2);
+
+         QCOMPARE(actual.format(), QImage::Format_ARGB32);
+         const QString diff = FirstDifference(expected, actual);
+         QVERIFY2(diff.isEmpty(), qPrintable(QString(otsu ? "otsu: " : "adapt: ") + diff));
+
+         //16 bit ones go through as their slider levels
+         const QImage deep = Deepen(gray);
+         const QImage levels = BitDepth::SliderLevels(deep, BitDepth::SliderLut(deep));
+         const QString deepDiff = FirstDifference(otsu ? ImageOps::LocalOtsuThreshold(levels, 3, 2) : ImageOps::AdaptiveThreshold(levels, 3, 2),
+                                                  otsu ? ImageOps::LocalOtsuThreshold(deep, 3, 2) : ImageOps::AdaptiveThreshold(deep, 3, 2));
+         QVERIFY2(deepDiff.isEmpty(), qPrintable(QString(otsu ? "otsu, 16 bit: " : "adapt, 16 bit: ") + deepDiff));
+      }
+   }
+
+   void preprocessHistory_data() { AddImages(false, 4000); }
+
+   //the Median button pressed twice, the way the main window does it: from
+   //the source with the document's settings, so the second press gives the
+   //same picture instead of a median of the median. Undo, Redo and Open take
+   //the input back with everything else.
+   void preprocessHistory()
+   {
+      const QImage gray = SimdKernels::ToGray(FetchImage());
+
+      Document document;
+      document.Open(gray);
+      QCOMPARE(document.Input(), gray);
+
+      QImage once;
+
+      for (int press = 0; press < 2; press++)
+      {
+         Pipeline::Params preprocessing = document.Preprocessing();
+         preprocessing.medianRadius = 2;
+         const QImage input = Pipeline::Preprocess(document.Source(), preprocessing);
+
+         if (press == 0)
+         {
+            once = input;
+         }
+
+         QCOMPARE(input, once);
+         document.CommitInput("Median", input, preprocessing);
+      }
+
+      document.Commit("Threshold", SimdKernels::ThresholdMask(once, 128));
+      QCOMPARE(document.Input(), once);
+
+      QVERIFY(document.Undo());
+      QVERIFY(document.Undo());
+      QVERIFY(document.Undo());
+      QCOMPARE(document.Input(), gray);
+      QCOMPARE(document.Preprocessing().medianRadius, 0);
+
+      QVERIFY(document.Redo());
+      QCOMPARE(document.Input(), once);
+      QCOMPARE(document.Preprocessing().medianRadius, 2);
+
+      document.Open(once);
+      QCOMPARE(document.Input(), once);
+      QCOMPARE(document.Preprocessing().medianRadius, 0);
+   }
+
+   void opening_data() { AddImages(true); }
+
+   //Open, DilateMask and ErodeMask straight off the distance maps against
+   //ErodeDisk and DilateDisk, exact
+   void opening()
+   {
+      const QImage img = FetchImage();
+      double referenceMs = 0;
+      double optimizedMs = 0;
+
+      for (const double& radius : { 1.0, 1.5, 2.0, 3.0 })
+      {
+         QImage expected;
+         QImage actual;
+         referenceMs += TimeMs([&]() { expected = DistanceTransform::Foreground(DistanceTransform::DilateDisk(DistanceTransform::ErodeDisk(img, radius), radius)); });
+         optimizedMs += TimeMs([&]() { actual = DistanceTransform::Open(img, radius); });
+
+         const QString diff = FirstDifference(expected, actual);
+         QVERIFY2(diff.isEmpty(), qPrintable(QString("radius %1: %2").arg(radius).arg(diff)));
+
+         //and the two halves on their own
+         const QString dilateDiff = FirstDifference(DistanceTransform::Foreground(DistanceTransform::DilateDisk(img, radius)), DistanceTransform::DilateMask(img, radius));
+         QVERIFY2(dilateDiff.isEmpty(), qPrintable(QString("dilate radius %1: %2").arg(radius).arg(dilateDiff)));
+
+         const QString erodeDiff = FirstDifference(DistanceTransform::Foreground(DistanceTransform::ErodeDisk(img, radius)), DistanceTransform::ErodeMask(img, radius));
+         QVERIFY2(erodeDiff.isEmpty(), qPrintable(QString("erode radius %1: %2").arg(radius).arg(erodeDiff)));
+      }
+
+      Record(referenceMs, optimizedMs);
+   }
+
+   void matchError_data()
+   {
+      QTest::addColumn<int>("seed");
+
+      for (int seed = 0; seed < 200; seed++)
+      {
+         QTest::newRow(QByteArray("seed " + QByteArray::number(seed)).constData()) << seed;
+      }
+   }
+
+   //the sorted dynamic program against trying every pairing, up to rounding
+   void matchError()
+   {
+      QFETCH(int, seed);
+      QRandomGenerator rng(seed);
+
+      QVector<double> measured(rng.bounded(6));
+      QVector<double> reference(rng.bounded(6));
+
+      for (auto& length : measured)
+      {
+         length = 0.5 + rng.generateDouble() * 100;
+      }
+
+      for (auto& length : reference)
+      {
+         length = 1 + rng.generateDouble() * 100;
+      }
+
+      QVector<bool> used(measured.count(), false);
+      const double expected = BruteForceMatchError(measured, reference, 0, used) / qMax(1, reference.count());
+      const double actual = Sweep::MatchError(measured, reference);
+
+      QVERIFY2(qAbs(actual - expected) < 1e-9, qPrintable(QString("%1, expected %2").arg(actual).arg(expected)));
+   }
+
+   void scratch_data() { AddImages(false, 4000); }
+
+   //the whole pipeline with every stage that takes scratch memory switched on,
+   //twice on the same picture. The second time everything has to come out of
+   //the pools the first one filled, and come out the same. The pictures are
+   //small enough that the row loops all stay on this thread. Then the same
+   //for ImageOps::Thin and GetBorderPixels, a batch run that mustn't need
+   //new blocks after its first picture, and the limit on what a thread keeps.
+   void scratch()
+   {
+      const QImage img = FetchImage();
+
+      Pipeline::Params params;
+      params.medianRadius = 1;
+      params.smoothSigma = 1;
+      params.backgroundRadius = 3;
+      params.openingRadius = 1;
+      params.splitFilter = "area > 20";
+      params.minSize = 0;
+
+      const Pipeline::Result first = Pipeline::Run(img, params);
+      const qint64 allocations = Scratch::ThisThread().heapAllocations;
+      const qint64 reuses = Scratch::ThisThread().reuses;
+      const Pipeline::Result second = Pipeline::Run(img, params);
+
+      QCOMPARE(Scratch::ThisThread().heapAllocations, allocations);
+      QVERIFY(img.width() * img.height() == 1 || Scratch::ThisThread().reuses > reuses);
+      QCOMPARE(second.cells.count(), first.cells.count());
+
+      for (int i = 0; i < first.cells.count(); i++)
+      {
+         QCOMPARE(second.cells[i].skeletonPixels, first.cells[i].skeletonPixels);
+      }
+
+      const QImage overlay = RedOverlay(DistanceTransform::Foreground(img));
+      const QVector<Pixel> skeleton = ImageOps::Thin(overlay);
+      const QVector<Pixel> borders = ImageOps::GetBorderPixels(overlay);
+      const qint64 thinAllocations = Scratch::ThisThread().heapAllocations;
+      QCOMPARE(ImageOps::Thin(overlay).count(), skeleton.count());
+      QCOMPARE(ImageOps::GetBorderPixels(overlay).count(), borders.count());
+      QCOMPARE(Scratch::ThisThread().heapAllocations, thinAllocations);
+
+      QTemporaryDir dir;
+      QVERIFY(dir.isValid());
+      QStringList paths;
+
+      for (int i = 0; i < 4; i++)
+      {
+         paths.push_back(dir.filePath(QString("frame%1.pgm").arg(i)));
+         QVERIFY(SimdKernels::ToGray(img).save(paths.back()));
+      }
+
+      Batch::Options options;
+      options.params = params;
+      options.workerThreads = 1;
+      const Batch::Stats stats = Batch::Run(paths, options, Batch::ResultCallback());
+      QCOMPARE(stats.failed, 0);
+      QCOMPARE(stats.warmScratchAllocations, 0ll);
+
+      //a block past the thread's limit goes back to the heap, one under it stays
+      const qint64 limit = Scratch::ThreadLimit();
+      Scratch::Trim();
+      Scratch::SetThreadLimit(1024);
+      const qint64 held = Scratch::ThisThread().bytesHeld;
+      {
+         Scratch::Buffer<uchar> big(4096);
+      }
+      QCOMPARE(Scratch::ThisThread().bytesHeld, held);
+      {
+         Scratch::Buffer<uchar> small(64);
+      }
+      QCOMPARE(Scratch::ThisThread().bytesHeld, held + 64);
+      Scratch::SetThreadLimit(limit);
+   }
+
+   //a sharded run over pictures on disk with a worker on another machine that
+   //died half way through a shard and one that died before it got its name
+   //into its lease. The first pass leaves both shards alone, the second treats
+   //their leases as stale, resumes after the dead one's last checkpoint, and
+   //the merge has to come out the same as running every picture once.
+   void shards()
+   {
+      QTemporaryDir dir;
+      QVERIFY(dir.isValid());
+
+      Shard::Manifest manifest;
+      manifest.shardSize = 3;
+      QStringList expected;
+      QVector<QString> rowsOf;
+
+      for (int i = 0; i < 8; i++)
+      {
+         const QImage img = SimdKernels::ToGray(MakeImage(Pattern::Dense, 60 + i * 9, 50 + i * 7));
+         const QString path = dir.filePath(QString("picture%1.pgm").arg(i));
+         QVERIFY(img.save(path));
+         manifest.images.push_back(path);
+         rowsOf.push_back(Pipeline::CsvRows(path, Pipeline::Run(img, Pipeline::Params())));
+
+         for (const auto& row : rowsOf.back().split('\n'))
+         {
+            if (!row.isEmpty())
+            {
+               expected.push_back(row);
+            }
+         }
+      }
+
+      const QString work = dir.filePath("run");
+      QVERIFY(Shard::CreateManifest(work, manifest));
+      QVERIFY(!Shard::CreateManifest(work, manifest));
+
+      //shard 1 checkpointed its first picture and was writing the next one's rows
+      QFile part(Shard::PartPath(work, 1));
+      QVERIFY(part.open(QIODevice::WriteOnly));
+      part.write(rowsOf[3].toUtf8() + "\n#done 3\n" + manifest.images[4].toUtf8() + ",0,1,2");
+      part.close();
+
+      //shard 2's worker died before it got its name into the lease
+      QFile lease(Shard::LeasePath(work, 1));
+      QVERIFY(lease.open(QIODevice::WriteOnly));
+      lease.write("elsewhere 1\n");
+      lease.close();
+      QFile empty(Shard::LeasePath(work, 2));
+      QVERIFY(empty.open(QIODevice::WriteOnly));
+      empty.close();
+
+      Shard::WorkOptions options;
+      Shard::WorkStats stats = Shard::Work(work, options);
+      QCOMPARE(stats.shards, 1);
+      QCOMPARE(stats.images, 3);
+      QCOMPARE(Shard::Status(work).leased, 2);
+      QVERIFY(!Shard::Merge(work, dir.filePath("merged.csv")));
+
+      options.leaseTimeoutMs = -1;
+      stats = Shard::Work(work, options);
+      QVERIFY2(stats.error.isEmpty(), qPrintable(stats.error));
+      QCOMPARE(stats.shards, 2);
+      QCOMPARE(stats.resumed, 1);
+      QCOMPARE(stats.skipped, 1);
+      QCOMPARE(stats.images, 4);
+      QCOMPARE(Shard::Status(work).done, 3);
+
+      //a second worker that appended picture 0 again before it saw the lease
+      //had gone, and a lease renamed out of the way by one that then died
+      QFile twice(Shard::ResultPath(work, 0));
+      QVERIFY(twice.open(QIODevice::WriteOnly | QIODevice::Append));
+      twice.write(rowsOf[0].toUtf8() + "\n#done 0\n");
+      twice.close();
+
+      QFile broken(Shard::LeasePath(work, 0) + ".1.broken");
+      QVERIFY(broken.open(QIODevice::WriteOnly));
+      broken.close();
+      QCOMPARE(Shard::Status(work).broken.count(), 1);
+
+      QString error;
+      QVERIFY2(Shard::Merge(work, dir.filePath("merged.csv"), false, &error), qPrintable(error));
+
+      QFile merged(dir.filePath("merged.csv"));
+      QVERIFY(merged.open(QIODevice::ReadOnly));
+      QCOMPARE(QString::fromUtf8(merged.readLine()).trimmed(), Pipeline::CsvHeader());
+
+      QStringList rows;
+
+      while (!merged.atEnd())
+      {
+         rows.push_back(QString::fromUtf8(merged.readLine()).trimmed());
+      }
+
+      expected.sort();
+      rows.sort();
+      QCOMPARE(rows, expected);
+   }
+
+   void deep_data() { AddImages(false, 4000); }
+
+   //the 16 bit paths: histograms against counting by hand at both depths, the
+   //mask kernel at every dispatch level, the two pass Otsu against a plain one
+   //on all 65536 levels (and on tiny pictures made to trip it up), the slider
+   //levels against the LUT, and the local thresholds against the brute force
+   //on the 16 bit values. All exact.
+   void deep()
+   {
+      const QImage img = FetchImage();
+      const QImage deep = Deepen(img);
+      double referenceMs = 0;
+      double optimizedMs = 0;
+
+      for (const auto& bits : { 12, 16 })
+      {
+         QVector<qint64> expected(1 << bits, 0);
+         referenceMs += TimeMs([&]() {
+            for (int y = 0; y < deep.height(); y++)
+            {
+               for (int x = 0; x < deep.width(); x++)
+               {
+                  expected[((const quint16*)deep.constScanLine(y))[x] >> (16 - bits)]++;
+               }
+            }
+         });
+
+         QVector<qint64> actual;
+         optimizedMs += TimeMs([&]() { actual = Otsu::ImageHistogram16(deep, bits); });
+         QCOMPARE(actual, expected);
+      }
+
+      const QVector<qint64> full = Otsu::ImageHistogram16(deep, 16);
+      int expectedThreshold = 0;
+      int actualThreshold = 0;
+      referenceMs += TimeMs([&]() { expectedThreshold = Otsu::GlobalThreshold(full); });
+      optimizedMs += TimeMs([&]() { actualThreshold = Otsu::GlobalThreshold16(deep); });
+      QCOMPARE(actualThreshold, expectedThreshold);
+
+      //8 bit pictures scaled up split the same way as they do at 8 bits
+      const QImage scaled = SimdKernels::ToGray16(img);
+      const QString otsuDiff = FirstDifference(SimdKernels::ThresholdMask(img, Otsu::GlobalThreshold(Otsu::ImageHistogram(img))),
+                                               SimdKernels::ThresholdMask(scaled, Otsu::GlobalThreshold16(scaled)));
+      QVERIFY2(otsuDiff.isEmpty(), qPrintable(otsuDiff));
+
+      //every value in one coarse bin, a flat picture, and edges that nearly tie
+      //still split the same as the plain histogram does
+      for (const auto& values : QVector<QVector<int>>{ { 1000, 1005 }, { 1000, 1000, 1000, 1005 }, { 1000 }, { 0, MAX_GRAY16_VAL },
+                                                       { 15, 16 }, { 100, 131, 131, 162 }, { 3, 4, 5, 40000, 40001, 40002 } })
+      {
+         QImage small(values.count(), 1, QImage::Format_Grayscale16);
+
+         for (int x = 0; x < values.count(); x++)
+         {
+            ((quint16*)small.scanLine(0))[x] = values[x];
+         }
+
+         QCOMPARE(Otsu::GlobalThreshold16(small), Otsu::GlobalThreshold(Otsu::ImageHistogram16(small, 16)));
+      }
+
+      const SimdKernels::CpuLevel active = SimdKernels::ActiveCpuLevel();
+
+      for (const auto& level : { SimdKernels::CpuLevel::Scalar, SimdKernels::CpuLevel::SSE41, SimdKernels::CpuLevel::AVX2 })
+      {
+         if (SimdKernels::SetCpuLevel(level) != level)
+         {
+            continue;
+         }
+
+         for (const auto& t : { -1, 0, 1, expectedThreshold, 32767, 32768, MAX_GRAY16_VAL - 1, MAX_GRAY16_VAL })
+         {
+            const QString diff = FirstDifference(BruteForceMask16(deep, t), SimdKernels::ThresholdMask(deep, t));
+            QVERIFY2(diff.isEmpty(), qPrintable(QString("%1, threshold %2: %3").arg(SimdKernels::CpuLevelName(level)).arg(t).arg(diff)));
+         }
+      }
+
+      SimdKernels::SetCpuLevel(active);
+
+      const QVector<int> lut = BitDepth::SliderLut(deep);
+      const QImage levels = BitDepth::SliderLevels(deep, lut);
+
+      for (int position = 0; position <= MAX_THRESH_VAL; position += 17)
+      {
+         const QString diff = FirstDifference(SimdKernels::ThresholdMask(deep, lut[position]), SimdKernels::ThresholdMask(levels, position));
+         QVERIFY2(diff.isEmpty(), qPrintable(QString("slider %1: %2").arg(position).arg(diff)));
+         QVERIFY(lut[BitDepth::SliderPosition(lut, lut[position])] == lut[position]);
+      }
+
+      for (const auto& mode : { LocalThreshold::Mode::Niblack, LocalThreshold::Mode::Sauvola })
+      {
+         const double k = mode == LocalThreshold::Mode::Niblack ? -0.2 : 0.34;
+         const double scale = BitDepth::Scale(16);
+
+         QImage expected;
+         QImage actual;
+         referenceMs += TimeMs([&]() { expected = BruteForceLocalThreshold(deep, mode, 7, k, 128 * scale, 2 * scale); });
+         optimizedMs += TimeMs([&]() { actual = LocalThreshold::Threshold(deep, mode, 7, k, 128, 2, 16); });
+
+         const QString diff = FirstDifference(expected, actual);
+         QVERIFY2(diff.isEmpty(), qPrintable(diff));
+      }
+
+      Record(referenceMs, optimizedMs);
+   }
+
+   void clean_data() { AddImages(); }
+
+   //MaxTree::Select against Threshold + LabelComponents + the size filter, exact
+   void clean()
+   {
+      const QImage img = FetchImage();
+      const int minArea = 5;
+      double referenceMs = 0;
+      double optimizedMs = 0;
+
+      for (const int& t : { 1, 127, 200 })
+      {
+         QImage expected;
+         QImage actual;
+         referenceMs += TimeMs([&]() { expected = ReferenceClean(img, t, minArea); });
+         optimizedMs += TimeMs([&]() { actual = MaxTree::Build(img).Select(t, minArea); });
+
+         const QString diff = FirstDifference(expected, actual);
+         QVERIFY2(diff.isEmpty(), qPrintable(QString("threshold %1: %2").arg(t).arg(diff)));
+      }
+
+      Record(referenceMs, optimizedMs);
+   }
+
+   void incremental_data() { AddImages(); }
+
+   //IncrementalLabeler dragged down, up and back, against a fresh clean at every
+   //stop. Exact. Only the last move is timed, that's the slider case it is for.
+   void incremental()
+   {
+      const QImage img = FetchImage();
+      const int minArea = 5;
+      IncrementalLabeler labeler;
+
+      QImage expected;
+      QImage actual;
+      double referenceMs = 0;
+      double optimizedMs = 0;
+
+      for (const int& t : { 200, 40, 160, 127 })
+      {
+         referenceMs = TimeMs([&]() { expected = ReferenceClean(img, t, minArea); });
+         optimizedMs = TimeMs([&]() {
+            labeler.Request(t);
+            actual = labeler.Update(img, minArea);
+         });
+
+         const QString diff = FirstDifference(expected, actual);
+         QVERIFY2(diff.isEmpty(), qPrintable(QString("threshold %1: %2").arg(t).arg(diff)));
+      }
+
+      Record(referenceMs, optimizedMs);
+   }
+
+   void flood_data() { AddImages(true); }
+
+   //Flood from every component's first pixel against the component the max
+   //tree puts that pixel in, exact. This is the case that caught Flood's
+   //visited array being indexed x * width + y.
+   void flood()
+   {
+      const QImage img = FetchImage();
+      const QImage binary = ImageOps::Threshold(img, 127);
+
+      MaxTree tree;
+      const double optimizedMs = TimeMs([&]() { tree = MaxTree::Build(img); });
+      double referenceMs = 0;
+
+      QVector<bool> seen(tree.Nodes().count(), false);
+
+      for (int y = 0; y < img.height(); y++)
+      {
+         for (int x = 0; x < img.width(); x++)
+         {
+            const int node = tree.NodeAt(x, y);
+
+            if (qGray(img.pixel(x, y)) <= 127 || seen[node])
+            {
+               continue;
+            }
+
+            seen[node] = true;
+
+            QVector<Pixel> s;
+            referenceMs += TimeMs([&]() { s = ImageOps::Flood(binary, Pixel(x, y), *eightConn); });
+            std::sort(s.begin(), s.end(), PixelLess);
+
+            QCOMPARE(s.count(), tree.Nodes()[node].area);
+
+            for (const auto& pix : s)
+            {
+               QVERIFY2(tree.NodeAt(pix.x, pix.y) == node, qPrintable(QString("(%1, %2) flooded from (%3, %4) is in another component")
+                        .arg(pix.x).arg(pix.y).arg(x).arg(y)));
+            }
+         }
+      }
+
+      Record(referenceMs, optimizedMs);
+   }
+
+   void tiles_data()
+   {
+      QTest::addColumn<int>("format");
+      QTest::newRow("argb32") << (int)QImage::Format_ARGB32;
+      QTest::newRow("gray8") << (int)QImage::Format_Grayscale8;
+      QTest::newRow("gray16") << (int)QImage::Format_Grayscale16;
+   }
+
+   //every tile at the levels four zoom levels pick, against the same part of
+   //the picture put through QImage::scaled, the right and bottom ones partial
+   //at every level. The picture is made of 8x8 blocks, so wherever in a
+   //block either side takes its sample from, it's the same value.
+   void tiles()
+   {
+      QFETCH(int, format);
+
+      const int blocksX = 300;
+      const int blocksY = 200;
+      QImage img(blocksX * 8, blocksY * 8, (QImage::Format)format);
+      QRandomGenerator rng(format);
+
+      for (int by = 0; by < blocksY; by++)
+      {
+         for (int bx = 0; bx < blocksX; bx++)
+         {
+            //levels that come through 8 bit unchanged, in case scaled goes
+            //through another format
+            const quint32 v = rng.generate();
+            const quint16 gray16 = (quint16)((v & 0xff) * 257);
+
+            for (int y = by * 8; y < by * 8 + 8; y++)
+            {
+               for (int x = bx * 8; x < bx * 8 + 8; x++)
+               {
+                  if (format == QImage::Format_Grayscale16)
+                  {
+                     ((quint16*)img.scanLine(y))[x] = gray16;
+                  }
+                  else if (format == QImage::Format_Grayscale8)
+                  {
+                     img.scanLine(y)[x] = (uchar)v;
+                  }
+                  else
+                  {
+                     ((QRgb*)img.scanLine(y))[x] = v | 0xff000000;
+                  }
+               }
+            }
+         }
+      }
+
+      const int span = TiledImageItem::TILE_SIZE;
+
+      //a 2400 pixel picture goes down to 300 pixels, the last level that
+      //still isn't smaller than a tile
+      for (int level = 0; level <= 3; level++)
+      {
+         QCOMPARE(TiledImageItem::Level(1.0 / (1 << level), img.size()), level);
+
+         const QImage scaled = img.scaled(img.width() >> level, img.height() >> level, Qt::IgnoreAspectRatio, Qt::FastTransformation)
+                                  .convertToFormat(img.format());
+
+         for (int ty = 0; ty * span < scaled.height(); ty++)
+         {
+            for (int tx = 0; tx * span < scaled.width(); tx++)
+            {
+               const QImage tile = TiledImageItem::RenderTile(img, level, tx, ty);
+               const QImage expected = scaled.copy(tx * span, ty * span, qMin(span, scaled.width() - tx * span), qMin(span, scaled.height() - ty * span));
+
+               QCOMPARE(tile.size(), expected.size());
+               const QString diff = FirstDifference(expected, tile);
+               QVERIFY2(diff.isEmpty(), qPrintable(QString("level %1, tile (%2, %3): ").arg(level).arg(tx).arg(ty) + diff));
+            }
+         }
+      }
+   }
+};
+
+QTEST_MAIN(DifferentialTest)
+
+#include "DifferentialTest.moc"
@@ -0,0 +1,19 @@
+QT       += core gui
+QT 	+= testlib
+QT 	+= concurrent
+greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
+
+CONFIG += c++11 console testcase
+CONFIG -= app_bundle
+
+TARGET = CellLengthTests
+
+# the view's tiling isn't part of the core, but its sampling gets checked here
+SOURCES += \
+    DifferentialTest.cpp \
+    ../TiledImageItem.cpp
+
+HEADERS += \
+    ../TiledImageItem.h
+
+include(../CellLengthCore.pri)